@@ -68,6 +68,8 @@ namespace FPV_VR_PRIORITY{
     constexpr int CPU_PRIORITY_GLRENDERER_STEREO=-16; //The GL thread also should get 1 whole cpu core
     constexpr int CPU_PRIORITY_UDPRECEIVER_VIDEO=-16;  //needs low latency and does not use the cpu that much
     constexpr int CPU_PRIORITY_DECODER_OUTPUT=-16;     //needs low latency and does not use the cpu that much
+    constexpr int CPU_PRIORITY_VIDEO_PARSER=-16;       //only used in the pipelined decoding mode. Same as the udp receiver
+    constexpr int CPU_PRIORITY_DECODER_INPUT=-16;      //only used in the pipelined decoding mode. Mostly waits for MediaCodec
     constexpr int CPU_PRIORITY_UVC_FRAME_CALLBACK=-17; //needs low latency but uses CPU a lot (decoding). More prio than GLRenderer
     // These are much lower
     constexpr int CPU_PRIORITY_GLRENDERER_MONO=-4; //only shows the OSD not video
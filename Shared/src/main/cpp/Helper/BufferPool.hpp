@@ -0,0 +1,143 @@
+#ifndef LIVEVIDEO10MS_BUFFERPOOL_HPP
+#define LIVEVIDEO10MS_BUFFERPOOL_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+// Pool of (big) buffers of type T that are handed out as ref-counted handles.
+// Copying a handle only increments an (intrusive) atomic counter, no memory is allocated or copied.
+// Once the last handle to a buffer goes away the buffer is returned to the pool and can be re-used.
+// If the pool is empty a new buffer is allocated and added to the pool - so after a short warm up
+// acquire() does not allocate anymore.
+// The pool may be destroyed while handles are still alive (the buffers are freed with the last handle).
+// Thread safety: acquire() and releasing handles can be done on any thread, a single handle must not be
+// used by multiple threads at the same time (same as std::shared_ptr)
+template<class T>
+class BufferPool{
+private:
+    struct State;
+    struct Slot{
+        T value;
+        std::atomic<int> refCount{0};
+        State* state;
+    };
+    // Shared between the pool and the outstanding buffers
+    struct State{
+        std::mutex mutex;
+        std::vector<Slot*> freeSlots;
+        std::size_t nLeasedSlots=0;
+        std::size_t nAllocatedSlots=0;
+        bool poolAlive=true;
+    };
+    static void release(Slot* slot){
+        State* state=slot->state;
+        bool deleteState;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->nLeasedSlots--;
+            if(state->poolAlive){
+                state->freeSlots.push_back(slot);
+            }else{
+                delete slot;
+            }
+            deleteState=!state->poolAlive && state->nLeasedSlots==0;
+        }
+        if(deleteState){
+            delete state;
+        }
+    }
+public:
+    class Handle{
+    public:
+        Handle()=default;
+        Handle(const Handle& other):slot(other.slot){
+            if(slot!=nullptr)slot->refCount.fetch_add(1,std::memory_order_relaxed);
+        }
+        Handle(Handle&& other)noexcept:slot(other.slot){
+            other.slot=nullptr;
+        }
+        Handle& operator=(Handle other)noexcept{
+            std::swap(slot,other.slot);
+            return *this;
+        }
+        ~Handle(){
+            if(slot!=nullptr && slot->refCount.fetch_sub(1,std::memory_order_acq_rel)==1){
+                release(slot);
+            }
+        }
+        T& operator*()const{return slot->value;}
+        T* operator->()const{return &slot->value;}
+        T* get()const{return slot==nullptr ? nullptr : &slot->value;}
+        explicit operator bool()const{return slot!=nullptr;}
+        // n of handles referencing the same buffer. If this returns 1 the caller is the only owner
+        int useCount()const{
+            return slot==nullptr ? 0 : slot->refCount.load(std::memory_order_acquire);
+        }
+    private:
+        friend class BufferPool;
+        explicit Handle(Slot* slot1):slot(slot1){
+            slot->refCount.store(1,std::memory_order_relaxed);
+        }
+        Slot* slot=nullptr;
+    };
+    explicit BufferPool(const std::size_t nPreallocatedBuffers=0):state(new State()){
+        for(std::size_t i=0;i<nPreallocatedBuffers;i++){
+            state->freeSlots.push_back(allocateSlot());
+        }
+    }
+    BufferPool(const BufferPool&)=delete;
+    BufferPool& operator=(const BufferPool&)=delete;
+    ~BufferPool(){
+        bool deleteState;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->poolAlive=false;
+            for(Slot* slot:state->freeSlots){
+                delete slot;
+            }
+            state->freeSlots.clear();
+            deleteState=state->nLeasedSlots==0;
+        }
+        if(deleteState){
+            delete state;
+        }
+    }
+    // Get a buffer that is not referenced by anybody else. Content of the buffer is undefined
+    Handle acquire(){
+        std::lock_guard<std::mutex> lock(state->mutex);
+        Slot* slot;
+        if(state->freeSlots.empty()){
+            slot=allocateSlot();
+        }else{
+            slot=state->freeSlots.back();
+            state->freeSlots.pop_back();
+        }
+        state->nLeasedSlots++;
+        return Handle(slot);
+    }
+    // total n of buffers allocated by this pool. Stays constant once warmed up
+    std::size_t getNAllocatedBuffers()const{
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->nAllocatedSlots;
+    }
+    // n of buffers that are currently referenced by at least one handle
+    std::size_t getNLeasedBuffers()const{
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->nLeasedSlots;
+    }
+private:
+    // Call with state->mutex locked or in the constructor
+    Slot* allocateSlot(){
+        // Default initialized: The buffer (e.g. a 1MB std::array) is not zero-filled, it is overwritten before use anyways
+        auto* slot=new Slot;
+        slot->state=state;
+        state->nAllocatedSlots++;
+        return slot;
+    }
+    State* const state;
+};
+
+#endif //LIVEVIDEO10MS_BUFFERPOOL_HPP
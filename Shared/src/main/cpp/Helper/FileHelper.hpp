@@ -6,6 +6,8 @@
 #define LIVEVIDEO10MS_FILEHELPER_HPP
 
 #include <cstdio>
+#include <cassert>
+#include <ctime>
 #include <string>
 #include <fstream>
 #include <sstream>
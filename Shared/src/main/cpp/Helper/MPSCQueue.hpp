@@ -0,0 +1,175 @@
+#ifndef LIVEVIDEO10MS_MPSCQUEUE_HPP
+#define LIVEVIDEO10MS_MPSCQUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TestCheck.hpp"
+
+// Bounded lock-free queue for any number of producer threads and exactly one consumer thread (D. Vyukov's bounded queue).
+// Like SPSCQueue the elements are pre-allocated and re-used: a producer claims a slot, fills it in place and publishes it
+// in tryWrite(), the consumer reads the slot returned by beginRead() and releases it with commitRead().
+// Each slot has a sequence number that tells whether it is free for the producer with a given position or ready for the consumer.
+// A producer that was preempted between claiming and publishing its slot delays the consumer (not the other producers)
+// until it continues.
+template<class T>
+class MPSCQueue{
+public:
+    // The capacity is rounded up to the next power of 2
+    explicit MPSCQueue(const std::size_t minCapacity):mCapacity(roundUpToPowerOf2(minCapacity)),mMask(mCapacity-1),
+        mSlots(new Slot[mCapacity]){
+        for(std::size_t i=0;i<mCapacity;i++){
+            mSlots[i].sequence.store(i,std::memory_order_relaxed);
+        }
+    }
+    MPSCQueue(const MPSCQueue&)=delete;
+    MPSCQueue& operator=(const MPSCQueue&)=delete;
+    // Any thread. Claims a free slot, calls fill(T&) on it and publishes it.
+    // Returns false without calling fill if the queue is full
+    template<class F>
+    bool tryWrite(F&& fill){
+        Slot* slot;
+        std::size_t head=mHead.load(std::memory_order_relaxed);
+        while (true){
+            slot=&mSlots[head & mMask];
+            const std::size_t sequence=slot->sequence.load(std::memory_order_acquire);
+            const auto diff=(intptr_t)sequence-(intptr_t)head;
+            if(diff==0){
+                if(mHead.compare_exchange_weak(head,head+1,std::memory_order_relaxed))break;
+            }else if(diff<0){
+                // The consumer has not released this slot yet
+                return false;
+            }else{
+                head=mHead.load(std::memory_order_relaxed);
+            }
+        }
+        fill(slot->value);
+        slot->sequence.store(head+1,std::memory_order_release);
+        // Pairs with the fence in waitForData(). Either the consumer sees the new element or we see that it is sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mConsumerSleeping.load(std::memory_order_relaxed)){
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCondition.notify_one();
+        }
+        return true;
+    }
+    // Consumer only. Returns nullptr if the queue is empty
+    T* beginRead(){
+        Slot& slot=mSlots[mTailLocal & mMask];
+        if(slot.sequence.load(std::memory_order_acquire)!=mTailLocal+1)return nullptr;
+        return &slot.value;
+    }
+    // Consumer only. Gives the slot returned by the last beginRead() back to the producers
+    void commitRead(){
+        mSlots[mTailLocal & mMask].sequence.store(mTailLocal+mCapacity,std::memory_order_release);
+        mTailLocal++;
+        mTail.store(mTailLocal,std::memory_order_relaxed);
+    }
+    // Consumer only. Spin for a short time, then block until a producer publishes an element or the timeout elapses.
+    // Returns the next element or nullptr on timeout
+    T* waitForData(const std::chrono::microseconds timeout){
+        for(int i=0;i<N_SPINS_BEFORE_SLEEP;i++){
+            if(T* ret=beginRead())return ret;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mMutex);
+        mConsumerSleeping.store(true,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        T* ret=beginRead();
+        if(ret==nullptr){
+            mCondition.wait_for(lock,timeout,[this,&ret]{
+                ret=beginRead();
+                return ret!=nullptr;
+            });
+        }
+        mConsumerSleeping.store(false,std::memory_order_relaxed);
+        return ret;
+    }
+    // Approximate n of claimed or published elements
+    std::size_t size()const{
+        const std::size_t tail=mTail.load(std::memory_order_relaxed);
+        const std::size_t head=mHead.load(std::memory_order_relaxed);
+        return head>tail ? head-tail : 0;
+    }
+    std::size_t capacity()const{
+        return mCapacity;
+    }
+    // Only while no other thread uses the queue. Calls f(T&) on the element of every slot (free or not),
+    // e.g. to release the buffers the elements keep for re-use
+    template<class F>
+    void forEachSlot(F&& f){
+        for(std::size_t i=0;i<mCapacity;i++){
+            f(mSlots[i].value);
+        }
+    }
+private:
+    static constexpr const int N_SPINS_BEFORE_SLEEP=64;
+    static std::size_t roundUpToPowerOf2(const std::size_t value){
+        std::size_t ret=1;
+        while (ret<value)ret<<=1;
+        return ret;
+    }
+    struct Slot{
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+    const std::size_t mCapacity;
+    const std::size_t mMask;
+    const std::unique_ptr<Slot[]> mSlots;
+    // Claimed by the producers. Head and tail are never wrapped, only the index into mSlots is
+    alignas(64) std::atomic<std::size_t> mHead{0};
+    // Only written by the consumer, mTail is a copy for size()
+    alignas(64) std::size_t mTailLocal=0;
+    std::atomic<std::size_t> mTail{0};
+    alignas(64) std::atomic<bool> mConsumerSleeping{false};
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+namespace TEST_MPSC_QUEUE{
+    // Multiple producers push a sequence of numbers each trough a small queue.
+    // Checks that all arrive and that the numbers of each producer stay in order. Returns the n of failed checks.
+    // inline: GroundRecorderFPV includes this header without running the test
+    static inline int test(const std::size_t nProducers=4,const std::size_t nElementsPerProducer=250*1000){
+        int nFailed=0;
+        MPSCQueue<std::pair<std::size_t,std::size_t>> queue(16);
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> producers;
+        for(std::size_t p=0;p<nProducers;p++){
+            producers.emplace_back([&queue,&stop,p,nElementsPerProducer]{
+                for(std::size_t i=0;i<nElementsPerProducer;i++){
+                    while (!queue.tryWrite([p,i](std::pair<std::size_t,std::size_t>& slot){slot={p,i};})){
+                        if(stop)return;
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        std::vector<std::size_t> nextExpected(nProducers,0);
+        for(std::size_t i=0;i<nProducers*nElementsPerProducer;i++){
+            auto* slot=queue.waitForData(std::chrono::seconds(1));
+            // nullptr on timeout, e.g. when a producer lost an element
+            TEST_CHECK(nFailed,slot!=nullptr && slot->first<nProducers);
+            if(slot==nullptr || slot->first>=nProducers)break;
+            TEST_CHECK(nFailed,slot->second==nextExpected[slot->first]);
+            nextExpected[slot->first]++;
+            queue.commitRead();
+        }
+        stop=true;
+        for(auto& producer:producers){
+            producer.join();
+        }
+        if(nFailed==0){
+            TEST_CHECK(nFailed,queue.size()==0);
+        }
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_MPSCQUEUE_HPP
@@ -0,0 +1,142 @@
+#ifndef LIVEVIDEO10MS_SPSCQUEUE_HPP
+#define LIVEVIDEO10MS_SPSCQUEUE_HPP
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TestCheck.hpp"
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// The elements are pre-allocated and re-used - the producer fills the slot returned by beginWrite() in place
+// and publishes it with commitWrite(), the consumer reads the slot returned by beginRead() and releases it
+// with commitRead(). Therefore no memory is allocated as long as T itself does not allocate (e.g. a std::vector
+// with enough capacity).
+// Neither side ever takes a lock, except when the consumer went to sleep in waitForData() and has to be woken up.
+template<class T>
+class SPSCQueue{
+public:
+    // The capacity is rounded up to the next power of 2
+    explicit SPSCQueue(const std::size_t minCapacity):mCapacity(roundUpToPowerOf2(minCapacity)),mMask(mCapacity-1),
+        mBuffer(mCapacity){}
+    SPSCQueue(const SPSCQueue&)=delete;
+    SPSCQueue& operator=(const SPSCQueue&)=delete;
+    // Producer only. Returns nullptr if the queue is full
+    T* beginWrite(){
+        const std::size_t head=mHead.load(std::memory_order_relaxed);
+        if(head-mTailCached==mCapacity){
+            mTailCached=mTail.load(std::memory_order_acquire);
+            if(head-mTailCached==mCapacity)return nullptr;
+        }
+        return &mBuffer[head & mMask];
+    }
+    // Producer only. Publishes the slot returned by the last beginWrite()
+    void commitWrite(){
+        mHead.store(mHead.load(std::memory_order_relaxed)+1,std::memory_order_release);
+        // Pairs with the fence in waitForData(). Either the consumer sees the new element or we see that it is sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mConsumerSleeping.load(std::memory_order_relaxed)){
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCondition.notify_one();
+        }
+    }
+    // Consumer only. Returns nullptr if the queue is empty
+    T* beginRead(){
+        const std::size_t tail=mTail.load(std::memory_order_relaxed);
+        if(mHeadCached==tail){
+            mHeadCached=mHead.load(std::memory_order_acquire);
+            if(mHeadCached==tail)return nullptr;
+        }
+        return &mBuffer[tail & mMask];
+    }
+    // Consumer only. Gives the slot returned by the last beginRead() back to the producer
+    void commitRead(){
+        mTail.store(mTail.load(std::memory_order_relaxed)+1,std::memory_order_release);
+    }
+    // Consumer only. Spin for a short time, then block until the producer commits an element or the timeout elapses.
+    // Returns the next element or nullptr on timeout
+    T* waitForData(const std::chrono::microseconds timeout){
+        for(int i=0;i<N_SPINS_BEFORE_SLEEP;i++){
+            if(T* ret=beginRead())return ret;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mMutex);
+        mConsumerSleeping.store(true,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        T* ret=beginRead();
+        if(ret==nullptr){
+            mCondition.wait_for(lock,timeout,[this,&ret]{
+                ret=beginRead();
+                return ret!=nullptr;
+            });
+        }
+        mConsumerSleeping.store(false,std::memory_order_relaxed);
+        return ret;
+    }
+    // Approximate n of elements in the queue (exact when called from the producer or consumer thread while the other one is idle)
+    std::size_t size()const{
+        return mHead.load(std::memory_order_acquire)-mTail.load(std::memory_order_acquire);
+    }
+    std::size_t capacity()const{
+        return mCapacity;
+    }
+private:
+    static constexpr const int N_SPINS_BEFORE_SLEEP=64;
+    static std::size_t roundUpToPowerOf2(const std::size_t value){
+        std::size_t ret=1;
+        while (ret<value)ret<<=1;
+        return ret;
+    }
+    const std::size_t mCapacity;
+    const std::size_t mMask;
+    std::vector<T> mBuffer;
+    // Written by the producer. Head and tail are never wrapped, only the index into mBuffer is
+    alignas(64) std::atomic<std::size_t> mHead{0};
+    std::size_t mTailCached=0;
+    // Written by the consumer
+    alignas(64) std::atomic<std::size_t> mTail{0};
+    std::size_t mHeadCached=0;
+    alignas(64) std::atomic<bool> mConsumerSleeping{false};
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+namespace TEST_SPSC_QUEUE{
+    // Pushes a sequence of numbers trough a small queue and checks that it arrives complete and in order.
+    // Returns the n of failed checks
+    static int test(const std::size_t nElements=1000*1000){
+        int nFailed=0;
+        SPSCQueue<std::size_t> queue(16);
+        std::atomic<bool> stop{false};
+        std::thread producer([&queue,&stop,nElements]{
+            for(std::size_t i=0;i<nElements;i++){
+                std::size_t* slot;
+                while ((slot=queue.beginWrite())==nullptr){
+                    if(stop)return;
+                    std::this_thread::yield();
+                }
+                *slot=i;
+                queue.commitWrite();
+            }
+        });
+        for(std::size_t i=0;i<nElements;i++){
+            std::size_t* slot=queue.waitForData(std::chrono::seconds(1));
+            TEST_CHECK(nFailed,slot!=nullptr);
+            if(slot==nullptr)break;
+            TEST_CHECK(nFailed,*slot==i);
+            queue.commitRead();
+        }
+        stop=true;
+        producer.join();
+        if(nFailed==0){
+            TEST_CHECK(nFailed,queue.size()==0);
+        }
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_SPSCQUEUE_HPP
@@ -10,6 +10,7 @@
 #include <vector>
 #include <AndroidLogger.hpp>
 #include <cmath>
+#include <cassert>
 #include <iomanip>
 
 class StringHelper{
@@ -0,0 +1,16 @@
+#ifndef LIVEVIDEO10MS_TESTCHECK_HPP
+#define LIVEVIDEO10MS_TESTCHECK_HPP
+
+#include <AndroidLogger.hpp>
+
+// Check of the TEST_* self tests. Unlike assert() it also checks in release builds (NDEBUG): A failed condition is
+// logged and counted in nFailed, the tests return that count (see Benchmark/UnitTests.cpp and VideoPlayer testLatency)
+#define TEST_CHECK(nFailed,condition)                                              \
+    do{                                                                            \
+        if(!(condition)){                                                          \
+            MLOGE<<__FILE__<<":"<<__LINE__<<" check failed: "<<#condition;      \
+            (nFailed)++;                                                           \
+        }                                                                          \
+    }while(0)
+
+#endif //LIVEVIDEO10MS_TESTCHECK_HPP
@@ -17,6 +17,7 @@
 #include "FileReaderMP4.hpp"
 #include "FileReaderRAW.hpp"
 #include "FileReaderFPV.h"
+#include "MappedFpvFile.hpp"
 #include <NDKThreadHelper.hpp>
 
 //return -1 if no valid telemetry filename, else the telemetry type
@@ -60,6 +61,8 @@ void FileReader::stopReadingIfStarted() {
     mThread.reset();
     started=false;
     nReceivedB=0;
+    mPositionMs=0;
+    mDurationMs=0;
 }
 
 void FileReader::receiveLoop(std::future<void> shouldTerminate) {
@@ -68,6 +71,8 @@ void FileReader::receiveLoop(std::future<void> shouldTerminate) {
         FileReaderMP4::readMP4FileInChunks(assetManager,FILEPATH, [this,&shouldTerminate](const uint8_t *data, size_t data_length) {
             splitDataInChunks(shouldTerminate,data, data_length,GroundRecorderFPV::PACKET_TYPE_VIDEO_H264);
         },shouldTerminate);
+    }else if(FileHelper::endsWith(FILEPATH, ".fpv") && assetManager==nullptr && playMappedFpvFile(shouldTerminate)){
+        // done
     }else if(FileHelper::endsWith(FILEPATH, ".fpv")){
         auto start=std::chrono::steady_clock::now();
         const bool loopAtEOF=assetManager!=nullptr;
@@ -113,6 +118,42 @@ void FileReader::receiveLoop(std::future<void> shouldTerminate) {
     }
 }
 
+bool FileReader::playMappedFpvFile(const std::future<void>& shouldTerminate) {
+    MappedFpvFile file;
+    if(!file.open(FILEPATH)){
+        return false;
+    }
+    mDurationMs=file.duration().count();
+    mSeekRequestMs=-1;
+    auto start=std::chrono::steady_clock::now();
+    size_t i=0;
+    while(i<file.size() && shouldTerminate.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout){
+        const long seekRequestMs=mSeekRequestMs.exchange(-1);
+        if(seekRequestMs>=0){
+            i=file.findKeyframe(std::chrono::milliseconds(seekRequestMs));
+            if(i>=file.size())break;
+            // The decoder might not have seen the parameter sets of the keyframe yet
+            for(const auto parameterSet:file.parameterSetsBefore(i)){
+                const auto packet=file.packet(parameterSet);
+                splitDataInChunks(shouldTerminate,packet.data,packet.data_length,packet.packet_type);
+            }
+            // Continue with the timing of the keyframe
+            start=std::chrono::steady_clock::now()-file.packet(i).timestamp;
+            MLOGD<<"Seek to "<<seekRequestMs<<"ms, keyframe at "<<file.packet(i).timestamp.count()<<"ms";
+        }
+        const auto packet=file.packet(i);
+        // Same timing as the sequential .fpv reader below
+        if(std::chrono::steady_clock::now()-start<packet.timestamp*0.8){
+            TestSleep::sleep(std::chrono::milliseconds(1));
+            continue;
+        }
+        splitDataInChunks(shouldTerminate,packet.data,packet.data_length,packet.packet_type);
+        mPositionMs=packet.timestamp.count();
+        i++;
+    }
+    return true;
+}
+
 void FileReader::splitDataInChunks(const std::future<void>& shouldTerminate,const uint8_t *data, const size_t size,GroundRecorderFPV::PACKET_TYPE packetType) {
     //We cannot use recursion due to stack pointer size limitation. -> Use loop instead.
     /*if(!receiving || size==0)return;
@@ -16,6 +16,8 @@
 #include <fstream>
 #include <array>
 #include <future>
+#include <atomic>
+#include <algorithm>
 #include "GroundRecorderFPV.hpp"
 
 //Creates a new thread that 'receives' data from File and forwards data
@@ -40,6 +42,10 @@ private:
     std::promise<void> exitSignal;
     bool started=false;
     std::mutex mMutexStartStop;
+    // .fpv files only (see MappedFpvFile). -1 == no seek requested
+    std::atomic<long> mSeekRequestMs{-1};
+    std::atomic<long> mPositionMs{0};
+    std::atomic<long> mDurationMs{0};
 public:
     /**
      * Does nothing until startReading is called
@@ -67,6 +73,20 @@ public:
     int getNReceivedBytes(){
         return nReceivedB;
     }
+    /**
+     * Continue playback at the last keyframe at or before @param position. Only .fpv files (not from assets) can seek,
+     * else this call has no effect
+     */
+    void seek(std::chrono::milliseconds position){
+        mSeekRequestMs=std::max((long)position.count(),0L);
+    }
+    // .fpv files only, the timestamp of the last packet passed to the callback / of the last packet in the file
+    std::chrono::milliseconds getPosition()const{
+        return std::chrono::milliseconds(mPositionMs.load());
+    }
+    std::chrono::milliseconds getDuration()const{
+        return std::chrono::milliseconds(mDurationMs.load());
+    }
 private:
     /**
      * Pass all data divided in parts of data of size==CHUNK_SIZE
@@ -75,6 +95,8 @@ private:
     void splitDataInChunks(const std::future<void>& shouldTerminate,const uint8_t data[],const size_t size,GroundRecorderFPV::PACKET_TYPE packetType);
     // Call all callbacks if not null
     void passChunk(const uint8_t data[],const size_t size,GroundRecorderFPV::PACKET_TYPE packetType);
+    // Play a .fpv file from the filesystem with its timing, seeking if requested. Returns false if the file cannot be mapped
+    bool playMappedFpvFile(const std::future<void>& shouldTerminate);
 };
 
 #endif //FPV_VR_FILERECEIVER_H
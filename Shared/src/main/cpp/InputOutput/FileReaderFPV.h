@@ -30,7 +30,7 @@ namespace FileReaderFPV{
     typedef struct{
         GroundRecorderFPV::PACKET_TYPE packet_type;
         std::chrono::milliseconds timestamp;
-        uint8_t* data;
+        const uint8_t* data;
         size_t data_length;
     }GroundRecordingPacket;
     typedef std::function<void(const GroundRecordingPacket&)> MY_CALLBACK;
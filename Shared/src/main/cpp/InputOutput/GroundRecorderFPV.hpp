@@ -13,49 +13,34 @@
 #include <FileHelper.hpp>
 #include <chrono>
 #include <optional>
+#include <mutex>
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <MPSCQueue.hpp>
+#include <StringHelper.hpp>
+#ifdef __ANDROID__
 #include <jni.h>
+#endif
 #include <AndroidLogger.hpp>
+#include <TestCheck.hpp>
 
 /**
- * Thread-safe class for writing a .fpv ground recording file
+ * Thread-safe class for writing a .fpv ground recording file.
+ * writePacketIfStarted() only copies the packet into a bounded lock-free queue (the slots and up to MAX_POOLED_BYTES of
+ * their buffers are re-used),
+ * a dedicated I/O thread writes the packets to the file. So a slow SD card does not stall the video receive thread.
+ * The I/O thread coalesces the packets into blocks of WRITE_BLOCK_SIZE that are written at aligned file offsets,
+ * and optionally calls fdatasync() every Options::syncInterval.
  */
 class GroundRecorderFPV{
-private:
-    const std::string DIRECTORY;
-    //Make sure only one thread writes to file at the time
-    std::mutex mMutexFileAccess;
-    bool started=false;
-    std::string createdPathFilename;
-    /**
-    * only as soon as we actually write data the file is created
-    * to not pollute the file system with empty files
-    */
-    void createOpenFileIfNeeded(){
-        //MLOGD<<"createOpenFileIfNeeded";
-        if(!ofstream.is_open()){
-            createdPathFilename=FileHelper::findUnusedFilename(DIRECTORY,"fpv");
-            //createdPathFilename=DIRECTORY+"TESTING.txt";
-            //MLOGD<<"Created "<<createdPathFilename;
-            ofstream.open (createdPathFilename.c_str());
-            if(!ofstream.is_open()){
-                MLOGE<<"Cannot open ?!"<<ofstream.failbit<<" fail: " <<ofstream.fail() << " bad: " << ofstream.bad();
-            }
-            fileCreationTime=std::chrono::steady_clock::now();
-        }
-    }
-    // If the file was created close it and return the file path of the created file
-    // Else do nothing and return std::nullopt
-    std::optional<std::string> closeFileIfOpened(){
-        if(ofstream.is_open()){
-            ofstream.flush();
-            ofstream.close();
-            return createdPathFilename;
-        }else{
-            MLOGD<<"No data was recorded";
-        }
-        return std::nullopt;
-    }
-    std::chrono::steady_clock::time_point fileCreationTime;
 public:
     static constexpr uint8_t PACKET_TYPE_VIDEO_H264=0;
     static constexpr uint8_t PACKET_TYPE_TELEMETRY_LTM=1;
@@ -78,42 +63,339 @@ public:
         TIMESTAMP_MS timestamp;
         uint8_t placeholder[8];//8 bytes as placeholder for future use
     }__attribute__((packed)) StreamPacketHeader;
-public:
-    GroundRecorderFPV(std::string s):DIRECTORY(s) {}
+    // What writePacketIfStarted() does when the I/O thread cannot keep up and the queue is full
+    enum class OverflowPolicy{
+        // Wait until there is space again (the calling thread is stalled, no packet is lost)
+        BLOCK,
+        // Drop the packet (the recording is missing the packet, the calling thread is never stalled)
+        DROP
+    };
+    struct Options{
+        // n of packets that can be queued
+        size_t queueCapacity=1024;
+        OverflowPolicy overflowPolicy=OverflowPolicy::DROP;
+        // Call fdatasync() at most this often while data is written, 0 == only when the file is closed
+        std::chrono::milliseconds syncInterval{0};
+    };
+    struct Stats{
+        long nWrittenPackets=0;
+        long nWrittenBytes=0;
+        // write calls to the file
+        long nWrites=0;
+        long nSyncs=0;
+        // n of times the queue was full
+        long nOverflows=0;
+        // dropped on overflow (DROP) or because of a write error
+        long nDroppedPackets=0;
+    };
+    GroundRecorderFPV(std::string s,const Options& options):DIRECTORY(std::move(s)),mOptions(options),
+        mQueue(options.queueCapacity){}
+    explicit GroundRecorderFPV(std::string s):GroundRecorderFPV(std::move(s),Options()){}
+    GroundRecorderFPV(const GroundRecorderFPV&)=delete;
+    GroundRecorderFPV& operator=(const GroundRecorderFPV&)=delete;
+    ~GroundRecorderFPV(){
+        stop();
+    }
     //It is okay to call start() multiple times
     //only in the 'started' state data is written to the ground recording file
     void start(){
-        std::lock_guard<std::mutex> lock(mMutexFileAccess);
+        std::lock_guard<std::mutex> lock(mMutexStartStop);
+        if(started)return;
+        // Packets of a producer that raced with the last stop()
+        while (mQueue.beginRead()!=nullptr){
+            mQueue.commitRead();
+            nDroppedPackets++;
+        }
+        createdPathFilename.clear();
+        writeError=false;
+        writing=true;
+        mIOThread=std::make_unique<std::thread>(&GroundRecorderFPV::writeLoop,this);
         started=true;
     }
-    std::optional<std::string> stop(JNIEnv* env,jobject androidContext){
-        std::lock_guard<std::mutex> lock(mMutexFileAccess);
+    // Write all queued packets and close the file.
+    // If the file was created return the file path of the created file, else std::nullopt
+    std::optional<std::string> stop(){
+        std::lock_guard<std::mutex> lock(mMutexStartStop);
         started=false;
-        auto ret=closeFileIfOpened();
+        if(mIOThread){
+            writing=false;
+            mIOThread->join();
+            mIOThread.reset();
+        }
+        // Nobody uses the queue anymore once the producers that saw started==true are done
+        while (nActiveProducers.load()>0){
+            std::this_thread::yield();
+        }
+        mQueue.forEachSlot([](QueuedPacket& queuedPacket){
+            std::vector<uint8_t>().swap(queuedPacket.data);
+            queuedPacket.pooledCapacity=0;
+        });
+        mPooledBytes=0;
+        if(createdPathFilename.empty()){
+            MLOGD<<"No data was recorded";
+            return std::nullopt;
+        }
+        const std::string ret=createdPathFilename;
+        createdPathFilename.clear();
+        return ret;
+    }
+#ifdef __ANDROID__
+    std::optional<std::string> stop(JNIEnv* env,jobject androidContext){
+        auto ret=stop();
         if(ret!=std::nullopt){
             GroundRecorderFPV::addFpvFileToContentProvider(env, androidContext,*ret);
         }
         return ret;
     }
+#endif
+    bool isStarted()const{
+        return started;
+    }
     //Only write data if started and data_length>0
     void writePacketIfStarted(const uint8_t *packet,const size_t packet_length,const PACKET_TYPE packet_type,int customTimeStamp=-1) {
-        std::lock_guard<std::mutex> lock(mMutexFileAccess);
-        if(!started)return;
         if(packet_length==0)return;
-        createOpenFileIfNeeded();
-        //calculate the timestamp
-        auto now=std::chrono::steady_clock::now();
-        const TIMESTAMP_MS timestamp=customTimeStamp!=-1 ? customTimeStamp :
-                (TIMESTAMP_MS)std::chrono::duration_cast<std::chrono::milliseconds>(now - fileCreationTime).count();
-        StreamPacketHeader streamPacket;
-        streamPacket.packet_length=(unsigned int)packet_length;
-        streamPacket.packet_type=packet_type;
-        streamPacket.timestamp=timestamp;
-        ofstream.write((char*)&streamPacket,sizeof(StreamPacketHeader));
-        ofstream.write((char*)packet,packet_length);
+        // stop() waits for all producers that might have seen started==true before it frees the slot buffers
+        nActiveProducers++;
+        const ActiveProducer activeProducer{nActiveProducers};
+        if(!started)return;
+        const auto now=std::chrono::steady_clock::now();
+        const auto fill=[packet,packet_length,packet_type,customTimeStamp,now](QueuedPacket& queuedPacket){
+            queuedPacket.data.assign(packet,packet+packet_length);
+            queuedPacket.packetType=packet_type;
+            queuedPacket.customTimeStamp=customTimeStamp;
+            queuedPacket.time=now;
+        };
+        if(mQueue.tryWrite(fill))return;
+        nOverflows++;
+        if(mOptions.overflowPolicy==OverflowPolicy::BLOCK){
+            while (started){
+                if(mQueue.tryWrite(fill))return;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        nDroppedPackets++;
+    }
+    Stats getStats()const{
+        Stats ret;
+        ret.nWrittenPackets=nWrittenPackets;
+        ret.nWrittenBytes=nWrittenBytes;
+        ret.nWrites=nWrites;
+        ret.nSyncs=nSyncs;
+        ret.nOverflows=nOverflows;
+        ret.nDroppedPackets=nDroppedPackets;
+        return ret;
+    }
+    std::string getStatsString()const{
+        const auto stats=getStats();
+        std::stringstream ss;
+        ss<<"Recording: packets "<<stats.nWrittenPackets<<" | "<<StringHelper::memorySizeReadable(stats.nWrittenBytes)
+          <<" in "<<stats.nWrites<<" writes | syncs "<<stats.nSyncs<<" | queue full "<<stats.nOverflows<<" | dropped "<<stats.nDroppedPackets;
+        return ss.str();
     }
+    // Packets are written to the file in blocks of this size (except for the partially filled last block, see FLUSH_INTERVAL)
+    static constexpr size_t WRITE_BLOCK_SIZE=256*1024;
+    // The partially filled last block is written at least this often
+    static constexpr std::chrono::milliseconds FLUSH_INTERVAL{500};
 private:
-    std::ofstream ofstream;
+    struct QueuedPacket{
+        std::vector<uint8_t> data;
+        PACKET_TYPE packetType;
+        int customTimeStamp;
+        std::chrono::steady_clock::time_point time;
+        // Capacity of data that is counted in mPooledBytes, only used by the I/O thread
+        size_t pooledCapacity=0;
+    };
+    struct ActiveProducer{
+        std::atomic<int>& nActiveProducers;
+        ~ActiveProducer(){
+            nActiveProducers--;
+        }
+    };
+    // Slot buffers bigger than this (e.g. key frames) are freed after writing instead of being re-used
+    static constexpr size_t MAX_POOLED_PACKET_SIZE=64*1024;
+    // The buffers of all slots together keep at most this much memory for re-use, the others are freed after writing.
+    // Without the limit each of the queueCapacity slots could keep up to MAX_POOLED_PACKET_SIZE
+    static constexpr size_t MAX_POOLED_BYTES=2*1024*1024;
+    static constexpr size_t BLOCK_ALIGNMENT=4096;
+    const std::string DIRECTORY;
+    const Options mOptions;
+    MPSCQueue<QueuedPacket> mQueue;
+    // start() / stop() are rare, writePacketIfStarted() does not lock this mutex
+    std::mutex mMutexStartStop;
+    std::atomic<bool> started{false};
+    // The I/O thread writes all queued packets and exits once this is false
+    std::atomic<bool> writing{false};
+    std::atomic<int> nActiveProducers{0};
+    // Sum of the pooledCapacity of all slots. Owned by the I/O thread while it runs
+    size_t mPooledBytes=0;
+    std::unique_ptr<std::thread> mIOThread;
+    // Owned by the I/O thread while it runs
+    std::string createdPathFilename;
+    int fd=-1;
+    std::chrono::steady_clock::time_point fileCreationTime;
+    TIMESTAMP_MS lastTimestamp=0;
+    struct FreeDeleter{
+        void operator()(uint8_t* p)const{free(p);}
+    };
+    std::unique_ptr<uint8_t,FreeDeleter> mBlock;
+    size_t mBlockFill=0;
+    // Of the first byte of mBlock in the file
+    off_t mBlockOffset=0;
+    // n of bytes of mBlock that are in the file already
+    size_t mBlockFlushed=0;
+    std::chrono::steady_clock::time_point lastFlush;
+    std::chrono::steady_clock::time_point lastSync;
+    bool unsyncedData=false;
+    bool writeError=false;
+    std::atomic<long> nWrittenPackets{0};
+    std::atomic<long> nWrittenBytes{0};
+    std::atomic<long> nWrites{0};
+    std::atomic<long> nSyncs{0};
+    std::atomic<long> nOverflows{0};
+    std::atomic<long> nDroppedPackets{0};
+
+    void writeLoop(){
+        while (true){
+            QueuedPacket* queuedPacket=mQueue.waitForData(std::chrono::milliseconds(50));
+            if(queuedPacket!=nullptr){
+                writePacket(*queuedPacket);
+                recycleBuffer(*queuedPacket);
+                mQueue.commitRead();
+            }else if(!writing){
+                break;
+            }
+            if(fd<0)continue;
+            const auto now=std::chrono::steady_clock::now();
+            if(mBlockFill>mBlockFlushed && now-lastFlush>=FLUSH_INTERVAL){
+                flushBlock();
+            }
+            if(mOptions.syncInterval.count()>0 && unsyncedData && now-lastSync>=mOptions.syncInterval){
+                sync();
+            }
+        }
+        closeFileIfOpened();
+    }
+    // Keep the buffer of the slot for the next packet if it fits into the budget, else free it
+    void recycleBuffer(QueuedPacket& queuedPacket){
+        mPooledBytes-=queuedPacket.pooledCapacity;
+        const size_t capacity=queuedPacket.data.capacity();
+        if(capacity<=MAX_POOLED_PACKET_SIZE && mPooledBytes+capacity<=MAX_POOLED_BYTES){
+            queuedPacket.pooledCapacity=capacity;
+            mPooledBytes+=capacity;
+        }else{
+            std::vector<uint8_t>().swap(queuedPacket.data);
+            queuedPacket.pooledCapacity=0;
+        }
+    }
+    /**
+    * only as soon as we actually write data the file is created
+    * to not pollute the file system with empty files
+    */
+    bool createOpenFileIfNeeded(const std::chrono::steady_clock::time_point firstPacketTime){
+        if(fd>=0)return true;
+        createdPathFilename=FileHelper::findUnusedFilename(DIRECTORY,"fpv");
+        fd=::open(createdPathFilename.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(fd<0){
+            MLOGE<<"Cannot open "<<createdPathFilename<<" "<<strerror(errno);
+            createdPathFilename.clear();
+            writeError=true;
+            return false;
+        }
+        if(!mBlock){
+            void* block=nullptr;
+            if(posix_memalign(&block,BLOCK_ALIGNMENT,WRITE_BLOCK_SIZE)!=0){
+                MLOGE<<"Cannot allocate write buffer";
+                ::close(fd);
+                fd=-1;
+                writeError=true;
+                return false;
+            }
+            mBlock.reset((uint8_t*)block);
+        }
+        mBlockFill=0;
+        mBlockOffset=0;
+        mBlockFlushed=0;
+        fileCreationTime=firstPacketTime;
+        lastTimestamp=0;
+        lastFlush=lastSync=std::chrono::steady_clock::now();
+        unsyncedData=false;
+        return true;
+    }
+    void writePacket(const QueuedPacket& queuedPacket){
+        if(writeError || !createOpenFileIfNeeded(queuedPacket.time)){
+            nDroppedPackets++;
+            return;
+        }
+        TIMESTAMP_MS timestamp;
+        if(queuedPacket.customTimeStamp!=-1){
+            timestamp=(TIMESTAMP_MS)queuedPacket.customTimeStamp;
+        }else{
+            // Multiple producers can queue their packets in a different order than they took the time
+            const auto ms=std::chrono::duration_cast<std::chrono::milliseconds>(queuedPacket.time - fileCreationTime).count();
+            timestamp=std::max(lastTimestamp,(TIMESTAMP_MS)std::max<std::chrono::milliseconds::rep>(ms,0));
+            lastTimestamp=timestamp;
+        }
+        StreamPacketHeader streamPacket{};
+        streamPacket.packet_length=(unsigned int)queuedPacket.data.size();
+        streamPacket.packet_type=queuedPacket.packetType;
+        streamPacket.timestamp=timestamp;
+        append((const uint8_t*)&streamPacket,sizeof(StreamPacketHeader));
+        append(queuedPacket.data.data(),queuedPacket.data.size());
+        nWrittenPackets++;
+    }
+    // Copy into the current block, write the block once it is full
+    void append(const uint8_t* data,size_t length){
+        while (length>0){
+            const size_t n=std::min(length,WRITE_BLOCK_SIZE-mBlockFill);
+            memcpy(mBlock.get()+mBlockFill,data,n);
+            mBlockFill+=n;
+            data+=n;
+            length-=n;
+            if(mBlockFill==WRITE_BLOCK_SIZE){
+                flushBlock();
+                mBlockOffset+=WRITE_BLOCK_SIZE;
+                mBlockFill=0;
+                mBlockFlushed=0;
+            }
+        }
+    }
+    // Write the current block (re-written as a whole once it is full, so all writes start at an aligned offset)
+    void flushBlock(){
+        if(mBlockFill==mBlockFlushed)return;
+        size_t written=0;
+        while (written<mBlockFill){
+            const ssize_t ret=pwrite(fd,mBlock.get()+written,mBlockFill-written,mBlockOffset+written);
+            if(ret<0){
+                if(errno==EINTR)continue;
+                // e.g. the SD card is full. The packets after this one are dropped
+                MLOGE<<"Cannot write "<<createdPathFilename<<" "<<strerror(errno);
+                writeError=true;
+                return;
+            }
+            written+=ret;
+        }
+        nWrittenBytes+=mBlockFill-mBlockFlushed;
+        nWrites++;
+        mBlockFlushed=mBlockFill;
+        lastFlush=std::chrono::steady_clock::now();
+        unsyncedData=true;
+    }
+    void sync(){
+        fdatasync(fd);
+        nSyncs++;
+        unsyncedData=false;
+        lastSync=std::chrono::steady_clock::now();
+    }
+    void closeFileIfOpened(){
+        if(fd<0)return;
+        flushBlock();
+        if(mOptions.syncInterval.count()>0 && unsyncedData){
+            sync();
+        }
+        ::close(fd);
+        fd=-1;
+    }
+#ifdef __ANDROID__
     void addFpvFileToContentProvider(JNIEnv* env,jobject androidContext,std::string filePath){
         MLOGD<<"Adding fpv file to content provider";
         jclass jcVideoSettings = env->FindClass("constantin/video/core/player/VideoSettings");
@@ -122,6 +404,86 @@ private:
         assert(jmethodId!=nullptr);
         env->CallStaticVoidMethod(jcVideoSettings,jmethodId,androidContext,env->NewStringUTF(filePath.c_str()));
     }
+#endif
 };
 
+namespace TEST_GROUND_RECORDER_FPV{
+    // Writes packets from 2 threads through a small queue that overflows (BLOCK, so none may be dropped),
+    // some bigger than WRITE_BLOCK_SIZE, then reads the file back. directory is the prefix of the created file,
+    // the file is deleted afterwards. Returns the n of failed checks
+    static inline int test(const std::string& directory){
+        int nFailed=0;
+        GroundRecorderFPV::Options options;
+        options.queueCapacity=16;
+        options.overflowPolicy=GroundRecorderFPV::OverflowPolicy::BLOCK;
+        options.syncInterval=std::chrono::milliseconds(1);
+        GroundRecorderFPV recorder(directory,options);
+        const int N_THREADS=2;
+        const int N_PACKETS_PER_THREAD=2000;
+        // Byte 0: the thread, byte 1,2: the packet index of this thread, then a pattern up to the size
+        const auto packetSize=[](const int i){
+            return (i%500==499) ? GroundRecorderFPV::WRITE_BLOCK_SIZE+i : (size_t)(3+(i*37)%1400);
+        };
+        const auto makePacket=[&packetSize](const int thread,const int i){
+            std::vector<uint8_t> packet(packetSize(i));
+            for(size_t j=0;j<packet.size();j++){
+                packet[j]=(uint8_t)(j+i);
+            }
+            packet[0]=(uint8_t)thread;
+            packet[1]=(uint8_t)(i>>8);
+            packet[2]=(uint8_t)i;
+            return packet;
+        };
+        recorder.start();
+        std::vector<std::thread> threads;
+        for(int t=0;t<N_THREADS;t++){
+            threads.emplace_back([&recorder,&makePacket,t]{
+                for(int i=0;i<N_PACKETS_PER_THREAD;i++){
+                    const auto packet=makePacket(t,i);
+                    recorder.writePacketIfStarted(packet.data(),packet.size(),GroundRecorderFPV::PACKET_TYPE_VIDEO_H264);
+                }
+            });
+        }
+        for(auto& thread:threads){
+            thread.join();
+        }
+        const auto filename=recorder.stop();
+        const auto stats=recorder.getStats();
+        TEST_CHECK(nFailed,filename.has_value());
+        TEST_CHECK(nFailed,stats.nWrittenPackets==N_THREADS*N_PACKETS_PER_THREAD && stats.nDroppedPackets==0);
+        if(!filename)return nFailed;
+        std::ifstream file(*filename,std::ios::binary);
+        std::vector<int> nextExpected(N_THREADS,0);
+        GroundRecorderFPV::TIMESTAMP_MS lastTimestamp=0;
+        size_t nBytes=0;
+        while (true){
+            GroundRecorderFPV::StreamPacketHeader header{};
+            file.read((char*)&header,sizeof(header));
+            if(file.gcount()==0)break;
+            TEST_CHECK(nFailed,file.gcount()==sizeof(header));
+            TEST_CHECK(nFailed,header.packet_type==GroundRecorderFPV::PACKET_TYPE_VIDEO_H264 && header.timestamp>=lastTimestamp);
+            lastTimestamp=header.timestamp;
+            std::vector<uint8_t> packet(header.packet_length);
+            file.read((char*)packet.data(),packet.size());
+            const bool complete=file.gcount()==(std::streamsize)packet.size() && packet.size()>=3 && packet[0]<N_THREADS;
+            TEST_CHECK(nFailed,complete);
+            if(!complete)break;
+            const int thread=packet[0];
+            TEST_CHECK(nFailed,nextExpected[thread]<N_PACKETS_PER_THREAD && packet==makePacket(thread,nextExpected[thread]));
+            nextExpected[thread]++;
+            nBytes+=sizeof(header)+packet.size();
+        }
+        for(const int n:nextExpected){
+            TEST_CHECK(nFailed,n==N_PACKETS_PER_THREAD);
+        }
+        TEST_CHECK(nFailed,(long)nBytes==stats.nWrittenBytes);
+        file.close();
+        std::remove(filename->c_str());
+        if(nFailed==0){
+            MLOGD<<"TEST_GROUND_RECORDER_FPV passed "<<recorder.getStatsString();
+        }
+        return nFailed;
+    }
+}
+
 #endif //TELEMETRY_GROUNDRECORDERFPV_HPP
@@ -0,0 +1,404 @@
+#ifndef LIVEVIDEO10MS_MAPPEDFPVFILE_HPP
+#define LIVEVIDEO10MS_MAPPEDFPVFILE_HPP
+
+#include <vector>
+#include <chrono>
+#include <string>
+#include <array>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "GroundRecorderFPV.hpp"
+#include "FileReaderFPV.h"
+#include <AndroidLogger.hpp>
+#include <TestCheck.hpp>
+
+/**
+ * Random access to a .fpv ground recording (see GroundRecorderFPV) without copying the packets.
+ * The file is memory mapped and indexed once: offset, length, timestamp, type and keyframe / parameter set flags
+ * of each packet. The index is cached next to the recording (FILENAME.idx) and rebuilt if the size of the recording changed.
+ * Seeking by timestamp uses a table of the first packet of each second, seeking to a keyframe a list of all keyframes.
+ * Mapping fails for recordings bigger than the address space (32 bit devices), use FileReaderFPV then.
+ */
+class MappedFpvFile{
+public:
+    static constexpr uint8_t FLAG_KEYFRAME=1;
+    static constexpr uint8_t FLAG_SPS=2;
+    static constexpr uint8_t FLAG_PPS=4;
+    static constexpr uint8_t FLAG_VPS=8;
+    // Keyframe only: The first slice of the picture (a keyframe with multiple slices is recorded as multiple packets)
+    static constexpr uint8_t FLAG_FIRST_SLICE=16;
+    struct IndexEntry{
+        // of the packet data, after the header
+        uint64_t offset;
+        uint32_t length;
+        GroundRecorderFPV::TIMESTAMP_MS timestamp;
+        GroundRecorderFPV::PACKET_TYPE packetType;
+        uint8_t flags;
+        uint8_t placeholder[6];
+    };
+    static_assert(sizeof(IndexEntry)==24,"The index file depends on the layout");
+    MappedFpvFile()=default;
+    MappedFpvFile(const MappedFpvFile&)=delete;
+    MappedFpvFile& operator=(const MappedFpvFile&)=delete;
+    ~MappedFpvFile(){
+        close();
+    }
+    /**
+     * Map the file and load the index, or build (and cache) it if there is no valid cached index
+     * @return false if the file cannot be opened or mapped
+     */
+    bool open(const std::string& filename,const bool cacheIndex=true){
+        close();
+        fd=::open(filename.c_str(),O_RDONLY);
+        if(fd<0){
+            MLOGE<<"Cannot open "<<filename;
+            return false;
+        }
+        struct stat st{};
+        if(fstat(fd,&st)!=0 || st.st_size==0){
+            close();
+            return false;
+        }
+        mappedSize=(size_t)st.st_size;
+        void* ptr=mmap(nullptr,mappedSize,PROT_READ,MAP_SHARED,fd,0);
+        if(ptr==MAP_FAILED){
+            MLOGE<<"Cannot map "<<filename<<" "<<strerror(errno);
+            mappedSize=0;
+            close();
+            return false;
+        }
+        mapped=(const uint8_t*)ptr;
+        // Playback is mostly sequential
+        madvise(ptr,mappedSize,MADV_SEQUENTIAL);
+        const std::string indexFilename=filename+".idx";
+        if(!cacheIndex || !readIndex(indexFilename)){
+            buildIndex();
+            if(cacheIndex){
+                writeIndex(indexFilename);
+            }
+        }
+        createLookupTables();
+        return true;
+    }
+    void close(){
+        if(mapped!=nullptr){
+            munmap((void*)mapped,mappedSize);
+            mapped=nullptr;
+        }
+        if(fd>=0){
+            ::close(fd);
+            fd=-1;
+        }
+        mappedSize=0;
+        mIndex.clear();
+        mSecondStarts.clear();
+        mKeyframes.clear();
+    }
+    // n of packets
+    size_t size()const{
+        return mIndex.size();
+    }
+    const IndexEntry& entry(const size_t i)const{
+        return mIndex[i];
+    }
+    // The data points into the mapped file and is valid until close()
+    FileReaderFPV::GroundRecordingPacket packet(const size_t i)const{
+        const auto& e=mIndex[i];
+        return {e.packetType,std::chrono::milliseconds(e.timestamp),&mapped[e.offset],e.length};
+    }
+    std::chrono::milliseconds duration()const{
+        return mIndex.empty() ? std::chrono::milliseconds(0) : std::chrono::milliseconds(mIndex.back().timestamp);
+    }
+    // Index of the first packet with a timestamp >= @param timestamp, size() if there is none
+    size_t findTimestamp(const std::chrono::milliseconds timestamp)const{
+        if(timestamp.count()<=0)return 0;
+        const size_t second=(size_t)timestamp.count()/1000;
+        if(second>=mSecondStarts.size())return mIndex.size();
+        size_t i=mSecondStarts[second];
+        while(i<mIndex.size() && mIndex[i].timestamp<timestamp.count()){
+            i++;
+        }
+        return i;
+    }
+    /**
+     * Index of the last keyframe at or before @param timestamp (the first keyframe if there is none before).
+     * size() if the recording has no keyframes
+     */
+    size_t findKeyframe(const std::chrono::milliseconds timestamp)const{
+        if(mKeyframes.empty())return mIndex.size();
+        const size_t i=findTimestamp(timestamp);
+        auto it=std::upper_bound(mKeyframes.begin(),mKeyframes.end(),i,[](const size_t value,const Keyframe& k){
+            return value<k.index;
+        });
+        if(it!=mKeyframes.begin())--it;
+        return it->index;
+    }
+    /**
+     * The last VPS / SPS / PPS packets before the keyframe @param keyframeIndex (see findKeyframe()),
+     * in the order they were recorded. Needed by the decoder if the stream only contains them once at the beginning
+     */
+    std::vector<size_t> parameterSetsBefore(const size_t keyframeIndex)const{
+        std::vector<size_t> ret;
+        for(const auto& k:mKeyframes){
+            if(k.index!=keyframeIndex)continue;
+            for(const auto p:k.parameterSets){
+                if(p>=0 && (size_t)p<keyframeIndex)ret.push_back((size_t)p);
+            }
+            std::sort(ret.begin(),ret.end());
+            break;
+        }
+        return ret;
+    }
+private:
+    int fd=-1;
+    const uint8_t* mapped=nullptr;
+    size_t mappedSize=0;
+    std::vector<IndexEntry> mIndex;
+    // The index of the first packet of each second
+    std::vector<uint32_t> mSecondStarts;
+    struct Keyframe{
+        size_t index;
+        // latest VPS,SPS,PPS before the keyframe, -1 if none
+        std::array<long,3> parameterSets;
+    };
+    std::vector<Keyframe> mKeyframes;
+    struct IndexFileHeader{
+        char magic[4];
+        uint32_t version;
+        // of the recording when the index was created
+        uint64_t fileSize;
+        uint64_t nEntries;
+    };
+    // 2: FLAG_FIRST_SLICE
+    static constexpr uint32_t INDEX_VERSION=2;
+
+    // Keyframe / parameter set flags of a packet (one NALU with start code)
+    static uint8_t getFlags(const GroundRecorderFPV::PACKET_TYPE packetType,const uint8_t* data,const size_t length){
+        if(length<4)return 0;
+        size_t i=0;
+        while(i+2<length && i<3 && data[i]==0)i++;
+        if(i<2 || data[i]!=1)return 0;
+        const uint8_t header=data[i+1];
+        if(packetType==GroundRecorderFPV::PACKET_TYPE_VIDEO_H264){
+            switch(header & 0x1f){
+                // first_mb_in_slice==0 (ue(v), a single 1 bit)
+                case 5:return FLAG_KEYFRAME | ((i+2<length && (data[i+2] & 0x80)) ? FLAG_FIRST_SLICE : 0);
+                case 7:return FLAG_SPS;
+                case 8:return FLAG_PPS;
+                default:return 0;
+            }
+        }else if(packetType==GroundRecorderFPV::PACKET_TYPE_VIDEO_H265){
+            const int type=(header>>1) & 0x3f;
+            // IRAP (BLA, IDR, CRA). first_slice_segment_in_pic_flag follows the 2 byte NALU header
+            if(type>=16 && type<=21)return FLAG_KEYFRAME | ((i+3<length && (data[i+3] & 0x80)) ? FLAG_FIRST_SLICE : 0);
+            switch(type){
+                case 32:return FLAG_VPS;
+                case 33:return FLAG_SPS;
+                case 34:return FLAG_PPS;
+                default:return 0;
+            }
+        }
+        return 0;
+    }
+    void buildIndex(){
+        mIndex.clear();
+        size_t offset=0;
+        while(offset+sizeof(GroundRecorderFPV::StreamPacketHeader)<=mappedSize){
+            GroundRecorderFPV::StreamPacketHeader header;
+            std::memcpy(&header,&mapped[offset],sizeof(header));
+            offset+=sizeof(header);
+            // The recording might have been interrupted while writing the last packet
+            if(offset+header.packet_length>mappedSize)break;
+            IndexEntry e{};
+            e.offset=offset;
+            e.length=header.packet_length;
+            e.timestamp=header.timestamp;
+            e.packetType=header.packet_type;
+            e.flags=getFlags(header.packet_type,&mapped[offset],header.packet_length);
+            mIndex.push_back(e);
+            offset+=header.packet_length;
+        }
+        MLOGD<<"Indexed "<<mIndex.size()<<" packets";
+    }
+    bool readIndex(const std::string& indexFilename){
+        struct stat st{};
+        if(stat(indexFilename.c_str(),&st)!=0)return false;
+        std::ifstream file(indexFilename,std::ios::binary);
+        IndexFileHeader header{};
+        if(!file.read((char*)&header,sizeof(header)))return false;
+        if(std::memcmp(header.magic,"FPVI",4)!=0 || header.version!=INDEX_VERSION || header.fileSize!=mappedSize){
+            return false;
+        }
+        // Do not trust nEntries before allocating: Each packet needs at least its header in the recording,
+        // and the index file has to contain exactly nEntries entries
+        if(header.nEntries>mappedSize/sizeof(GroundRecorderFPV::StreamPacketHeader) ||
+           (uint64_t)st.st_size!=sizeof(header)+header.nEntries*sizeof(IndexEntry)){
+            MLOGE<<"Corrupt index "<<indexFilename<<", rebuilding it";
+            return false;
+        }
+        mIndex.resize(header.nEntries);
+        if(!file.read((char*)mIndex.data(),header.nEntries*sizeof(IndexEntry))){
+            mIndex.clear();
+            return false;
+        }
+        for(const auto& e:mIndex){
+            if(e.offset>mappedSize || e.length>mappedSize-e.offset){
+                mIndex.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+    void writeIndex(const std::string& indexFilename)const{
+        // Not possible for read only directories, the index is built each time then
+        std::ofstream file(indexFilename,std::ios::binary|std::ios::trunc);
+        if(!file.is_open())return;
+        const IndexFileHeader header{{'F','P','V','I'},INDEX_VERSION,mappedSize,mIndex.size()};
+        file.write((const char*)&header,sizeof(header));
+        file.write((const char*)mIndex.data(),mIndex.size()*sizeof(IndexEntry));
+    }
+    void createLookupTables(){
+        mSecondStarts.clear();
+        mKeyframes.clear();
+        std::array<long,3> parameterSets{-1,-1,-1};
+        for(size_t i=0;i<mIndex.size();i++){
+            const auto& e=mIndex[i];
+            // The timestamps are increasing
+            while(mSecondStarts.size()<=e.timestamp/1000){
+                mSecondStarts.push_back((uint32_t)i);
+            }
+            if(e.flags & FLAG_VPS)parameterSets[0]=(long)i;
+            if(e.flags & FLAG_SPS)parameterSets[1]=(long)i;
+            if(e.flags & FLAG_PPS)parameterSets[2]=(long)i;
+            // The other slices of a keyframe with multiple slices belong to the keyframe of its first slice
+            if((e.flags & FLAG_KEYFRAME) && ((e.flags & FLAG_FIRST_SLICE) || mKeyframes.empty())){
+                // The parameter sets are part of the keyframe if they were recorded right before it.
+                // Only walk back over them, not over the previous keyframe (e.g. a stream of only IDR frames)
+                size_t start=i;
+                while(start>0 && (mIndex[start-1].flags & (FLAG_VPS|FLAG_SPS|FLAG_PPS))){
+                    start--;
+                }
+                mKeyframes.push_back({start,parameterSets});
+            }
+        }
+    }
+};
+
+namespace TEST_MAPPED_FPV_FILE{
+    // Recording of N_FRAMES h264 frames, 100ms apart: SPS, PPS and a keyframe with 2 slices first,
+    // then a telemetry packet and only keyframes with 1 slice
+    static inline std::vector<std::pair<GroundRecorderFPV::PACKET_TYPE,std::vector<uint8_t>>> createRecording(const std::string& filename,const int N_FRAMES){
+        std::vector<std::pair<GroundRecorderFPV::PACKET_TYPE,std::vector<uint8_t>>> packets;
+        std::vector<GroundRecorderFPV::TIMESTAMP_MS> timestamps;
+        const auto add=[&packets,&timestamps](const GroundRecorderFPV::PACKET_TYPE type,std::vector<uint8_t> data,const int frame){
+            packets.emplace_back(type,std::move(data));
+            timestamps.push_back((GroundRecorderFPV::TIMESTAMP_MS)frame*100);
+        };
+        const auto video=GroundRecorderFPV::PACKET_TYPE_VIDEO_H264;
+        add(video,{0,0,0,1,0x67,0x42,0xc0,0x28},0);
+        add(video,{0,0,0,1,0x68,0xce,0x3c,0x80},0);
+        // first_mb_in_slice 0 / 1
+        add(video,{0,0,0,1,0x65,0x88,0x84,0x00},0);
+        add(video,{0,0,0,1,0x65,0x40,0x84,0x00},0);
+        add(GroundRecorderFPV::PACKET_TYPE_TELEMETRY_LTM,{1,2,3},0);
+        for(int frame=1;frame<N_FRAMES;frame++){
+            add(video,{0,0,0,1,0x65,0x88,(uint8_t)frame,0x00},frame);
+        }
+        std::ofstream file(filename,std::ios::binary|std::ios::trunc);
+        for(size_t i=0;i<packets.size();i++){
+            GroundRecorderFPV::StreamPacketHeader header{};
+            header.packet_length=(unsigned int)packets[i].second.size();
+            header.packet_type=packets[i].first;
+            header.timestamp=timestamps[i];
+            file.write((const char*)&header,sizeof(header));
+            file.write((const char*)packets[i].second.data(),packets[i].second.size());
+        }
+        return packets;
+    }
+    // Index, seeking, the cached index and the rejection of a corrupt one.
+    // The recording and its index are created in directory and deleted afterwards. Returns the n of failed checks
+    static inline int test(const std::string& directory){
+        int nFailed=0;
+        const int N_FRAMES=30;
+        const std::string filename=directory+"TestMappedFpvFile.fpv";
+        const std::string indexFilename=filename+".idx";
+        std::remove(indexFilename.c_str());
+        const auto packets=createRecording(filename,N_FRAMES);
+        // Packet index of the keyframe of frame n
+        const auto keyframeOf=[](const int frame){
+            return frame==0 ? (size_t)0 : (size_t)(5+frame-1);
+        };
+        std::vector<MappedFpvFile::IndexEntry> built;
+        {
+            MappedFpvFile file;
+            TEST_CHECK(nFailed,file.open(filename));
+            TEST_CHECK(nFailed,file.size()==packets.size());
+            for(size_t i=0;i<file.size() && i<packets.size();i++){
+                const auto packet=file.packet(i);
+                TEST_CHECK(nFailed,packet.packet_type==packets[i].first && packet.data_length==packets[i].second.size() &&
+                        std::memcmp(packet.data,packets[i].second.data(),packet.data_length)==0);
+                built.push_back(file.entry(i));
+            }
+            TEST_CHECK(nFailed,file.duration()==std::chrono::milliseconds((N_FRAMES-1)*100));
+            TEST_CHECK(nFailed,file.findTimestamp(std::chrono::milliseconds(0))==0);
+            TEST_CHECK(nFailed,file.findTimestamp(std::chrono::milliseconds(1450))==keyframeOf(15));
+            TEST_CHECK(nFailed,file.findTimestamp(std::chrono::milliseconds(N_FRAMES*100))==file.size());
+            // Every frame is a keyframe (the back-walk must not merge them), the 2 slices of the first one are one keyframe
+            TEST_CHECK(nFailed,file.findKeyframe(std::chrono::milliseconds(0))==keyframeOf(0));
+            TEST_CHECK(nFailed,file.findKeyframe(std::chrono::milliseconds(100))==keyframeOf(1));
+            TEST_CHECK(nFailed,file.findKeyframe(std::chrono::milliseconds(1550))==keyframeOf(16));
+            TEST_CHECK(nFailed,file.findKeyframe(std::chrono::milliseconds(100*N_FRAMES))==keyframeOf(N_FRAMES-1));
+            TEST_CHECK(nFailed,file.parameterSetsBefore(keyframeOf(0)).empty());
+            TEST_CHECK(nFailed,(file.parameterSetsBefore(keyframeOf(16))==std::vector<size_t>{0,1}));
+        }
+        const auto patchIndex=[&indexFilename](const std::streamoff offset,const uint64_t value,const size_t size){
+            std::fstream file(indexFilename,std::ios::binary|std::ios::in|std::ios::out);
+            file.seekp(offset);
+            file.write((const char*)&value,size);
+        };
+        // Header: magic, version, fileSize, nEntries. Then the entries (timestamp at offset 12)
+        const std::streamoff N_ENTRIES_OFFSET=16;
+        const std::streamoff FIRST_ENTRY_OFFSET=24;
+        {
+            // The cached index is used (the timestamp of the last packet only changed in the index)
+            patchIndex(FIRST_ENTRY_OFFSET+(std::streamoff)(packets.size()-1)*sizeof(MappedFpvFile::IndexEntry)+12,12345,4);
+            MappedFpvFile file;
+            TEST_CHECK(nFailed,file.open(filename) && file.size()==packets.size());
+            TEST_CHECK(nFailed,file.size()>0 && file.entry(file.size()-1).timestamp==12345);
+        }
+        const auto rebuilt=[&filename,&built](){
+            MappedFpvFile file;
+            if(!file.open(filename) || file.size()!=built.size())return false;
+            for(size_t i=0;i<built.size();i++){
+                if(std::memcmp(&file.entry(i),&built[i],sizeof(MappedFpvFile::IndexEntry))!=0)return false;
+            }
+            return true;
+        };
+        // Corrupt indices are rebuilt (and re-written): n of entries, an entry outside the recording, truncated
+        patchIndex(N_ENTRIES_OFFSET,(uint64_t)1<<40,8);
+        TEST_CHECK(nFailed,rebuilt());
+        patchIndex(FIRST_ENTRY_OFFSET,(uint64_t)1<<40,8);
+        TEST_CHECK(nFailed,rebuilt());
+        {
+            std::ofstream file(indexFilename,std::ios::binary|std::ios::app);
+            file.put(0);
+        }
+        TEST_CHECK(nFailed,rebuilt());
+        // The rebuilt index is valid again
+        {
+            struct stat st{};
+            TEST_CHECK(nFailed,stat(indexFilename.c_str(),&st)==0 &&
+                    (size_t)st.st_size==FIRST_ENTRY_OFFSET+built.size()*sizeof(MappedFpvFile::IndexEntry));
+        }
+        std::remove(indexFilename.c_str());
+        std::remove(filename.c_str());
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_MAPPEDFPVFILE_HPP
@@ -0,0 +1,575 @@
+#include "PacketReplayer.h"
+#include "GroundRecorderFPV.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <AndroidLogger.hpp>
+#include <FileHelper.hpp>
+#include <TestCheck.hpp>
+
+#ifdef __ANDROID__
+#include <NDKThreadHelper.hpp>
+#endif
+
+using namespace std::chrono;
+
+namespace{
+    // See https://wiki.wireshark.org/Development/LibpcapFileFormat
+    constexpr uint32_t PCAP_MAGIC_US=0xa1b2c3d4;
+    constexpr uint32_t PCAP_MAGIC_NS=0xa1b23c4d;
+    constexpr uint32_t LINKTYPE_NULL=0;
+    constexpr uint32_t LINKTYPE_ETHERNET=1;
+    constexpr uint32_t LINKTYPE_RAW=101;
+    constexpr uint32_t LINKTYPE_LINUX_SLL=113;
+    constexpr uint32_t LINKTYPE_IPV4=228;
+    constexpr uint32_t LINKTYPE_IPV6=229;
+    constexpr uint32_t LINKTYPE_LINUX_SLL2=276;
+    constexpr uint16_t ETHERTYPE_IPV4=0x0800;
+    constexpr uint16_t ETHERTYPE_IPV6=0x86DD;
+    constexpr uint8_t IPPROTO_UDP_=17;
+
+    uint16_t readU16BE(const uint8_t* p){
+        return (uint16_t)((p[0]<<8) | p[1]);
+    }
+
+    struct Payload{
+        const uint8_t* data;
+        size_t length;
+    };
+    // Returns the UDP payload of an IPv4 / IPv6 packet
+    std::optional<Payload> udpPayload(const uint8_t* ip,const size_t length,const int udpPort){
+        if(length<1)return std::nullopt;
+        const int version=ip[0]>>4;
+        size_t headerLength;
+        size_t ipLength;
+        if(version==4){
+            if(length<20)return std::nullopt;
+            headerLength=(ip[0] & 0x0f)*4;
+            ipLength=readU16BE(&ip[2]);
+            const uint16_t fragment=readU16BE(&ip[6]);
+            // more fragments flag or fragment offset
+            if(ip[9]!=IPPROTO_UDP_ || (fragment & 0x3fff)!=0)return std::nullopt;
+        }else if(version==6){
+            if(length<40)return std::nullopt;
+            headerLength=40;
+            ipLength=40+readU16BE(&ip[4]);
+            // extension headers are not supported
+            if(ip[6]!=IPPROTO_UDP_)return std::nullopt;
+        }else{
+            return std::nullopt;
+        }
+        ipLength=std::min(ipLength,length);
+        if(ipLength<headerLength+8)return std::nullopt;
+        const uint8_t* udp=&ip[headerLength];
+        if(udpPort!=0 && readU16BE(&udp[2])!=udpPort)return std::nullopt;
+        const size_t udpLength=std::min<size_t>(readU16BE(&udp[4]),ipLength-headerLength);
+        if(udpLength<8)return std::nullopt;
+        return Payload{udp+8,udpLength-8};
+    }
+    // Returns the IP packet of a link layer frame
+    std::optional<Payload> ipPacket(const uint32_t linkType,const uint8_t* frame,const size_t length){
+        size_t offset;
+        uint16_t etherType;
+        switch(linkType){
+            case LINKTYPE_NULL:{
+                if(length<4)return std::nullopt;
+                // address family in the byte order of the capturing host. The IP version is checked later anyway
+                return Payload{frame+4,length-4};
+            }
+            case LINKTYPE_RAW:
+            case LINKTYPE_IPV4:
+            case LINKTYPE_IPV6:
+                return Payload{frame,length};
+            case LINKTYPE_ETHERNET:{
+                offset=14;
+                if(length<offset)return std::nullopt;
+                etherType=readU16BE(&frame[12]);
+                // 802.1Q / 802.1ad VLAN tags
+                while((etherType==0x8100 || etherType==0x88a8) && length>=offset+4){
+                    etherType=readU16BE(&frame[offset+2]);
+                    offset+=4;
+                }
+            }break;
+            case LINKTYPE_LINUX_SLL:
+                offset=16;
+                if(length<offset)return std::nullopt;
+                etherType=readU16BE(&frame[14]);
+                break;
+            case LINKTYPE_LINUX_SLL2:
+                offset=20;
+                if(length<offset)return std::nullopt;
+                etherType=readU16BE(&frame[0]);
+                break;
+            default:
+                return std::nullopt;
+        }
+        if(etherType!=ETHERTYPE_IPV4 && etherType!=ETHERTYPE_IPV6)return std::nullopt;
+        return Payload{frame+offset,length-offset};
+    }
+}
+
+bool CaptureReader::open(const std::string& filename,const int udpPort) {
+    mFile=std::ifstream(filename,std::ios::in|std::ios::binary);
+    mUDPPort=udpPort;
+    mFirstTimestamp=std::nullopt;
+    if(!mFile.is_open()){
+        MLOGE<<"Cannot open capture "<<filename;
+        return false;
+    }
+    if(containsRawNALUs(filename)){
+        mFormat=Format::FPV;
+        mFirstPacketPosition=mFile.tellg();
+        return true;
+    }
+    mFormat=Format::PCAP;
+    uint8_t header[24];
+    if(!mFile.read((char*)header,sizeof(header))){
+        MLOGE<<"Not a pcap file "<<filename;
+        return false;
+    }
+    uint32_t magic;
+    std::memcpy(&magic,header,sizeof(magic));
+    if(magic==PCAP_MAGIC_US || magic==PCAP_MAGIC_NS){
+        mSwapped=false;
+    }else if(__builtin_bswap32(magic)==PCAP_MAGIC_US || __builtin_bswap32(magic)==PCAP_MAGIC_NS){
+        mSwapped=true;
+    }else{
+        MLOGE<<"Not a pcap file (pcapng is not supported) "<<filename;
+        return false;
+    }
+    mNanosecondTimestamps=toHost(magic)==PCAP_MAGIC_NS;
+    std::memcpy(&mLinkType,&header[20],sizeof(mLinkType));
+    // The upper 16 bits might contain FCS info
+    mLinkType=toHost(mLinkType) & 0xffff;
+    mFirstPacketPosition=mFile.tellg();
+    return true;
+}
+
+uint32_t CaptureReader::toHost(const uint32_t value)const {
+    return mSwapped ? __builtin_bswap32(value) : value;
+}
+
+void CaptureReader::rewind() {
+    mFile.clear();
+    mFile.seekg(mFirstPacketPosition);
+    mFirstTimestamp=std::nullopt;
+}
+
+std::optional<CapturedPacket> CaptureReader::next() {
+    if(!mFile.is_open())return std::nullopt;
+    return mFormat==Format::PCAP ? nextPcap() : nextFpv();
+}
+
+std::optional<CapturedPacket> CaptureReader::nextPcap() {
+    while(true){
+        uint32_t recordHeader[4];
+        if(!mFile.read((char*)recordHeader,sizeof(recordHeader))){
+            return std::nullopt;
+        }
+        const uint32_t capturedLength=toHost(recordHeader[2]);
+        mBuffer.resize(capturedLength);
+        if(!mFile.read((char*)mBuffer.data(),capturedLength)){
+            MLOGE<<"pcap file is truncated";
+            return std::nullopt;
+        }
+        const auto ip=ipPacket(mLinkType,mBuffer.data(),mBuffer.size());
+        if(!ip)continue;
+        const auto payload=udpPayload(ip->data,ip->length,mUDPPort);
+        if(!payload)continue;
+        const nanoseconds timestamp=seconds(toHost(recordHeader[0]))+
+                (mNanosecondTimestamps ? nanoseconds(toHost(recordHeader[1])) : microseconds(toHost(recordHeader[1])));
+        if(!mFirstTimestamp){
+            mFirstTimestamp=timestamp;
+        }
+        return CapturedPacket{std::max(timestamp-*mFirstTimestamp,nanoseconds(0)),
+                              std::vector<uint8_t>(payload->data,payload->data+payload->length)};
+    }
+}
+
+bool CaptureReader::containsRawNALUs(const std::string &filename) {
+    return FileHelper::endsWith(filename,".fpv");
+}
+
+std::optional<CapturedPacket> CaptureReader::nextFpv() {
+    while(true){
+        GroundRecorderFPV::StreamPacketHeader header;
+        if(!mFile.read((char*)&header,sizeof(header))){
+            return std::nullopt;
+        }
+        mBuffer.resize(header.packet_length);
+        if(!mFile.read((char*)mBuffer.data(),header.packet_length)){
+            MLOGE<<"fpv file was written wrong";
+            return std::nullopt;
+        }
+        if(header.packet_type!=GroundRecorderFPV::PACKET_TYPE_VIDEO_H264 &&
+           header.packet_type!=GroundRecorderFPV::PACKET_TYPE_VIDEO_H265){
+            continue;
+        }
+        const nanoseconds timestamp=milliseconds(header.timestamp);
+        if(!mFirstTimestamp){
+            mFirstTimestamp=timestamp;
+        }
+        return CapturedPacket{std::max(timestamp-*mFirstTimestamp,nanoseconds(0)),mBuffer};
+    }
+}
+
+bool LossTrace::open(const std::string& filename) {
+    mDiffs.clear();
+    std::ifstream file(filename);
+    std::string line;
+    while(std::getline(file,line)){
+        const auto pos=line.find("values : ");
+        if(pos==std::string::npos)continue;
+        std::istringstream values(line.substr(pos+9));
+        int diff;
+        while(values>>diff){
+            if(diff>=1 && diff<=64)mDiffs.push_back(diff);
+        }
+    }
+    mIndex=0;
+    mNLostLeft=0;
+    return !mDiffs.empty();
+}
+
+bool LossTrace::nextLost() {
+    if(mDiffs.empty())return false;
+    if(mNLostLeft>0){
+        mNLostLeft--;
+        return true;
+    }
+    mNLostLeft=mDiffs[mIndex]-1;
+    mIndex=(mIndex+1)%mDiffs.size();
+    return false;
+}
+
+std::optional<ReplayConfig> ReplayConfig::parse(const std::string& config) {
+    ReplayConfig ret;
+    std::istringstream ss(config);
+    std::string pair;
+    while(std::getline(ss,pair,',')){
+        if(pair.empty())continue;
+        const auto pos=pair.find('=');
+        if(pos==std::string::npos){
+            MLOGE<<"Replay config: expected key=value, got "<<pair;
+            return std::nullopt;
+        }
+        const std::string key=pair.substr(0,pos);
+        const std::string value=pair.substr(pos+1);
+        try{
+            if(key=="rate"){
+                ret.rate=std::stof(value);
+            }else if(key=="loop"){
+                ret.loop=std::stoi(value)!=0;
+            }else if(key=="seed"){
+                ret.seed=(uint32_t)std::stoul(value);
+            }else if(key=="loss"){
+                ret.loss=std::stof(value);
+            }else if(key=="burst_start"){
+                ret.burstStart=std::stof(value);
+            }else if(key=="burst_end"){
+                ret.burstEnd=std::stof(value);
+            }else if(key=="burst_loss"){
+                ret.burstLoss=std::stof(value);
+            }else if(key=="trace"){
+                ret.lossTrace=value;
+            }else if(key=="jitter_us"){
+                ret.maxJitter=microseconds(std::stol(value));
+            }else if(key=="reorder"){
+                ret.reorder=std::stof(value);
+            }else if(key=="reorder_distance"){
+                ret.reorderDistance=std::max(std::stoi(value),1);
+            }else if(key=="duplicate"){
+                ret.duplicate=std::stof(value);
+            }else if(key=="port"){
+                ret.udpPort=std::stoi(value);
+            }else{
+                MLOGE<<"Replay config: unknown key "<<key;
+                return std::nullopt;
+            }
+        }catch(const std::exception&){
+            MLOGE<<"Replay config: invalid value "<<pair;
+            return std::nullopt;
+        }
+    }
+    return ret;
+}
+
+std::string ReplayConfig::toString() const {
+    std::stringstream ss;
+    ss<<"rate="<<rate<<",loop="<<(loop ? 1 : 0)<<",seed="<<seed<<",loss="<<loss
+      <<",burst_start="<<burstStart<<",burst_end="<<burstEnd<<",burst_loss="<<burstLoss;
+    if(!lossTrace.empty()){
+        ss<<",trace="<<lossTrace;
+    }
+    ss<<",jitter_us="<<maxJitter.count()<<",reorder="<<reorder<<",reorder_distance="<<reorderDistance
+      <<",duplicate="<<duplicate<<",port="<<udpPort;
+    return ss.str();
+}
+
+PacketImpairment::PacketImpairment(const ReplayConfig& config):mConfig(config),mRandom(config.seed) {
+    if(!mConfig.lossTrace.empty()){
+        mLossTrace.emplace();
+        if(!mLossTrace->open(mConfig.lossTrace)){
+            MLOGE<<"Cannot read loss trace "<<mConfig.lossTrace;
+            mLossTrace=std::nullopt;
+        }
+    }
+}
+
+bool PacketImpairment::isLost() {
+    bool lost=mLossTrace && mLossTrace->nextLost();
+    if(mConfig.burstStart>0){
+        mBurst=mBurst ? mUniform(mRandom)>=mConfig.burstEnd : mUniform(mRandom)<mConfig.burstStart;
+        if(mBurst && mUniform(mRandom)<mConfig.burstLoss){
+            lost=true;
+        }
+    }
+    if(mConfig.loss>0 && mUniform(mRandom)<mConfig.loss){
+        lost=true;
+    }
+    return lost;
+}
+
+void PacketImpairment::schedule(CapturedPacket packet,const nanoseconds timestamp) {
+    packet.timestamp=timestamp;
+    mScheduled.push(ScheduledPacket{std::move(packet),mNScheduled++});
+}
+
+void PacketImpairment::add(CapturedPacket packet) {
+    mStats.nPackets++;
+    mLatestInput=std::max(mLatestInput,packet.timestamp);
+    if(isLost()){
+        mStats.nLost++;
+    }else{
+        nanoseconds timestamp=mLatestInput;
+        if(mConfig.maxJitter.count()>0){
+            timestamp+=duration_cast<nanoseconds>(mConfig.maxJitter*mUniform(mRandom));
+        }
+        // jitter alone does not reorder
+        timestamp=std::max(timestamp,mLatestOutput);
+        mLatestOutput=timestamp;
+        if(mConfig.duplicate>0 && mUniform(mRandom)<mConfig.duplicate){
+            mStats.nDuplicated++;
+            schedule(packet,timestamp);
+        }
+        if(mConfig.reorder>0 && mUniform(mRandom)<mConfig.reorder){
+            mStats.nReordered++;
+            // +1: the distance is counted after this packet was added
+            mHeldPackets.push_back({std::move(packet),mConfig.reorderDistance+1});
+        }else{
+            schedule(std::move(packet),timestamp);
+        }
+    }
+    // Held packets are sent after the next reorderDistance packets of the capture (lost or not)
+    for(auto it=mHeldPackets.begin();it!=mHeldPackets.end();){
+        if(--it->nPacketsLeft==0){
+            schedule(std::move(it->packet),mLatestOutput);
+            it=mHeldPackets.erase(it);
+        }else{
+            ++it;
+        }
+    }
+}
+
+void PacketImpairment::flush() {
+    for(auto& held:mHeldPackets){
+        schedule(std::move(held.packet),mLatestOutput);
+    }
+    mHeldPackets.clear();
+    mFlushed=true;
+}
+
+std::optional<CapturedPacket> PacketImpairment::next() {
+    if(mScheduled.empty())return std::nullopt;
+    // All packets added later are scheduled at or after mLatestInput
+    if(!mFlushed && mScheduled.top().packet.timestamp>=mLatestInput)return std::nullopt;
+    // top() is const, the packet is moved out right before pop()
+    auto packet=std::move(const_cast<ScheduledPacket&>(mScheduled.top()).packet);
+    mScheduled.pop();
+    return packet;
+}
+
+PacketReplayer::PacketReplayer(JavaVM* javaVm,int CPUPriority,ReplayConfig config,DATA_CALLBACK onDataCallback):
+        javaVm(javaVm),mCPUPriority(CPUPriority),mConfig(std::move(config)),onDataCallback(std::move(onDataCallback)){
+}
+
+void PacketReplayer::startReplaying(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(replaying)return;
+    MLOGD<<"Replay "<<filename<<" "<<mConfig.toString();
+    replaying=true;
+    finished=false;
+    mThread=std::make_unique<std::thread>(&PacketReplayer::replayLoop,this,filename);
+#ifdef __ANDROID__
+    NDKThreadHelper::setName(mThread->native_handle(),"PacketReplayer");
+#endif
+}
+
+void PacketReplayer::stopReplaying() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if(!replaying)return;
+        replaying=false;
+    }
+    mStopCondition.notify_all();
+    if(mThread->joinable()){
+        mThread->join();
+    }
+    mThread.reset();
+}
+
+bool PacketReplayer::waitUntil(const steady_clock::time_point timePoint) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopCondition.wait_until(lock,timePoint,[this]{return !replaying;});
+    return replaying;
+}
+
+PacketImpairment::Stats PacketReplayer::getStats() const {
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    return mStats;
+}
+
+std::string PacketReplayer::getStatsString() const {
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    std::stringstream ss;
+    ss<<"Replayed: "<<nSentPackets<<" | lost: "<<mStats.nLost<<" | reordered: "<<mStats.nReordered
+      <<" | duplicated: "<<mStats.nDuplicated;
+    return ss.str();
+}
+
+void PacketReplayer::replayLoop(std::string filename) {
+    if(javaVm!=nullptr){
+#ifdef __ANDROID__
+        NDKThreadHelper::setProcessThreadPriorityAttachDetach(javaVm,mCPUPriority,"PacketReplayer");
+#endif
+    }
+    CaptureReader reader;
+    if(!reader.open(filename,mConfig.udpPort)){
+        finished=true;
+        return;
+    }
+    PacketImpairment impairment(mConfig);
+    const auto start=steady_clock::now();
+    // Added to the timestamps of the capture each time it starts again
+    nanoseconds loopOffset{0};
+    nanoseconds lastTimestamp{0};
+    bool endOfCapture=false;
+    bool emptyCapture=true;
+    while(true){
+        if(!endOfCapture){
+            auto packet=reader.next();
+            if(packet){
+                emptyCapture=false;
+                packet->timestamp+=loopOffset;
+                lastTimestamp=packet->timestamp;
+                impairment.add(std::move(*packet));
+            }else if(mConfig.loop && !emptyCapture){
+                // 1 frame (at 60fps) between the last and first packet
+                loopOffset=lastTimestamp+milliseconds(16);
+                reader.rewind();
+            }else{
+                impairment.flush();
+                endOfCapture=true;
+            }
+        }
+        while(auto packet=impairment.next()){
+            if(mConfig.rate>0 && !waitUntil(start+duration_cast<nanoseconds>(packet->timestamp/mConfig.rate))){
+                return;
+            }
+            onDataCallback(packet->data.data(),packet->data.size());
+            std::lock_guard<std::mutex> lock(mStatsMutex);
+            nSentPackets++;
+            mStats=impairment.getStats();
+        }
+        if(endOfCapture)break;
+        if(mConfig.rate<=0){
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(!replaying)return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mStatsMutex);
+        mStats=impairment.getStats();
+    }
+    MLOGD<<"Replay done. "<<getStatsString();
+    finished=true;
+}
+
+namespace TEST_PACKET_REPLAYER{
+    struct Replay{
+        std::vector<std::vector<uint8_t>> packets;
+        PacketImpairment::Stats stats;
+        bool finished=false;
+    };
+    static Replay replay(const std::string& filename,const ReplayConfig& config){
+        Replay ret;
+        PacketReplayer replayer(nullptr,0,config,[&ret](const uint8_t data[],const size_t dataLength){
+            ret.packets.emplace_back(data,data+dataLength);
+        });
+        replayer.startReplaying(filename);
+        const auto timeout=steady_clock::now()+seconds(10);
+        while(!replayer.isFinished() && steady_clock::now()<timeout){
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        replayer.stopReplaying();
+        ret.stats=replayer.getStats();
+        ret.finished=replayer.isFinished();
+        return ret;
+    }
+    static bool operator==(const PacketImpairment::Stats& a,const PacketImpairment::Stats& b){
+        return a.nPackets==b.nPackets && a.nLost==b.nLost && a.nReordered==b.nReordered && a.nDuplicated==b.nDuplicated;
+    }
+
+    int test(const std::string& directory){
+        int nFailed=0;
+        const int N_PACKETS=5000;
+        const std::string filename=directory+"TestPacketReplayer.fpv";
+        {
+            std::ofstream file(filename,std::ios::binary | std::ios::trunc);
+            for(int i=0;i<N_PACKETS;i++){
+                // The packet index, then a pattern
+                std::vector<uint8_t> packet((size_t)(4+i%300));
+                std::memcpy(packet.data(),&i,sizeof(i));
+                for(size_t j=4;j<packet.size();j++){
+                    packet[j]=(uint8_t)(i+j);
+                }
+                GroundRecorderFPV::StreamPacketHeader header{};
+                header.packet_length=(unsigned int)packet.size();
+                header.packet_type=GroundRecorderFPV::PACKET_TYPE_VIDEO_H264;
+                header.timestamp=(GroundRecorderFPV::TIMESTAMP_MS)i;
+                file.write((const char*)&header,sizeof(header));
+                file.write((const char*)packet.data(),packet.size());
+            }
+            TEST_CHECK(nFailed,file.good());
+        }
+        const auto config=ReplayConfig::parse("rate=0,seed=7,loss=0.02,burst_start=0.005,jitter_us=3000,reorder=0.02,duplicate=0.01");
+        TEST_CHECK(nFailed,config.has_value());
+        if(config){
+            const auto first=replay(filename,*config);
+            const auto second=replay(filename,*config);
+            TEST_CHECK(nFailed,first.finished && second.finished);
+            TEST_CHECK(nFailed,first.stats.nPackets==N_PACKETS && first.stats.nLost>0 && first.stats.nReordered>0 &&
+                    first.stats.nDuplicated>0);
+            TEST_CHECK(nFailed,(long)first.packets.size()==first.stats.nPackets-first.stats.nLost+first.stats.nDuplicated);
+            TEST_CHECK(nFailed,first.packets==second.packets && first.stats==second.stats);
+            auto otherSeed=*config;
+            otherSeed.seed++;
+            const auto third=replay(filename,otherSeed);
+            TEST_CHECK(nFailed,third.finished && third.stats.nPackets==N_PACKETS);
+            TEST_CHECK(nFailed,third.packets!=first.packets);
+            // Without impairment the capture is replayed as it is
+            const auto lossless=replay(filename,*ReplayConfig::parse("rate=0"));
+            TEST_CHECK(nFailed,(lossless.packets.size()==N_PACKETS && lossless.stats.nLost==0));
+            for(size_t i=0;i<lossless.packets.size() && i<N_PACKETS;i++){
+                int index=-1;
+                std::memcpy(&index,lossless.packets[i].data(),sizeof(index));
+                if(index!=(int)i){
+                    TEST_CHECK(nFailed,index==(int)i);
+                    break;
+                }
+            }
+        }
+        std::remove(filename.c_str());
+        return nFailed;
+    }
+}
@@ -0,0 +1,219 @@
+#ifndef LIVEVIDEO10MS_PACKETREPLAYER_H
+#define LIVEVIDEO10MS_PACKETREPLAYER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+//
+#ifdef __ANDROID__
+#include <jni.h>
+#else
+using JavaVM=void*;
+#endif
+
+// One packet of a capture. The timestamp is relative to the first packet of the capture
+struct CapturedPacket{
+    std::chrono::nanoseconds timestamp;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * Reads the packets of a capture one by one.
+ * .pcap (libpcap format, e.g. tcpdump -w): The payload of the IPv4 / IPv6 UDP packets. Fragmented IP packets are skipped
+ * .fpv (GroundRecorderFPV): The h264 / h265 packets (raw NALUs), with ms timestamps
+ */
+class CaptureReader{
+public:
+    /**
+     * @param udpPort only read UDP packets to this destination port from .pcap files, 0 == all
+     * @return false if the file cannot be opened or has an unknown format
+     */
+    bool open(const std::string& filename,int udpPort=0);
+    // True for .fpv captures, their packets are raw NALUs (h264 / h265) instead of the datagrams of a video protocol
+    static bool containsRawNALUs(const std::string& filename);
+    // Returns std::nullopt at EOF
+    std::optional<CapturedPacket> next();
+    // Start again at the first packet
+    void rewind();
+private:
+    enum class Format{PCAP,FPV};
+    Format mFormat=Format::PCAP;
+    std::ifstream mFile;
+    std::streampos mFirstPacketPosition;
+    int mUDPPort=0;
+    // pcap only
+    bool mSwapped=false;
+    bool mNanosecondTimestamps=false;
+    uint32_t mLinkType=0;
+    std::optional<std::chrono::nanoseconds> mFirstTimestamp;
+    std::vector<uint8_t> mBuffer;
+    std::optional<CapturedPacket> nextPcap();
+    std::optional<CapturedPacket> nextFpv();
+    uint32_t toHost(uint32_t value)const;
+};
+
+/**
+ * The loss of a capture of H264Parser::debugSequenceNumbers() (the captures in XFEC/testing).
+ * The "values : " lines contain the difference of consecutive sequence numbers,
+ * a difference d > 1 means d-1 packets were lost. Reordering (d <= 0) and outages of more than 64 packets are left out.
+ */
+class LossTrace{
+public:
+    // Returns false if the file contains no differences
+    bool open(const std::string& filename);
+    // Returns true if the next packet is lost. Repeats the trace
+    bool nextLost();
+private:
+    std::vector<int> mDiffs;
+    size_t mIndex=0;
+    int mNLostLeft=0;
+};
+
+/**
+ * Network conditions applied to a replayed capture. Parsed from a comma separated list of key=value pairs,
+ * e.g. "loss=0.01,jitter_us=2000,reorder=0.005,seed=3". Keys: see parse() / toString()
+ */
+struct ReplayConfig{
+    // 1: original timing, 2: twice as fast. <=0: as fast as possible
+    float rate=1.0f;
+    // Start again at the end of the capture
+    bool loop=false;
+    // Same seed, capture and config == same packets in the same order
+    uint32_t seed=1;
+    // Probability that a packet is lost
+    float loss=0;
+    // Burst loss (Gilbert-Elliott). Probability to enter / leave the burst state per packet, loss probability in the burst state.
+    // Disabled if burstStart==0
+    float burstStart=0;
+    float burstEnd=0.5f;
+    float burstLoss=1.0f;
+    // Additionally lose the packets of a LossTrace
+    std::string lossTrace;
+    // Each packet is delayed by a random time up to maxJitter. Does not change the order of the packets
+    std::chrono::microseconds maxJitter{0};
+    // Probability that a packet is sent after the next reorderDistance packets
+    float reorder=0;
+    int reorderDistance=3;
+    // Probability that a packet is sent twice
+    float duplicate=0;
+    // See CaptureReader::open
+    int udpPort=0;
+    // Returns std::nullopt on unknown keys / invalid values. An empty string returns the default (no impairment)
+    static std::optional<ReplayConfig> parse(const std::string& config);
+    std::string toString()const;
+};
+
+/**
+ * Applies the loss, jitter, reordering and duplication of a ReplayConfig to a stream of packets.
+ * Deterministic, the output only depends on the config (including its seed) and the input.
+ * Not thread-safe
+ */
+class PacketImpairment{
+public:
+    struct Stats{
+        long nPackets=0;
+        long nLost=0;
+        long nReordered=0;
+        long nDuplicated=0;
+    };
+    explicit PacketImpairment(const ReplayConfig& config);
+    // Add the next packet of the capture. Timestamps must not decrease
+    void add(CapturedPacket packet);
+    // Returns the next packet to send if it is known already, the timestamp is the time when it should be sent.
+    // Else std::nullopt (add the next packet or call flush())
+    std::optional<CapturedPacket> next();
+    // End of the capture, all packets still held back can be sent
+    void flush();
+    const Stats& getStats()const{
+        return mStats;
+    }
+private:
+    const ReplayConfig mConfig;
+    std::mt19937 mRandom;
+    std::uniform_real_distribution<float> mUniform{0.0f,1.0f};
+    bool mBurst=false;
+    std::optional<LossTrace> mLossTrace;
+    std::chrono::nanoseconds mLatestInput{0};
+    std::chrono::nanoseconds mLatestOutput{0};
+    bool mFlushed=false;
+    Stats mStats;
+    struct HeldPacket{
+        CapturedPacket packet;
+        int nPacketsLeft;
+    };
+    std::vector<HeldPacket> mHeldPackets;
+    struct ScheduledPacket{
+        CapturedPacket packet;
+        uint64_t order;
+        bool operator>(const ScheduledPacket& other)const{
+            return packet.timestamp!=other.packet.timestamp ? packet.timestamp>other.packet.timestamp : order>other.order;
+        }
+    };
+    std::priority_queue<ScheduledPacket,std::vector<ScheduledPacket>,std::greater<>> mScheduled;
+    uint64_t mNScheduled=0;
+    bool isLost();
+    void schedule(CapturedPacket packet,std::chrono::nanoseconds timestamp);
+};
+
+/**
+ * Creates a new thread that replays a capture (see CaptureReader) with the timing of the capture and the
+ * network conditions of a ReplayConfig (see PacketImpairment). Each packet is passed to the DATA_CALLBACK,
+ * like a datagram of the UDPReceiver.
+ */
+class PacketReplayer{
+public:
+    typedef std::function<void(const uint8_t[],size_t)> DATA_CALLBACK;
+    /**
+     * @param javaVm used to set the thread priority (see UDPReceiver), nullptr when not using android
+     */
+    PacketReplayer(JavaVM* javaVm,int CPUPriority,ReplayConfig config,DATA_CALLBACK onDataCallback);
+    /**
+     * Create and start the replay thread, which runs until the end of the capture or until stopReplaying() is called
+     */
+    void startReplaying(const std::string& filename);
+    /**
+     * After this call returns it is guaranteed that no more data will be passed to the callback
+     */
+    void stopReplaying();
+    // True once all packets were passed to the callback (or the capture cannot be read)
+    bool isFinished()const{
+        return finished;
+    }
+    PacketImpairment::Stats getStats()const;
+    std::string getStatsString()const;
+private:
+    void replayLoop(std::string filename);
+    // Returns false if stopReplaying() was called while waiting
+    bool waitUntil(std::chrono::steady_clock::time_point timePoint);
+    JavaVM* const javaVm;
+    const int mCPUPriority;
+    const ReplayConfig mConfig;
+    const DATA_CALLBACK onDataCallback;
+    std::unique_ptr<std::thread> mThread;
+    std::mutex mMutex;
+    std::condition_variable mStopCondition;
+    bool replaying=false;
+    std::atomic<bool> finished=false;
+    mutable std::mutex mStatsMutex;
+    PacketImpairment::Stats mStats;
+    long nSentPackets=0;
+};
+
+namespace TEST_PACKET_REPLAYER{
+    // Replays a generated .fpv capture (created in directory and deleted afterwards) with loss, jitter, reordering
+    // and duplication: The same seed has to give the same packets in the same order and the same stats,
+    // another seed different ones. Returns the n of failed checks
+    int test(const std::string& directory);
+}
+
+#endif //LIVEVIDEO10MS_PACKETREPLAYER_H
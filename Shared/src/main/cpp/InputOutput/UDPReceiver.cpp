@@ -1,10 +1,14 @@
 
 #include "UDPReceiver.h"
 #include <arpa/inet.h>
+#include <sys/time.h>
 #include <utility>
 #include <vector>
 #include <sstream>
 #include <array>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <StringHelper.hpp>
 
 #ifdef __ANDROID__
@@ -20,10 +24,31 @@ void UDPReceiver::registerOnSourceIPFound(SOURCE_IP_CALLBACK onSourceIP1) {
     this->onSourceIP=std::move(onSourceIP1);
 }
 
+void UDPReceiver::setBatchMode(size_t batchSize,BATCH_DATA_CALLBACK onBatchReceivedCallback1,size_t slotSize) {
+    assert(mUDPReceiverThread==nullptr);
+    mBatchSize=std::max(batchSize,(size_t)1);
+    mSlotSize=std::min(slotSize,UDP_PACKET_MAX_SIZE);
+    onBatchReceivedCallback=std::move(onBatchReceivedCallback1);
+}
+
+void UDPReceiver::setReceiveTimeout(std::chrono::milliseconds timeout,TIMEOUT_CALLBACK onReceiveTimeout1) {
+    assert(mUDPReceiverThread==nullptr);
+    mReceiveTimeout=timeout;
+    onReceiveTimeout=std::move(onReceiveTimeout1);
+}
+
 long UDPReceiver::getNReceivedBytes()const {
     return nReceivedBytes;
 }
 
+long UDPReceiver::getNReceivedPackets()const {
+    return nReceivedPackets;
+}
+
+long UDPReceiver::getNReceiveCalls()const {
+    return nReceiveCalls;
+}
+
 std::string UDPReceiver::getSourceIPAddress()const {
     return senderIP;
 }
@@ -69,6 +94,14 @@ void UDPReceiver::receiveFromUDPLoop() {
         getsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &recvBufferSize, &len);
         MLOGD<<"Wanted "<<StringHelper::memorySizeReadable(WANTED_RCVBUF_SIZE)<<" Set "<<StringHelper::memorySizeReadable(recvBufferSize);
     }
+    if(mReceiveTimeout.count()>0){
+        timeval tv{};
+        tv.tv_sec=mReceiveTimeout.count()/1000;
+        tv.tv_usec=(mReceiveTimeout.count()%1000)*1000;
+        if(setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+            MLOGD<<"Cannot set receive timeout";
+        }
+    }
     if(javaVm!=nullptr){
 #ifdef __ANDROID__
          NDKThreadHelper::setProcessThreadPriorityAttachDetach(javaVm, mCPUPriority, mName.c_str());
@@ -83,6 +116,11 @@ void UDPReceiver::receiveFromUDPLoop() {
         MLOGE<<"Error binding Port; "<<mPort;
         return;
     }
+    if(mBatchSize>1){
+        receiveFromUDPLoopBatched();
+        close(mSocket);
+        return;
+    }
     //wrap into unique pointer to avoid running out of stack
     const auto buff=std::make_unique<std::array<uint8_t,UDP_PACKET_MAX_SIZE>>();
 
@@ -101,17 +139,18 @@ void UDPReceiver::receiveFromUDPLoop() {
             onDataReceivedCallback(buff->data(), (size_t)message_length);
 
             nReceivedBytes+=message_length;
-            //The source ip stuff
-            const char* p=inet_ntoa(source.sin_addr);
-            std::string s1=std::string(p);
-            if(senderIP!=s1){
-                senderIP=s1;
-            }
-            if(onSourceIP!=nullptr){
-                onSourceIP(p);
-            }
+            nReceivedPackets++;
+            nReceiveCalls++;
+            updateSourceIP(source);
+        }else if(message_length==0){
+            // An empty datagram (or shutdown() in stopReceiving()), errno is not set then
+            continue;
         }else{
-            if(errno != EWOULDBLOCK) {
+            if(errno == EWOULDBLOCK) {
+                if(onReceiveTimeout!=nullptr && receiving){
+                    onReceiveTimeout();
+                }
+            }else if(receiving) { // shutdown() in stopReceiving() makes recvfrom return
                 MLOGE<<"Error on recvfrom. errno="<<errno<<" "<<strerror(errno);
             }
         }
@@ -119,6 +158,87 @@ void UDPReceiver::receiveFromUDPLoop() {
     close(mSocket);
 }
 
+void UDPReceiver::receiveFromUDPLoopBatched() {
+    // Everything recvmmsg needs is allocated once. Each slot is reused for every batch,
+    // which is why the data is only valid during the callback
+    const size_t N=mBatchSize;
+    std::vector<uint8_t> slots(N*mSlotSize);
+    std::vector<mmsghdr> msgs(N);
+    std::vector<iovec> iovecs(N);
+    std::vector<sockaddr_in> sources(N);
+    std::vector<Packet> packets(N);
+    for(size_t i=0;i<N;i++){
+        iovecs[i].iov_base=&slots[i*mSlotSize];
+        iovecs[i].iov_len=mSlotSize;
+    }
+    while (receiving) {
+        // recvmmsg overwrites msg_len and msg_namelen, the rest stays the same
+        for(size_t i=0;i<N;i++){
+            msghdr& hdr=msgs[i].msg_hdr;
+            memset(&hdr,0,sizeof(msghdr));
+            hdr.msg_iov=&iovecs[i];
+            hdr.msg_iovlen=1;
+            hdr.msg_name=&sources[i];
+            hdr.msg_namelen=sizeof(sockaddr_in);
+        }
+        // MSG_WAITFORONE: block until the first datagram arrives, then return everything that is already queued
+        // without waiting for the batch to fill up. So batching never adds latency
+        const int nMessages=recvmmsg(mSocket,msgs.data(),N,MSG_WAITFORONE,nullptr);
+        if(nMessages<=0){
+            // errno is only set if -1 was returned. shutdown() in stopReceiving() makes recvmmsg return
+            if(nMessages<0 && errno == EWOULDBLOCK) {
+                if(onReceiveTimeout!=nullptr && receiving){
+                    onReceiveTimeout();
+                }
+            }else if(nMessages<0 && receiving) {
+                MLOGE<<"Error on recvmmsg. errno="<<errno<<" "<<strerror(errno);
+            }
+            continue;
+        }
+        nReceiveCalls++;
+        size_t nPackets=0;
+        size_t nBytes=0;
+        int lastAccepted=-1;
+        for(int i=0;i<nMessages;i++){
+            if((msgs[i].msg_hdr.msg_flags & MSG_TRUNC)!=0){
+                MLOGE<<"Datagram bigger than slot size "<<mSlotSize;
+                continue;
+            }
+            const size_t message_length=msgs[i].msg_len;
+            if(message_length==0)continue;
+            packets[nPackets++]={(const uint8_t*)iovecs[i].iov_base,message_length};
+            nBytes+=message_length;
+            lastAccepted=i;
+        }
+        if(nPackets==0){
+            continue;
+        }
+        if(onBatchReceivedCallback!=nullptr){
+            onBatchReceivedCallback(packets.data(),nPackets);
+        }else{
+            for(size_t i=0;i<nPackets;i++){
+                onDataReceivedCallback(packets[i].data,packets[i].data_length);
+            }
+        }
+        nReceivedBytes+=nBytes;
+        nReceivedPackets+=nPackets;
+        // Usually all datagrams of a batch come from the same sender,the last accepted one is enough
+        updateSourceIP(sources[lastAccepted]);
+    }
+}
+
+void UDPReceiver::updateSourceIP(const sockaddr_in& source) {
+    if(source.sin_addr.s_addr==lastSenderAddr){
+        return;
+    }
+    lastSenderAddr=source.sin_addr.s_addr;
+    const char* p=inet_ntoa(source.sin_addr);
+    senderIP=std::string(p);
+    if(onSourceIP!=nullptr){
+        onSourceIP(senderIP);
+    }
+}
+
 int UDPReceiver::getPort() const {
     return mPort;
 }
@@ -9,6 +9,10 @@
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
 //
 #ifdef __ANDROID__
 #include <jni.h>
@@ -21,6 +25,14 @@ class UDPReceiver {
 public:
     typedef std::function<void(const uint8_t[],size_t)> DATA_CALLBACK;
     typedef std::function<void(const std::string)> SOURCE_IP_CALLBACK;
+    // One datagram of a batch. data points into a preallocated slot owned by the receiver
+    // and is only valid for the duration of the BATCH_DATA_CALLBACK
+    struct Packet{
+        const uint8_t* data;
+        size_t data_length;
+    };
+    typedef std::function<void(const Packet[],size_t)> BATCH_DATA_CALLBACK;
+    typedef std::function<void()> TIMEOUT_CALLBACK;
 public:
     /**
      * @param javaVm used to set thread priority (attach and then detach) for android,
@@ -34,9 +46,23 @@ public:
      */
     UDPReceiver(JavaVM* javaVm,int port,std::string name,int CPUPriority,DATA_CALLBACK onDataReceivedCallback,size_t WANTED_RCVBUF_SIZE=0);
     /**
-     * Register a callback that is called once and contains the IP address of the first received packet's sender
+     * Register a callback that is called with the IP address of the first received packet's sender
+     * and then again only if the sender IP changes
      */
     void registerOnSourceIPFound(SOURCE_IP_CALLBACK onSourceIP1);
+    /**
+     * Receive up to @param batchSize datagrams per syscall (recvmmsg) instead of one (recvfrom).
+     * The datagrams are written into batchSize preallocated slots of @param slotSize bytes each,
+     * datagrams bigger than slotSize are dropped. If @param onBatchReceivedCallback is set the whole batch is
+     * passed to it, else onDataReceivedCallback is called once for each datagram.
+     * Must be called before startReceiving(). batchSize<=1 disables batching (default)
+     */
+    void setBatchMode(size_t batchSize,BATCH_DATA_CALLBACK onBatchReceivedCallback=nullptr,size_t slotSize=UDP_PACKET_MAX_SIZE);
+    /**
+     * Call @param onReceiveTimeout on the receiver thread every time no datagram arrived for @param timeout (SO_RCVTIMEO),
+     * e.g. to give up data that is held back waiting for a lost packet. Must be called before startReceiving()
+     */
+    void setReceiveTimeout(std::chrono::milliseconds timeout,TIMEOUT_CALLBACK onReceiveTimeout);
     /**
      * Start receiver thread,which opens UDP port
      */
@@ -47,10 +73,16 @@ public:
     void stopReceiving();
     //Get function(s) for private member variables
     long getNReceivedBytes()const;
+    long getNReceivedPackets()const;
+    // n of syscalls that returned at least one datagram
+    long getNReceiveCalls()const;
     std::string getSourceIPAddress()const;
     int getPort()const;
 private:
     void receiveFromUDPLoop();
+    void receiveFromUDPLoopBatched();
+    // Only does the string conversion when the sender changed
+    void updateSourceIP(const sockaddr_in& source);
     const DATA_CALLBACK onDataReceivedCallback=nullptr;
     SOURCE_IP_CALLBACK onSourceIP= nullptr;
     const int mPort;
@@ -61,8 +93,16 @@ private:
     ///We need this reference to stop the receiving thread
     int mSocket=0;
     std::string senderIP="0.0.0.0";
+    in_addr_t lastSenderAddr=0;
+    size_t mBatchSize=1;
+    size_t mSlotSize=UDP_PACKET_MAX_SIZE;
+    BATCH_DATA_CALLBACK onBatchReceivedCallback=nullptr;
+    std::chrono::milliseconds mReceiveTimeout{0};
+    TIMEOUT_CALLBACK onReceiveTimeout=nullptr;
     std::atomic<bool> receiving=false;
     std::atomic<long> nReceivedBytes=0;
+    std::atomic<long> nReceivedPackets=0;
+    std::atomic<long> nReceiveCalls=0;
     std::unique_ptr<std::thread> mUDPReceiverThread;
     //https://en.wikipedia.org/wiki/User_Datagram_Protocol
     //65,507 bytes (65,535 − 8 byte UDP header − 20 byte IP header).
@@ -3,10 +3,13 @@
 //
 
 #include "UDPSender.h"
+#ifdef __ANDROID__
 #include <jni.h>
+#endif
 #include <cstdlib>
 #include <pthread.h>
 #include <cerrno>
+#include <cstring>
 #include <sys/ioctl.h>
 #include <endian.h>
 #include <sys/socket.h>
@@ -9,6 +9,8 @@
 // dummy methods for ATrace such that the code compiles even tough the functionality is not available
 // To enable tracing, re-compile code with minapi 23 (minimum for proper logging with the android ndk)
 // This can be usefull if you want to use tracing in your project when debugging but use a minapi lower than 23 for releases
+#include <cstdint>
+
 #if __ANDROID_API__ >= 23
 #include <android/trace.h>
 static constexpr const bool isATraceAvailable=true;
@@ -16,7 +18,18 @@ static constexpr const bool isATraceAvailable=true;
 
 static void ATrace_beginSection(const char* sectionName){}
 static void ATrace_endSection(){}
+static bool ATrace_isEnabled(){return false;}
 static constexpr const bool isATraceAvailable=false;
 #endif
 
+// Same for the async sections and counters, they need api 29
+#if __ANDROID_API__ >= 29
+static constexpr const bool isATraceAsyncAvailable=true;
+#else
+static void ATrace_beginAsyncSection(const char* sectionName,int32_t cookie){}
+static void ATrace_endAsyncSection(const char* sectionName,int32_t cookie){}
+static void ATrace_setCounter(const char* counterName,int64_t counterValue){}
+static constexpr const bool isATraceAsyncAvailable=false;
+#endif
+
 #endif //RENDERINGX_ATRACECOMPBAT_H
@@ -5,10 +5,53 @@
 #ifndef FPV_VR_PRIVATE_MDEBUG_H
 #define FPV_VR_PRIVATE_MDEBUG_H
 
+#include <atomic>
+
+// Log levels, same values as android_LogPriority
+enum class MLogLevel{V=2,D=3,I=4,W=5,E=6};
+
+// Statements below the compile time threshold are removed completely. By default verbose logs only exist in debug builds.
+// Override with e.g. -DMLOG_MIN_LEVEL=6 to only keep errors
+#ifndef MLOG_MIN_LEVEL
+#ifdef NDEBUG
+#define MLOG_MIN_LEVEL 3
+#else
+#define MLOG_MIN_LEVEL 2
+#endif
+#endif
+
+// Runtime threshold, can be changed at any time from any thread. Default: debug (verbose logs are compiled in for debug
+// builds, but not printed unless enabled)
+class MLogThreshold{
+public:
+    static void set(const MLogLevel level){
+        minLevel.store((int)level,std::memory_order_relaxed);
+    }
+    static bool isEnabled(const MLogLevel level){
+        return (int)level>=minLevel.load(std::memory_order_relaxed);
+    }
+private:
+    static inline std::atomic<int> minLevel{(int)MLogLevel::D};
+};
+#define MLOG_IS_ENABLED(level) ((int)(level)>=MLOG_MIN_LEVEL && MLogThreshold::isEnabled(level))
+
+// Turns a disabled log statement into a no-op: MLOGX<<a<<b expands to !enabled ? (void)0 : MLogVoidify() & (logger<<a<<b)
+// The logger (including the tag) is never constructed and a,b are never evaluated. The ternary (instead of if/else)
+// keeps un-braced if(...) MLOGD<<...; else ...; statements working.
+struct MLogVoidify{
+    template<class T>
+    void operator&(T&&){}
+};
+#define MLOG_IF(level) !MLOG_IS_ENABLED(level) ? (void)0 : MLogVoidify() &
+
 #ifndef __ANDROID__
+// Host builds (tests, benchmarks): stdout is left to the program output
 #include <iostream>
-#define MLOGD std::cout
-#define MLOGE std::cout
+#define MLOGV MLOG_IF(MLogLevel::V) std::cerr
+#define MLOGD MLOG_IF(MLogLevel::D) std::cerr
+#define MLOGE MLOG_IF(MLogLevel::E) std::cerr
+#define MLOGD2(CUSTOM_TAG) MLOG_IF(MLogLevel::D) std::cerr<<CUSTOM_TAG<<": "
+#define MLOGE2(CUSTOM_TAG) MLOG_IF(MLogLevel::E) std::cerr<<CUSTOM_TAG<<": "
 #else
 
 #include "android/log.h"
@@ -142,8 +185,10 @@ namespace PrettyFunctionHelper{
 
 // Here we use the current class name / namespace as tag (with pretty function workaround)
 // Unfortunately we can only achieve that using a 'old c-style' macro
-#define MLOGD AndroidLogger(ANDROID_LOG_DEBUG,__CLASS_NAME__)
-#define MLOGE AndroidLogger(ANDROID_LOG_ERROR,__CLASS_NAME__)
+// MLOGV is meant for hot paths (e.g. once per packet), see MLOG_MIN_LEVEL and MLogThreshold
+#define MLOGV MLOG_IF(MLogLevel::V) AndroidLogger(ANDROID_LOG_VERBOSE,__CLASS_NAME__)
+#define MLOGD MLOG_IF(MLogLevel::D) AndroidLogger(ANDROID_LOG_DEBUG,__CLASS_NAME__)
+#define MLOGE MLOG_IF(MLogLevel::E) AndroidLogger(ANDROID_LOG_ERROR,__CLASS_NAME__)
 
 // When using a custom TAG we do not need a macro. Use cpp style instead
 static AndroidLogger MLOGD2(const std::string CUSTOM_TAG){
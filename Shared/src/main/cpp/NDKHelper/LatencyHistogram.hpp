@@ -0,0 +1,234 @@
+#ifndef LIVEVIDEO10MS_LATENCYHISTOGRAM_HPP
+#define LIVEVIDEO10MS_LATENCYHISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TimeHelper.hpp"
+#include "TestCheck.hpp"
+
+// Fixed bucket latency histogram (like HdrHistogram) with microsecond resolution.
+// Values below SUB_BUCKETS us have their own bucket, above that each power of two is split into SUB_BUCKETS buckets,
+// such that a bucket is at most 1/SUB_BUCKETS (6%) wide relative to its value. Covers 0us to ~134s (larger values are counted as MAX_VALUE_US).
+// Recording is lock-free and wait-free (besides the max) and can be done from any n of threads, e.g. the MediaCodec
+// input and output threads. Reading (snapshot()) can be done from any thread at any time, a concurrent sample might be
+// missing in the max / sum but is never lost.
+// Unlike the averages in DecodingInfo this keeps the p99 / max spikes, unlike LatencyTrace it is cheap enough to be always on.
+class LatencyHistogram{
+public:
+    static constexpr int SUB_BUCKET_BITS=4;
+    static constexpr uint64_t SUB_BUCKETS=1<<SUB_BUCKET_BITS;
+    // n of powers of two above SUB_BUCKETS
+    static constexpr int N_EXPONENTS=23;
+    static constexpr std::size_t N_BUCKETS=(N_EXPONENTS+1)*SUB_BUCKETS;
+    static constexpr uint64_t MAX_VALUE_US=((2*SUB_BUCKETS)<<(N_EXPONENTS-1))-1;
+    static std::size_t bucketIndex(uint64_t valueUs){
+        valueUs=std::min(valueUs,MAX_VALUE_US);
+        if(valueUs<SUB_BUCKETS)return (std::size_t)valueUs;
+        const int exponent=(63-__builtin_clzll(valueUs))-SUB_BUCKET_BITS;
+        return (std::size_t)((exponent+1)*SUB_BUCKETS+((valueUs>>exponent)-SUB_BUCKETS));
+    }
+    // Highest value that falls into the bucket
+    static uint64_t bucketUpperBoundUs(const std::size_t index){
+        if(index<SUB_BUCKETS)return index;
+        const int exponent=(int)(index/SUB_BUCKETS)-1;
+        return ((SUB_BUCKETS+index%SUB_BUCKETS+1)<<exponent)-1;
+    }
+    LatencyHistogram()=default;
+    LatencyHistogram(const LatencyHistogram&)=delete;
+    LatencyHistogram& operator=(const LatencyHistogram&)=delete;
+    void record(const std::chrono::nanoseconds latency){
+        const uint64_t valueUs=latency.count()>0 ? (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(latency).count() : 0;
+        mBuckets[bucketIndex(valueUs)].fetch_add(1,std::memory_order_relaxed);
+        mSumUs.fetch_add(valueUs,std::memory_order_relaxed);
+        uint64_t max=mMaxUs.load(std::memory_order_relaxed);
+        while(valueUs>max && !mMaxUs.compare_exchange_weak(max,valueUs,std::memory_order_relaxed)){}
+    }
+    // A sample recorded concurrently might survive the reset
+    void reset(){
+        for(auto& bucket:mBuckets){
+            bucket.store(0,std::memory_order_relaxed);
+        }
+        mSumUs.store(0,std::memory_order_relaxed);
+        mMaxUs.store(0,std::memory_order_relaxed);
+    }
+    struct Snapshot{
+        std::array<uint32_t,N_BUCKETS> counts{};
+        uint64_t nSamples=0;
+        uint64_t sumUs=0;
+        uint64_t maxUs=0;
+        // Nearest rank. Returns the upper bound of the bucket (at most 6% above the real value), but never more than the max
+        std::chrono::microseconds percentile(const double p)const{
+            if(nSamples==0)return std::chrono::microseconds(0);
+            const auto rank=std::max<uint64_t>((uint64_t)(p/100.0*(double)nSamples+0.999999),1);
+            uint64_t n=0;
+            for(std::size_t i=0;i<N_BUCKETS;i++){
+                n+=counts[i];
+                if(n>=rank){
+                    return std::chrono::microseconds(std::min(bucketUpperBoundUs(i),maxUs));
+                }
+            }
+            return std::chrono::microseconds(maxUs);
+        }
+        std::chrono::microseconds avg()const{
+            return std::chrono::microseconds(nSamples>0 ? sumUs/nSamples : 0);
+        }
+        std::chrono::microseconds max()const{
+            return std::chrono::microseconds(maxUs);
+        }
+        std::string toString()const{
+            std::stringstream ss;
+            ss<<"n="<<nSamples;
+            if(nSamples>0){
+                ss<<" avg="<<MyTimeHelper::R(avg())<<" p50="<<MyTimeHelper::R(percentile(50))<<" p90="<<MyTimeHelper::R(percentile(90))
+                  <<" p99="<<MyTimeHelper::R(percentile(99))<<" max="<<MyTimeHelper::R(max());
+            }
+            return ss.str();
+        }
+    };
+    Snapshot snapshot()const{
+        Snapshot ret;
+        for(std::size_t i=0;i<N_BUCKETS;i++){
+            ret.counts[i]=mBuckets[i].load(std::memory_order_relaxed);
+            ret.nSamples+=ret.counts[i];
+        }
+        ret.sumUs=mSumUs.load(std::memory_order_relaxed);
+        ret.maxUs=mMaxUs.load(std::memory_order_relaxed);
+        return ret;
+    }
+    // Compact binary form, only the non-empty buckets. Native byte order (little endian on all android abis):
+    // "LVLH", uint32 version (1), uint32 SUB_BUCKET_BITS, uint32 N_BUCKETS, uint32 n of histograms, followed by each histogram:
+    // uint64 sumUs, uint64 maxUs, uint32 n of non-empty buckets, followed by n * (uint32 bucket index, uint32 count)
+    static std::vector<uint8_t> serialize(const std::vector<Snapshot>& snapshots){
+        std::vector<uint8_t> ret(SERIALIZED_MAGIC,SERIALIZED_MAGIC+4);
+        append<uint32_t>(ret,SERIALIZED_VERSION);
+        append<uint32_t>(ret,SUB_BUCKET_BITS);
+        append<uint32_t>(ret,N_BUCKETS);
+        append<uint32_t>(ret,(uint32_t)snapshots.size());
+        for(const auto& snapshot:snapshots){
+            append<uint64_t>(ret,snapshot.sumUs);
+            append<uint64_t>(ret,snapshot.maxUs);
+            const auto nNonEmpty=(uint32_t)std::count_if(snapshot.counts.begin(),snapshot.counts.end(),[](const uint32_t count){return count>0;});
+            append<uint32_t>(ret,nNonEmpty);
+            for(std::size_t i=0;i<N_BUCKETS;i++){
+                if(snapshot.counts[i]==0)continue;
+                append<uint32_t>(ret,(uint32_t)i);
+                append<uint32_t>(ret,snapshot.counts[i]);
+            }
+        }
+        return ret;
+    }
+    // std::nullopt if the data is not a (complete) serialized form with the same bucket layout
+    static std::optional<std::vector<Snapshot>> deserialize(const uint8_t* data,const std::size_t length){
+        std::size_t offset=4;
+        if(length<offset || std::memcmp(data,SERIALIZED_MAGIC,4)!=0)return std::nullopt;
+        uint32_t version,subBucketBits,nBuckets,nSnapshots;
+        if(!read(data,length,offset,version) || !read(data,length,offset,subBucketBits) || !read(data,length,offset,nBuckets) ||
+           !read(data,length,offset,nSnapshots)){
+            return std::nullopt;
+        }
+        if(version!=SERIALIZED_VERSION || subBucketBits!=SUB_BUCKET_BITS || nBuckets!=N_BUCKETS)return std::nullopt;
+        // An empty histogram takes 20 bytes
+        if(nSnapshots>(length-offset)/20)return std::nullopt;
+        std::vector<Snapshot> ret(nSnapshots);
+        for(auto& snapshot:ret){
+            uint32_t nNonEmpty;
+            if(!read(data,length,offset,snapshot.sumUs) || !read(data,length,offset,snapshot.maxUs) || !read(data,length,offset,nNonEmpty)){
+                return std::nullopt;
+            }
+            for(uint32_t i=0;i<nNonEmpty;i++){
+                uint32_t index,count;
+                if(!read(data,length,offset,index) || !read(data,length,offset,count) || index>=N_BUCKETS)return std::nullopt;
+                snapshot.counts[index]=count;
+                snapshot.nSamples+=count;
+            }
+        }
+        return ret;
+    }
+private:
+    static constexpr const char* SERIALIZED_MAGIC="LVLH";
+    static constexpr const uint32_t SERIALIZED_VERSION=1;
+    template<class T>
+    static void append(std::vector<uint8_t>& data,const T value){
+        const auto offset=data.size();
+        data.resize(offset+sizeof(T));
+        std::memcpy(&data[offset],&value,sizeof(T));
+    }
+    template<class T>
+    static bool read(const uint8_t* data,const std::size_t length,std::size_t& offset,T& value){
+        if(offset+sizeof(T)>length)return false;
+        std::memcpy(&value,&data[offset],sizeof(T));
+        offset+=sizeof(T);
+        return true;
+    }
+    std::array<std::atomic<uint32_t>,N_BUCKETS> mBuckets{};
+    std::atomic<uint64_t> mSumUs{0};
+    std::atomic<uint64_t> mMaxUs{0};
+};
+
+namespace TEST_LATENCY_HISTOGRAM{
+    // Bucket boundaries, percentiles of a known distribution recorded from 4 threads and the serialized form.
+    // Returns the n of failed checks
+    static int test(){
+        using namespace std::chrono;
+        int nFailed=0;
+        for(uint64_t valueUs=0;valueUs<=LatencyHistogram::MAX_VALUE_US;valueUs=valueUs*9/8+1){
+            const auto index=LatencyHistogram::bucketIndex(valueUs);
+            TEST_CHECK(nFailed,index<LatencyHistogram::N_BUCKETS);
+            TEST_CHECK(nFailed,valueUs<=LatencyHistogram::bucketUpperBoundUs(index));
+            TEST_CHECK(nFailed,index==0 || valueUs>LatencyHistogram::bucketUpperBoundUs(index-1));
+            TEST_CHECK(nFailed,(LatencyHistogram::bucketUpperBoundUs(index)-valueUs<=std::max<uint64_t>(valueUs/LatencyHistogram::SUB_BUCKETS,1)));
+        }
+        TEST_CHECK(nFailed,LatencyHistogram::bucketIndex(LatencyHistogram::MAX_VALUE_US)==LatencyHistogram::N_BUCKETS-1);
+        TEST_CHECK(nFailed,LatencyHistogram::bucketIndex(LatencyHistogram::MAX_VALUE_US*2)==LatencyHistogram::N_BUCKETS-1);
+        LatencyHistogram histogram;
+        // 1ms..1000ms, one value per ms, each recorded by 4 threads
+        std::vector<std::thread> threads;
+        for(int t=0;t<4;t++){
+            threads.emplace_back([&histogram]{
+                for(int i=1;i<=1000;i++){
+                    histogram.record(milliseconds(i));
+                }
+            });
+        }
+        for(auto& thread:threads){
+            thread.join();
+        }
+        const auto snapshot=histogram.snapshot();
+        TEST_CHECK(nFailed,snapshot.nSamples==4000);
+        TEST_CHECK(nFailed,snapshot.max()==milliseconds(1000));
+        TEST_CHECK(nFailed,snapshot.avg()==microseconds(500500));
+        for(const double p:{50.0,90.0,99.0}){
+            const auto expected=microseconds((int64_t)(p*10*1000));
+            const auto actual=snapshot.percentile(p);
+            TEST_CHECK(nFailed,actual>=expected && actual<=expected+expected/LatencyHistogram::SUB_BUCKETS);
+        }
+        TEST_CHECK(nFailed,snapshot.percentile(100)==milliseconds(1000));
+        LatencyHistogram empty;
+        const auto serialized=LatencyHistogram::serialize({snapshot,empty.snapshot()});
+        const auto deserialized=LatencyHistogram::deserialize(serialized.data(),serialized.size());
+        TEST_CHECK(nFailed,deserialized && deserialized->size()==2);
+        if(deserialized && deserialized->size()==2){
+            TEST_CHECK(nFailed,deserialized->at(0).counts==snapshot.counts && deserialized->at(0).nSamples==snapshot.nSamples &&
+                       deserialized->at(0).maxUs==snapshot.maxUs && deserialized->at(0).sumUs==snapshot.sumUs);
+            TEST_CHECK(nFailed,deserialized->at(1).nSamples==0);
+        }
+        TEST_CHECK(nFailed,(!LatencyHistogram::deserialize(serialized.data(),serialized.size()-1)));
+        histogram.reset();
+        TEST_CHECK(nFailed,histogram.snapshot().nSamples==0);
+        if(nFailed==0){
+            MLOGD<<"TEST_LATENCY_HISTOGRAM passed "<<snapshot.toString()<<" ("<<serialized.size()<<" bytes serialized)";
+        }
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_LATENCYHISTOGRAM_HPP
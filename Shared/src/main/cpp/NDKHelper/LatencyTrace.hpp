@@ -0,0 +1,368 @@
+#ifndef LIVEVIDEO10MS_LATENCYTRACE_HPP
+#define LIVEVIDEO10MS_LATENCYTRACE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "TimeHelper.hpp"
+#include "ATraceCompbat.hpp"
+#include "TestCheck.hpp"
+
+// Traces every NALU / frame trough the video pipeline. Each thread writes (monotonic ns) time stamps into its own
+// lock-free ring buffer, the newest LatencyTrace::RING_SIZE events per thread are kept.
+// Unlike the averages in DecodingInfo this gives the tail latency (p99 / max) of each stage.
+// A NALU / frame is identified by its ingress time (NALU::creationTime, NALUs from the same rtp aggregation packet
+// share it and are counted once). MediaCodec only hands back the presentation time on the output side, therefore
+// the 'queued to codec' event also stores the presentation time to link them.
+// When ATrace async sections are available (api 29) and tracing is enabled the codec stages also show up in systrace.
+// Disabled by default, then stamping costs one atomic load.
+class LatencyTrace{
+public:
+    enum Stage:uint32_t{
+        INGRESS=0,              // First byte of the NALU received (NALU::creationTime)
+        DEPACKETIZED=1,         // NALU complete, handed out by the parser
+        QUEUED_TO_CODEC=2,      // Input buffer queued
+        RELEASED_FROM_CODEC=3,  // Output buffer released (rendered)
+        N_STAGES=4
+    };
+    // Latency between two stages
+    enum Interval{
+        DEPACKETIZE=0,          // INGRESS -> DEPACKETIZED
+        WAIT_FOR_CODEC=1,       // DEPACKETIZED -> QUEUED_TO_CODEC (queues, waiting for a free input buffer)
+        DECODE=2,               // QUEUED_TO_CODEC -> RELEASED_FROM_CODEC
+        TOTAL=3,                // INGRESS -> RELEASED_FROM_CODEC
+        N_INTERVALS=4
+    };
+    // Also the record format of the binary dump
+    struct Event{
+        uint64_t unitId;
+        int64_t timestampNs;
+        // presentation time passed to MediaCodec (QUEUED_TO_CODEC,RELEASED_FROM_CODEC), 0 otherwise
+        uint64_t codecPtsUs;
+        uint32_t stage;
+        uint32_t threadIndex;
+    };
+    static_assert(sizeof(Event)==32,"Event is written to the binary dump as it is");
+    struct IntervalStats{
+        long nSamples=0;
+        std::chrono::nanoseconds p50{0};
+        std::chrono::nanoseconds p90{0};
+        std::chrono::nanoseconds p99{0};
+        std::chrono::nanoseconds max{0};
+        // min / max / avg of the same samples
+        AvgCalculator minMaxAvg;
+    };
+    struct Snapshot{
+        std::array<IntervalStats,N_INTERVALS> intervals;
+        std::string toString()const{
+            static constexpr const char* NAMES[N_INTERVALS]={"Depacketize","WaitForCodec","Decode","Total"};
+            std::stringstream ss;
+            for(int i=0;i<N_INTERVALS;i++){
+                const auto& stats=intervals[i];
+                ss<<NAMES[i]<<": n="<<stats.nSamples;
+                if(stats.nSamples>0){
+                    ss<<" p50="<<MyTimeHelper::R(stats.p50)<<" p90="<<MyTimeHelper::R(stats.p90)
+                      <<" p99="<<MyTimeHelper::R(stats.p99)<<" max="<<MyTimeHelper::R(stats.max);
+                }
+                if(i+1<N_INTERVALS)ss<<"\n";
+            }
+            return ss.str();
+        }
+    };
+    static constexpr const std::size_t RING_SIZE=4096;
+    static void setEnabled(const bool enabled){
+        mEnabled.store(enabled,std::memory_order_relaxed);
+    }
+    static bool isEnabled(){
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+    static uint64_t getUnitId(const std::chrono::steady_clock::time_point ingressTime){
+        return (uint64_t)toNs(ingressTime);
+    }
+    // Call when a parser hands out a NALU. Writes the INGRESS and DEPACKETIZED events
+    static void stampDepacketized(const std::chrono::steady_clock::time_point ingressTime){
+        if(!isEnabled())return;
+        const uint64_t unitId=getUnitId(ingressTime);
+        Ring& ring=getThreadRing();
+        ring.write({unitId,toNs(ingressTime),0,INGRESS,ring.index});
+        ring.write({unitId,toNs(std::chrono::steady_clock::now()),0,DEPACKETIZED,ring.index});
+        if(isATraceAsyncAvailable && ATrace_isEnabled()){
+            ATrace_beginAsyncSection(ATRACE_WAIT_FOR_CODEC,(int32_t)unitId);
+        }
+    }
+    // Call after the input buffer with the NALU / frame was queued with presentation time codecPtsUs
+    static void stampQueuedToCodec(const std::chrono::steady_clock::time_point ingressTime,const uint64_t codecPtsUs){
+        if(!isEnabled())return;
+        const uint64_t unitId=getUnitId(ingressTime);
+        Ring& ring=getThreadRing();
+        ring.write({unitId,toNs(std::chrono::steady_clock::now()),codecPtsUs,QUEUED_TO_CODEC,ring.index});
+        if(isATraceAsyncAvailable && ATrace_isEnabled()){
+            ATrace_endAsyncSection(ATRACE_WAIT_FOR_CODEC,(int32_t)unitId);
+            ATrace_beginAsyncSection(ATRACE_DECODE,(int32_t)codecPtsUs);
+        }
+    }
+    // Call after the output buffer with presentation time codecPtsUs was released
+    static void stampReleasedFromCodec(const uint64_t codecPtsUs){
+        if(!isEnabled())return;
+        Ring& ring=getThreadRing();
+        ring.write({0,toNs(std::chrono::steady_clock::now()),codecPtsUs,RELEASED_FROM_CODEC,ring.index});
+        if(isATraceAsyncAvailable && ATrace_isEnabled()){
+            ATrace_endAsyncSection(ATRACE_DECODE,(int32_t)codecPtsUs);
+        }
+    }
+    // Ignore all events recorded until now
+    static void reset(){
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        for(const auto& ring:registry().rings){
+            ring->reset();
+        }
+    }
+    // All events (of all threads) since the last reset, unordered. Can be called from any thread at any time
+    static std::vector<Event> collectEvents(){
+        std::vector<Event> ret;
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        for(const auto& ring:registry().rings){
+            ring->readInto(ret);
+        }
+        return ret;
+    }
+    static Snapshot snapshot(){
+        return calculateSnapshot(collectEvents());
+    }
+    static Snapshot calculateSnapshot(const std::vector<Event>& events){
+        // timestamps of each stage per unit, 0 if missing
+        std::unordered_map<uint64_t,std::array<int64_t,N_STAGES>> units;
+        std::unordered_map<uint64_t,uint64_t> unitIdByPts;
+        for(const auto& event:events){
+            if(event.stage==QUEUED_TO_CODEC){
+                unitIdByPts[event.codecPtsUs]=event.unitId;
+            }
+        }
+        for(const auto& event:events){
+            uint64_t unitId=event.unitId;
+            if(event.stage==RELEASED_FROM_CODEC){
+                const auto it=unitIdByPts.find(event.codecPtsUs);
+                if(it==unitIdByPts.end())continue;
+                unitId=it->second;
+            }
+            if(event.stage>=N_STAGES)continue;
+            auto& timestamps=units.try_emplace(unitId,std::array<int64_t,N_STAGES>{}).first->second;
+            timestamps[event.stage]=event.timestampNs;
+        }
+        static constexpr Stage FROM[N_INTERVALS]={INGRESS,DEPACKETIZED,QUEUED_TO_CODEC,INGRESS};
+        static constexpr Stage TO[N_INTERVALS]={DEPACKETIZED,QUEUED_TO_CODEC,RELEASED_FROM_CODEC,RELEASED_FROM_CODEC};
+        std::array<std::vector<std::chrono::nanoseconds>,N_INTERVALS> samples;
+        for(const auto& unit:units){
+            const auto& timestamps=unit.second;
+            for(int i=0;i<N_INTERVALS;i++){
+                if(timestamps[FROM[i]]!=0 && timestamps[TO[i]]!=0){
+                    samples[i].emplace_back(timestamps[TO[i]]-timestamps[FROM[i]]);
+                }
+            }
+        }
+        Snapshot ret;
+        for(int i=0;i<N_INTERVALS;i++){
+            auto& values=samples[i];
+            auto& stats=ret.intervals[i];
+            if(values.empty())continue;
+            std::sort(values.begin(),values.end());
+            stats.nSamples=(long)values.size();
+            stats.p50=percentile(values,50);
+            stats.p90=percentile(values,90);
+            stats.p99=percentile(values,99);
+            stats.max=values.back();
+            for(const auto value:values){
+                stats.minMaxAvg.add(value);
+            }
+        }
+        return ret;
+    }
+    // Binary dump for offline analysis. Format (native byte order, little endian on all android abis):
+    // "LVLT", uint32 version (1), uint32 sizeof(Event), uint32 n of events, followed by the events (see Event)
+    static bool dumpToFile(const std::string& filename){
+        const auto events=collectEvents();
+        std::ofstream file(filename,std::ios::binary | std::ios::trunc);
+        if(!file.is_open()){
+            MLOGE<<"Cannot open "<<filename;
+            return false;
+        }
+        const uint32_t header[3]={DUMP_VERSION,(uint32_t)sizeof(Event),(uint32_t)events.size()};
+        file.write(DUMP_MAGIC,4);
+        file.write((const char*)header,sizeof(header));
+        file.write((const char*)events.data(),events.size()*sizeof(Event));
+        return file.good();
+    }
+private:
+    static constexpr const char* DUMP_MAGIC="LVLT";
+    static constexpr const uint32_t DUMP_VERSION=1;
+    static constexpr const char* ATRACE_WAIT_FOR_CODEC="WaitForCodec";
+    static constexpr const char* ATRACE_DECODE="Decode";
+    static int64_t toNs(const std::chrono::steady_clock::time_point timePoint){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(timePoint.time_since_epoch()).count();
+    }
+    // nearest rank, values has to be sorted
+    static std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds>& values,const int p){
+        const std::size_t rank=(values.size()*p+99)/100;
+        return values[std::max<std::size_t>(rank,1)-1];
+    }
+    // Written by exactly one thread, read by any thread. Each slot is protected by a sequence number (seqlock),
+    // such that a reader can detect (and skip) a slot that is overwritten while it is being read
+    class Ring{
+    public:
+        explicit Ring(const uint32_t index):index(index){}
+        const uint32_t index;
+        // false after the owning thread exited, then the ring can be re-used by the next new thread
+        std::atomic<bool> owned{true};
+        void write(const Event& event){
+            const uint64_t i=mHead.load(std::memory_order_relaxed);
+            Slot& slot=mSlots[i & (RING_SIZE-1)];
+            slot.seq.store(2*i+1,std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.unitId.store(event.unitId,std::memory_order_relaxed);
+            slot.timestampNs.store(event.timestampNs,std::memory_order_relaxed);
+            slot.codecPtsUs.store(event.codecPtsUs,std::memory_order_relaxed);
+            slot.stage.store(event.stage,std::memory_order_relaxed);
+            slot.seq.store(2*i+2,std::memory_order_release);
+            mHead.store(i+1,std::memory_order_release);
+        }
+        // Can be called from any thread
+        void reset(){
+            mBegin.store(mHead.load(std::memory_order_acquire),std::memory_order_relaxed);
+        }
+        void readInto(std::vector<Event>& events)const{
+            const uint64_t head=mHead.load(std::memory_order_acquire);
+            const uint64_t begin=std::max(head>RING_SIZE ? head-RING_SIZE : 0,mBegin.load(std::memory_order_relaxed));
+            for(uint64_t i=begin;i<head;i++){
+                const Slot& slot=mSlots[i & (RING_SIZE-1)];
+                const uint64_t seq1=slot.seq.load(std::memory_order_acquire);
+                Event event{slot.unitId.load(std::memory_order_relaxed),slot.timestampNs.load(std::memory_order_relaxed),
+                            slot.codecPtsUs.load(std::memory_order_relaxed),slot.stage.load(std::memory_order_relaxed),index};
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const uint64_t seq2=slot.seq.load(std::memory_order_relaxed);
+                // overwritten by the writer in the meantime
+                if(seq1!=2*i+2 || seq2!=seq1)continue;
+                events.push_back(event);
+            }
+        }
+    private:
+        struct Slot{
+            std::atomic<uint64_t> seq{0};
+            std::atomic<uint64_t> unitId{0};
+            std::atomic<int64_t> timestampNs{0};
+            std::atomic<uint64_t> codecPtsUs{0};
+            std::atomic<uint32_t> stage{0};
+        };
+        std::array<Slot,RING_SIZE> mSlots;
+        std::atomic<uint64_t> mHead{0};
+        // Events before mBegin were removed by reset()
+        std::atomic<uint64_t> mBegin{0};
+    };
+    struct Registry{
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Ring>> rings;
+    };
+    // The rings are never freed, only handed to the next thread
+    static Registry& registry(){
+        static Registry registry;
+        return registry;
+    }
+    struct ThreadRing{
+        Ring* ring=nullptr;
+        ~ThreadRing(){
+            if(ring!=nullptr){
+                ring->owned.store(false,std::memory_order_release);
+            }
+        }
+    };
+    static Ring& getThreadRing(){
+        static thread_local ThreadRing threadRing;
+        if(threadRing.ring==nullptr){
+            auto& reg=registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            for(auto& ring:reg.rings){
+                bool expected=false;
+                if(ring->owned.compare_exchange_strong(expected,true,std::memory_order_acquire)){
+                    threadRing.ring=ring.get();
+                    break;
+                }
+            }
+            if(threadRing.ring==nullptr){
+                reg.rings.push_back(std::make_unique<Ring>((uint32_t)reg.rings.size()));
+                threadRing.ring=reg.rings.back().get();
+            }
+        }
+        return *threadRing.ring;
+    }
+    static inline std::atomic<bool> mEnabled{false};
+};
+
+namespace TEST_LATENCY_TRACE{
+    // Traces NALUs from 2 threads (parser, decoder output) and checks the intervals,
+    // then reads the binary dump back. Returns the n of failed checks
+    static int test(const std::string& dumpFilename=""){
+        using namespace std::chrono;
+        int nFailed=0;
+        const bool wasEnabled=LatencyTrace::isEnabled();
+        LatencyTrace::setEnabled(true);
+        LatencyTrace::reset();
+        const int N_UNITS=100;
+        std::vector<std::pair<steady_clock::time_point,uint64_t>> queued;
+        for(int i=0;i<N_UNITS;i++){
+            const auto ingressTime=steady_clock::now()-milliseconds(2);
+            LatencyTrace::stampDepacketized(ingressTime);
+            const uint64_t ptsUs=(uint64_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count()+i;
+            LatencyTrace::stampQueuedToCodec(ingressTime,ptsUs);
+            queued.emplace_back(ingressTime,ptsUs);
+        }
+        std::thread outputThread([&queued]{
+            for(const auto& unit:queued){
+                LatencyTrace::stampReleasedFromCodec(unit.second);
+            }
+        });
+        outputThread.join();
+        const auto snapshot=LatencyTrace::snapshot();
+        for(const auto& interval:snapshot.intervals){
+            TEST_CHECK(nFailed,interval.nSamples==N_UNITS);
+            TEST_CHECK(nFailed,interval.p50<=interval.p90 && interval.p90<=interval.p99 && interval.p99<=interval.max);
+        }
+        TEST_CHECK(nFailed,snapshot.intervals[LatencyTrace::DEPACKETIZE].p50>=milliseconds(2));
+        TEST_CHECK(nFailed,snapshot.intervals[LatencyTrace::TOTAL].max>=snapshot.intervals[LatencyTrace::DECODE].max);
+        MLOGD<<"LatencyTrace\n"<<snapshot.toString();
+        // Read back only what the header promises once it was read completely and matches
+        const bool dumped=!dumpFilename.empty() && LatencyTrace::dumpToFile(dumpFilename);
+        TEST_CHECK(nFailed,dumpFilename.empty() || dumped);
+        if(dumped){
+            std::ifstream file(dumpFilename,std::ios::binary);
+            char magic[4]={};
+            uint32_t header[3]={};
+            file.read(magic,sizeof(magic));
+            file.read((char*)header,sizeof(header));
+            const bool validHeader=file.good() && std::memcmp(magic,"LVLT",4)==0 && header[1]==sizeof(LatencyTrace::Event) &&
+                    header[2]==4*N_UNITS;
+            TEST_CHECK(nFailed,validHeader);
+            if(validHeader){
+                std::vector<LatencyTrace::Event> events(header[2]);
+                const auto eventsSize=(std::streamsize)(events.size()*sizeof(LatencyTrace::Event));
+                file.read((char*)events.data(),eventsSize);
+                TEST_CHECK(nFailed,file.gcount()==eventsSize);
+                TEST_CHECK(nFailed,LatencyTrace::calculateSnapshot(events).intervals[LatencyTrace::TOTAL].nSamples==N_UNITS);
+            }
+        }
+        LatencyTrace::reset();
+        LatencyTrace::setEnabled(wasEnabled);
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_LATENCYTRACE_HPP
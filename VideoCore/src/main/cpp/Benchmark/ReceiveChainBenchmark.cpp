@@ -0,0 +1,641 @@
+// Host benchmark of the receive chain: UDPReceiver -> H264Parser (FECDecoder, RTPDecoder / ParseRAW) -> NALUs.
+// Replays the test videos (see VideoFileReader) over UDP loopback as raw h264, rtp and rtp inside FEC
+// (one sequence per rtp packet and one per frame), optionally with the loss of the captures in XFEC/testing.
+// --replay instead sends the packets of a .pcap / .fpv capture with its original timing (see PacketReplayer).
+// Reports packets/s, NALUs/s and p50 / p99 per stage latency as JSON. Exit code 1 if a lossless replay
+// did not output all NALUs.
+// With --restarts it also simulates how long a decoder restart on a format change blocks feeding (see DecoderManager), with
+// and without preparing the next codec in the background. There is no MediaCodec on the host, the codec (stubs/media/NdkMediaCodec.h)
+// only takes the time given with --codec-costs - so the result just shows what preparing saves for these costs.
+// Each video is also parsed as one Annex B byte stream with ParseRAW, SIMD and scalar (see TestParseRAW.hpp). Exit code 1
+// if their NALUs differ.
+// If libavcodec is installed on the host (see CMakeLists.txt) each video is also decoded with FFMpegDecoder (the
+// VS_USE_FFMPEG_DECODER backend), with one slice thread and one per core. Reports fps and the p50 / p99 time from
+// sending an access unit until its frame is output, to compare with the decoding time of MediaCodec on the phone.
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <PacketReplayer.h>
+#include <UDPReceiver.h>
+#include <UDPSender.h>
+#include <wifibroadcast/fec.hh>
+#include "../Parser/H264Parser.h"
+#include "../Parser/TestParseRAW.hpp"
+#include "../Decoder/DecoderManager.hpp"
+#include "VideoFileReader.hpp"
+#ifdef BENCHMARK_WITH_FFMPEG
+#include "../Decoder/FFMpegDecoder.h"
+#endif
+
+namespace{
+    using namespace std::chrono;
+
+    struct Options{
+        std::string videosDirectory=DEFAULT_VIDEOS_DIRECTORY;
+        std::string capturesDirectory=DEFAULT_CAPTURES_DIRECTORY;
+        int port=6200;
+        int packetsPerSecond=20000;
+        std::string outputFilename;
+        bool verbose=false;
+        std::string replayFilename;
+        std::string replayProtocol="rtp";
+        std::string replayConfig;
+        int nDecoderRestarts=0;
+        // create,configure,start,stop,delete in ms
+        std::string codecCosts="150,10,5,5,50";
+    };
+
+    enum class Mode{RAW,RTP,RTP_FEC,RTP_FEC_FRAME};
+    static const char* modeName(const Mode mode){
+        switch(mode){
+            case Mode::RAW:return "raw";
+            case Mode::RTP:return "rtp";
+            case Mode::RTP_FEC:return "rtp_fec";
+            case Mode::RTP_FEC_FRAME:return "rtp_fec_frame";
+        }
+        return "";
+    }
+    // Same sizes as VideoTransmitter
+    static constexpr size_t RAW_CHUNK_SIZE=1024;
+    static constexpr size_t RTP_PACKET_MAX_SIZE=1024;
+    static constexpr uint16_t FEC_MAX_BLOCK_SIZE=1500;
+
+    typedef std::vector<CapturedPacket> Datagrams;
+    static void appendDatagram(Datagrams& datagrams,const uint8_t* data,const size_t length){
+        datagrams.push_back(CapturedPacket{nanoseconds(0),std::vector<uint8_t>(data,data+length)});
+    }
+
+    // The timestamps are assigned by the caller
+    static Datagrams createDatagrams(const std::vector<VideoFileReader::AccessUnit>& video,const Mode mode){
+        Datagrams ret;
+        if(mode==Mode::RAW){
+            std::vector<uint8_t> stream;
+            for(const auto& accessUnit:video){
+                for(const auto& nalu:accessUnit){
+                    stream.insert(stream.end(),nalu.begin(),nalu.end());
+                }
+            }
+            for(size_t offset=0;offset<stream.size();offset+=RAW_CHUNK_SIZE){
+                appendDatagram(ret,&stream[offset],std::min(RAW_CHUNK_SIZE,stream.size()-offset));
+            }
+            return ret;
+        }
+        FECBufferEncoder packetEncoder(FEC_MAX_BLOCK_SIZE,0.5f);
+        FECFrameEncoder frameEncoder(FEC_MAX_BLOCK_SIZE,0.5f,64);
+        const auto appendBlocks=[&ret](const std::vector<std::shared_ptr<FECBlock>>& blocks){
+            for(const auto& block:blocks){
+                appendDatagram(ret,block->pkt_data(),block->pkt_length());
+            }
+        };
+        auto rtpEncoder=std::make_unique<RTPEncoder>([&](const RTPEncoder::RTPPacket& packet){
+            if(mode==Mode::RTP){
+                appendDatagram(ret,packet.data,packet.data_len);
+            }else if(mode==Mode::RTP_FEC){
+                appendBlocks(packetEncoder.encode_buffer(packet.data,packet.data_len));
+            }else{
+                appendBlocks(frameEncoder.add_packet(packet.data,packet.data_len));
+            }
+        },RTP_PACKET_MAX_SIZE);
+        for(const auto& accessUnit:video){
+            for(const auto& nalu:accessUnit){
+                rtpEncoder->parseNALtoRTP(30,nalu.data(),nalu.size());
+            }
+            if(mode==Mode::RTP_FEC_FRAME){
+                appendBlocks(frameEncoder.flush());
+            }
+        }
+        return ret;
+    }
+
+    struct Percentiles{
+        long nSamples=0;
+        nanoseconds p50{0};
+        nanoseconds p99{0};
+        nanoseconds max{0};
+    };
+    // nearest rank
+    static Percentiles calculatePercentiles(std::vector<nanoseconds> values){
+        Percentiles ret;
+        if(values.empty())return ret;
+        std::sort(values.begin(),values.end());
+        const auto percentile=[&values](const int p){
+            const size_t rank=(values.size()*p+99)/100;
+            return values[std::max<size_t>(rank,1)-1];
+        };
+        ret.nSamples=(long)values.size();
+        ret.p50=percentile(50);
+        ret.p99=percentile(99);
+        ret.max=values.back();
+        return ret;
+    }
+
+    struct Result{
+        std::string video;
+        Mode mode;
+        // ReplayConfig::toString() or the loss capture, empty if there was no loss
+        std::string impairment;
+        // 0 == unknown (replay)
+        size_t nExpectedNALUs=0;
+        size_t nSentPackets=0;
+        size_t nLostPackets=0;
+        size_t nReorderedPackets=0;
+        size_t nDuplicatedPackets=0;
+        size_t nReceivedPackets=0;
+        size_t nNALUs=0;
+        size_t nNALUBytes=0;
+        // first to last packet received
+        nanoseconds receiveDuration{0};
+        // sum of the time spent in H264Parser
+        nanoseconds parseDuration{0};
+        // sendto() -> receiver callback
+        Percentiles udpLatency;
+        // H264Parser call per packet (FEC, depacketizing and the NALU callback)
+        Percentiles parseLatency;
+        // First data of a NALU received -> NALU handed out (NALU::creationTime)
+        Percentiles naluLatency;
+        bool complete()const{
+            // The raw parser only hands out a NALU once the next start code arrives
+            return !impairment.empty() || nNALUs+(mode==Mode::RAW ? 1 : 0)>=nExpectedNALUs;
+        }
+    };
+
+    // Sends the datagrams at their timestamps through the PacketImpairment of config to the receive chain
+    static Result run(const Options& options,const Datagrams& datagrams,const Mode mode,const ReplayConfig& config){
+        Result result;
+        result.mode=mode;
+        // Each datagram is sent with its index in front, such that the receiver can look up the send time.
+        // Duplication at most doubles the n of datagrams
+        std::vector<std::atomic<int64_t>> sendTimesNs(datagrams.size()*2);
+
+        std::vector<nanoseconds> udpLatencies,parseLatencies,naluLatencies;
+        udpLatencies.reserve(datagrams.size());
+        parseLatencies.reserve(datagrams.size());
+        std::atomic<size_t> nReceivedPackets{0};
+        steady_clock::time_point firstReceived{},lastReceived{};
+        H264Parser parser([&](const NALU& nalu){
+            naluLatencies.push_back(steady_clock::now()-nalu.creationTime);
+            result.nNALUs++;
+            result.nNALUBytes+=nalu.getSize();
+        });
+        UDPReceiver receiver(nullptr,options.port,"Benchmark",0,[&](const uint8_t* data,const size_t length){
+            const auto now=steady_clock::now();
+            uint32_t index;
+            if(length<=sizeof(index))return;
+            std::memcpy(&index,data,sizeof(index));
+            if(index>=sendTimesNs.size())return;
+            udpLatencies.emplace_back(now.time_since_epoch().count()-sendTimesNs[index].load(std::memory_order_acquire));
+            const uint8_t* payload=data+sizeof(index);
+            const size_t payloadLength=length-sizeof(index);
+            switch(mode){
+                case Mode::RAW:parser.parse_raw_h264_stream(payload,payloadLength);break;
+                case Mode::RTP:parser.parse_rtp_h264_stream(payload,payloadLength);break;
+                default:parser.parseCustomRTPinsideFEC(payload,payloadLength);break;
+            }
+            const auto end=steady_clock::now();
+            parseLatencies.push_back(end-now);
+            if(firstReceived==steady_clock::time_point{}){
+                firstReceived=now;
+            }
+            lastReceived=end;
+            nReceivedPackets.fetch_add(1,std::memory_order_release);
+        },8*1024*1024);
+        receiver.startReceiving();
+        // Wait until the socket is bound
+        std::this_thread::sleep_for(milliseconds(50));
+
+        UDPSender sender("127.0.0.1",options.port,UDPSender::EXAMPLE_MEDIUM_SNDBUFF_SIZE);
+        PacketImpairment impairment(config);
+        std::vector<uint8_t> buffer;
+        const auto start=steady_clock::now();
+        const auto send=[&](const CapturedPacket& packet){
+            const auto index=(uint32_t)result.nSentPackets;
+            buffer.resize(sizeof(index)+packet.data.size());
+            std::memcpy(buffer.data(),&index,sizeof(index));
+            std::memcpy(&buffer[sizeof(index)],packet.data.data(),packet.data.size());
+            if(config.rate>0){
+                const auto sendTime=start+duration_cast<nanoseconds>(packet.timestamp/config.rate);
+                while(steady_clock::now()<sendTime){
+                    // busy wait, sleeping is too coarse for a couple of us
+                }
+            }
+            sendTimesNs[index].store(steady_clock::now().time_since_epoch().count(),std::memory_order_release);
+            sender.mySendTo(buffer.data(),buffer.size());
+            result.nSentPackets++;
+        };
+        for(const auto& datagram:datagrams){
+            impairment.add(datagram);
+            while(const auto packet=impairment.next()){
+                send(*packet);
+            }
+        }
+        impairment.flush();
+        while(const auto packet=impairment.next()){
+            send(*packet);
+        }
+        result.nLostPackets=impairment.getStats().nLost;
+        result.nReorderedPackets=impairment.getStats().nReordered;
+        result.nDuplicatedPackets=impairment.getStats().nDuplicated;
+        // Wait until everything was received or nothing arrived for a while (dropped by the OS)
+        size_t lastNReceived=0;
+        for(auto lastProgress=steady_clock::now();steady_clock::now()-lastProgress<milliseconds(500);){
+            const size_t n=nReceivedPackets.load(std::memory_order_acquire);
+            if(n==result.nSentPackets)break;
+            if(n!=lastNReceived){
+                lastNReceived=n;
+                lastProgress=steady_clock::now();
+            }
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        receiver.stopReceiving();
+        result.nReceivedPackets=nReceivedPackets.load();
+        result.receiveDuration=lastReceived-firstReceived;
+        for(const auto latency:parseLatencies){
+            result.parseDuration+=latency;
+        }
+        result.udpLatency=calculatePercentiles(std::move(udpLatencies));
+        result.parseLatency=calculatePercentiles(std::move(parseLatencies));
+        result.naluLatency=calculatePercentiles(std::move(naluLatencies));
+        return result;
+    }
+
+    static std::vector<std::string> listFiles(const std::string& directory,const std::vector<std::string>& suffixes){
+        std::vector<std::string> ret;
+        DIR* dir=opendir(directory.c_str());
+        if(dir==nullptr)return ret;
+        while(const dirent* entry=readdir(dir)){
+            const std::string name=entry->d_name;
+            if(name[0]=='.')continue;
+            if(entry->d_type==DT_DIR){
+                for(const auto& file:listFiles(directory+"/"+name,suffixes)){
+                    ret.push_back(name+"/"+file);
+                }
+                continue;
+            }
+            for(const auto& suffix:suffixes){
+                if(suffix.empty() || (name.size()>=suffix.size() && name.compare(name.size()-suffix.size(),suffix.size(),suffix)==0)){
+                    ret.push_back(name);
+                    break;
+                }
+            }
+        }
+        closedir(dir);
+        std::sort(ret.begin(),ret.end());
+        return ret;
+    }
+
+    static double perSecond(const size_t n,const nanoseconds duration){
+        return duration.count()>0 ? n*1e9/duration.count() : 0.0;
+    }
+    static void writePercentiles(std::ostream& out,const char* name,const Percentiles& percentiles){
+        out<<"\""<<name<<"\":{\"n\":"<<percentiles.nSamples
+           <<",\"p50\":"<<duration<double,std::micro>(percentiles.p50).count()
+           <<",\"p99\":"<<duration<double,std::micro>(percentiles.p99).count()
+           <<",\"max\":"<<duration<double,std::micro>(percentiles.max).count()<<"}";
+    }
+    // Time between the parameter sets and the key frame of the new format (one frame at 60fps).
+    // The old codec keeps decoding meanwhile
+    static constexpr auto KEY_FRAME_AFTER_PARAMETER_SETS=milliseconds(16);
+    static bool parseCodecCosts(const std::string& value,StubMediaCodec::Costs& costs){
+        std::vector<int> ms;
+        std::stringstream ss(value);
+        std::string item;
+        while(std::getline(ss,item,',')){
+            try{
+                ms.push_back(std::stoi(item));
+            }catch(const std::exception&){
+                return false;
+            }
+        }
+        if(ms.size()!=5)return false;
+        costs={milliseconds(ms[0]),milliseconds(ms[1]),milliseconds(ms[2]),milliseconds(ms[3]),milliseconds(ms[4])};
+        return true;
+    }
+    // Switches between H264 and H265 nRestarts times. Measures the time feeding is blocked by each switch.
+    // cold: The old codec is deleted and the new one created on the feeding thread (no DecoderManager::prepare()).
+    // hot: The new codec is created in the background once the parameter sets arrive, the old one deleted in the background
+    static Percentiles runDecoderRestarts(const int nRestarts,const bool hot){
+        DecoderManager manager;
+        bool isH265=false;
+        AMediaCodec* codec=manager.acquire(isH265,false);
+        AMediaCodec_configure(codec,nullptr,nullptr,nullptr,0);
+        AMediaCodec_start(codec);
+        std::vector<nanoseconds> switchTimes;
+        for(int i=0;i<nRestarts;i++){
+            isH265=!isH265;
+            if(hot){
+                manager.prepare(isH265,false);
+            }
+            std::this_thread::sleep_for(KEY_FRAME_AFTER_PARAMETER_SETS);
+            const auto begin=steady_clock::now();
+            AMediaCodec_stop(codec);
+            if(hot){
+                manager.retire(codec);
+            }else{
+                AMediaCodec_delete(codec);
+            }
+            codec=manager.acquire(isH265,false);
+            AMediaCodec_configure(codec,nullptr,nullptr,nullptr,0);
+            AMediaCodec_start(codec);
+            switchTimes.push_back(steady_clock::now()-begin);
+        }
+        AMediaCodec_stop(codec);
+        AMediaCodec_delete(codec);
+        return calculatePercentiles(std::move(switchTimes));
+    }
+    struct RestartResult{
+        Percentiles cold;
+        Percentiles hot;
+    };
+
+    struct ParseRAWResult{
+        std::string video;
+        size_t nBytes=0;
+        TEST_PARSE_RAW::BenchmarkResult result;
+    };
+    static constexpr size_t PARSE_RAW_CHUNK_SIZE=1024;
+    // All NALUs of the video (with their 0,0,0,1 prefix) as one stream, like the input of ParseRAW
+    static ParseRAWResult runParseRAW(const std::vector<VideoFileReader::AccessUnit>& video){
+        std::vector<uint8_t> annexB;
+        for(const auto& accessUnit:video){
+            for(const auto& nalu:accessUnit){
+                annexB.insert(annexB.end(),nalu.begin(),nalu.end());
+            }
+        }
+        ParseRAWResult ret;
+        ret.nBytes=annexB.size();
+        ret.result=TEST_PARSE_RAW::benchmark(annexB,PARSE_RAW_CHUNK_SIZE);
+        return ret;
+    }
+
+    struct DecodeResult{
+        std::string video;
+        // 0 == one per core
+        int nThreads=0;
+        long nFrames=0;
+        long nErrors=0;
+        nanoseconds duration{0};
+        Percentiles latency;
+    };
+#ifdef BENCHMARK_WITH_FFMPEG
+    // Decodes the video as fast as possible, one access unit per decode() call (like FFMpegSurfaceDecoder).
+    // Latency: from sending the access unit until the frame callback
+    static DecodeResult runFFMpegDecode(const std::vector<VideoFileReader::AccessUnit>& video,const int nThreads){
+        DecodeResult result;
+        result.nThreads=nThreads;
+        std::vector<nanoseconds> latencies;
+        FFMpegDecoder decoder([&latencies](const AVFrame* frame,const steady_clock::time_point creationTime){
+            latencies.push_back(steady_clock::now()-creationTime);
+        });
+        if(!decoder.open(false,nThreads)){
+            return result;
+        }
+        std::vector<uint8_t> buffer;
+        const auto begin=steady_clock::now();
+        for(const auto& accessUnit:video){
+            buffer.clear();
+            for(const auto& nalu:accessUnit){
+                buffer.insert(buffer.end(),nalu.begin(),nalu.end());
+            }
+            decoder.decode(buffer.data(),buffer.size(),steady_clock::now());
+        }
+        result.duration=steady_clock::now()-begin;
+        result.nFrames=decoder.nDecodedFrames;
+        result.nErrors=decoder.nDecodingErrors;
+        result.latency=calculatePercentiles(std::move(latencies));
+        return result;
+    }
+#endif
+
+    static void writeJSON(std::ostream& out,const Options& options,const std::vector<Result>& results,const std::optional<RestartResult>& restartResult,
+            const std::vector<ParseRAWResult>& parseRAWResults,const std::vector<DecodeResult>& decodeResults){
+        out<<"{\n\"benchmark\":\"ReceiveChainBenchmark\",\n\"packets_per_second_sent\":"<<options.packetsPerSecond<<",\n";
+        if(restartResult){
+            out<<"\"decoder_restart_us\":{\"simulated\":true,\"codec_costs_ms\":\""<<options.codecCosts<<"\",";
+            writePercentiles(out,"cold",restartResult->cold);
+            out<<",";
+            writePercentiles(out,"hot",restartResult->hot);
+            out<<"},\n";
+        }
+        if(!parseRAWResults.empty()){
+            out<<"\"parse_raw\":[\n";
+            for(size_t i=0;i<parseRAWResults.size();i++){
+                const auto& r=parseRAWResults[i];
+                out<<"{\"video\":\""<<r.video<<"\",\"bytes\":"<<r.nBytes<<",\"chunk_size\":"<<PARSE_RAW_CHUNK_SIZE
+                   <<",\"identical\":"<<(r.result.identical ? "true" : "false")
+                   <<",\"scalar_gb_per_second\":"<<r.result.scalarGBs<<",\"simd_gb_per_second\":"<<r.result.simdGBs
+                   <<"}"<<(i+1<parseRAWResults.size() ? ",\n" : "\n");
+            }
+            out<<"],\n";
+        }
+        if(!decodeResults.empty()){
+            out<<"\"ffmpeg_decode\":[\n";
+            for(size_t i=0;i<decodeResults.size();i++){
+                const auto& r=decodeResults[i];
+                out<<"{\"video\":\""<<r.video<<"\",\"threads\":"<<r.nThreads<<",\"frames\":"<<r.nFrames<<",\"errors\":"<<r.nErrors
+                   <<",\"fps\":"<<perSecond(r.nFrames,r.duration)<<",\"latency_us\":{";
+                writePercentiles(out,"decode",r.latency);
+                out<<"}}"<<(i+1<decodeResults.size() ? ",\n" : "\n");
+            }
+            out<<"],\n";
+        }
+        out<<"\"results\":[\n";
+        for(size_t i=0;i<results.size();i++){
+            const auto& r=results[i];
+            out<<"{\"video\":\""<<r.video<<"\",\"mode\":\""<<modeName(r.mode)<<"\",\"impairment\":";
+            if(r.impairment.empty()){
+                out<<"null";
+            }else{
+                out<<"\""<<r.impairment<<"\"";
+            }
+            out<<",\"sent_packets\":"<<r.nSentPackets<<",\"lost_packets\":"<<r.nLostPackets
+               <<",\"reordered_packets\":"<<r.nReorderedPackets<<",\"duplicated_packets\":"<<r.nDuplicatedPackets
+               <<",\"received_packets\":"<<r.nReceivedPackets
+               <<",\"nalus\":"<<r.nNALUs<<",\"expected_nalus\":"<<r.nExpectedNALUs<<",\"nalu_bytes\":"<<r.nNALUBytes
+               <<",\"complete\":"<<(r.complete() ? "true" : "false")
+               <<",\"packets_per_second\":"<<perSecond(r.nReceivedPackets,r.receiveDuration)
+               <<",\"parser_packets_per_second\":"<<perSecond(r.nReceivedPackets,r.parseDuration)
+               <<",\"parser_nalus_per_second\":"<<perSecond(r.nNALUs,r.parseDuration)
+               <<",\"latency_us\":{";
+            writePercentiles(out,"udp",r.udpLatency);
+            out<<",";
+            writePercentiles(out,"parse",r.parseLatency);
+            out<<",";
+            writePercentiles(out,"nalu_assembly",r.naluLatency);
+            out<<"}}"<<(i+1<results.size() ? ",\n" : "\n");
+        }
+        out<<"]\n}\n";
+    }
+
+    static void printUsage(){
+        std::cerr<<"ReceiveChainBenchmark [--videos DIR] [--captures DIR] [--port PORT] [--rate PACKETS_PER_SECOND]"
+                   " [--output FILE] [--verbose] [--replay CAPTURE [--protocol raw|rtp|rtp_fec] [--impairment CONFIG]]"
+                   " [--restarts N] [--codec-costs CREATE,CONFIGURE,START,STOP,DELETE]\n"
+                   "  --videos    .mp4 (avc1) and .h264 files, default "<<DEFAULT_VIDEOS_DIRECTORY<<"\n"
+                   "  --captures  loss captures, default "<<DEFAULT_CAPTURES_DIRECTORY<<"\n"
+                   "  --rate      send rate, 0 == as fast as possible (the OS might drop packets then)\n"
+                   "  --output    write the JSON to FILE instead of stdout\n"
+                   "  --replay    send a .pcap / .fpv capture instead of the videos, with the original timing\n"
+                   "  --protocol  of the packets of a .pcap, default rtp. .fpv captures are always raw\n"
+                   "  --impairment see ReplayConfig, e.g. loss=0.01,jitter_us=2000,reorder=0.005,seed=3,rate=2\n"
+                   "  --restarts  n of simulated decoder restarts (cold and hot), default 0 == none\n"
+                   "  --codec-costs the stub codec sleeps for in --restarts, in ms, default 150,10,5,5,50\n";
+    }
+}
+
+int main(int argc,char* argv[]){
+    Options options;
+    for(int i=1;i<argc;i++){
+        const std::string arg=argv[i];
+        const bool hasValue=i+1<argc;
+        if(arg=="--videos" && hasValue){
+            options.videosDirectory=argv[++i];
+        }else if(arg=="--captures" && hasValue){
+            options.capturesDirectory=argv[++i];
+        }else if(arg=="--port" && hasValue){
+            options.port=std::stoi(argv[++i]);
+        }else if(arg=="--rate" && hasValue){
+            options.packetsPerSecond=std::stoi(argv[++i]);
+        }else if(arg=="--output" && hasValue){
+            options.outputFilename=argv[++i];
+        }else if(arg=="--replay" && hasValue){
+            options.replayFilename=argv[++i];
+        }else if(arg=="--protocol" && hasValue){
+            options.replayProtocol=argv[++i];
+        }else if(arg=="--impairment" && hasValue){
+            options.replayConfig=argv[++i];
+        }else if(arg=="--restarts" && hasValue){
+            options.nDecoderRestarts=std::stoi(argv[++i]);
+        }else if(arg=="--codec-costs" && hasValue){
+            options.codecCosts=argv[++i];
+        }else if(arg=="--verbose"){
+            options.verbose=true;
+        }else{
+            printUsage();
+            return 2;
+        }
+    }
+    // The parsers log about every packet / NALU
+    MLogThreshold::set(options.verbose ? MLogLevel::D : MLogLevel::E);
+    if(!parseCodecCosts(options.codecCosts,StubMediaCodec::costs)){
+        printUsage();
+        return 2;
+    }
+
+    std::vector<Result> results;
+    if(!options.replayFilename.empty()){
+        const auto config=ReplayConfig::parse(options.replayConfig);
+        std::optional<Mode> mode;
+        for(const auto m:{Mode::RAW,Mode::RTP,Mode::RTP_FEC}){
+            if(options.replayProtocol==modeName(m))mode=m;
+        }
+        // --protocol is the protocol of the datagrams in a .pcap, a .fpv capture contains the raw NALUs
+        if(CaptureReader::containsRawNALUs(options.replayFilename)){
+            mode=Mode::RAW;
+        }
+        if(!config || !mode){
+            printUsage();
+            return 2;
+        }
+        CaptureReader reader;
+        if(!reader.open(options.replayFilename,config->udpPort)){
+            return 1;
+        }
+        Datagrams datagrams;
+        while(auto packet=reader.next()){
+            datagrams.push_back(std::move(*packet));
+        }
+        Result result=run(options,datagrams,*mode,*config);
+        result.video=options.replayFilename;
+        result.impairment=config->toString();
+        std::cerr<<options.replayFilename<<" "<<modeName(*mode)<<": "<<result.nNALUs<<" NALUs, udp p99 "
+                 <<duration<double,std::micro>(result.udpLatency.p99).count()<<"us\n";
+        results.push_back(std::move(result));
+    }
+    const auto videos=options.replayFilename.empty() ? listFiles(options.videosDirectory,{".mp4",".h264"}) : std::vector<std::string>{};
+    const auto captures=listFiles(options.capturesDirectory,{""});
+    std::vector<ParseRAWResult> parseRAWResults;
+    std::vector<DecodeResult> decodeResults;
+    for(const auto& videoFilename:videos){
+        const auto video=VideoFileReader::readAccessUnits(options.videosDirectory+"/"+videoFilename);
+        if(!video){
+            std::cerr<<"Cannot read "<<videoFilename<<", skipped\n";
+            continue;
+        }
+        std::vector<std::pair<Mode,std::string>> runs;
+        for(const auto mode:{Mode::RAW,Mode::RTP,Mode::RTP_FEC,Mode::RTP_FEC_FRAME}){
+            runs.emplace_back(mode,"");
+        }
+        for(const auto& capture:captures){
+            for(const auto mode:{Mode::RTP,Mode::RTP_FEC,Mode::RTP_FEC_FRAME}){
+                runs.emplace_back(mode,capture);
+            }
+        }
+        {
+            ParseRAWResult parseRAWResult=runParseRAW(*video);
+            parseRAWResult.video=videoFilename;
+            std::cerr<<videoFilename<<" ParseRAW identical output: "<<(parseRAWResult.result.identical ? "yes" : "NO")
+                     <<" scalar "<<parseRAWResult.result.scalarGBs<<" GB/s simd "<<parseRAWResult.result.simdGBs<<" GB/s\n";
+            parseRAWResults.push_back(std::move(parseRAWResult));
+        }
+#ifdef BENCHMARK_WITH_FFMPEG
+        for(const int nThreads:{1,0}){
+            DecodeResult decodeResult=runFFMpegDecode(*video,nThreads);
+            decodeResult.video=videoFilename;
+            std::cerr<<videoFilename<<" ffmpeg threads="<<nThreads<<": "<<perSecond(decodeResult.nFrames,decodeResult.duration)
+                     <<" fps, decode p50 "<<duration<double,std::micro>(decodeResult.latency.p50).count()<<"us\n";
+            decodeResults.push_back(std::move(decodeResult));
+        }
+#endif
+        size_t nNALUs=0;
+        for(const auto& accessUnit:*video){
+            nNALUs+=accessUnit.size();
+        }
+        for(const auto& r:runs){
+            // The capture loss and the send rate of the options
+            ReplayConfig config;
+            config.rate=options.packetsPerSecond>0 ? 1.0f : 0.0f;
+            if(!r.second.empty()){
+                config.lossTrace=options.capturesDirectory+"/"+r.second;
+            }
+            Datagrams datagrams=createDatagrams(*video,r.first);
+            for(size_t i=0;i<datagrams.size();i++){
+                datagrams[i].timestamp=options.packetsPerSecond>0 ? nanoseconds(i*1000*1000*1000/options.packetsPerSecond) : nanoseconds(0);
+            }
+            Result result=run(options,datagrams,r.first,config);
+            result.video=videoFilename;
+            result.impairment=r.second;
+            result.nExpectedNALUs=nNALUs;
+            std::cerr<<videoFilename<<" "<<modeName(r.first)<<" "<<r.second<<": "<<result.nNALUs<<"/"<<result.nExpectedNALUs
+                     <<" NALUs, udp p99 "<<duration<double,std::micro>(result.udpLatency.p99).count()<<"us\n";
+            results.push_back(std::move(result));
+        }
+    }
+    if(results.empty()){
+        std::cerr<<"No videos in "<<options.videosDirectory<<"\n";
+        return 1;
+    }
+    std::optional<RestartResult> restartResult;
+    if(options.nDecoderRestarts>0){
+        restartResult=RestartResult{runDecoderRestarts(options.nDecoderRestarts,false),runDecoderRestarts(options.nDecoderRestarts,true)};
+        std::cerr<<"Decoder restart p50 cold "<<duration<double,std::milli>(restartResult->cold.p50).count()
+                 <<"ms hot "<<duration<double,std::milli>(restartResult->hot.p50).count()<<"ms\n";
+    }
+    if(options.outputFilename.empty()){
+        writeJSON(std::cout,options,results,restartResult,parseRAWResults,decodeResults);
+    }else{
+        std::ofstream file(options.outputFilename);
+        writeJSON(file,options,results,restartResult,parseRAWResults,decodeResults);
+    }
+    const bool allComplete=std::all_of(results.begin(),results.end(),[](const Result& r){return r.complete();});
+    const bool parseRAWIdentical=std::all_of(parseRAWResults.begin(),parseRAWResults.end(),[](const ParseRAWResult& r){return r.result.identical;});
+    return allComplete && parseRAWIdentical ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// Host ctest of the TEST_* self tests of the receive chain (see CMakeLists.txt). On the phone they run from
+// VideoPlayer testLatency. Exit code 1 if any check failed.
+
+#include <iostream>
+#include <AndroidLogger.hpp>
+#include <SPSCQueue.hpp>
+#include <MPSCQueue.hpp>
+#include <LatencyHistogram.hpp>
+#include <LatencyTrace.hpp>
+#include <GroundRecorderFPV.hpp>
+#include <MappedFpvFile.hpp>
+#include <PacketReplayer.h>
+#include "../NALU/AccessUnitAssembler.hpp"
+#include "../NALU/KeyFrameFinder.hpp"
+#include "../Parser/ParseRTP.h"
+
+int main(){
+    MLogThreshold::set(MLogLevel::I);
+    int nFailed=0;
+    const auto run=[&nFailed](const char* name,const int nFailedChecks){
+        std::cerr<<name<<": "<<(nFailedChecks==0 ? "passed" : "FAILED")<<"\n";
+        nFailed+=nFailedChecks;
+    };
+    run("testDepacketizer",TestEncodeDecodeRTP::testDepacketizer());
+    run("TEST_SPSC_QUEUE",TEST_SPSC_QUEUE::test());
+    run("TEST_MPSC_QUEUE",TEST_MPSC_QUEUE::test());
+    run("TEST_ACCESS_UNIT_ASSEMBLER",TEST_ACCESS_UNIT_ASSEMBLER::test());
+    run("TEST_KEY_FRAME_FINDER",TEST_KEY_FRAME_FINDER::test());
+    run("TEST_LATENCY_HISTOGRAM",TEST_LATENCY_HISTOGRAM::test());
+    // The dump goes to the working directory (the build directory under ctest)
+    run("TEST_LATENCY_TRACE",TEST_LATENCY_TRACE::test("UnitTestsLatencyTrace.bin"));
+    run("TEST_GROUND_RECORDER_FPV",TEST_GROUND_RECORDER_FPV::test("UnitTests"));
+    run("TEST_PACKET_REPLAYER",TEST_PACKET_REPLAYER::test(""));
+    run("TEST_MAPPED_FPV_FILE",TEST_MAPPED_FPV_FILE::test(""));
+    std::cerr<<nFailed<<" failed checks\n";
+    return nFailed==0 ? 0 : 1;
+}
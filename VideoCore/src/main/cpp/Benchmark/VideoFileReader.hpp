@@ -0,0 +1,209 @@
+#ifndef LIVEVIDEO10MS_VIDEOFILEREADER_HPP
+#define LIVEVIDEO10MS_VIDEOFILEREADER_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Reads the h264 test videos on the host, where there is no AMediaExtractor (see FileReaderMP4).
+// Returns the access units of the video, each access unit is a list of NALUs with the 0,0,0,1 prefix.
+// .mp4: The first avc1 track, a minimal ISO BMFF parser (stsd/avcC, stsz, stsc, stco/co64).
+// The SPS / PPS of the avcC box are prepended to the first access unit.
+// .h264: Annex B byte stream, each NALU is one access unit.
+namespace VideoFileReader{
+    typedef std::vector<std::vector<uint8_t>> AccessUnit;
+
+    static std::vector<uint8_t> readFile(const std::string& filename){
+        std::ifstream file(filename,std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),std::istreambuf_iterator<char>());
+    }
+    static uint32_t readU32(const uint8_t* p){
+        return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+    }
+    static uint64_t readU64(const uint8_t* p){
+        return ((uint64_t)readU32(p)<<32) | readU32(p+4);
+    }
+    static uint16_t readU16(const uint8_t* p){
+        return (uint16_t)((p[0]<<8) | p[1]);
+    }
+    static std::vector<uint8_t> withPrefix(const uint8_t* data,const size_t length){
+        std::vector<uint8_t> ret(4+length,0);
+        ret[3]=1;
+        std::memcpy(&ret[4],data,length);
+        return ret;
+    }
+
+    struct Box{
+        const uint8_t* payload;
+        size_t payloadLength;
+    };
+    // Returns the first child box of the given type in [data,data+length)
+    static std::optional<Box> findBox(const uint8_t* data,const size_t length,const char* type){
+        size_t offset=0;
+        while(offset+8<=length){
+            uint64_t size=readU32(&data[offset]);
+            size_t headerSize=8;
+            if(size==1 && offset+16<=length){
+                size=readU64(&data[offset+8]);
+                headerSize=16;
+            }else if(size==0){
+                size=length-offset;
+            }
+            if(size<headerSize || offset+size>length)return std::nullopt;
+            if(std::memcmp(&data[offset+4],type,4)==0){
+                return Box{&data[offset+headerSize],(size_t)size-headerSize};
+            }
+            offset+=size;
+        }
+        return std::nullopt;
+    }
+    // Same as above, following the path of box types
+    static std::optional<Box> findBox(const uint8_t* data,const size_t length,const std::vector<const char*>& path){
+        Box box{data,length};
+        for(const auto type:path){
+            const auto child=findBox(box.payload,box.payloadLength,type);
+            if(!child)return std::nullopt;
+            box=*child;
+        }
+        return box;
+    }
+
+    static std::optional<std::vector<AccessUnit>> readMP4(const std::vector<uint8_t>& file){
+        const auto moov=findBox(file.data(),file.size(),"moov");
+        if(!moov)return std::nullopt;
+        // Find the first track with an avc1 sample entry
+        size_t offset=0;
+        while(offset<moov->payloadLength){
+            const auto trak=findBox(moov->payload+offset,moov->payloadLength-offset,"trak");
+            if(!trak)return std::nullopt;
+            offset=trak->payload+trak->payloadLength-moov->payload;
+            const auto stbl=findBox(trak->payload,trak->payloadLength,{"mdia","minf","stbl"});
+            if(!stbl)continue;
+            const auto stsd=findBox(stbl->payload,stbl->payloadLength,"stsd");
+            // version / flags, entry count
+            if(!stsd || stsd->payloadLength<8)continue;
+            const auto avc1=findBox(stsd->payload+8,stsd->payloadLength-8,"avc1");
+            // The child boxes follow the 78 bytes of the VisualSampleEntry
+            if(!avc1 || avc1->payloadLength<78)continue;
+            const auto avcC=findBox(avc1->payload+78,avc1->payloadLength-78,"avcC");
+            const auto stsz=findBox(stbl->payload,stbl->payloadLength,"stsz");
+            const auto stsc=findBox(stbl->payload,stbl->payloadLength,"stsc");
+            auto chunkOffsetBox=findBox(stbl->payload,stbl->payloadLength,"stco");
+            const bool co64=!chunkOffsetBox;
+            if(co64){
+                chunkOffsetBox=findBox(stbl->payload,stbl->payloadLength,"co64");
+            }
+            if(!avcC || avcC->payloadLength<7 || !stsz || stsz->payloadLength<12 || !stsc || stsc->payloadLength<8 ||
+               !chunkOffsetBox || chunkOffsetBox->payloadLength<8){
+                return std::nullopt;
+            }
+            // avcC: length size and parameter sets
+            const uint8_t* p=avcC->payload;
+            const uint8_t* const avcCEnd=avcC->payload+avcC->payloadLength;
+            const int lengthSize=(p[4] & 3)+1;
+            AccessUnit parameterSets;
+            int nSets=p[5] & 0x1f;
+            p+=6;
+            for(int pps=0;pps<2;pps++){
+                for(int i=0;i<nSets && p+2<=avcCEnd;i++){
+                    const uint16_t len=readU16(p);
+                    if(p+2+len>avcCEnd)return std::nullopt;
+                    parameterSets.push_back(withPrefix(p+2,len));
+                    p+=2+len;
+                }
+                if(pps==0){
+                    if(p>=avcCEnd)break;
+                    nSets=*p++;
+                }
+            }
+            // Sample sizes
+            const uint32_t constantSampleSize=readU32(stsz->payload+4);
+            const uint32_t nSamples=readU32(stsz->payload+8);
+            if(constantSampleSize==0 && stsz->payloadLength<12+4*(size_t)nSamples)return std::nullopt;
+            // Chunk offsets
+            const uint32_t nChunks=readU32(chunkOffsetBox->payload+4);
+            if(chunkOffsetBox->payloadLength<8+(co64 ? 8 : 4)*(size_t)nChunks)return std::nullopt;
+            // Samples per chunk, run length coded
+            const uint32_t nEntries=readU32(stsc->payload+4);
+            if(stsc->payloadLength<8+12*(size_t)nEntries)return std::nullopt;
+            std::vector<AccessUnit> ret;
+            uint32_t sample=0;
+            for(uint32_t entry=0;entry<nEntries;entry++){
+                const uint8_t* e=stsc->payload+8+12*entry;
+                const uint32_t firstChunk=readU32(e);
+                const uint32_t samplesPerChunk=readU32(e+4);
+                const uint32_t lastChunk=entry+1<nEntries ? readU32(e+12)-1 : nChunks;
+                for(uint32_t chunk=firstChunk;chunk<=lastChunk && chunk>=1 && chunk<=nChunks;chunk++){
+                    const uint8_t* o=chunkOffsetBox->payload+8+(co64 ? 8 : 4)*(chunk-1);
+                    uint64_t sampleOffset=co64 ? readU64(o) : readU32(o);
+                    for(uint32_t i=0;i<samplesPerChunk && sample<nSamples;i++,sample++){
+                        const uint32_t sampleSize=constantSampleSize!=0 ? constantSampleSize : readU32(stsz->payload+12+4*sample);
+                        if(sampleOffset+sampleSize>file.size())return std::nullopt;
+                        // Length prefixed NALUs
+                        AccessUnit accessUnit=ret.empty() ? parameterSets : AccessUnit{};
+                        size_t naluOffset=0;
+                        while(naluOffset+lengthSize<=sampleSize){
+                            const uint8_t* n=&file[sampleOffset+naluOffset];
+                            uint32_t naluLength=0;
+                            for(int b=0;b<lengthSize;b++){
+                                naluLength=(naluLength<<8) | n[b];
+                            }
+                            if(naluOffset+lengthSize+naluLength>sampleSize)break;
+                            accessUnit.push_back(withPrefix(n+lengthSize,naluLength));
+                            naluOffset+=lengthSize+naluLength;
+                        }
+                        ret.push_back(std::move(accessUnit));
+                        sampleOffset+=sampleSize;
+                    }
+                }
+            }
+            return ret;
+        }
+        return std::nullopt;
+    }
+
+    static std::vector<AccessUnit> readAnnexB(const std::vector<uint8_t>& file){
+        std::vector<AccessUnit> ret;
+        // Start of the current NALU (after the start code), 0 == none
+        size_t naluBegin=0;
+        for(size_t i=0;i+3<=file.size();i++){
+            if(file[i]==0 && file[i+1]==0 && file[i+2]==1){
+                if(naluBegin!=0){
+                    // A 4 byte start code belongs to the next NALU
+                    const size_t end=(i>0 && file[i-1]==0) ? i-1 : i;
+                    ret.push_back({withPrefix(&file[naluBegin],end-naluBegin)});
+                }
+                naluBegin=i+3;
+                i+=2;
+            }
+        }
+        if(naluBegin!=0 && naluBegin<file.size()){
+            ret.push_back({withPrefix(&file[naluBegin],file.size()-naluBegin)});
+        }
+        return ret;
+    }
+
+    // Returns std::nullopt if the file cannot be read / is not supported
+    static std::optional<std::vector<AccessUnit>> readAccessUnits(const std::string& filename){
+        const auto file=readFile(filename);
+        if(file.empty())return std::nullopt;
+        const auto endsWith=[&filename](const std::string& suffix){
+            return filename.size()>=suffix.size() && filename.compare(filename.size()-suffix.size(),suffix.size(),suffix)==0;
+        };
+        if(endsWith(".mp4")){
+            return readMP4(file);
+        }
+        if(endsWith(".h264")){
+            auto ret=readAnnexB(file);
+            if(ret.empty())return std::nullopt;
+            return ret;
+        }
+        return std::nullopt;
+    }
+}
+
+#endif //LIVEVIDEO10MS_VIDEOFILEREADER_HPP
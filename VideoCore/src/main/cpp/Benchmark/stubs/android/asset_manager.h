@@ -0,0 +1,21 @@
+// Host build only (see Benchmark/CMakeLists.txt): What FileReaderFPV needs to compile. Only declared,
+// the host builds do not read assets
+
+#ifndef BENCHMARK_STUB_ASSET_MANAGER_H
+#define BENCHMARK_STUB_ASSET_MANAGER_H
+
+#include <sys/types.h>
+
+struct AAssetManager;
+struct AAsset;
+
+enum{
+    AASSET_MODE_BUFFER=3
+};
+
+AAsset* AAssetManager_open(AAssetManager* mgr,const char* filename,int mode);
+int AAsset_read(AAsset* asset,void* buf,size_t count);
+off_t AAsset_seek(AAsset* asset,off_t offset,int whence);
+void AAsset_close(AAsset* asset);
+
+#endif //BENCHMARK_STUB_ASSET_MANAGER_H
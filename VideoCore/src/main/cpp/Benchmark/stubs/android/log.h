@@ -0,0 +1,32 @@
+// Host build only (see Benchmark/CMakeLists.txt): __android_log_print() prints to stderr
+
+#ifndef BENCHMARK_STUB_ANDROID_LOG_H
+#define BENCHMARK_STUB_ANDROID_LOG_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef enum android_LogPriority{
+    ANDROID_LOG_UNKNOWN=0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT,
+} android_LogPriority;
+
+static inline int __android_log_print(int prio,const char* tag,const char* fmt,...){
+    if(prio<ANDROID_LOG_DEBUG)return 0;
+    va_list args;
+    va_start(args,fmt);
+    fprintf(stderr,"%s: ",tag);
+    const int ret=vfprintf(stderr,fmt,args);
+    fprintf(stderr,"\n");
+    va_end(args);
+    return ret;
+}
+
+#endif //BENCHMARK_STUB_ANDROID_LOG_H
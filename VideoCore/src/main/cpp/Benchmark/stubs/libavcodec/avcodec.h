@@ -0,0 +1,17 @@
+// Host build only (see Benchmark/CMakeLists.txt): H264Parser only keeps (unused) pointers to these types.
+// If libavcodec is installed on the host (BENCHMARK_WITH_FFMPEG) the real header is used instead
+
+#ifdef BENCHMARK_WITH_FFMPEG
+#include_next <libavcodec/avcodec.h>
+#else
+
+#ifndef BENCHMARK_STUB_AVCODEC_H
+#define BENCHMARK_STUB_AVCODEC_H
+
+typedef struct AVCodec AVCodec;
+typedef struct AVCodecContext AVCodecContext;
+typedef struct AVCodecParserContext AVCodecParserContext;
+typedef struct AVPacket AVPacket;
+
+#endif //BENCHMARK_STUB_AVCODEC_H
+#endif //BENCHMARK_WITH_FFMPEG
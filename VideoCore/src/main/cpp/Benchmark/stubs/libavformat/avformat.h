@@ -0,0 +1 @@
+// Host build only (see Benchmark/CMakeLists.txt)
@@ -0,0 +1,62 @@
+// Host build only (see Benchmark/CMakeLists.txt): A codec that does not decode anything.
+// Creating, configuring, starting, stopping and deleting it takes the time set in StubMediaCodec::costs,
+// such that the decoder restart (see DecoderManager) can be measured without a phone
+
+#ifndef BENCHMARK_STUB_NDK_MEDIA_CODEC_H
+#define BENCHMARK_STUB_NDK_MEDIA_CODEC_H
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+typedef enum{
+    AMEDIA_OK=0,
+    AMEDIA_ERROR_UNKNOWN=-10000,
+} media_status_t;
+
+struct AMediaFormat;
+struct ANativeWindow;
+struct AMediaCrypto;
+struct AMediaCodec{
+    bool started=false;
+};
+
+namespace StubMediaCodec{
+    struct Costs{
+        std::chrono::microseconds create{0};
+        std::chrono::microseconds configure{0};
+        std::chrono::microseconds start{0};
+        std::chrono::microseconds stop{0};
+        std::chrono::microseconds destroy{0};
+    };
+    inline Costs costs;
+}
+
+static inline AMediaCodec* AMediaCodec_createDecoderByType(const char* /*mime*/){
+    std::this_thread::sleep_for(StubMediaCodec::costs.create);
+    return new AMediaCodec();
+}
+static inline AMediaCodec* AMediaCodec_createCodecByName(const char* name){
+    return AMediaCodec_createDecoderByType(name);
+}
+static inline media_status_t AMediaCodec_configure(AMediaCodec* /*codec*/,const AMediaFormat* /*format*/,ANativeWindow* /*surface*/,AMediaCrypto* /*crypto*/,uint32_t /*flags*/){
+    std::this_thread::sleep_for(StubMediaCodec::costs.configure);
+    return AMEDIA_OK;
+}
+static inline media_status_t AMediaCodec_start(AMediaCodec* codec){
+    std::this_thread::sleep_for(StubMediaCodec::costs.start);
+    codec->started=true;
+    return AMEDIA_OK;
+}
+static inline media_status_t AMediaCodec_stop(AMediaCodec* codec){
+    std::this_thread::sleep_for(StubMediaCodec::costs.stop);
+    codec->started=false;
+    return AMEDIA_OK;
+}
+static inline media_status_t AMediaCodec_delete(AMediaCodec* codec){
+    std::this_thread::sleep_for(StubMediaCodec::costs.destroy);
+    delete codec;
+    return AMEDIA_OK;
+}
+
+#endif //BENCHMARK_STUB_NDK_MEDIA_CODEC_H
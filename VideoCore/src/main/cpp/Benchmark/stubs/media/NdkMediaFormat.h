@@ -0,0 +1,17 @@
+// Host build only (see Benchmark/CMakeLists.txt): What KeyFrameFinder needs to compile, the format is never used on the host
+
+#ifndef BENCHMARK_STUB_NDK_MEDIA_FORMAT_H
+#define BENCHMARK_STUB_NDK_MEDIA_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct AMediaFormat;
+
+static const char* const AMEDIAFORMAT_KEY_WIDTH="width";
+static const char* const AMEDIAFORMAT_KEY_HEIGHT="height";
+
+static inline void AMediaFormat_setInt32(AMediaFormat* /*format*/,const char* /*name*/,int32_t /*value*/){}
+static inline void AMediaFormat_setBuffer(AMediaFormat* /*format*/,const char* /*name*/,const void* /*data*/,size_t /*size*/){}
+
+#endif //BENCHMARK_STUB_NDK_MEDIA_FORMAT_H
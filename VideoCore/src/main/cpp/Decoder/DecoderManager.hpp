@@ -0,0 +1,110 @@
+#ifndef LIVEVIDEO10MS_DECODERMANAGER_HPP
+#define LIVEVIDEO10MS_DECODERMANAGER_HPP
+
+#include <media/NdkMediaCodec.h>
+#include <AndroidLogger.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Creates and deletes the AMediaCodec instances of LowLagDecoder.
+// Creating a codec (allocating the hw component) and deleting one takes up to a couple of hundred ms on some devices.
+// When the video format changes (H264 <-> H265, resolution) the codec for the new format can be created on a background
+// thread with prepare() while the current one keeps decoding. The switch then only costs stop / configure / start.
+// A codec that was stopped (and therefore disconnected from the surface) is deleted on a background thread by retire(),
+// such that the next codec can be configured with the same ANativeWindow right away.
+// Not thread safe, only used by the thread feeding the decoder (with mMutexInputPipe locked)
+class DecoderManager{
+public:
+    DecoderManager()=default;
+    DecoderManager(const DecoderManager&)=delete;
+    DecoderManager& operator=(const DecoderManager&)=delete;
+    ~DecoderManager(){
+        flush();
+    }
+    static const char* getMime(const bool isH265){
+        return isH265 ? "video/hevc" : "video/avc";
+    }
+    // Start creating a codec for the next format. Does nothing if a codec for this mime is prepared already
+    void prepare(const bool isH265,const bool useSwDecoder){
+        const std::string mime=getMime(isH265);
+        if(mPrepareThread && mPreparedMime==mime && mPreparedSw==useSwDecoder)return;
+        discardPrepared();
+        mPreparedMime=mime;
+        mPreparedSw=useSwDecoder;
+        mPrepareThread=std::make_unique<std::thread>([this,mime,useSwDecoder]{
+            mPrepared=create(mime,useSwDecoder);
+        });
+    }
+    // True if acquire() with these arguments returns the codec from prepare() (it might still be created)
+    bool isPrepared(const bool isH265,const bool useSwDecoder)const{
+        return mPrepareThread!=nullptr && mPreparedMime==getMime(isH265) && mPreparedSw==useSwDecoder;
+    }
+    // Returns the prepared codec (waits until it is created) or creates one on the calling thread.
+    // The codec is not configured yet. nullptr on failure
+    AMediaCodec* acquire(const bool isH265,const bool useSwDecoder){
+        AMediaCodec* ret=nullptr;
+        if(isPrepared(isH265,useSwDecoder)){
+            mPrepareThread->join();
+            mPrepareThread.reset();
+            ret=mPrepared;
+            mPrepared=nullptr;
+        }else{
+            discardPrepared();
+        }
+        if(ret==nullptr){
+            ret=create(getMime(isH265),useSwDecoder);
+        }
+        if(ret==nullptr){
+            // Most likely there are too many codec instances, wait until the retired ones are deleted
+            waitForRetired();
+            ret=create(getMime(isH265),useSwDecoder);
+        }
+        return ret;
+    }
+    // The codec has to be stopped (AMediaCodec_stop) already. Deleted on a background thread
+    void retire(AMediaCodec* codec){
+        if(codec==nullptr)return;
+        waitForRetired();
+        mRetireThread=std::make_unique<std::thread>([codec]{
+            AMediaCodec_delete(codec);
+        });
+    }
+    // Wait until all retired codecs are deleted and delete the prepared one
+    void flush(){
+        discardPrepared();
+        waitForRetired();
+    }
+private:
+    std::unique_ptr<std::thread> mPrepareThread;
+    std::string mPreparedMime;
+    bool mPreparedSw=false;
+    // Written by mPrepareThread, read after joining it
+    AMediaCodec* mPrepared=nullptr;
+    std::unique_ptr<std::thread> mRetireThread;
+    static AMediaCodec* create(const std::string& mime,const bool useSwDecoder){
+        AMediaCodec* ret=useSwDecoder ? AMediaCodec_createCodecByName("OMX.google.h264.decoder") :
+                AMediaCodec_createDecoderByType(mime.c_str());
+        if(ret==nullptr){
+            MLOGE<<"Cannot create decoder for "<<mime;
+        }
+        return ret;
+    }
+    void discardPrepared(){
+        if(!mPrepareThread)return;
+        mPrepareThread->join();
+        mPrepareThread.reset();
+        if(mPrepared!=nullptr){
+            AMediaCodec_delete(mPrepared);
+            mPrepared=nullptr;
+        }
+    }
+    void waitForRetired(){
+        if(!mRetireThread)return;
+        mRetireThread->join();
+        mRetireThread.reset();
+    }
+};
+
+#endif //LIVEVIDEO10MS_DECODERMANAGER_HPP
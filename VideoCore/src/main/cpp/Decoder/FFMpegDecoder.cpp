@@ -0,0 +1,82 @@
+#include "FFMpegDecoder.h"
+#include <AndroidLogger.hpp>
+
+FFMpegDecoder::FFMpegDecoder(FRAME_CALLBACK onFrameCallback):onFrameCallback(std::move(onFrameCallback)){
+}
+
+FFMpegDecoder::~FFMpegDecoder(){
+    close();
+}
+
+bool FFMpegDecoder::open(const bool isH265,const int nThreads){
+    close();
+    const AVCodec* codec=avcodec_find_decoder(isH265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+    if(codec==nullptr){
+        MLOGE<<"No libavcodec decoder for "<<(isH265 ? "H265" : "H264");
+        return false;
+    }
+    mContext=avcodec_alloc_context3(codec);
+    mContext->thread_type=FF_THREAD_SLICE;
+    mContext->thread_count=nThreads;
+    mContext->flags|=AV_CODEC_FLAG_LOW_DELAY;
+    // Allow non spec compliant speedups
+    mContext->flags2|=AV_CODEC_FLAG2_FAST;
+    const int ret=avcodec_open2(mContext,codec,nullptr);
+    if(ret<0){
+        MLOGE<<"avcodec_open2 failed "<<ret;
+        avcodec_free_context(&mContext);
+        return false;
+    }
+    mPacket=av_packet_alloc();
+    mFrame=av_frame_alloc();
+    mIsH265=isH265;
+    nDecodedFrames=0;
+    nDecodingErrors=0;
+    MLOGD<<"Opened "<<codec->name<<" with "<<mContext->thread_count<<" slice threads";
+    return true;
+}
+
+void FFMpegDecoder::close(){
+    if(mContext!=nullptr){
+        avcodec_free_context(&mContext);
+    }
+    if(mPacket!=nullptr){
+        av_packet_free(&mPacket);
+    }
+    if(mFrame!=nullptr){
+        av_frame_free(&mFrame);
+    }
+}
+
+bool FFMpegDecoder::decode(const uint8_t* data,const size_t length,const std::chrono::steady_clock::time_point creationTime){
+    if(mContext==nullptr)return false;
+    // Not reference counted, avcodec_send_packet() copies the data (and adds the padding libavcodec needs)
+    mPacket->data=const_cast<uint8_t*>(data);
+    mPacket->size=(int)length;
+    // Comes back as the pts of the frame, no re-ordering in low delay mode
+    mPacket->pts=creationTime.time_since_epoch().count();
+    int ret=avcodec_send_packet(mContext,mPacket);
+    mPacket->data=nullptr;
+    mPacket->size=0;
+    if(ret<0){
+        nDecodingErrors++;
+        MLOGD<<"avcodec_send_packet "<<ret;
+        return false;
+    }
+    while(true){
+        ret=avcodec_receive_frame(mContext,mFrame);
+        if(ret==AVERROR(EAGAIN) || ret==AVERROR_EOF){
+            break;
+        }
+        if(ret<0){
+            nDecodingErrors++;
+            MLOGD<<"avcodec_receive_frame "<<ret;
+            return false;
+        }
+        nDecodedFrames++;
+        const auto creationTime=std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(mFrame->pts));
+        onFrameCallback(mFrame,creationTime);
+        av_frame_unref(mFrame);
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef LIVEVIDEO10MS_FFMPEGDECODER_H
+#define LIVEVIDEO10MS_FFMPEGDECODER_H
+
+#include <chrono>
+#include <functional>
+#include "../NALU/NALU.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Decodes H264 / H265 on the CPU with libavcodec. No android dependencies, such that it can be used in the host benchmark, too.
+// Tuned for latency, not throughput:
+// Slice threading (a frame with n slices is decoded by up to n threads). Frame threading would hold back one frame per thread.
+// AV_CODEC_FLAG_LOW_DELAY: a frame is output as soon as it is decoded (no re-ordering, fine for streams without b-frames).
+// Each call to decode() should contain one whole access unit (see AccessUnitAssembler), parameter sets can be passed on their own.
+class FFMpegDecoder{
+public:
+    // The frame is only valid during the callback.
+    // creationTime: NALU::creationTime of the access unit the frame was decoded from
+    typedef std::function<void(const AVFrame* frame,std::chrono::steady_clock::time_point creationTime)> FRAME_CALLBACK;
+    explicit FFMpegDecoder(FRAME_CALLBACK onFrameCallback);
+    FFMpegDecoder(const FFMpegDecoder&)=delete;
+    FFMpegDecoder& operator=(const FFMpegDecoder&)=delete;
+    ~FFMpegDecoder();
+    // nThreads: n of slice threads, 0 == one per cpu core. Returns false if the codec is not available
+    bool open(bool isH265,int nThreads=0);
+    void close();
+    bool isOpen()const{
+        return mContext!=nullptr;
+    }
+    bool isH265()const{
+        return mIsH265;
+    }
+    // Send the data to the decoder and call the frame callback for each frame that became available.
+    // Returns false if libavcodec rejected the data (e.g. a frame that references a lost one)
+    bool decode(const NALU& nalu){
+        return decode(nalu.getData(),nalu.getSize(),nalu.creationTime);
+    }
+    bool decode(const uint8_t* data,size_t length,std::chrono::steady_clock::time_point creationTime);
+    // n of frames output since open()
+    long nDecodedFrames=0;
+    long nDecodingErrors=0;
+private:
+    const FRAME_CALLBACK onFrameCallback;
+    AVCodecContext* mContext=nullptr;
+    AVPacket* mPacket=nullptr;
+    AVFrame* mFrame=nullptr;
+    bool mIsH265=false;
+};
+
+#endif //LIVEVIDEO10MS_FFMPEGDECODER_H
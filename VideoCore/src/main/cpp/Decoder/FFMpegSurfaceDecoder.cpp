@@ -0,0 +1,203 @@
+#include "FFMpegSurfaceDecoder.h"
+#include "../IDV.hpp"
+#include <android/native_window_jni.h>
+#include <AndroidLogger.hpp>
+#include <LatencyTrace.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <sstream>
+
+using namespace std::chrono;
+
+FFMpegSurfaceDecoder::FFMpegSurfaceDecoder(){
+    resetStatistics();
+}
+
+FFMpegSurfaceDecoder::~FFMpegSurfaceDecoder(){
+    std::lock_guard<std::mutex> lock(mMutexInputPipe);
+    mDecoder.close();
+    if(window!=nullptr){
+        ANativeWindow_release(window);
+        window=nullptr;
+    }
+}
+
+void FFMpegSurfaceDecoder::setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings){
+    mNThreads=videoSettings.getInt(IDV::VS_FFMPEG_DECODER_THREADS,0);
+    std::lock_guard<std::mutex> lock(mMutexInputPipe);
+    if(surface==nullptr){
+        if(window==nullptr){
+            return;
+        }
+        inputPipeClosed=true;
+        mDecoder.close();
+        mAccessUnitAssembler.reset();
+        ANativeWindow_release(window);
+        window=nullptr;
+        mBuffersRatio={};
+        resetStatistics();
+    }else{
+        assert(window==nullptr);
+        window=ANativeWindow_fromSurface(env,surface);
+        inputPipeClosed=false;
+    }
+}
+
+void FFMpegSurfaceDecoder::registerOnDecoderRatioChangedCallback(DECODER_RATIO_CHANGED decoderRatioChangedC){
+    onDecoderRatioChangedCallback=std::move(decoderRatioChangedC);
+}
+
+void FFMpegSurfaceDecoder::registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_CALLBACK decodingInfoChangedCallback){
+    onDecodingInfoChangedCallback=std::move(decodingInfoChangedCallback);
+}
+
+void FFMpegSurfaceDecoder::interpretNALU(const NALU& nalu){
+    std::lock_guard<std::mutex> lock(mMutexInputPipe);
+    decodingInfo.nNALU++;
+    if(nalu.getSize()<=4){
+        return;
+    }
+    if(nalu.isSPS() || nalu.isPPS() || (nalu.IS_H265_PACKET && nalu.isVPS())){
+        if(nalu.IS_H265_PACKET!=mParameterSetsH265){
+            mParameterSets.clear();
+            mParameterSetsH265=nalu.IS_H265_PACKET;
+        }
+        mParameterSets[nalu.get_nal_unit_type()].assign(nalu.getData(),nalu.getData()+nalu.getSize());
+    }
+    if(inputPipeClosed){
+        return;
+    }
+    mAccessUnitAssembler.addNALU(nalu);
+}
+
+void FFMpegSurfaceDecoder::decodeAccessUnit(const NALU& accessUnit,const int nNALUs){
+    if(!mDecoder.isOpen() || mDecoder.isH265()!=accessUnit.IS_H265_PACKET){
+        if(!mDecoder.open(accessUnit.IS_H265_PACKET,mNThreads)){
+            return;
+        }
+        mWaitingForKeyFrame=true;
+        if(mParameterSetsH265==accessUnit.IS_H265_PACKET){
+            // VPS, SPS, PPS (ascending NALU types)
+            for(const auto& parameterSet:mParameterSets){
+                mDecoder.decode(parameterSet.second.data(),parameterSet.second.size(),steady_clock::now());
+            }
+        }
+    }
+    const bool isParameterSet=accessUnit.isSPS() || accessUnit.isPPS() || (accessUnit.IS_H265_PACKET && accessUnit.isVPS());
+    if(!isParameterSet && mWaitingForKeyFrame){
+        if(!accessUnit.isKeyFrame()){
+            return;
+        }
+        mWaitingForKeyFrame=false;
+    }
+    nNALUBytesFed.add(accessUnit.getSize());
+    const auto now=steady_clock::now();
+    parsingTime.add(now-accessUnit.creationTime);
+    mDecodingLatency.record(DecodingLatency::PARSE,now-accessUnit.creationTime);
+    const auto ptsUs=(uint64_t)duration_cast<microseconds>(accessUnit.creationTime.time_since_epoch()).count();
+    LatencyTrace::stampQueuedToCodec(accessUnit.creationTime,ptsUs);
+    mDecodeBegin=now;
+    if(mDecoder.decode(accessUnit)){
+        decodingInfo.nNALUSFeeded++;
+        nNALUsInFedBuffers.add(nNALUs);
+    }
+    recalculateDecodingInfoIfNeeded();
+}
+
+static void copyPlane(uint8_t* dst,const int dstStride,const uint8_t* src,const int srcStride,const int width,const int height){
+    for(int i=0;i<height;i++){
+        std::memcpy(&dst[i*dstStride],&src[i*srcStride],(size_t)width);
+    }
+}
+
+void FFMpegSurfaceDecoder::onFrame(const AVFrame* frame,const steady_clock::time_point creationTime){
+    decodingTime.add(steady_clock::now()-mDecodeBegin);
+    if(frame->format!=AV_PIX_FMT_YUV420P && frame->format!=AV_PIX_FMT_YUVJ420P){
+        if(!mLoggedUnsupportedFormat){
+            MLOGE<<"Unsupported pixel format "<<frame->format;
+            mLoggedUnsupportedFormat=true;
+        }
+        return;
+    }
+    const auto renderBegin=steady_clock::now();
+    const VideoRatio ratio{frame->width,frame->height};
+    if(ratio!=mBuffersRatio){
+        ANativeWindow_setBuffersGeometry(window,frame->width,frame->height,WINDOW_FORMAT_YV12);
+        mBuffersRatio=ratio;
+        MLOGD<<"Surface buffers "<<frame->width<<"x"<<frame->height<<" YV12";
+        if(onDecoderRatioChangedCallback!=nullptr){
+            onDecoderRatioChangedCallback(ratio);
+        }
+    }
+    ANativeWindow_Buffer buffer;
+    // Blocks if all buffers of the surface are queued for display
+    if(ANativeWindow_lock(window,&buffer,nullptr)!=0){
+        MLOGE<<"Cannot lock surface";
+        return;
+    }
+    // YV12: Y plane, then the V (Cr) plane, then the U (Cb) plane.
+    // The chroma stride is half the luma stride aligned to 16 bytes, the chroma height half the height
+    auto* dst=(uint8_t*)buffer.bits;
+    const int yStride=buffer.stride;
+    const int cStride=((yStride/2)+15) & ~15;
+    const int width=std::min(frame->width,buffer.width);
+    const int height=std::min(frame->height,buffer.height);
+    uint8_t* dstV=dst+yStride*buffer.height;
+    uint8_t* dstU=dstV+cStride*(buffer.height/2);
+    copyPlane(dst,yStride,frame->data[0],frame->linesize[0],width,height);
+    copyPlane(dstV,cStride,frame->data[2],frame->linesize[2],(width+1)/2,height/2);
+    copyPlane(dstU,cStride,frame->data[1],frame->linesize[1],(width+1)/2,height/2);
+    ANativeWindow_unlockAndPost(window);
+    LatencyTrace::stampReleasedFromCodec((uint64_t)duration_cast<microseconds>(creationTime.time_since_epoch()).count());
+    const auto renderEnd=steady_clock::now();
+    renderTime.add(renderEnd-renderBegin);
+    mDecodingLatency.record(DecodingLatency::DECODE,renderEnd-mDecodeBegin);
+    mDecodingLatency.record(DecodingLatency::TOTAL,renderEnd-creationTime);
+    nDecodedFrames.add(1);
+}
+
+void FFMpegSurfaceDecoder::recalculateDecodingInfoIfNeeded(){
+    const auto now=steady_clock::now();
+    const auto delta=now-decodingInfo.lastCalculation;
+    if(delta<=DECODING_INFO_RECALCULATION_INTERVAL){
+        return;
+    }
+    decodingInfo.lastCalculation=now;
+    decodingInfo.currentFPS=(float)nDecodedFrames.getDeltaSinceLastCall()/(float)duration_cast<seconds>(delta).count();
+    decodingInfo.currentKiloBitsPerSecond=((float)nNALUBytesFed.getDeltaSinceLastCall()/duration_cast<seconds>(delta).count())/1024.0f*8.0f;
+    decodingInfo.avgParsingTime_ms=parsingTime.getAvg_ms();
+    decodingInfo.avgWaitForInputBTime_ms=0;
+    // Until the frame is visible to the compositor, like the MediaCodec decoding time
+    decodingInfo.avgDecodingTime_ms=decodingTime.getAvg_ms()+renderTime.getAvg_ms();
+    decodingInfo.nDecodedFrames=nDecodedFrames.getAbsolute();
+    decodingInfo.feedAccessUnits=true;
+    decodingInfo.asyncDecoding=false;
+    if(decodingInfo.nNALUSFeeded>0){
+        decodingInfo.avgNALUsPerInputBuffer=(float)nNALUsInFedBuffers.getAbsolute()/(float)decodingInfo.nNALUSFeeded;
+    }
+    if(now-lastLog>TIME_BETWEEN_LOGS){
+        lastLog=now;
+        std::ostringstream log;
+        log<<std::fixed<<"......................FFMpeg Decoding Latency Averages......................"
+           <<"\nParsing:"<<decodingInfo.avgParsingTime_ms<<" | Decoding:"<<decodingTime.getAvg_ms()<<" | Render:"<<renderTime.getAvg_ms()
+           <<"\nN NALUS:"<<decodingInfo.nNALU<<" | N access units decoded:"<<decodingInfo.nNALUSFeeded<<" | N Decoded Frames:"<<nDecodedFrames.getAbsolute()
+           <<" | Errors:"<<mDecoder.nDecodingErrors<<"\nFPS:"<<decodingInfo.currentFPS
+           <<"\n"<<mDecodingLatency.toString();
+        MLOGD<<log.str();
+    }
+    if(onDecodingInfoChangedCallback!=nullptr){
+        onDecodingInfoChangedCallback(decodingInfo);
+    }
+}
+
+void FFMpegSurfaceDecoder::resetStatistics(){
+    nDecodedFrames.reset();
+    nNALUBytesFed.reset();
+    nNALUsInFedBuffers.reset();
+    parsingTime.reset();
+    decodingTime.reset();
+    renderTime.reset();
+    mDecodingLatency.reset();
+    decodingInfo={};
+}
@@ -0,0 +1,79 @@
+#ifndef LIVEVIDEO10MS_FFMPEGSURFACEDECODER_H
+#define LIVEVIDEO10MS_FFMPEGSURFACEDECODER_H
+
+#include <android/native_window.h>
+#include <jni.h>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <TimeHelper.hpp>
+#include "IDecoder.hpp"
+#include "FFMpegDecoder.h"
+#include "../NALU/AccessUnitAssembler.hpp"
+
+// CPU only decode path (VS_USE_FFMPEG_DECODER): FFMpegDecoder with slice threading, each frame is copied into a buffer
+// of the output surface (ANativeWindow) as YV12, no color conversion.
+// Decoding and rendering happen on the thread feeding the decoder. The slices are grouped into access units first,
+// a frame is only decoded once all its slices arrived.
+// Compared to LowLagDecoder: no MediaCodec input / output buffer queues, but the decoding time scales with the resolution
+// and the n of cpu cores. Compare avgDecodingTime_ms of the DecodingInfo.
+class FFMpegSurfaceDecoder : public IDecoder{
+public:
+    FFMpegSurfaceDecoder();
+    ~FFMpegSurfaceDecoder() override;
+    void setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings) override;
+    void registerOnDecoderRatioChangedCallback(DECODER_RATIO_CHANGED decoderRatioChangedC) override;
+    void registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_CALLBACK decodingInfoChangedCallback) override;
+    void interpretNALU(const NALU& nalu) override;
+    // No WAIT_FOR_INPUT samples, there are no input buffers
+    const DecodingLatency& getDecodingLatency()const override{
+        return mDecodingLatency;
+    }
+private:
+    // Parameter sets or one access unit, with mMutexInputPipe locked
+    void decodeAccessUnit(const NALU& accessUnit,int nNALUs);
+    // Copy the frame into the next buffer of the surface
+    void onFrame(const AVFrame* frame,std::chrono::steady_clock::time_point creationTime);
+    void recalculateDecodingInfoIfNeeded();
+    void resetStatistics();
+    FFMpegDecoder mDecoder{[this](const AVFrame* frame,const std::chrono::steady_clock::time_point creationTime){
+        onFrame(frame,creationTime);
+    }};
+    AccessUnitAssembler mAccessUnitAssembler{[this](const NALU& accessUnit,const int nNALUs){
+        decodeAccessUnit(accessUnit,nNALUs);
+    }};
+    // Slices are dropped until the first key frame after opening the decoder, they would only decode into garbage
+    bool mWaitingForKeyFrame=true;
+    // The latest VPS / SPS / PPS by NALU type, also while there is no surface.
+    // Fed to the decoder when it is (re-)opened, in case the stream does not repeat them
+    std::map<int,std::vector<uint8_t>> mParameterSets;
+    bool mParameterSetsH265=false;
+    // n of slice threads, 0 == one per cpu core
+    int mNThreads=0;
+    ANativeWindow* window=nullptr;
+    // The input pipe is closed until we set a valid surface
+    bool inputPipeClosed=true;
+    std::mutex mMutexInputPipe;
+    // Size of the surface buffers, set from the first frame of each resolution
+    VideoRatio mBuffersRatio{};
+    bool mLoggedUnsupportedFormat=false;
+    DECODER_RATIO_CHANGED onDecoderRatioChangedCallback=nullptr;
+    DECODING_INFO_CHANGED_CALLBACK onDecodingInfoChangedCallback=nullptr;
+    DecodingInfo decodingInfo;
+    std::chrono::steady_clock::time_point mDecodeBegin;
+    RelativeCalculator nDecodedFrames;
+    RelativeCalculator nNALUBytesFed;
+    RelativeCalculator nNALUsInFedBuffers;
+    AvgCalculator parsingTime;
+    AvgCalculator decodingTime;
+    // Waiting for a free buffer of the surface and copying the frame into it
+    AvgCalculator renderTime;
+    DecodingLatency mDecodingLatency;
+    std::chrono::steady_clock::time_point lastLog=std::chrono::steady_clock::now();
+    static const constexpr auto DECODING_INFO_RECALCULATION_INTERVAL=std::chrono::milliseconds(1000);
+    static constexpr auto TIME_BETWEEN_LOGS=std::chrono::seconds(5);
+    // HAL_PIXEL_FORMAT_YV12 (AHARDWAREBUFFER_FORMAT_YV12), accepted by ANativeWindow_setBuffersGeometry() but not part of the NDK enum
+    static constexpr int32_t WINDOW_FORMAT_YV12=0x32315659;
+};
+
+#endif //LIVEVIDEO10MS_FFMPEGSURFACEDECODER_H
@@ -0,0 +1,118 @@
+#ifndef LIVEVIDEO10MS_IDECODER_HPP
+#define LIVEVIDEO10MS_IDECODER_HPP
+
+#include <jni.h>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <vector>
+#include <SharedPreferences.hpp>
+#include <LatencyHistogram.hpp>
+#include "../NALU/NALU.hpp"
+
+struct DecodingInfo{
+    std::chrono::steady_clock::time_point lastCalculation=std::chrono::steady_clock::now();
+    long nNALU=0;
+    long nNALUSFeeded=0;
+    long nDecodedFrames=0;
+    float currentFPS=0;
+    float currentKiloBitsPerSecond=0;
+    float avgParsingTime_ms=0;
+    float avgWaitForInputBTime_ms=0;
+    float avgDecodingTime_ms=0;
+    // true if one input buffer contains a whole frame (access unit), false if one input buffer contains one NALU.
+    // In access unit mode avgParsingTime_ms includes the time the first slice waits for the rest of the frame
+    bool feedAccessUnits=false;
+    // n of NALUs (slices) fed to the decoder, divided by nNALUSFeeded (n of input buffers)
+    float avgNALUsPerInputBuffer=0;
+    // true if the decoder notifies about free input / output buffers (VS_ASYNC_DECODING, android 9+),
+    // false if they are polled. In async mode avgWaitForInputBTime_ms is only > 0 if the decoder has no free input buffer
+    bool asyncDecoding=false;
+    bool operator==(const DecodingInfo& d2)const{
+        return nNALU==d2.nNALU && nNALUSFeeded==d2.nNALUSFeeded && currentFPS==d2.currentFPS &&
+               currentKiloBitsPerSecond==d2.currentKiloBitsPerSecond && avgParsingTime_ms==d2.avgParsingTime_ms &&
+               avgWaitForInputBTime_ms==d2.avgWaitForInputBTime_ms && avgDecodingTime_ms==d2.avgDecodingTime_ms &&
+               feedAccessUnits==d2.feedAccessUnits && avgNALUsPerInputBuffer==d2.avgNALUsPerInputBuffer &&
+               asyncDecoding==d2.asyncDecoding;
+    }
+    bool operator !=(const DecodingInfo& d2)const{
+        return !(*this==d2);
+    }
+};
+struct VideoRatio{
+    int width=0;
+    int height=0;
+    bool operator==(const VideoRatio& b)const{
+        return width==b.width && height==b.height;
+    }
+    bool operator !=(const VideoRatio& b)const{
+        return !(*this==b);
+    }
+};
+
+// Per frame latency of each decoding stage, the distribution of what DecodingInfo only has the averages of.
+// Recorded by the decoder threads without locking, can be read from any thread
+struct DecodingLatency{
+    enum Stage{
+        PARSE=0,                // NALU::creationTime until the decoder starts feeding it (avgParsingTime_ms)
+        WAIT_FOR_INPUT=1,       // Waiting for a free input buffer (avgWaitForInputBTime_ms)
+        DECODE=2,               // Queued until released / rendered (avgDecodingTime_ms)
+        TOTAL=3,                // NALU::creationTime until released / rendered
+        N_STAGES=4
+    };
+    static constexpr const char* STAGE_NAMES[N_STAGES]={"Parsing","WaitInputBuffer","Decoding","Total"};
+    std::array<LatencyHistogram,N_STAGES> histograms;
+    void record(const Stage stage,const std::chrono::nanoseconds latency){
+        histograms[stage].record(latency);
+    }
+    void reset(){
+        for(auto& histogram:histograms){
+            histogram.reset();
+        }
+    }
+    // In Stage order
+    std::vector<LatencyHistogram::Snapshot> snapshot()const{
+        std::vector<LatencyHistogram::Snapshot> ret;
+        for(const auto& histogram:histograms){
+            ret.push_back(histogram.snapshot());
+        }
+        return ret;
+    }
+    // Stages without samples are skipped
+    std::string toString()const{
+        std::stringstream ss;
+        const auto snapshots=snapshot();
+        for(int i=0;i<N_STAGES;i++){
+            if(snapshots[i].nSamples==0)continue;
+            if(ss.tellp()>0)ss<<"\n";
+            ss<<STAGE_NAMES[i]<<": "<<snapshots[i].toString();
+        }
+        return ss.str();
+    }
+};
+
+// What VideoPlayer needs from a decoder backend:
+// LowLagDecoder: MediaCodec (hw, or the OMX sw decoder with VS_USE_SW_DECODER)
+// FFMpegSurfaceDecoder: libavcodec on the CPU (VS_USE_FFMPEG_DECODER)
+class IDecoder{
+public:
+    //Make sure to do no heavy lifting on the callbacks, they are called from the threads of the decoder
+    //The decoding info callback is called about once per second
+    typedef std::function<void(const DecodingInfo)> DECODING_INFO_CHANGED_CALLBACK;
+    //The decoder ratio callback is called every time the output format changes
+    typedef std::function<void(const VideoRatio)> DECODER_RATIO_CHANGED;
+    virtual ~IDecoder()=default;
+    // This call acquires or releases the output surface
+    // When releasing the surface, the decoder will be stopped if running and any resources will be freed
+    // After releasing the surface it is safe for the android os to delete it
+    virtual void setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings)=0;
+    //register the specified callbacks. Only one can be registered at a time
+    virtual void registerOnDecoderRatioChangedCallback(DECODER_RATIO_CHANGED decoderRatioChangedC)=0;
+    virtual void registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_CALLBACK decodingInfoChangedCallback)=0;
+    // Called for each NALU from the thread feeding the decoder (receiver / parser or the decoder input thread in pipelined mode)
+    virtual void interpretNALU(const NALU& nalu)=0;
+    virtual const DecodingLatency& getDecodingLatency()const=0;
+};
+
+#endif //LIVEVIDEO10MS_IDECODER_HPP
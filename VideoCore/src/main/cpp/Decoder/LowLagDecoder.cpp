@@ -3,7 +3,9 @@
 #include "../IDV.hpp"
 #include <AndroidThreadPrioValues.hpp>
 #include <NDKThreadHelper.hpp>
+#include <LatencyTrace.hpp>
 #include <unistd.h>
+#include <dlfcn.h>
 #include <sstream>
 
 
@@ -14,13 +16,50 @@
 
 using namespace std::chrono;
 
+// AMediaCodec_setAsyncNotifyCallback() and its types are API 28+, but minSdkVersion is 21 - so it is looked up at run time.
+// Same layout as AMediaCodecOnAsyncNotifyCallback
+struct AsyncNotifyCallback{
+    void (*onAsyncInputAvailable)(AMediaCodec* codec,void* userdata,int32_t index);
+    void (*onAsyncOutputAvailable)(AMediaCodec* codec,void* userdata,int32_t index,AMediaCodecBufferInfo* bufferInfo);
+    void (*onAsyncFormatChanged)(AMediaCodec* codec,void* userdata,AMediaFormat* format);
+    void (*onAsyncError)(AMediaCodec* codec,void* userdata,media_status_t error,int32_t actionCode,const char* detail);
+};
+typedef media_status_t (*SET_ASYNC_NOTIFY_CALLBACK)(AMediaCodec* codec,AsyncNotifyCallback callback,void* userdata);
+// actionCode of onAsyncError, same as MediaCodec.CodecException.ACTION_TRANSIENT. 2 means recoverable, anything else fatal
+static constexpr int32_t ACTION_CODE_TRANSIENT=1;
+// nullptr if not available (android < 9)
+static SET_ASYNC_NOTIFY_CALLBACK getSetAsyncNotifyCallback(){
+    static const auto setAsyncNotifyCallback=(SET_ASYNC_NOTIFY_CALLBACK)dlsym(RTLD_DEFAULT,"AMediaCodec_setAsyncNotifyCallback");
+    return setAsyncNotifyCallback;
+}
+
+// VCL NALU (slice of a frame). In access unit mode the first slice decides
+static bool isSlice(const NALU& nalu){
+    const int type=nalu.get_nal_unit_type();
+    if(nalu.IS_H265_PACKET){
+        return type>=H265::NAL_UNIT_CODED_SLICE_TRAIL_N && type<=H265::NAL_UNIT_RESERVED_VCL31;
+    }
+    return type>=NAL_UNIT_TYPE_CODED_SLICE_NON_IDR && type<=NAL_UNIT_TYPE_CODED_SLICE_IDR;
+}
+
 LowLagDecoder::LowLagDecoder(JNIEnv* env){
     env->GetJavaVM(&javaVm);
     resetStatistics();
+    // Called from interpretNALU() (with mMutexInputPipe locked)
+    mKeyFrameFinder.registerOnFormatChangedCallback([this](const KeyFrameFinder::VideoFormat& videoFormat){
+        mReconfigurePending=decoder.configured && videoFormat!=mConfiguredFormat;
+        if(mReconfigurePending){
+            // The new parameter sets usually arrive right before the key frame, start creating the next codec now
+            mDecoderManager.prepare(videoFormat.isH265,USE_SW_DECODER_INSTEAD);
+        }
+    });
 }
 
 void LowLagDecoder::setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings){
     USE_SW_DECODER_INSTEAD=videoSettings.getBoolean(IDV::VS_USE_SW_DECODER);
+    FEED_ACCESS_UNITS=videoSettings.getBoolean(IDV::VS_FEED_ACCESS_UNITS);
+    ASYNC_DECODING=videoSettings.getBoolean(IDV::VS_ASYNC_DECODING);
+    MAX_DECODER_INPUT_LATENCY_MS=videoSettings.getInt(IDV::VS_MAX_DECODER_INPUT_LATENCY_MS,0);
     if(surface==nullptr){
         //MLOGD<<"Set output surface to null";
         //assert(decoder.window!=nullptr);
@@ -31,15 +70,11 @@ void LowLagDecoder::setOutputSurface(JNIEnv* env,jobject surface,SharedPreferenc
         std::lock_guard<std::mutex> lock(mMutexInputPipe);
         inputPipeClosed=true;
         if(decoder.configured){
-            AMediaCodec_stop(decoder.codec);
-            AMediaCodec_delete(decoder.codec);
+            stopDecoder();
             mKeyFrameFinder.reset();
-            decoder.configured=false;
-            if(mCheckOutputThread->joinable()){
-                mCheckOutputThread->join();
-                mCheckOutputThread.reset();
-            }
         }
+        mReconfigurePending=false;
+        mDecoderManager.flush();
         ANativeWindow_release(decoder.window);
         decoder.window=nullptr;
         resetStatistics();
@@ -60,22 +95,27 @@ void LowLagDecoder::registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_
     onDecodingInfoChangedCallback=std::move(decodingInfoChangedCallback);
 }
 
+void LowLagDecoder::registerOnKeyFrameRequestCallback(KEY_FRAME_REQUEST_CALLBACK keyFrameRequestCallback){
+    onKeyFrameRequestCallback=std::move(keyFrameRequestCallback);
+}
+
 void LowLagDecoder::interpretNALU(const NALU& nalu){
-    // TODO: RN switching between h264 / h265 requires re-setting the surface
-    if(decoder.configured){
-        assert(nalu.IS_H265_PACKET==IS_H265);
-    }
-    if(nalu.IS_H265_PACKET){
-        IS_H265=true;
+    if(FEED_ACCESS_UNITS){
+        mAccessUnitAssembler.addNALU(nalu);
     }else{
-        IS_H265=false;
+        // In case the mode was switched while an access unit was incomplete
+        mAccessUnitAssembler.flush();
+        interpretNALUOrAccessUnit(nalu,1);
     }
+}
+
+void LowLagDecoder::interpretNALUOrAccessUnit(const NALU& nalu,const int nNALUs){
     //MLOGD<<"Is H265 "<<nalu.IS_H265_PACKET;
-    MLOGD<<"NALU type "<<nalu.get_nal_name();
+    MLOGV<<"NALU type "<<nalu.get_nal_name();
     //return;
     //we need this lock, since the receiving/parsing/feeding does not run on the same thread who sets the input surface
     std::lock_guard<std::mutex> lock(mMutexInputPipe);
-    decodingInfo.nNALU++;
+    decodingInfo.nNALU+=nNALUs;
     if(nalu.getSize()<=4){
         //No data in NALU (e.g at the beginning of a stream)
         return;
@@ -90,54 +130,96 @@ void LowLagDecoder::interpretNALU(const NALU& nalu){
         mKeyFrameFinder.saveIfKeyFrame(nalu);
         return;
     }
+    if(decoder.configured && mAsyncCodecFailed){
+        // Same as creating it for the first time, except that the parameter sets are known already
+        MLOGE<<"Decoder failed, restarting it";
+        stopDecoder();
+        configureStartDecoder();
+        if(decoder.configured){
+            // Until the next key frame the new decoder can only produce garbage
+            waitForKeyFrame(steady_clock::now());
+        }
+    }
     if(decoder.configured){
+        // Repeated parameter sets only cost a compare. If they change the video format, mReconfigurePending is set
+        mKeyFrameFinder.saveIfKeyFrame(nalu);
+        const bool isParameterSet=nalu.isSPS() || nalu.isPPS() || (nalu.IS_H265_PACKET && nalu.isVPS());
+        if(mReconfigurePending){
+            // The new parameter sets become csd-0 / csd-1. The frames before the key frame still belong to the old format
+            if(isParameterSet){
+                return;
+            }
+            if(nalu.isKeyFrame()){
+                hotRestartDecoder();
+                if(!decoder.configured){
+                    return;
+                }
+            }
+        }
+        // Data of the other codec cannot be decoded, wait until the new parameter sets are complete
+        if(nalu.IS_H265_PACKET!=IS_H265){
+            return;
+        }
         //if(nalu.get_nal_unit_type()==NAL_UNIT_TYPE_SPS || nalu.get_nal_unit_type()==NAL_UNIT_TYPE_PPS || nalu.get_nal_unit_type()==NAL_UNIT_TYPE_SEI){
         //    return;
         //}
         if(nalu.get_nal_unit_type()==NAL_UNIT_TYPE_SEI){
             return;
         }
-        feedDecoder(nalu);
-        decodingInfo.nNALUSFeeded++;
+        if(!admitToDecoder(nalu)){
+            return;
+        }
+        if(feedDecoder(nalu,nNALUs)){
+            decodingInfo.nNALUSFeeded++;
+            // Only recovered once the key frame actually reached the decoder
+            if(mWaitingForKeyFrame && isSlice(nalu) && nalu.isKeyFrame()){
+                mWaitingForKeyFrame=false;
+                std::lock_guard<std::mutex> statsLock(mAdmissionStatsMutex);
+                mAdmissionStats.recoveryTime.add(steady_clock::now()-mWaitingForKeyFrameSince);
+            }
+        }else if(MAX_DECODER_INPUT_LATENCY_MS>0 && isSlice(nalu)){
+            // The decoder could not take it in time
+            {
+                std::lock_guard<std::mutex> statsLock(mAdmissionStatsMutex);
+                mAdmissionStats.nDroppedFrames++;
+            }
+            if(nalu.isReference()){
+                waitForKeyFrame(steady_clock::now());
+            }
+        }
     }else{
         //Store sps,pps, vps(H265 only)
         // As soon as enough data has been buffered to initialize the decoder,do so.
         mKeyFrameFinder.saveIfKeyFrame(nalu);
         if(mKeyFrameFinder.allKeyFramesAvailable()){
-            configureStartDecoder(mKeyFrameFinder.getCSD0(),mKeyFrameFinder.getCSD1());
+            configureStartDecoder();
         }
     }
 }
 
-void LowLagDecoder::configureStartDecoder(const NALU& sps,const NALU& pps){
-    const std::string MIME=IS_H265 ? "video/hevc" : "video/avc";
-    if(USE_SW_DECODER_INSTEAD){
-        decoder.codec = AMediaCodec_createCodecByName("OMX.google.h264.decoder");
-    }else {
-        decoder.codec = AMediaCodec_createDecoderByType(MIME.c_str());
-        //decoder.codec = AMediaCodec_createDecoderByType("video/mjpeg");
-        //const std::string s=(decoder.codec== nullptr ? "No" : "YES");
-        //MDebug::log("Created decoder"+s);
-        //char* name;
-        //AMediaCodec_getName(decoder.codec,&name);
-        //MLOGD("Created decoder %s",name);
-        //AMediaCodec_releaseName(decoder.codec,name);
+void LowLagDecoder::configureStartDecoder(){
+    mConfiguredFormat=*mKeyFrameFinder.getVideoFormat();
+    mReconfigurePending=false;
+    IS_H265=mConfiguredFormat.isH265;
+    const std::string MIME=DecoderManager::getMime(IS_H265);
+    // The prepared one after a format change, else created now
+    decoder.codec=mDecoderManager.acquire(IS_H265,USE_SW_DECODER_INSTEAD);
+    if (decoder.codec== nullptr) {
+        MLOGD<<"Cannot create decoder";
+        //set csd-0 and csd-1 back to 0, maybe they were just faulty but we have better luck with the next ones
+        mKeyFrameFinder.reset();
+        return;
     }
     AMediaFormat* format=AMediaFormat_new();
     AMediaFormat_setString(format,AMEDIAFORMAT_KEY_MIME,MIME.c_str());
     if(IS_H265){
         mKeyFrameFinder.setVPS_SPS_PPS_WIDTH_HEIGHT(format);
     }else{
-        const auto videoWH= sps.getVideoWidthHeightSPS();
-        MLOGD<<"Video W:"<<videoWH[0]<<" H:"<<videoWH[1];
         //AMediaFormat_setInt32(decoder.format,AMEDIAFORMAT_KEY_FRAME_RATE,60);
         //AVCProfileBaseline==1
         //AMediaFormat_setInt32(decoder.format,AMEDIAFORMAT_KEY_PROFILE,1);
         //AMediaFormat_setInt32(decoder.format,AMEDIAFORMAT_KEY_PRIORITY,0);
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_WIDTH,videoWH[0]);
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_HEIGHT,videoWH[1]);
-        AMediaFormat_setBuffer(format,"csd-0",sps.getData(),sps.getSize());
-        AMediaFormat_setBuffer(format,"csd-1",pps.getData(),pps.getSize());
+        mKeyFrameFinder.setSPS_PPS_WIDTH_HEIGHT(format);
         //AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_BIT_RATE,5*1024*1024);
         //static const auto PARAMETER_KEY_LOW_LATENCY="low-latency";
         //AMediaFormat_setInt32(format,PARAMETER_KEY_LOW_LATENCY,1);
@@ -146,36 +228,266 @@ void LowLagDecoder::configureStartDecoder(const NALU& sps,const NALU& pps){
         //static const auto AMEDIAFORMAT_KEY_PRIORITY="priority";
         //AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_PRIORITY,0);
     }
+    MLOGD<<"Video W:"<<mConfiguredFormat.width<<" H:"<<mConfiguredFormat.height;
 
+    {
+        std::lock_guard<std::mutex> lock(mAsyncInputMutex);
+        mAsyncCodec=decoder.codec;
+    }
+    mAsyncMode=ASYNC_DECODING && setAsyncCallbacks();
     AMediaCodec_configure(decoder.codec,format, decoder.window, nullptr, 0);
     AMediaFormat_delete(format);
     format=AMediaCodec_getOutputFormat(decoder.codec);
     //MLOGD<<"Output format"<<AMediaFormat_toString(format);
     AMediaFormat_delete(format);
+    AMediaCodec_start(decoder.codec);
+    if(!mAsyncMode){
+        mCheckOutputThread=std::make_unique<std::thread>(&LowLagDecoder::checkOutputLoop,this,decoder.codec);
+        NDKThreadHelper::setName(mCheckOutputThread->native_handle(),"LLDCheckOutput");
+    }
+    decoder.configured=true;
+}
 
-    if (decoder.codec== nullptr) {
-        MLOGD<<"Cannot configure decoder";
-        //set csd-0 and csd-1 back to 0, maybe they were just faulty but we have better luck with the next ones
-        mKeyFrameFinder.reset();
+void LowLagDecoder::stopDecoder(){
+    {
+        // After that no index of the stopped codec can be pushed anymore
+        std::lock_guard<std::mutex> lock(mAsyncInputMutex);
+        mAsyncCodec=nullptr;
+        mAsyncGeneration++;
+    }
+    // Also disconnects the codec from the surface, the next one can be configured with it
+    AMediaCodec_stop(decoder.codec);
+    // the output thread exits as soon as dequeueOutputBuffer fails
+    if(mCheckOutputThread && mCheckOutputThread->joinable()){
+        mCheckOutputThread->join();
+    }
+    mCheckOutputThread.reset();
+    mDecoderManager.retire(decoder.codec);
+    decoder.codec=nullptr;
+    decoder.configured=false;
+    mWaitingForKeyFrame=false;
+    // The indices are only valid for the stopped codec, callbacks of the stopped codec are ignored
+    while(mFreeInputBuffers.beginRead()!=nullptr){
+        mFreeInputBuffers.commitRead();
+    }
+    mAsyncMode=false;
+    mAsyncCodecFailed=false;
+}
+
+void LowLagDecoder::hotRestartDecoder(){
+    const auto begin=steady_clock::now();
+    const auto videoFormat=*mKeyFrameFinder.getVideoFormat();
+    const bool prepared=mDecoderManager.isPrepared(videoFormat.isH265,USE_SW_DECODER_INSTEAD);
+    MLOGD<<"Video format changed, switching decoder (prepared: "<<(prepared ? "yes" : "no")<<")";
+    stopDecoder();
+    configureStartDecoder();
+    if(!decoder.configured){
         return;
     }
-    AMediaCodec_start(decoder.codec);
-    mCheckOutputThread=std::make_unique<std::thread>(&LowLagDecoder::checkOutputLoop,this);
-    NDKThreadHelper::setName(mCheckOutputThread->native_handle(),"LLDCheckOutput");
-    decoder.configured=true;
+    mRestartBeginNs=(int64_t)duration_cast<nanoseconds>(begin.time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(mRestartStatsMutex);
+    mRestartStats.nRestarts++;
+    if(prepared){
+        mRestartStats.nPreparedRestarts++;
+    }
+    mRestartStats.switchTime.add(steady_clock::now()-begin);
+}
+
+bool LowLagDecoder::setAsyncCallbacks(){
+    const auto setAsyncNotifyCallback=getSetAsyncNotifyCallback();
+    if(setAsyncNotifyCallback==nullptr){
+        MLOGD<<"Async decoding needs android 9, using polling";
+        return false;
+    }
+    const AsyncNotifyCallback callback{onAsyncInputAvailable,onAsyncOutputAvailable,onAsyncFormatChanged,onAsyncError};
+    const auto status=setAsyncNotifyCallback(decoder.codec,callback,this);
+    if(status!=AMEDIA_OK){
+        MLOGE<<"AMediaCodec_setAsyncNotifyCallback failed "<<(int)status<<", using polling";
+        return false;
+    }
+    return true;
+}
+
+void LowLagDecoder::onAsyncInputAvailable(AMediaCodec* codec,void* userdata,int32_t index){
+    auto* self=static_cast<LowLagDecoder*>(userdata);
+    // The callbacks of the old and the new codec run on different threads, but the queue takes only one producer
+    std::lock_guard<std::mutex> lock(self->mAsyncInputMutex);
+    if(codec!=self->mAsyncCodec)return;
+    FreeInputBuffer* slot=self->mFreeInputBuffers.beginWrite();
+    if(slot==nullptr){
+        MLOGE<<"More free input buffers than expected";
+        return;
+    }
+    *slot=FreeInputBuffer{index,self->mAsyncGeneration};
+    self->mFreeInputBuffers.commitWrite();
+}
+
+void LowLagDecoder::onAsyncOutputAvailable(AMediaCodec* codec,void* userdata,int32_t index,AMediaCodecBufferInfo* bufferInfo){
+    auto* self=static_cast<LowLagDecoder*>(userdata);
+    if(codec!=self->mAsyncCodec)return;
+    self->onOutputBufferAvailable(codec,(size_t)index,*bufferInfo);
+    self->recalculateDecodingInfoIfNeeded();
+}
+
+void LowLagDecoder::onAsyncFormatChanged(AMediaCodec* codec,void* userdata,AMediaFormat* format){
+    auto* self=static_cast<LowLagDecoder*>(userdata);
+    if(codec==self->mAsyncCodec){
+        self->onOutputFormatChanged(format);
+    }
+    // The format is owned by the callee
+    AMediaFormat_delete(format);
+}
+
+void LowLagDecoder::onAsyncError(AMediaCodec* codec,void* userdata,media_status_t error,int32_t actionCode,const char* detail){
+    MLOGE<<"Decoder error "<<(int)error<<" action "<<actionCode<<" "<<(detail==nullptr ? "" : detail);
+    auto* self=static_cast<LowLagDecoder*>(userdata);
+    // A transient error resolves itself. Otherwise the codec has to be stopped, and since a recoverable error
+    // would need the codec to be configured again anyways it is simply replaced (by the feeding thread)
+    if(codec==self->mAsyncCodec && actionCode!=ACTION_CODE_TRANSIENT){
+        self->mAsyncCodecFailed=true;
+    }
 }
 
-void LowLagDecoder::feedDecoder(const NALU& nalu){
+ssize_t LowLagDecoder::dequeueInputBuffer(const int64_t timeoutUs){
+    if(!mAsyncMode){
+        return AMediaCodec_dequeueInputBuffer(decoder.codec,timeoutUs);
+    }
+    // Usually an input buffer is free already and this does not block (no binder call either)
+    while(true){
+        const FreeInputBuffer* freeInputBuffer=mFreeInputBuffers.waitForData(std::chrono::microseconds(timeoutUs));
+        if(freeInputBuffer==nullptr){
+            return AMEDIACODEC_INFO_TRY_AGAIN_LATER;
+        }
+        const FreeInputBuffer ret=*freeInputBuffer;
+        mFreeInputBuffers.commitRead();
+        // Index of a codec that was stopped in the meantime
+        if(ret.generation==mAsyncGeneration){
+            return ret.index;
+        }
+    }
+}
+
+bool LowLagDecoder::admitToDecoder(const NALU& nalu){
+    const int maxLatencyMs=MAX_DECODER_INPUT_LATENCY_MS;
+    if(maxLatencyMs<=0){
+        return true;
+    }
+    // Parameter sets (needed by the next key frame) and other non-slice NALUs are tiny, always feed them
+    if(!isSlice(nalu)){
+        return true;
+    }
+    const auto now=steady_clock::now();
+    // Even if it is late - dropping it would mean waiting for the next one.
+    // mWaitingForKeyFrame is cleared once it was fed
+    if(nalu.isKeyFrame()){
+        return true;
+    }
+    if(mWaitingForKeyFrame){
+        {
+            std::lock_guard<std::mutex> lock(mAdmissionStatsMutex);
+            mAdmissionStats.nSkippedFrames++;
+        }
+        requestKeyFrameIfNeeded(now);
+        return false;
+    }
+    if(now-nalu.creationTime>std::chrono::milliseconds(maxLatencyMs)){
+        {
+            std::lock_guard<std::mutex> lock(mAdmissionStatsMutex);
+            mAdmissionStats.nDroppedFrames++;
+        }
+        // Nothing depends on a non-reference frame, dropping it does not break the following ones
+        if(nalu.isReference()){
+            waitForKeyFrame(now);
+        }
+        return false;
+    }
+    return true;
+}
+
+void LowLagDecoder::waitForKeyFrame(const std::chrono::steady_clock::time_point now){
+    if(mWaitingForKeyFrame)return;
+    MLOGD<<"Dropped a reference frame, waiting for the next key frame";
+    mWaitingForKeyFrame=true;
+    mWaitingForKeyFrameSince=now;
+    mLastKeyFrameRequest={};
+    requestKeyFrameIfNeeded(now);
+}
+
+void LowLagDecoder::requestKeyFrameIfNeeded(const std::chrono::steady_clock::time_point now){
+    if(onKeyFrameRequestCallback==nullptr || now-mLastKeyFrameRequest<KEY_FRAME_REQUEST_INTERVAL){
+        return;
+    }
+    mLastKeyFrameRequest=now;
+    {
+        std::lock_guard<std::mutex> lock(mAdmissionStatsMutex);
+        mAdmissionStats.nKeyFrameRequests++;
+    }
+    onKeyFrameRequestCallback();
+}
+
+LowLagDecoder::AdmissionStats LowLagDecoder::getAdmissionStats()const{
+    std::lock_guard<std::mutex> lock(mAdmissionStatsMutex);
+    return mAdmissionStats;
+}
+
+LowLagDecoder::RestartStats LowLagDecoder::getRestartStats()const{
+    std::lock_guard<std::mutex> lock(mRestartStatsMutex);
+    return mRestartStats;
+}
+
+std::string LowLagDecoder::RestartStats::toString()const{
+    std::stringstream ss;
+    ss<<"Decoder restarts: "<<nRestarts<<" (prepared: "<<nPreparedRestarts<<")";
+    if(switchTime.getNSamples()>0){
+        ss<<" | switch: "<<switchTime.getAvgReadable();
+    }
+    if(downtime.getNSamples()>0){
+        ss<<" | downtime: "<<downtime.getAvgReadable();
+    }
+    return ss.str();
+}
+
+std::string LowLagDecoder::AdmissionStats::toString()const{
+    std::stringstream ss;
+    ss<<"Decoder dropped: "<<nDroppedFrames<<" | skipped until key frame: "<<nSkippedFrames<<" | key frame requests: "<<nKeyFrameRequests;
+    if(recoveryTime.getNSamples()>0){
+        ss<<"\nRecovery time: "<<recoveryTime.getAvgReadable();
+    }
+    return ss.str();
+}
+
+bool LowLagDecoder::feedDecoder(const NALU& nalu,const int nNALUs){
     const auto now=std::chrono::steady_clock::now();
     const auto deltaParsing=now-nalu.creationTime;
+    const auto maxLatency=std::chrono::milliseconds(MAX_DECODER_INPUT_LATENCY_MS);
+    // Only slices of non key frames are bound. Key frames are admitted even if late (see admitToDecoder), and a dropped
+    // parameter set would break all frames until the next key frame
+    const bool latencyBounded=maxLatency.count()>0 && isSlice(nalu) && !nalu.isKeyFrame();
     while(true){
-        const auto index=AMediaCodec_dequeueInputBuffer(decoder.codec,BUFFER_TIMEOUT_US);
+        // No input buffers will become available anymore, the decoder is restarted with the next NALU
+        if(mAsyncCodecFailed){
+            return false;
+        }
+        int64_t timeoutUs=BUFFER_TIMEOUT_US;
+        if(latencyBounded){
+            // Do not wait longer than the admission policy allows
+            const auto remaining=maxLatency-(steady_clock::now()-nalu.creationTime);
+            if(remaining<=std::chrono::nanoseconds(0)){
+                return false;
+            }
+            timeoutUs=std::min(timeoutUs,(int64_t)duration_cast<microseconds>(remaining).count()+1);
+        }
+        const auto index=dequeueInputBuffer(timeoutUs);
         if (index >=0) {
             size_t inputBufferSize;
             void* buf = AMediaCodec_getInputBuffer(decoder.codec,(size_t)index,&inputBufferSize);
+            if(buf==nullptr){
+                MLOGE<<"No input buffer for index "<<(int)index;
+                return false;
+            }
             if(nalu.getSize()>inputBufferSize){
                 MLOGD<<"Nalu too big"<<nalu.getSize();
-                return;
+                return false;
             }
             std::memcpy(buf, nalu.getData(),(size_t)nalu.getSize());
             //this timestamp will be later used to calculate the decoding latency
@@ -184,9 +496,15 @@ void LowLagDecoder::feedDecoder(const NALU& nalu){
             //const auto flag=nalu.isPPS() || nalu.isSPS() ? AMEDIACODEC_BUFFER_FLAG_CODEC_CONFIG : 0;
             //AMediaCodec_queueInputBuffer(decoder.codec, (size_t)index, 0, (size_t)nalu.data_length,presentationTimeUS, flag);
             AMediaCodec_queueInputBuffer(decoder.codec, (size_t)index, 0, (size_t)nalu.getSize(),presentationTimeUS,0);
-            waitForInputB.add(steady_clock::now() - now);
+            LatencyTrace::stampQueuedToCodec(nalu.creationTime,presentationTimeUS);
+            storeCreationTime(presentationTimeUS,nalu.creationTime);
+            const auto deltaWaitForInputB=steady_clock::now() - now;
+            waitForInputB.add(deltaWaitForInputB);
             parsingTime.add(deltaParsing);
-            return;
+            mDecodingLatency.record(DecodingLatency::PARSE,deltaParsing);
+            mDecodingLatency.record(DecodingLatency::WAIT_FOR_INPUT,deltaWaitForInputB);
+            nNALUsInFedBuffers.add(nNALUs);
+            return true;
         }else if(index==AMEDIACODEC_INFO_TRY_AGAIN_LATER){
             //just try again. But if we had no success in the last 1 second,log a warning and return.
             const auto elapsedTimeTryingForBuffer=std::chrono::steady_clock::now()-now;
@@ -194,50 +512,34 @@ void LowLagDecoder::feedDecoder(const NALU& nalu){
                 // Since OpenHD provides a lossy link it is really unlikely, but possible that we somehow 'break' the codec by feeding corrupt data.
                 // It will probably recover itself as soon as we feed enough valid data though;
                 MLOGE<<"AMEDIACODEC_INFO_TRY_AGAIN_LATER for more than 1 second "<<MyTimeHelper::R(elapsedTimeTryingForBuffer)<<"return.";
-                return;
+                return false;
             }
         }else{
             //Something went wrong. But we will feed the next NALU soon anyways
             MLOGD<<"dequeueInputBuffer idx "<<(int)index<<"return.";
-            return;
+            return false;
         }
     }
 }
 
-void LowLagDecoder::checkOutputLoop() {
+void LowLagDecoder::checkOutputLoop(AMediaCodec* codec) {
     NDKThreadHelper::setProcessThreadPriorityAttachDetach(javaVm,FPV_VR_PRIORITY::CPU_PRIORITY_DECODER_OUTPUT,"DecoderCheckOutput");
     AMediaCodecBufferInfo info;
     bool decoderSawEOS=false;
     bool decoderProducedUnknown=false;
     while(!decoderSawEOS && !decoderProducedUnknown) {
-        ssize_t index=AMediaCodec_dequeueOutputBuffer(decoder.codec,&info,BUFFER_TIMEOUT_US);
+        ssize_t index=AMediaCodec_dequeueOutputBuffer(codec,&info,BUFFER_TIMEOUT_US);
         if (index >= 0) {
-            const auto now=steady_clock::now();
-            const int64_t nowNS=(int64_t)duration_cast<nanoseconds>(now.time_since_epoch()).count();
-            const int64_t nowUS=(int64_t)duration_cast<microseconds>(now.time_since_epoch()).count();
-            //the timestamp for releasing the buffer is in NS, just release as fast as possible (e.g. now)
-            //https://android.googlesource.com/platform/frameworks/av/+/master/media/ndk/NdkMediaCodec.cpp
-            //-> renderOutputBufferAndRelease which is in https://android.googlesource.com/platform/frameworks/av/+/3fdb405/media/libstagefright/MediaCodec.cpp
-            //-> Message kWhatReleaseOutputBuffer -> onReleaseOutputBuffer
-            // also https://android.googlesource.com/platform/frameworks/native/+/5c1139f/libs/gui/SurfaceTexture.cpp
-            AMediaCodec_releaseOutputBufferAtTime(decoder.codec,(size_t)index,nowNS);
-            //but the presentationTime is in US
-            decodingTime.add(std::chrono::microseconds(nowUS - info.presentationTimeUs));
-            nDecodedFrames.add(1);
+            onOutputBufferAvailable(codec,(size_t)index,info);
             if (info.flags & AMEDIACODEC_BUFFER_FLAG_END_OF_STREAM) {
                 MLOGD<<"Decoder saw EOS";
                 decoderSawEOS=true;
                 continue;
             }
         } else if (index == AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED ) {
-            auto format = AMediaCodec_getOutputFormat(decoder.codec);
-            int width=0,height=0;
-            AMediaFormat_getInt32(format,AMEDIAFORMAT_KEY_WIDTH,&width);
-            AMediaFormat_getInt32(format,AMEDIAFORMAT_KEY_HEIGHT,&height);
-            if(onDecoderRatioChangedCallback!= nullptr && width != 0 && height != 0){
-                onDecoderRatioChangedCallback({width, height});
-            }
-            MLOGD << "AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED " << width << " " << height << " " << AMediaFormat_toString(format);
+            auto format = AMediaCodec_getOutputFormat(codec);
+            onOutputFormatChanged(format);
+            AMediaFormat_delete(format);
         } else if(index==AMEDIACODEC_INFO_OUTPUT_BUFFERS_CHANGED){
             MLOGD<<"AMEDIACODEC_INFO_OUTPUT_BUFFERS_CHANGED";
         } else if(index==AMEDIACODEC_INFO_TRY_AGAIN_LATER) {
@@ -248,27 +550,93 @@ void LowLagDecoder::checkOutputLoop() {
             decoderProducedUnknown=true;
             continue;
         }
-        //every 2 seconds recalculate the current fps and bitrate
-        const auto now=steady_clock::now();
-        const auto delta=now-decodingInfo.lastCalculation;
-        if(delta>DECODING_INFO_RECALCULATION_INTERVAL){
-            decodingInfo.lastCalculation=steady_clock::now();
-            decodingInfo.currentFPS=(float)nDecodedFrames.getDeltaSinceLastCall()/(float)duration_cast<seconds>(delta).count();
-            decodingInfo.currentKiloBitsPerSecond=((float)nNALUBytesFed.getDeltaSinceLastCall()/duration_cast<seconds>(delta).count())/1024.0f*8.0f;
-            //and recalculate the avg latencies. If needed,also print the log.
-            decodingInfo.avgDecodingTime_ms=decodingTime.getAvg_ms();
-            decodingInfo.avgParsingTime_ms=parsingTime.getAvg_ms();
-            decodingInfo.avgWaitForInputBTime_ms=waitForInputB.getAvg_ms();
-            decodingInfo.nDecodedFrames=nDecodedFrames.getAbsolute();
-            printAvgLog();
-            if(onDecodingInfoChangedCallback!= nullptr){
-                onDecodingInfoChangedCallback(decodingInfo);
-            }
-        }
+        recalculateDecodingInfoIfNeeded();
     }
     MLOGD<<"Exit CheckOutputLoop";
 }
 
+void LowLagDecoder::onOutputBufferAvailable(AMediaCodec* codec,const size_t index,const AMediaCodecBufferInfo& info){
+    const auto now=steady_clock::now();
+    const int64_t nowNS=(int64_t)duration_cast<nanoseconds>(now.time_since_epoch()).count();
+    const int64_t nowUS=(int64_t)duration_cast<microseconds>(now.time_since_epoch()).count();
+    //the timestamp for releasing the buffer is in NS, just release as fast as possible (e.g. now)
+    //https://android.googlesource.com/platform/frameworks/av/+/master/media/ndk/NdkMediaCodec.cpp
+    //-> renderOutputBufferAndRelease which is in https://android.googlesource.com/platform/frameworks/av/+/3fdb405/media/libstagefright/MediaCodec.cpp
+    //-> Message kWhatReleaseOutputBuffer -> onReleaseOutputBuffer
+    // also https://android.googlesource.com/platform/frameworks/native/+/5c1139f/libs/gui/SurfaceTexture.cpp
+    AMediaCodec_releaseOutputBufferAtTime(codec,index,nowNS);
+    const int64_t restartBeginNs=mRestartBeginNs.exchange(0);
+    if(restartBeginNs!=0){
+        std::lock_guard<std::mutex> lock(mRestartStatsMutex);
+        mRestartStats.downtime.add(nanoseconds(nowNS-restartBeginNs));
+    }
+    LatencyTrace::stampReleasedFromCodec((uint64_t)info.presentationTimeUs);
+    //but the presentationTime is in US
+    decodingTime.add(std::chrono::microseconds(nowUS - info.presentationTimeUs));
+    mDecodingLatency.record(DecodingLatency::DECODE,std::chrono::microseconds(nowUS - info.presentationTimeUs));
+    const auto creationTime=findCreationTime((uint64_t)info.presentationTimeUs);
+    if(creationTime){
+        mDecodingLatency.record(DecodingLatency::TOTAL,now-*creationTime);
+    }
+    nDecodedFrames.add(1);
+}
+
+void LowLagDecoder::storeCreationTime(const uint64_t presentationTimeUs,const steady_clock::time_point creationTime){
+    QueuedCreationTime& slot=mQueuedCreationTimes[presentationTimeUs % N_QUEUED_CREATION_TIMES];
+    slot.presentationTimeUs.store(0,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.creationTimeNs.store(duration_cast<nanoseconds>(creationTime.time_since_epoch()).count(),std::memory_order_relaxed);
+    slot.presentationTimeUs.store(presentationTimeUs,std::memory_order_release);
+}
+
+std::optional<steady_clock::time_point> LowLagDecoder::findCreationTime(const uint64_t presentationTimeUs)const{
+    const QueuedCreationTime& slot=mQueuedCreationTimes[presentationTimeUs % N_QUEUED_CREATION_TIMES];
+    if(slot.presentationTimeUs.load(std::memory_order_acquire)!=presentationTimeUs){
+        return std::nullopt;
+    }
+    const int64_t creationTimeNs=slot.creationTimeNs.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(slot.presentationTimeUs.load(std::memory_order_relaxed)!=presentationTimeUs){
+        return std::nullopt;
+    }
+    return steady_clock::time_point(nanoseconds(creationTimeNs));
+}
+
+void LowLagDecoder::onOutputFormatChanged(AMediaFormat* format){
+    int width=0,height=0;
+    AMediaFormat_getInt32(format,AMEDIAFORMAT_KEY_WIDTH,&width);
+    AMediaFormat_getInt32(format,AMEDIAFORMAT_KEY_HEIGHT,&height);
+    if(onDecoderRatioChangedCallback!= nullptr && width != 0 && height != 0){
+        onDecoderRatioChangedCallback({width, height});
+    }
+    MLOGD << "AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED " << width << " " << height << " " << AMediaFormat_toString(format);
+}
+
+void LowLagDecoder::recalculateDecodingInfoIfNeeded(){
+    //every 2 seconds recalculate the current fps and bitrate
+    const auto now=steady_clock::now();
+    const auto delta=now-decodingInfo.lastCalculation;
+    if(delta>DECODING_INFO_RECALCULATION_INTERVAL){
+        decodingInfo.lastCalculation=steady_clock::now();
+        decodingInfo.currentFPS=(float)nDecodedFrames.getDeltaSinceLastCall()/(float)duration_cast<seconds>(delta).count();
+        decodingInfo.currentKiloBitsPerSecond=((float)nNALUBytesFed.getDeltaSinceLastCall()/duration_cast<seconds>(delta).count())/1024.0f*8.0f;
+        //and recalculate the avg latencies. If needed,also print the log.
+        decodingInfo.avgDecodingTime_ms=decodingTime.getAvg_ms();
+        decodingInfo.avgParsingTime_ms=parsingTime.getAvg_ms();
+        decodingInfo.avgWaitForInputBTime_ms=waitForInputB.getAvg_ms();
+        decodingInfo.nDecodedFrames=nDecodedFrames.getAbsolute();
+        decodingInfo.feedAccessUnits=FEED_ACCESS_UNITS;
+        decodingInfo.asyncDecoding=mAsyncMode;
+        if(decodingInfo.nNALUSFeeded>0){
+            decodingInfo.avgNALUsPerInputBuffer=(float)nNALUsInFedBuffers.getAbsolute()/(float)decodingInfo.nNALUSFeeded;
+        }
+        printAvgLog();
+        if(onDecodingInfoChangedCallback!= nullptr){
+            onDecodingInfoChangedCallback(decodingInfo);
+        }
+    }
+}
+
 void LowLagDecoder::printAvgLog() {
     if(PRINT_DEBUG_INFO){
         auto now=steady_clock::now();
@@ -285,7 +653,17 @@ void LowLagDecoder::printAvgLog() {
                     <<" | Decoding Latency Sum:"<<avgDecodingLatencySum<<
                     "\nN NALUS:"<<decodingInfo.nNALU
                     <<" | N NALUES feeded:" <<decodingInfo.nNALUSFeeded<<" | N Decoded Frames:"<<nDecodedFrames.getAbsolute()<<
-                    "\nFPS:"<<decodingInfo.currentFPS;
+                    "\nFPS:"<<decodingInfo.currentFPS
+                    <<" | Mode:"<<(decodingInfo.feedAccessUnits ? "access unit" : "NALU")<<(decodingInfo.asyncDecoding ? " async" : " polling")
+                    <<" | NALUs per input buffer:"<<decodingInfo.avgNALUsPerInputBuffer
+                    <<"\n"<<mDecodingLatency.toString();
+            if(MAX_DECODER_INPUT_LATENCY_MS>0){
+                frameLog<<"\n"<<getAdmissionStats().toString();
+            }
+            const auto restartStats=getRestartStats();
+            if(restartStats.nRestarts>0){
+                frameLog<<"\n"<<restartStats.toString();
+            }
             MLOGD<<frameLog.str();
         }
     }
@@ -294,10 +672,18 @@ void LowLagDecoder::printAvgLog() {
 void LowLagDecoder::resetStatistics() {
     nDecodedFrames.reset();
     nNALUBytesFed.reset();
+    nNALUsInFedBuffers.reset();
     parsingTime.reset();
     waitForInputB.reset();
     decodingTime.reset();
+    mDecodingLatency.reset();
     decodingInfo={};
+    {
+        std::lock_guard<std::mutex> lock(mAdmissionStatsMutex);
+        mAdmissionStats={};
+    }
+    std::lock_guard<std::mutex> lock(mRestartStatsMutex);
+    mRestartStats={};
 }
 
 
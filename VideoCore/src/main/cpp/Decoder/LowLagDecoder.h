@@ -12,45 +12,21 @@
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <array>
+#include <optional>
 
 #include "../NALU/NALU.hpp"
 #include <TimeHelper.hpp>
 #include <SharedPreferences.hpp>
+#include <SPSCQueue.hpp>
 #include "../NALU/KeyFrameFinder.hpp"
+#include "../NALU/AccessUnitAssembler.hpp"
+#include "DecoderManager.hpp"
+#include "IDecoder.hpp"
 
-struct DecodingInfo{
-    std::chrono::steady_clock::time_point lastCalculation=std::chrono::steady_clock::now();
-    long nNALU=0;
-    long nNALUSFeeded=0;
-    long nDecodedFrames=0;
-    float currentFPS=0;
-    float currentKiloBitsPerSecond=0;
-    float avgParsingTime_ms=0;
-    float avgWaitForInputBTime_ms=0;
-    float avgDecodingTime_ms=0;
-    bool operator==(const DecodingInfo& d2)const{
-        return nNALU==d2.nNALU && nNALUSFeeded==d2.nNALUSFeeded && currentFPS==d2.currentFPS &&
-               currentKiloBitsPerSecond==d2.currentKiloBitsPerSecond && avgParsingTime_ms==d2.avgParsingTime_ms &&
-               avgWaitForInputBTime_ms==d2.avgWaitForInputBTime_ms && avgDecodingTime_ms==d2.avgDecodingTime_ms;
-    }
-    bool operator !=(const DecodingInfo& d2)const{
-        return !(*this==d2);
-    }
-};
-struct VideoRatio{
-    int width=0;
-    int height=0;
-    bool operator==(const VideoRatio& b)const{
-        return width==b.width && height==b.height;
-    }
-    bool operator !=(const VideoRatio& b)const{
-        return !(*this==b);
-    }
-};
-
-//Handles decoding of .h264 and .h265 video
+//Handles decoding of .h264 and .h265 video with MediaCodec
 // (Second one not tested well yet)
-class LowLagDecoder {
+class LowLagDecoder : public IDecoder{
 private:
     struct Decoder{
         bool configured= false;
@@ -58,11 +34,35 @@ private:
         ANativeWindow* window= nullptr;
     };
 public:
-    //Make sure to do no heavy lifting on this callback, since it is called from the low-latency mCheckOutputThread thread (best to copy values and leave processing to another thread)
+    //Make sure to do no heavy lifting on the DECODING_INFO_CHANGED_CALLBACK, since it is called from the low-latency mCheckOutputThread thread
+    // (or the MediaCodec callback thread in async mode) (best to copy values and leave processing to another thread)
     //The decoding info callback is called every DECODING_INFO_RECALCULATION_INTERVAL_MS
-    typedef std::function<void(const DecodingInfo)> DECODING_INFO_CHANGED_CALLBACK;
-    //The decoder ratio callback is called every time the output format changes
-    typedef std::function<void(const VideoRatio)> DECODER_RATIO_CHANGED;
+    // Called (from the thread feeding the decoder) when frames were dropped and the decoder waits for the next key frame,
+    // repeated every KEY_FRAME_REQUEST_INTERVAL until it arrives. See VS_MAX_DECODER_INPUT_LATENCY_MS
+    typedef std::function<void()> KEY_FRAME_REQUEST_CALLBACK;
+    // Counters of the latency-bounded admission policy (VS_MAX_DECODER_INPUT_LATENCY_MS)
+    // In access unit mode one 'frame' is one access unit, else it is one NALU (slice)
+    struct AdmissionStats{
+        // Older than the limit when they were about to be fed, or no input buffer became free within the limit
+        long nDroppedFrames=0;
+        // Dropped while waiting for the next key frame, because they might reference a dropped frame
+        long nSkippedFrames=0;
+        long nKeyFrameRequests=0;
+        // Time from the first dropped reference frame until the next key frame was fed
+        AvgCalculator recoveryTime;
+        std::string toString()const;
+    };
+    // Restarts because the video format changed while the decoder was running
+    struct RestartStats{
+        long nRestarts=0;
+        // The codec for the new format was created in the background before the key frame arrived
+        long nPreparedRestarts=0;
+        // Feeding blocked by stopping the old and configuring / starting the new codec
+        AvgCalculator switchTime;
+        // Key frame of the new format arrived -> first frame of the new codec rendered
+        AvgCalculator downtime;
+        std::string toString()const;
+    };
 public:
     //We cannot initialize the Decoder until we have SPS and PPS data -
     //when streaming this data will be available at some point in future
@@ -72,27 +72,76 @@ public:
     // After acquiring the surface, the decoder will be started as soon as enough configuration data was passed to it
     // When releasing the surface, the decoder will be stopped if running and any resources will be freed
     // After releasing the surface it is safe for the android os to delete it
-    void setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings);
+    void setOutputSurface(JNIEnv* env,jobject surface,SharedPreferences& videoSettings) override;
     //register the specified callbacks. Only one can be registered at a time
-    void registerOnDecoderRatioChangedCallback(DECODER_RATIO_CHANGED decoderRatioChangedC);
-    void registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_CALLBACK decodingInfoChangedCallback);
+    void registerOnDecoderRatioChangedCallback(DECODER_RATIO_CHANGED decoderRatioChangedC) override;
+    void registerOnDecodingInfoChangedCallback(DECODING_INFO_CHANGED_CALLBACK decodingInfoChangedCallback) override;
+    void registerOnKeyFrameRequestCallback(KEY_FRAME_REQUEST_CALLBACK keyFrameRequestCallback);
     //If the decoder has been configured, feed NALU. Else search for configuration data and
     //configure as soon as possible
     // If the input pipe was closed (surface has been removed or is not set yet), only buffer key frames
-    void interpretNALU(const NALU& nalu);
+    // In access unit mode (VS_FEED_ACCESS_UNITS) the slices of one frame are grouped into one input buffer first
+    void interpretNALU(const NALU& nalu) override;
+    AdmissionStats getAdmissionStats()const;
+    RestartStats getRestartStats()const;
+    const DecodingLatency& getDecodingLatency()const override{
+        return mDecodingLatency;
+    }
 private:
-    //Initialize decoder with provided SPS/PPS data.
+    // nNALUs: n of NALUs (slices) in nalu, > 1 only in access unit mode
+    void interpretNALUOrAccessUnit(const NALU& nalu,int nNALUs);
+    //Initialize decoder with the active SPS/PPS (VPS) data from mKeyFrameFinder.
     //Set Decoder.configured to true on success
-    void configureStartDecoder(const NALU& sps,const NALU& pps);
+    void configureStartDecoder();
+    //Stop the decoder and hand it to mDecoderManager for deletion, but keep the output surface. Set Decoder.configured to false
+    void stopDecoder();
+    // The video format changed and the key frame of the new format arrived: Switch to the codec mDecoderManager prepared
+    void hotRestartDecoder();
+    // Latency-bounded admission: Returns false if the NALU should be dropped instead of being fed.
+    // Once a reference frame was dropped all frames until the next key frame are dropped, too
+    bool admitToDecoder(const NALU& nalu);
+    // A reference frame was dropped, drop everything until the next key frame and request one
+    void waitForKeyFrame(std::chrono::steady_clock::time_point now);
+    void requestKeyFrameIfNeeded(std::chrono::steady_clock::time_point now);
     //Wait for input buffer to become available before feeding NALU
-    void feedDecoder(const NALU& nalu);
+    //Returns false if the NALU was not fed (e.g. no input buffer became available in time)
+    // Key frames and parameter sets are not bound by MAX_DECODER_INPUT_LATENCY_MS, they wait up to 1 second like without admission policy
+    bool feedDecoder(const NALU& nalu,int nNALUs);
+    // Like AMediaCodec_dequeueInputBuffer(), in async mode the index is taken from mFreeInputBuffers instead
+    ssize_t dequeueInputBuffer(int64_t timeoutUs);
     //Runs until EOS arrives at output buffer or decoder is stopped
-    void checkOutputLoop();
+    // The thread exits once the codec is stopped. Takes the codec, since decoder.codec is replaced on restart
+    void checkOutputLoop(AMediaCodec* codec);
+    // Polling and async mode
+    void onOutputBufferAvailable(AMediaCodec* codec,size_t index,const AMediaCodecBufferInfo& info);
+    void onOutputFormatChanged(AMediaFormat* format);
+    void recalculateDecodingInfoIfNeeded();
+    // Register the async callbacks (before AMediaCodec_configure). Returns false if not supported (android < 9)
+    bool setAsyncCallbacks();
+    static void onAsyncInputAvailable(AMediaCodec* codec,void* userdata,int32_t index);
+    static void onAsyncOutputAvailable(AMediaCodec* codec,void* userdata,int32_t index,AMediaCodecBufferInfo* bufferInfo);
+    static void onAsyncFormatChanged(AMediaCodec* codec,void* userdata,AMediaFormat* format);
+    static void onAsyncError(AMediaCodec* codec,void* userdata,media_status_t error,int32_t actionCode,const char* detail);
     //Debug log
     void printAvgLog();
     void resetStatistics();
     std::unique_ptr<std::thread> mCheckOutputThread= nullptr;
     bool USE_SW_DECODER_INSTEAD=false;
+    std::atomic<bool> FEED_ACCESS_UNITS=false;
+    std::atomic<bool> ASYNC_DECODING=false;
+    // True if the current decoder uses the async callbacks (no mCheckOutputThread)
+    bool mAsyncMode=false;
+    // Async mode: Indices of the input buffers the decoder gave us. Filled by the MediaCodec callback thread,
+    // consumed by the thread feeding the decoder (with mMutexInputPipe locked). Never more than the n of input buffers of the decoder
+    struct FreeInputBuffer{
+        int32_t index;
+        // mAsyncGeneration when the index was pushed, indices of a stopped codec are skipped
+        uint32_t generation;
+    };
+    SPSCQueue<FreeInputBuffer> mFreeInputBuffers{64};
+    AccessUnitAssembler mAccessUnitAssembler{[this](const NALU& accessUnit,const int nNALUs){
+        interpretNALUOrAccessUnit(accessUnit,nNALUs);
+    }};
     //Holds the AMediaCodec instance, as well as the state (configured or not configured)
     Decoder decoder{};
     DecodingInfo decodingInfo;
@@ -101,14 +150,37 @@ private:
     std::mutex mMutexInputPipe;
     DECODER_RATIO_CHANGED onDecoderRatioChangedCallback= nullptr;
     DECODING_INFO_CHANGED_CALLBACK onDecodingInfoChangedCallback= nullptr;
+    KEY_FRAME_REQUEST_CALLBACK onKeyFrameRequestCallback= nullptr;
+    // 0 == admission policy disabled. Then the decoder is fed everything, feedDecoder() waits up to 1 second for an input buffer
+    std::atomic<int> MAX_DECODER_INPUT_LATENCY_MS=0;
+    // Admission state, only used with mMutexInputPipe locked
+    bool mWaitingForKeyFrame=false;
+    std::chrono::steady_clock::time_point mWaitingForKeyFrameSince;
+    std::chrono::steady_clock::time_point mLastKeyFrameRequest;
+    mutable std::mutex mAdmissionStatsMutex;
+    AdmissionStats mAdmissionStats;
+    static constexpr auto KEY_FRAME_REQUEST_INTERVAL=std::chrono::milliseconds(200);
     // So we can temporarily attach the output thread to the vm and make ndk calls
     JavaVM* javaVm=nullptr;
     std::chrono::steady_clock::time_point lastLog=std::chrono::steady_clock::now();
     RelativeCalculator nDecodedFrames;
     RelativeCalculator nNALUBytesFed;
+    RelativeCalculator nNALUsInFedBuffers;
     AvgCalculator parsingTime;
     AvgCalculator waitForInputB;
     AvgCalculator decodingTime;
+    DecodingLatency mDecodingLatency;
+    // NALU::creationTime of each queued input buffer by its presentation time, such that the output side can record the total latency.
+    // Written by the feeding thread, read by the output thread. Seqlock like LatencyTrace, a slot that was overwritten
+    // in the meantime (more than N_QUEUED_CREATION_TIMES buffers in flight) is skipped
+    struct QueuedCreationTime{
+        std::atomic<uint64_t> presentationTimeUs{0};
+        std::atomic<int64_t> creationTimeNs{0};
+    };
+    static constexpr const size_t N_QUEUED_CREATION_TIMES=64;
+    std::array<QueuedCreationTime,N_QUEUED_CREATION_TIMES> mQueuedCreationTimes;
+    void storeCreationTime(uint64_t presentationTimeUs,std::chrono::steady_clock::time_point creationTime);
+    std::optional<std::chrono::steady_clock::time_point> findCreationTime(uint64_t presentationTimeUs)const;
     //Every n ms re-calculate the Decoding info
     static const constexpr auto DECODING_INFO_RECALCULATION_INTERVAL=std::chrono::milliseconds(1000);
     static constexpr const bool PRINT_DEBUG_INFO=true;
@@ -123,6 +195,24 @@ private:
     };
     KeyFrameFinder mKeyFrameFinder;
     bool IS_H265= false;
+    // Format the decoder was configured with
+    KeyFrameFinder::VideoFormat mConfiguredFormat{};
+    // Set when the parameter sets changed the video format while the decoder is running.
+    // The old decoder keeps decoding until the key frame of the new format arrives, then it is replaced
+    // by the codec mDecoderManager created in the background meanwhile (without touching the surface)
+    bool mReconfigurePending=false;
+    DecoderManager mDecoderManager;
+    // Async mode: callbacks of other (stopped) codecs are ignored
+    std::atomic<AMediaCodec*> mAsyncCodec{nullptr};
+    // Incremented each time a codec is stopped. Together with mAsyncCodec only changed with mAsyncInputMutex locked
+    std::atomic<uint32_t> mAsyncGeneration{0};
+    std::mutex mAsyncInputMutex;
+    // Set by onAsyncError() if the codec cannot continue, the feeding thread replaces it
+    std::atomic<bool> mAsyncCodecFailed{false};
+    // steady_clock ns when the last restart started, 0 once the new codec rendered its first frame
+    std::atomic<int64_t> mRestartBeginNs{0};
+    mutable std::mutex mRestartStatsMutex;
+    RestartStats mRestartStats;
 };
 
 #endif //LOW_LAG_DECODER
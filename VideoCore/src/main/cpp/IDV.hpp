@@ -6,6 +6,8 @@ public:
     static constexpr const char* VS_PROTOCOL="Video stream protocol";
     static constexpr const char* VS_PORT="Video stream port";
     static constexpr const char* VS_GROUND_RECORDING="VS_GROUND_RECORDING";
+    static constexpr const char* VS_GROUND_RECORDING_BLOCK_ON_OVERFLOW="VS_GROUND_RECORDING_BLOCK_ON_OVERFLOW";
+    static constexpr const char* VS_GROUND_RECORDING_SYNC_INTERVAL_MS="VS_GROUND_RECORDING_SYNC_INTERVAL_MS";
     static constexpr const char* VS_SOURCE="VS_SOURCE";
     static constexpr const char* VS_PLAYBACK_FILENAME="VS_PLAYBACK_FILENAME";
     static constexpr const char* VS_ASSETS_FILENAME_TEST_ONLY="VS_ASSETS_FILENAME_TEST_ONLY";
@@ -14,6 +16,17 @@ public:
     static constexpr const char* VS_FFMPEG_URL="VS_FFMPEG_URL";
     static constexpr const char* VS_VIDEO_VIEW_TYPE="VS_VIDEO_VIEW_TYPE";
     static constexpr const char* VS_360_VIDEO_FOV="VS_360_VIDEO_FOV";
+    static constexpr const char* VS_RTP_REORDER_BUDGET_US="VS_RTP_REORDER_BUDGET_US";
+    static constexpr const char* VS_PIPELINED_DECODING="VS_PIPELINED_DECODING";
+    static constexpr const char* VS_FEED_ACCESS_UNITS="VS_FEED_ACCESS_UNITS";
+    static constexpr const char* VS_ASYNC_DECODING="VS_ASYNC_DECODING";
+    static constexpr const char* VS_MAX_DECODER_INPUT_LATENCY_MS="VS_MAX_DECODER_INPUT_LATENCY_MS";
+    static constexpr const char* VS_REQUEST_KEY_FRAMES="VS_REQUEST_KEY_FRAMES";
+    static constexpr const char* VS_USE_FFMPEG_DECODER="VS_USE_FFMPEG_DECODER";
+    static constexpr const char* VS_FFMPEG_DECODER_THREADS="VS_FFMPEG_DECODER_THREADS";
+    static constexpr const char* VS_LATENCY_TRACE="VS_LATENCY_TRACE";
+    static constexpr const char* VS_REPLAY_FILENAME="VS_REPLAY_FILENAME";
+    static constexpr const char* VS_REPLAY_CONFIG="VS_REPLAY_CONFIG";
 };
 
 #endif //CONSTI_10_100_IDV
@@ -0,0 +1,141 @@
+#ifndef LIVEVIDEO10MS_ACCESSUNITASSEMBLER_HPP
+#define LIVEVIDEO10MS_ACCESSUNITASSEMBLER_HPP
+
+#include "NALU.hpp"
+#include <cstring>
+#include <functional>
+#include <AndroidLogger.hpp>
+#include <TestCheck.hpp>
+
+// Groups the slices (VCL NALUs) of one frame into one access unit, such that the decoder gets one input buffer per frame
+// instead of one per slice. The access unit is forwarded as a NALU (all slices with their 0,0,0,1 prefix, back to back)
+// that has the creation time of its first slice.
+// An access unit is complete when
+// 1) a NALU arrives that starts the next one (AUD, SPS, PPS, VPS, SEI or a slice with first_mb_in_slice==0 /
+//    first_slice_segment_in_pic_flag==1). This means the last frame is only forwarded once the next frame starts arriving
+// 2) the last slice had the rtp marker bit set (NALU::isEndOfAccessUnit). No added latency
+// Parameter sets are forwarded on their own (the decoder needs them for configuration), AUD and SEI are dropped.
+class AccessUnitAssembler{
+public:
+    // nNALUs: n of slices in the access unit
+    typedef std::function<void(const NALU& accessUnit,const int nNALUs)> ACCESS_UNIT_CALLBACK;
+    explicit AccessUnitAssembler(ACCESS_UNIT_CALLBACK cb):cb(std::move(cb)){}
+    void addNALU(const NALU& nalu){
+        if(nalu.getSize()<=4)return;
+        const bool isH265=nalu.IS_H265_PACKET;
+        const int type=nalu.get_nal_unit_type();
+        if(!isVCL(type,isH265)){
+            flush();
+            if(nalu.isSPS() || nalu.isPPS() || (isH265 && nalu.isVPS())){
+                cb(nalu,1);
+            }
+            return;
+        }
+        if(isFirstSliceOfPicture(nalu) || isH265!=mIsH265 || mLength+nalu.getSize()>NALU::NALU_MAXLEN){
+            flush();
+        }
+        if(mNNALUs==0){
+            mFirstCreationTime=nalu.creationTime;
+            mIsH265=isH265;
+        }
+        std::memcpy(&(*mBuffer)[mLength],nalu.getData(),nalu.getSize());
+        mLength+=nalu.getSize();
+        mNNALUs++;
+        if(nalu.isEndOfAccessUnit){
+            flush();
+        }
+    }
+    // Forward the current access unit even though it might not be complete yet
+    void flush(){
+        if(mNNALUs==0)return;
+        {
+            NALU accessUnit(mBuffer,mLength,mIsH265,mFirstCreationTime);
+            accessUnit.isEndOfAccessUnit=true;
+            cb(accessUnit,mNNALUs);
+        }
+        if(mBuffer.useCount()>1){
+            mBuffer=mBufferPool.acquire();
+        }
+        mLength=0;
+        mNNALUs=0;
+        nAccessUnits++;
+    }
+    // Drop the current access unit
+    void reset(){
+        mLength=0;
+        mNNALUs=0;
+    }
+    long nAccessUnits=0;
+private:
+    const ACCESS_UNIT_CALLBACK cb;
+    NALU::NALU_BUFFER_POOL mBufferPool{1};
+    NALU::NALU_BUFFER_POOL::Handle mBuffer=mBufferPool.acquire();
+    size_t mLength=0;
+    int mNNALUs=0;
+    bool mIsH265=false;
+    std::chrono::steady_clock::time_point mFirstCreationTime;
+    static bool isVCL(const int type,const bool isH265){
+        if(isH265){
+            return type>=H265::NAL_UNIT_CODED_SLICE_TRAIL_N && type<=H265::NAL_UNIT_RESERVED_VCL31;
+        }
+        return type>=NAL_UNIT_TYPE_CODED_SLICE_NON_IDR && type<=NAL_UNIT_TYPE_CODED_SLICE_IDR;
+    }
+    // The first syntax element after the NAL unit header is first_mb_in_slice (ue(v), h264) or
+    // first_slice_segment_in_pic_flag (u(1), h265). For both the first bit is 1 if (and only if) this is the first slice of a picture
+    static bool isFirstSliceOfPicture(const NALU& nalu){
+        const size_t offset=nalu.IS_H265_PACKET ? 6 : 5;
+        if(nalu.getSize()<=offset)return false;
+        return (nalu.getData()[offset] & 0x80)!=0;
+    }
+};
+
+namespace TEST_ACCESS_UNIT_ASSEMBLER{
+    static NALU makeNALU(NALU::NALU_BUFFER_POOL& pool,const std::vector<uint8_t>& payload,const bool isEndOfAccessUnit=false){
+        auto buffer=pool.acquire();
+        const uint8_t prefix[4]={0,0,0,1};
+        std::memcpy(buffer->data(),prefix,4);
+        std::memcpy(&(*buffer)[4],payload.data(),payload.size());
+        NALU nalu(buffer,4+payload.size());
+        nalu.isEndOfAccessUnit=isEndOfAccessUnit;
+        return nalu;
+    }
+    // Returns the n of failed checks
+    static int test(){
+        int nFailed=0;
+        NALU::NALU_BUFFER_POOL pool;
+        std::vector<int> nNALUs;
+        std::vector<size_t> sizes;
+        AccessUnitAssembler assembler([&nNALUs,&sizes](const NALU& accessUnit,const int n){
+            nNALUs.push_back(n);
+            sizes.push_back(accessUnit.getSize());
+        });
+        // SPS, PPS, IDR with 3 slices (first_mb_in_slice 0,x,x)
+        assembler.addNALU(makeNALU(pool,{0x67,1,2}));
+        assembler.addNALU(makeNALU(pool,{0x68,3}));
+        assembler.addNALU(makeNALU(pool,{0x65,0x88,1}));
+        assembler.addNALU(makeNALU(pool,{0x65,0x40,2}));
+        assembler.addNALU(makeNALU(pool,{0x65,0x20,3}));
+        TEST_CHECK(nFailed,(nNALUs==std::vector<int>{1,1}));
+        // P frame with 2 slices, first one starts a new access unit
+        assembler.addNALU(makeNALU(pool,{0x41,0x9a,1}));
+        TEST_CHECK(nFailed,(nNALUs==std::vector<int>{1,1,3}));
+        TEST_CHECK(nFailed,sizes.size()==3 && sizes[2]==3*7);
+        // Second slice has the rtp marker bit set - forwarded immediately
+        assembler.addNALU(makeNALU(pool,{0x41,0x40,2},true));
+        TEST_CHECK(nFailed,(nNALUs==std::vector<int>{1,1,3,2}));
+        // AUD and SEI are dropped, but end the current access unit
+        assembler.addNALU(makeNALU(pool,{0x41,0x9a,1}));
+        assembler.addNALU(makeNALU(pool,{0x09,0xf0}));
+        assembler.addNALU(makeNALU(pool,{0x06,5,1}));
+        TEST_CHECK(nFailed,(nNALUs==std::vector<int>{1,1,3,2,1}));
+        TEST_CHECK(nFailed,assembler.nAccessUnits==3);
+        assembler.flush();
+        TEST_CHECK(nFailed,nNALUs.size()==5);
+        if(nFailed==0){
+            MLOGD<<"TEST_ACCESS_UNIT_ASSEMBLER passed";
+        }
+        return nFailed;
+    }
+}
+
+#endif //LIVEVIDEO10MS_ACCESSUNITASSEMBLER_HPP
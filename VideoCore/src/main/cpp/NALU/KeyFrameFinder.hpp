@@ -6,72 +6,228 @@
 #define LIVEVIDEO10MS_KEYFRAMEFINDER_HPP
 
 #include "NALU.hpp"
+#include "ParameterSetParser.hpp"
 #include <vector>
 #include <AndroidLogger.hpp>
+#include <TestCheck.hpp>
 #include <media/NdkMediaFormat.h>
+#include <functional>
+#include <map>
 #include <memory>
+#include <optional>
 
-// Takes a continuous stream of NALUs and save SPS / PPS data
-// For later use
+// Takes a continuous stream of NALUs and saves the SPS / PPS (and VPS for H265) data for later use.
+// Parameter sets are stored by their id and parsed only once. Most encoders repeat them before every key frame,
+// a repeated parameter set costs one byte-wise compare. The 'active' parameter sets are the latest PPS and the SPS / VPS it refers to.
+// When the video format (codec or resolution) of the active parameter sets changes the format changed callback is called,
+// such that the decoder only has to be re-configured when really needed.
 class KeyFrameFinder{
-private:
-    std::unique_ptr<NALU> SPS;
-    std::unique_ptr<NALU> PPS;
-    // VPS are only used in H265
-    std::unique_ptr<NALU> VPS;
 public:
-    void saveIfKeyFrame(const NALU &nalu){
-        if(nalu.getSize()<=0)return;
-        if(nalu.isSPS()){
-            SPS=std::make_unique<NALU>(nalu);
-            //MLOGD<<"SPS found";
-        }else if(nalu.isPPS()){
-            PPS=std::make_unique<NALU>(nalu);
-            //MLOGD<<"PPS found";
-        }else if(nalu.IS_H265_PACKET && nalu.isVPS()){
-            VPS=std::make_unique<NALU>(nalu);
-            //MLOGD<<"VPS found";
+    struct VideoFormat{
+        bool isH265=false;
+        int width=0;
+        int height=0;
+        bool operator==(const VideoFormat& other)const{
+            return isH265==other.isH265 && width==other.width && height==other.height;
+        }
+        bool operator!=(const VideoFormat& other)const{
+            return !(*this==other);
         }
+    };
+    typedef std::function<void(const VideoFormat& videoFormat)> FORMAT_CHANGED_CALLBACK;
+    void registerOnFormatChangedCallback(FORMAT_CHANGED_CALLBACK formatChangedCallback){
+        onFormatChangedCallback=std::move(formatChangedCallback);
     }
-    bool allKeyFramesAvailable(){
-        return SPS != nullptr && PPS != nullptr;
+    // Returns true if the NALU is a parameter set that was not known yet or differs from the stored one with the same id
+    bool saveIfKeyFrame(const NALU &nalu){
+        if(nalu.getSize()<=4)return false;
+        const bool isH265=nalu.IS_H265_PACKET;
+        const bool isVPS=isH265 && nalu.isVPS();
+        if(!(nalu.isSPS() || nalu.isPPS() || isVPS))return false;
+        if(isH265!=IS_H265){
+            // codec changed, none of the stored parameter sets is valid anymore
+            reset();
+            IS_H265=isH265;
+        }
+        auto& table=isVPS ? VPS : nalu.isSPS() ? SPS : PPS;
+        for(const auto& entry:table){
+            if(entry.second.data.size()==nalu.getSize() && std::memcmp(entry.second.data.data(),nalu.getData(),nalu.getSize())==0){
+                return false;
+            }
+        }
+        ParameterSet parameterSet;
+        if(isVPS){
+            const auto id=ParameterSetParser::parseVPSId(nalu.getDataWithoutPrefix(),nalu.getDataSizeWithoutPrefix());
+            if(!id)return false;
+            parameterSet.id=*id;
+        }else if(nalu.isSPS()){
+            const auto info=isH265 ? ParameterSetParser::parseSPSH265(nalu.getDataWithoutPrefix(),nalu.getDataSizeWithoutPrefix()) :
+                    ParameterSetParser::parseSPSH264(nalu.getDataWithoutPrefix(),nalu.getDataSizeWithoutPrefix());
+            if(!info){
+                MLOGE<<"Cannot parse SPS";
+                return false;
+            }
+            parameterSet.id=info->id;
+            parameterSet.refId=info->vpsId;
+            parameterSet.width=info->width;
+            parameterSet.height=info->height;
+        }else{
+            const auto info=ParameterSetParser::parsePPS(nalu.getDataWithoutPrefix(),nalu.getDataSizeWithoutPrefix(),isH265);
+            if(!info){
+                MLOGE<<"Cannot parse PPS";
+                return false;
+            }
+            parameterSet.id=info->id;
+            parameterSet.refId=info->spsId;
+            latestPPSId=info->id;
+        }
+        parameterSet.data.assign(nalu.getData(),nalu.getData()+nalu.getSize());
+        table[parameterSet.id]=std::move(parameterSet);
+        checkFormatChanged();
+        return true;
+    }
+    // True if the latest PPS and all parameter sets it refers to are available
+    bool allKeyFramesAvailable()const{
+        const ParameterSet* sps=getActiveSPS();
+        if(sps==nullptr)return false;
+        return !IS_H265 || find(VPS,sps->refId)!=nullptr;
+    }
+    // Format of the active parameter sets
+    std::optional<VideoFormat> getVideoFormat()const{
+        const ParameterSet* sps=getActiveSPS();
+        if(sps==nullptr)return std::nullopt;
+        return VideoFormat{IS_H265,sps->width,sps->height};
     }
     //SPS
-    const NALU& getCSD0()const{
-        return *SPS;
+    const std::vector<uint8_t>& getCSD0()const{
+        return getActiveSPS()->data;
     }
     //PPS
-    const NALU& getCSD1()const{
-        return *PPS;
+    const std::vector<uint8_t>& getCSD1()const{
+        return find(PPS,latestPPSId)->data;
     }
-    void setSPS_PPS_WIDTH_HEIGHT(AMediaFormat* format){
-        const auto sps=getCSD0();
-        const auto pps=getCSD1();
-        const auto videoWH= sps.getVideoWidthHeightSPS();
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_WIDTH,videoWH[0]);
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_HEIGHT,videoWH[1]);
-        AMediaFormat_setBuffer(format,"csd-0",sps.getData(),(size_t)sps.getSize());
-        AMediaFormat_setBuffer(format,"csd-1",pps.getData(),(size_t)pps.getSize());
+    // Only valid if allKeyFramesAvailable()
+    void setSPS_PPS_WIDTH_HEIGHT(AMediaFormat* format)const{
+        const auto& sps=getCSD0();
+        const auto& pps=getCSD1();
+        const auto videoFormat=*getVideoFormat();
+        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_WIDTH,videoFormat.width);
+        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_HEIGHT,videoFormat.height);
+        AMediaFormat_setBuffer(format,"csd-0",sps.data(),sps.size());
+        AMediaFormat_setBuffer(format,"csd-1",pps.data(),pps.size());
     }
-    static void appendNaluData(std::vector<uint8_t>& buff,const NALU& nalu){
-        buff.insert(buff.begin(),nalu.getData(),nalu.getData()+nalu.getSize());
+    static void appendNaluData(std::vector<uint8_t>& buff,const std::vector<uint8_t>& nalu){
+        buff.insert(buff.end(),nalu.begin(),nalu.end());
     }
-    void setVPS_SPS_PPS_WIDTH_HEIGHT(AMediaFormat* format){
+    // Only valid if allKeyFramesAvailable()
+    void setVPS_SPS_PPS_WIDTH_HEIGHT(AMediaFormat* format)const{
+        const auto& vps=find(VPS,getActiveSPS()->refId)->data;
+        const auto& sps=getCSD0();
+        const auto& pps=getCSD1();
         std::vector<uint8_t> buff={};
-        buff.reserve(SPS->getSize()+PPS->getSize()+VPS->getSize());
-        appendNaluData(buff,*VPS);
-        appendNaluData(buff,*SPS);
-        appendNaluData(buff,*PPS);
-        const auto videoWH= getCSD0().getVideoWidthHeightSPS();
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_WIDTH,videoWH[0]);
-        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_HEIGHT,videoWH[1]);
+        buff.reserve(vps.size()+sps.size()+pps.size());
+        appendNaluData(buff,vps);
+        appendNaluData(buff,sps);
+        appendNaluData(buff,pps);
+        const auto videoFormat=*getVideoFormat();
+        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_WIDTH,videoFormat.width);
+        AMediaFormat_setInt32(format,AMEDIAFORMAT_KEY_HEIGHT,videoFormat.height);
         AMediaFormat_setBuffer(format,"csd-0",buff.data(),buff.size());
     }
     void reset(){
-        SPS=nullptr;
-        PPS=nullptr;
-        VPS=nullptr;
+        SPS.clear();
+        PPS.clear();
+        VPS.clear();
+        latestPPSId=-1;
+        lastFormat.reset();
+    }
+private:
+    struct ParameterSet{
+        int id=0;
+        // SPS: id of the VPS (H265 only), PPS: id of the SPS
+        int refId=0;
+        // SPS only
+        int width=0;
+        int height=0;
+        // with 0,0,0,1 prefix
+        std::vector<uint8_t> data;
+    };
+    std::map<int,ParameterSet> SPS;
+    std::map<int,ParameterSet> PPS;
+    // VPS are only used in H265
+    std::map<int,ParameterSet> VPS;
+    int latestPPSId=-1;
+    bool IS_H265=false;
+    std::optional<VideoFormat> lastFormat;
+    FORMAT_CHANGED_CALLBACK onFormatChangedCallback=nullptr;
+    static const ParameterSet* find(const std::map<int,ParameterSet>& table,const int id){
+        const auto it=table.find(id);
+        return it==table.end() ? nullptr : &it->second;
+    }
+    const ParameterSet* getActiveSPS()const{
+        const ParameterSet* pps=find(PPS,latestPPSId);
+        if(pps==nullptr)return nullptr;
+        return find(SPS,pps->refId);
+    }
+    void checkFormatChanged(){
+        if(!allKeyFramesAvailable())return;
+        const auto videoFormat=*getVideoFormat();
+        if(lastFormat && *lastFormat==videoFormat)return;
+        lastFormat=videoFormat;
+        MLOGD<<"Video format "<<(videoFormat.isH265 ? "H265 " : "H264 ")<<videoFormat.width<<"x"<<videoFormat.height;
+        if(onFormatChangedCallback!=nullptr){
+            onFormatChangedCallback(videoFormat);
+        }
     }
 };
 
+namespace TEST_KEY_FRAME_FINDER{
+    static NALU makeNALU(NALU::NALU_BUFFER_POOL& pool,const std::vector<uint8_t>& payload,const bool isH265=false){
+        auto buffer=pool.acquire();
+        const uint8_t prefix[4]={0,0,0,1};
+        std::memcpy(buffer->data(),prefix,4);
+        std::memcpy(&(*buffer)[4],payload.data(),payload.size());
+        return NALU(buffer,4+payload.size(),isH265);
+    }
+    // Also covers ParameterSetParser. Returns the n of failed checks
+    static int test(){
+        int nFailed=0;
+        NALU::NALU_BUFFER_POOL pool;
+        std::vector<KeyFrameFinder::VideoFormat> formats;
+        KeyFrameFinder keyFrameFinder;
+        keyFrameFinder.registerOnFormatChangedCallback([&formats](const KeyFrameFinder::VideoFormat& format){
+            formats.push_back(format);
+        });
+        // x264 1920x1080 SPS (baseline, with VUI) and a PPS (id 0, sps id 0)
+        const std::vector<uint8_t> sps1080={103,66,192,40,217,0,120,2,39,229,192,90,128,128,128,160,0,0,125,32,0,29,76,17,227,6,73};
+        const std::vector<uint8_t> pps={104,206,56,128};
+        TEST_CHECK(nFailed,keyFrameFinder.saveIfKeyFrame(makeNALU(pool,sps1080)));
+        TEST_CHECK(nFailed,!keyFrameFinder.allKeyFramesAvailable());
+        TEST_CHECK(nFailed,keyFrameFinder.saveIfKeyFrame(makeNALU(pool,pps)));
+        TEST_CHECK(nFailed,keyFrameFinder.allKeyFramesAvailable());
+        TEST_CHECK(nFailed,(formats.size()==1 && formats[0]==KeyFrameFinder::VideoFormat{false,1920,1080}));
+        // Repeated parameter sets are ignored
+        TEST_CHECK(nFailed,!keyFrameFinder.saveIfKeyFrame(makeNALU(pool,sps1080)));
+        TEST_CHECK(nFailed,!keyFrameFinder.saveIfKeyFrame(makeNALU(pool,pps)));
+        // Same resolution without VUI - changed parameter set, but same format
+        TEST_CHECK(nFailed,keyFrameFinder.saveIfKeyFrame(makeNALU(pool,{103,66,192,40,217,0,120,2,39,229,64})));
+        TEST_CHECK(nFailed,formats.size()==1);
+        // x265 1920x1080 VPS (only the id matters), SPS and PPS
+        const std::vector<uint8_t> vps265={0x40,0x01,0x0c,0x01,0xff,0xff};
+        const std::vector<uint8_t> sps265={0x42,0x01,0x01,0x01,0x60,0x00,0x00,0x03,0x00,0x90,0x00,0x00,0x03,0x00,0x00,0x03,0x00,0x78,
+                                           0xa0,0x03,0xc0,0x80,0x10,0xe5,0x96,0x56,0x69,0x24,0xca,0xe0,0x10,0x00,0x00,0x03,0x00,0x10,
+                                           0x00,0x00,0x03,0x01,0xe0,0x80};
+        const std::vector<uint8_t> pps265={0x44,0x01,0xc1,0x72,0xb4,0x62,0x40};
+        keyFrameFinder.saveIfKeyFrame(makeNALU(pool,vps265,true));
+        keyFrameFinder.saveIfKeyFrame(makeNALU(pool,sps265,true));
+        keyFrameFinder.saveIfKeyFrame(makeNALU(pool,pps265,true));
+        TEST_CHECK(nFailed,keyFrameFinder.allKeyFramesAvailable());
+        TEST_CHECK(nFailed,(formats.size()==2 && formats[1]==KeyFrameFinder::VideoFormat{true,1920,1080}));
+        if(nFailed==0){
+            MLOGD<<"TEST_KEY_FRAME_FINDER passed";
+        }
+        return nFailed;
+    }
+}
+
 #endif //LIVEVIDEO10MS_KEYFRAMEFINDER_HPP
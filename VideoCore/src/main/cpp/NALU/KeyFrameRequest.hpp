@@ -0,0 +1,26 @@
+#ifndef LIVEVIDEO10MS_KEYFRAMEREQUEST_HPP
+#define LIVEVIDEO10MS_KEYFRAMEREQUEST_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// Sent by the receiver when it dropped frames and waits for the next key frame (IDR), such that the transmitter
+// can make the encoder produce one right away instead of at the next i-frame interval.
+// One UDP packet to the same port as the FECFeedback (video port + FECFeedback::FEEDBACK_PORT_OFFSET).
+// Lost requests are repeated by the receiver as long as it waits for the key frame
+struct __attribute__((__packed__)) KeyFrameRequest{
+    static constexpr uint32_t MAGIC=0x49445252; // "IDRR"
+    KeyFrameRequest()=default;
+    explicit KeyFrameRequest(uint32_t requestNum):requestNum(requestNum){}
+    uint32_t magic=MAGIC;
+    // Incremented with each request
+    uint32_t requestNum=0;
+    // Returns false if the buffer is not a key frame request
+    static bool parse(const uint8_t* buf,const size_t length,KeyFrameRequest& request){
+        if(length!=sizeof(KeyFrameRequest))return false;
+        std::memcpy(&request,buf,sizeof(KeyFrameRequest));
+        return request.magic==MAGIC;
+    }
+};
+
+#endif //LIVEVIDEO10MS_KEYFRAMEREQUEST_HPP
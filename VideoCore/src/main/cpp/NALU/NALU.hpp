@@ -13,18 +13,23 @@
 #include <sstream>
 #include <array>
 #include <vector>
+#include <functional>
+#include <memory>
 #include <h264_stream.h>
 #include <android/log.h>
 #include <AndroidLogger.hpp>
 #include <variant>
 #include <optional>
+#include <BufferPool.hpp>
 
 #include "H26X.hpp"
+#include "ParameterSetParser.hpp"
 
 
 /**
  * A NALU either contains H264 data (default) or H265 data
- * NOTE: Only when copy constructing a NALU it owns the data, else it only holds a data pointer (that might get overwritten by the parser if you hold onto a NALU)
+ * NOTE: A NALU created from a NALU_BUFFER only holds a data pointer (that might get overwritten by the parser if you hold onto a NALU).
+ * A NALU created from a pooled buffer (NALU_BUFFER_POOL::Handle) keeps the buffer alive, the parser won't touch it until the last copy is gone.
  * Also, H264 and H265 is slightly different
  */
 class NALU{
@@ -40,28 +45,41 @@ public:
     static constexpr const auto NALU_MAXLEN=1024*1024;
     // Application should re-use NALU_BUFFER to avoid memory allocations
     using NALU_BUFFER=std::array<uint8_t,NALU_MAXLEN>;
-    // Copy constructor allocates new buffer for data (heavy)
+    // Parsers assemble NALUs into buffers from this pool such that consumers can hold onto a NALU without copying it
+    using NALU_BUFFER_POOL=BufferPool<NALU_BUFFER>;
+    // Copy constructor of a pooled NALU only increments the ref count of the buffer (light)
+    // Else it allocates new buffer for data (heavy)
     NALU(const NALU& nalu):
-    ownedData(std::vector<uint8_t>(nalu.getData(),nalu.getData()+nalu.getSize())),
-    data(ownedData->data()),data_len(nalu.getSize()),creationTime(nalu.creationTime),IS_H265_PACKET(nalu.IS_H265_PACKET){
+    ownedData(nalu.pooledData ? std::nullopt : std::optional<std::vector<uint8_t>>(std::vector<uint8_t>(nalu.getData(),nalu.getData()+nalu.getSize()))),
+    pooledData(nalu.pooledData),
+    data(pooledData ? pooledData->data() : ownedData->data()),data_len(nalu.getSize()),creationTime(nalu.creationTime),IS_H265_PACKET(nalu.IS_H265_PACKET),
+    isEndOfAccessUnit(nalu.isEndOfAccessUnit){
         //MLOGD<<"NALU copy constructor";
     }
     // Default constructor does not allocate a new buffer,only stores some pointer (light)
     NALU(const NALU_BUFFER& data1,const size_t data_length,const bool IS_H265_PACKET1=false,const std::chrono::steady_clock::time_point creationTime=std::chrono::steady_clock::now()):
             data(data1.data()),data_len(data_length),creationTime{creationTime},IS_H265_PACKET(IS_H265_PACKET1){
     };
+    // Shares ownership of the pooled buffer (light)
+    NALU(const NALU_BUFFER_POOL::Handle& data1,const size_t data_length,const bool IS_H265_PACKET1=false,const std::chrono::steady_clock::time_point creationTime=std::chrono::steady_clock::now()):
+            pooledData(data1),data(data1->data()),data_len(data_length),creationTime{creationTime},IS_H265_PACKET(IS_H265_PACKET1){
+    };
     ~NALU()= default;
 private:
     // With the default constructor a NALU does not own its memory. This saves us one memcpy. However, storing a NALU after the lifetime of the
     // Non-owned memory expired is also needed in some places, so the copy-constructor creates a copy of the non-owned data and stores it in a optional buffer
     // WARNING: Order is important here (Initializer list). Declare before data pointer
     const std::optional<std::vector<uint8_t>> ownedData={};
+    const NALU_BUFFER_POOL::Handle pooledData={};
     //const NALU_BUFFER& data;
     const uint8_t* data;
     const size_t data_len;
 public:
     const bool IS_H265_PACKET;
     const std::chrono::steady_clock::time_point creationTime;
+    // Set by the rtp parser if the packet that completed this NALU had the marker bit set (last NALU of a frame).
+    // If false the NALU might still be the last one of a frame (e.g. raw streams don't have this information)
+    bool isEndOfAccessUnit=false;
 public:
     // pointer to the NALU data with 0001 prefix
     const uint8_t* getData()const{
@@ -96,6 +114,24 @@ public:
         assert(IS_H265_PACKET);
         return get_nal_unit_type()==H265::NAL_UNIT_VPS;
     }
+    // IDR slice (h264) or IRAP slice (h265, BLA / IDR / CRA). Decoding can start here
+    bool isKeyFrame()const{
+        const int type=get_nal_unit_type();
+        if(IS_H265_PACKET){
+            return type>=H265::NAL_UNIT_CODED_SLICE_BLA_W_LP && type<=H265::NAL_UNIT_CODED_SLICE_CRA;
+        }
+        return type==NAL_UNIT_TYPE_CODED_SLICE_IDR;
+    }
+    // False if no other frame references this one, e.g. a slice with nal_ref_idc==0 (h264) or a sub-layer non-reference
+    // picture (h265, TRAIL_N, TSA_N, ...). Such a slice can be dropped without breaking the following frames
+    bool isReference()const{
+        if(getSize()<5)return false;
+        if(IS_H265_PACKET){
+            const int type=get_nal_unit_type();
+            return !(type<=H265::NAL_UNIT_RESERVED_VCL_N14 && (type%2)==0);
+        }
+        return (getData()[4] & 0x60)!=0;
+    }
     int get_nal_unit_type()const{
         if(getSize()<5)return -1;
         if(IS_H265_PACKET){
@@ -126,20 +162,12 @@ public:
     //Returns video width and height if the NALU is an SPS
     std::array<int,2> getVideoWidthHeightSPS()const{
         assert(isSPS());
-        //if(!isSPS()){
-        //    return {-1,-1};
-        //}
-        if(IS_H265_PACKET){
+        const auto sps=IS_H265_PACKET ? ParameterSetParser::parseSPSH265(getDataWithoutPrefix(),getDataSizeWithoutPrefix()) :
+                ParameterSetParser::parseSPSH264(getDataWithoutPrefix(),getDataSizeWithoutPrefix());
+        if(!sps){
             return {640,480};
-        }else{
-            h264_stream_t* h = h264_new();
-            read_nal_unit(h,getDataWithoutPrefix(),(int)getDataSizeWithoutPrefix());
-            sps_t* sps=h->sps;
-            int Width = ((sps->pic_width_in_mbs_minus1 +1)*16) -sps->frame_crop_right_offset *2 -sps->frame_crop_left_offset *2;
-            int Height = ((2 -sps->frame_mbs_only_flag)* (sps->pic_height_in_map_units_minus1 +1) * 16) - (sps->frame_crop_bottom_offset* 2) - (sps->frame_crop_top_offset* 2);
-            h264_free(h);
-            return {Width,Height};
         }
+        return {sps->width,sps->height};
     }
 
     //Don't forget to free the h264 stream
@@ -0,0 +1,232 @@
+#ifndef LIVEVIDEO10MS_PARAMETERSETPARSER_HPP
+#define LIVEVIDEO10MS_PARAMETERSETPARSER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Minimal parser for the fields of h264 / h265 parameter sets that are needed to configure a decoder
+// (ids and video dimensions). Unlike h264bitstream it does not allocate a whole h264_stream_t and supports h265.
+// All functions take the NALU data without the 0,0,0,1 prefix but with the NAL unit header
+namespace ParameterSetParser{
+    // Reads bits from the RBSP (emulation prevention bytes removed) of a NALU.
+    // Reading past the end returns 0 and sets the error flag
+    class RBSPBitReader{
+    public:
+        RBSPBitReader(const uint8_t* data,const size_t data_length){
+            rbsp.reserve(data_length);
+            int nZeros=0;
+            for(size_t i=0;i<data_length;i++){
+                const uint8_t byte=data[i];
+                if(nZeros>=2 && byte==3){
+                    nZeros=0;
+                    continue;
+                }
+                nZeros=byte==0 ? nZeros+1 : 0;
+                rbsp.push_back(byte);
+            }
+        }
+        uint32_t u(const int nBits){
+            uint32_t ret=0;
+            for(int i=0;i<nBits;i++){
+                ret=(ret<<1) | readBit();
+            }
+            return ret;
+        }
+        bool flag(){
+            return readBit()!=0;
+        }
+        // Exp-Golomb unsigned
+        uint32_t ue(){
+            int leadingZeros=0;
+            while (readBit()==0){
+                leadingZeros++;
+                if(leadingZeros>31){
+                    error=true;
+                    return 0;
+                }
+            }
+            return ((1u<<leadingZeros)-1)+u(leadingZeros);
+        }
+        // Exp-Golomb signed
+        int32_t se(){
+            const uint32_t value=ue();
+            return (value & 1) ? (int32_t)((value+1)/2) : -(int32_t)(value/2);
+        }
+        void skip(const int nBits){
+            bitOffset+=nBits;
+        }
+        bool hasError()const{
+            return error || bitOffset>rbsp.size()*8;
+        }
+    private:
+        std::vector<uint8_t> rbsp;
+        size_t bitOffset=0;
+        bool error=false;
+        uint32_t readBit(){
+            if(bitOffset>=rbsp.size()*8){
+                error=true;
+                return 0;
+            }
+            const uint32_t ret=(rbsp[bitOffset/8]>>(7-(bitOffset%8))) & 1;
+            bitOffset++;
+            return ret;
+        }
+    };
+    struct SPSInfo{
+        int id=0;
+        // only h265
+        int vpsId=0;
+        int width=0;
+        int height=0;
+    };
+    struct PPSInfo{
+        int id=0;
+        int spsId=0;
+    };
+    // Width / height of the chroma samples relative to the luma samples, needed for the cropping units
+    inline void getSubWidthHeightC(const uint32_t chromaFormatIdc,const bool separateColourPlane,int& subWidthC,int& subHeightC){
+        subWidthC=(chromaFormatIdc==1 || chromaFormatIdc==2) && !separateColourPlane ? 2 : 1;
+        subHeightC=chromaFormatIdc==1 && !separateColourPlane ? 2 : 1;
+    }
+    inline void skipScalingListH264(RBSPBitReader& r,const int size){
+        int lastScale=8,nextScale=8;
+        for(int j=0;j<size;j++){
+            if(nextScale!=0){
+                nextScale=(lastScale+r.se()+256)%256;
+            }
+            lastScale=nextScale==0 ? lastScale : nextScale;
+        }
+    }
+    inline std::optional<SPSInfo> parseSPSH264(const uint8_t* data,const size_t data_length){
+        RBSPBitReader r(data,data_length);
+        r.skip(8); // NAL unit header
+        const uint32_t profileIdc=r.u(8);
+        r.skip(16); // constraint flags, level_idc
+        SPSInfo ret;
+        ret.id=(int)r.ue();
+        uint32_t chromaFormatIdc=1;
+        bool separateColourPlane=false;
+        if(profileIdc==100 || profileIdc==110 || profileIdc==122 || profileIdc==244 || profileIdc==44 || profileIdc==83 ||
+           profileIdc==86 || profileIdc==118 || profileIdc==128 || profileIdc==138 || profileIdc==139 || profileIdc==134 || profileIdc==135){
+            chromaFormatIdc=r.ue();
+            if(chromaFormatIdc==3){
+                separateColourPlane=r.flag();
+            }
+            r.ue(); // bit_depth_luma_minus8
+            r.ue(); // bit_depth_chroma_minus8
+            r.skip(1); // qpprime_y_zero_transform_bypass_flag
+            if(r.flag()){ // seq_scaling_matrix_present_flag
+                for(int i=0;i<(chromaFormatIdc!=3 ? 8 : 12);i++){
+                    if(r.flag()){
+                        skipScalingListH264(r,i<6 ? 16 : 64);
+                    }
+                }
+            }
+        }
+        r.ue(); // log2_max_frame_num_minus4
+        const uint32_t picOrderCntType=r.ue();
+        if(picOrderCntType==0){
+            r.ue(); // log2_max_pic_order_cnt_lsb_minus4
+        }else if(picOrderCntType==1){
+            r.skip(1); // delta_pic_order_always_zero_flag
+            r.se(); // offset_for_non_ref_pic
+            r.se(); // offset_for_top_to_bottom_field
+            const uint32_t nRefFramesInPicOrderCntCycle=r.ue();
+            for(uint32_t i=0;i<nRefFramesInPicOrderCntCycle && !r.hasError();i++){
+                r.se();
+            }
+        }
+        r.ue(); // max_num_ref_frames
+        r.skip(1); // gaps_in_frame_num_value_allowed_flag
+        const uint32_t picWidthInMbsMinus1=r.ue();
+        const uint32_t picHeightInMapUnitsMinus1=r.ue();
+        const bool frameMbsOnly=r.flag();
+        if(!frameMbsOnly){
+            r.skip(1); // mb_adaptive_frame_field_flag
+        }
+        r.skip(1); // direct_8x8_inference_flag
+        uint32_t cropLeft=0,cropRight=0,cropTop=0,cropBottom=0;
+        if(r.flag()){ // frame_cropping_flag
+            cropLeft=r.ue();
+            cropRight=r.ue();
+            cropTop=r.ue();
+            cropBottom=r.ue();
+        }
+        if(r.hasError())return std::nullopt;
+        int subWidthC,subHeightC;
+        getSubWidthHeightC(chromaFormatIdc,separateColourPlane,subWidthC,subHeightC);
+        const int cropUnitX=chromaFormatIdc==0 ? 1 : subWidthC;
+        const int cropUnitY=(chromaFormatIdc==0 ? 1 : subHeightC)*(2-frameMbsOnly);
+        ret.width=(int)(picWidthInMbsMinus1+1)*16-cropUnitX*(int)(cropLeft+cropRight);
+        ret.height=(int)((2-frameMbsOnly)*(picHeightInMapUnitsMinus1+1)*16)-cropUnitY*(int)(cropTop+cropBottom);
+        return ret;
+    }
+    inline void skipProfileTierLevelH265(RBSPBitReader& r,const uint32_t maxSubLayersMinus1){
+        // general_profile_space ... general_level_idc
+        r.skip(96);
+        bool subLayerProfilePresent[8]={false};
+        bool subLayerLevelPresent[8]={false};
+        for(uint32_t i=0;i<maxSubLayersMinus1;i++){
+            subLayerProfilePresent[i]=r.flag();
+            subLayerLevelPresent[i]=r.flag();
+        }
+        if(maxSubLayersMinus1>0){
+            for(uint32_t i=maxSubLayersMinus1;i<8;i++){
+                r.skip(2); // reserved_zero_2bits
+            }
+        }
+        for(uint32_t i=0;i<maxSubLayersMinus1;i++){
+            if(subLayerProfilePresent[i])r.skip(88);
+            if(subLayerLevelPresent[i])r.skip(8);
+        }
+    }
+    inline std::optional<SPSInfo> parseSPSH265(const uint8_t* data,const size_t data_length){
+        RBSPBitReader r(data,data_length);
+        r.skip(16); // NAL unit header
+        SPSInfo ret;
+        ret.vpsId=(int)r.u(4);
+        const uint32_t maxSubLayersMinus1=r.u(3);
+        r.skip(1); // sps_temporal_id_nesting_flag
+        if(maxSubLayersMinus1>7)return std::nullopt;
+        skipProfileTierLevelH265(r,maxSubLayersMinus1);
+        ret.id=(int)r.ue();
+        const uint32_t chromaFormatIdc=r.ue();
+        bool separateColourPlane=false;
+        if(chromaFormatIdc==3){
+            separateColourPlane=r.flag();
+        }
+        const uint32_t picWidth=r.ue();
+        const uint32_t picHeight=r.ue();
+        uint32_t confLeft=0,confRight=0,confTop=0,confBottom=0;
+        if(r.flag()){ // conformance_window_flag
+            confLeft=r.ue();
+            confRight=r.ue();
+            confTop=r.ue();
+            confBottom=r.ue();
+        }
+        if(r.hasError())return std::nullopt;
+        int subWidthC,subHeightC;
+        getSubWidthHeightC(chromaFormatIdc,separateColourPlane,subWidthC,subHeightC);
+        ret.width=(int)picWidth-subWidthC*(int)(confLeft+confRight);
+        ret.height=(int)picHeight-subHeightC*(int)(confTop+confBottom);
+        return ret;
+    }
+    inline std::optional<PPSInfo> parsePPS(const uint8_t* data,const size_t data_length,const bool isH265){
+        RBSPBitReader r(data,data_length);
+        r.skip(isH265 ? 16 : 8);
+        PPSInfo ret;
+        ret.id=(int)r.ue();
+        ret.spsId=(int)r.ue();
+        if(r.hasError())return std::nullopt;
+        return ret;
+    }
+    // vps_video_parameter_set_id are the first 4 bits after the NAL unit header
+    inline std::optional<int> parseVPSId(const uint8_t* data,const size_t data_length){
+        if(data_length<3)return std::nullopt;
+        return data[2]>>4;
+    }
+}
+
+#endif //LIVEVIDEO10MS_PARAMETERSETPARSER_HPP
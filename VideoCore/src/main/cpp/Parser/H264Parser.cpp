@@ -18,7 +18,14 @@ void logIfNull(void * ptr,std::string message){
 H264Parser::H264Parser(NALU_DATA_CALLBACK onNewNALU):
         onNewNALU(std::move(onNewNALU)),
         mParseRAW(std::bind(&H264Parser::newNaluExtracted, this, std::placeholders::_1)),
-        mDecodeRTP(std::bind(&H264Parser::newNaluExtracted, this, std::placeholders::_1)){
+        mDecodeRTP(std::bind(&H264Parser::newNaluExtracted, this, std::placeholders::_1)),
+        mRTPReorderBuffer([this](const uint8_t* rtp_data,const size_t data_length){
+            if(mRTPIsH265){
+                mDecodeRTP.parseRTPH265toNALU(rtp_data,data_length);
+            }else{
+                mDecodeRTP.parseRTPtoNALU(rtp_data,data_length);
+            }
+        }){
     // ffmpeg stuff
     /*m_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
     logIfNull(m_codec,"avcodec_find_decoder");
@@ -35,6 +42,7 @@ H264Parser::H264Parser(NALU_DATA_CALLBACK onNewNALU):
 
 void H264Parser::reset(){
     mParseRAW.reset();
+    mRTPReorderBuffer.reset();
     mDecodeRTP.reset();
     nParsedNALUs=0;
     nParsedKeyFrames=0;
@@ -56,13 +64,23 @@ void H264Parser::parse_raw_h265_stream(const uint8_t *data,const size_t data_len
 void H264Parser::parse_rtp_h264_stream(const uint8_t *rtp_data,const size_t data_length) {
     //const auto seqNr=RTPDecoder::getSequenceNumber(rtp_data,data_length);
     //debugSequenceNumbers(seqNr);
-    mDecodeRTP.parseRTPtoNALU(rtp_data, data_length);
+    mRTPIsH265=false;
+    if(data_length==0){
+        mRTPReorderBuffer.checkTimeouts();
+        return;
+    }
+    mRTPReorderBuffer.addPacket(rtp_data, data_length);
 }
 
 void H264Parser::parse_rtp_h265_stream(const uint8_t *rtp_data,const size_t data_length) {
     //const auto seqNr=RTPDecoder::getSequenceNumber(rtp_data,data_length);
     //debugSequenceNumbers(seqNr);
-    mDecodeRTP.parseRTPH265toNALU(rtp_data, data_length);
+    mRTPIsH265=true;
+    if(data_length==0){
+        mRTPReorderBuffer.checkTimeouts();
+        return;
+    }
+    mRTPReorderBuffer.addPacket(rtp_data, data_length);
 }
 
 void H264Parser::parseDjiLiveVideoData(const uint8_t *data,const size_t data_length) {
@@ -79,6 +97,10 @@ void H264Parser::setLimitFPS(int maxFPS1) {
     this->maxFPS=maxFPS1;
 }
 
+void H264Parser::setRTPReorderBudget(std::size_t maxNPackets,std::chrono::microseconds maxLatency) {
+    mRTPReorderBuffer.setBudget(maxNPackets,maxLatency);
+}
+
 void H264Parser::newNaluExtracted(const NALU& nalu) {
     using namespace std::chrono;
     //LOGD("H264Parser::newNaluExtracted");
@@ -165,15 +187,19 @@ void H264Parser::parseCustom(const uint8_t *data, const std::size_t data_length)
 
 void H264Parser::parseCustomRTPinsideFEC(const uint8_t *data, const std::size_t data_len) {
 
-    mFECDecoder.add_block(data, data_len);
+    if(data_len==0){
+        mFECDecoder.check_timeout();
+    }else{
+        mFECDecoder.add_block(data, data_len);
+    }
     //std::vector<uint8_t> obuf;
     //obuf.reserve(1024*1024);
-    for (std::shared_ptr<FECBlock> sblk = mFECDecoder.get_block(); sblk; sblk = mFECDecoder.get_block()) {
+    for (FECBlockView sblk = mFECDecoder.get_block_view(); sblk; sblk = mFECDecoder.get_block_view()) {
         // One block should be equal to one rtp packet
         const uint8_t* sblkData=sblk->data();
         const size_t sblkDataLength=sblk->data_length();
         if(sblkDataLength>10){
-            MLOGD<<"Parsing rtp "<<sblkDataLength;
+            MLOGV<<"Parsing rtp "<<sblkDataLength;
             const auto seqNr=RTPDecoder::getSequenceNumber(sblkData,sblkDataLength);
             debugSequenceNumbers(seqNr);
             mDecodeRTP.parseRTPtoNALU(sblkData,sblkDataLength);
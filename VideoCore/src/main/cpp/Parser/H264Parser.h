@@ -5,6 +5,7 @@
 #ifndef FPV_VR_PARSE2H264RAW_H
 #define FPV_VR_PARSE2H264RAW_H
 
+#include <algorithm>
 #include <functional>
 #include <sstream>
 
@@ -21,6 +22,7 @@
 
 #include "ParseRAW.h"
 #include "ParseRTP.h"
+#include "RTPReorderBuffer.hpp"
 
 #include "FrameLimiter.hpp"
 //
@@ -42,19 +44,39 @@ public:
     H264Parser(NALU_DATA_CALLBACK onNewNALU);
     void parse_raw_h264_stream(const uint8_t* data,const size_t data_length);
     void parse_raw_h265_stream(const uint8_t* data,const size_t data_length);
+    // An empty packet (data_len==0) only forwards the packets the re-order buffer held back longer than its budget.
+    // Call it when no packet arrived for a while (see getRTPReorderTimeout()), else they are held back until the next packet
     void parse_rtp_h264_stream(const uint8_t* rtp_data,const size_t data_len);
     void parse_rtp_h265_stream(const uint8_t* rtp_data,const size_t data_len);
     //void parse_rtp_h264_stream_ffmpeg(const uint8_t* rtp_data,const size_t data_len);
     void parseDjiLiveVideoData(const uint8_t* data,const size_t data_len);
     //
     void parseCustom(const uint8_t* data,const size_t data_len);
+    // An empty packet (data_len==0) only gives up the FEC sequences whose timeout has passed.
+    // Call it when no packet arrived for FEC_TIMEOUT, else a lost sequence holds back the following ones until the next packet
     void parseCustomRTPinsideFEC(const uint8_t* data, const size_t data_len);
+    static constexpr const auto FEC_TIMEOUT=std::chrono::milliseconds(10);
     void reset();
 public:
     long nParsedNALUs=0;
     long nParsedKeyFrames=0;
     //For live video set to -1 (no fps limitation), else additional latency will be generated
     void setLimitFPS(int maxFPS);
+    // Re-order rtp packets, trading up to maxLatency for less incomplete (dropped) NALUs. 0 == disabled (default)
+    void setRTPReorderBudget(std::size_t maxNPackets,std::chrono::microseconds maxLatency);
+    // How often to check the re-order budget while no packets arrive, such that a packet is held back at most 1.5 x maxLatency
+    static std::chrono::milliseconds getRTPReorderTimeout(const std::chrono::microseconds maxLatency){
+        return std::max(std::chrono::duration_cast<std::chrono::milliseconds>(maxLatency/2),std::chrono::milliseconds(1));
+    }
+    const RTPReorderBuffer::Stats& getRTPReorderStats()const{
+        return mRTPReorderBuffer.getStats();
+    }
+    long getNDroppedIncompleteNALUs()const{
+        return mDecodeRTP.nDroppedIncompleteNALUs;
+    }
+    const FECDecoderStats& getFECStats()const{
+        return mFECDecoder.stats();
+    }
 private:
     void newNaluExtracted(const NALU& nalu);
     const NALU_DATA_CALLBACK onNewNALU;
@@ -62,6 +84,9 @@ private:
     std::chrono::steady_clock::time_point lastTimeOnNewNALUCalled=std::chrono::steady_clock::now();
     ParseRAW mParseRAW;
     RTPDecoder mDecodeRTP;
+    // Forwards (re-ordered) packets to mDecodeRTP
+    RTPReorderBuffer mRTPReorderBuffer;
+    bool mRTPIsH265=false;
 
     FrameLimiter mFrameLimiter;
     int maxFPS=0;
@@ -86,8 +111,11 @@ private:
     int droppedPacketsSinceLastForwardedPacket=0;
     //
     AvgCalculatorSize avgUDPPacketSize;
-    //
-    FECDecoder mFECDecoder;
+    // VideoTransmitter wraps every rtp packet (up to 1500 bytes) into its own sequence, other transmitters use
+    // a couple of data / FEC blocks. The arena grows if the stream needs more.
+    // Up to 8 sequences are decoded at the same time such that reordered packets can still be used, a missing block
+    // holds back the following ones for at most FEC_TIMEOUT.
+    FECDecoder mFECDecoder{8,8,1502,8,FEC_TIMEOUT};
     //
     std::vector<std::size_t> receivedDataPacketsSize;
 private:
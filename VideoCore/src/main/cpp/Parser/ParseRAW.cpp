@@ -6,6 +6,8 @@
 #include "ParseRAW.h"
 #include <android/log.h>
 #include <AndroidLogger.hpp>
+#include <algorithm>
+#include "StartCodeScanner.hpp"
 
 ParseRAW::ParseRAW(NALU_DATA_CALLBACK cb):cb(cb){
 }
@@ -22,62 +24,86 @@ void ParseRAW::reset(){
 }
 
 void ParseRAW::getAvailableBuffer(){
-    std::lock_guard<std::mutex> lock(mBufferMutex);
-    for(const auto buff:allocatedBuffers){
-
+    if(nalu_data.useCount()>1){
+        nalu_data=mBufferPool.acquire();
     }
 }
 
 void ParseRAW::parseData(const uint8_t* data,const size_t data_length,const bool isH265){
-    //if(nalu_data== nullptr){
-    //    nalu_data=new uint8_t[NALU::NALU_MAXLEN];
-    //}
-    MLOGD<<"NALU data "<<data_length;
-    for (size_t i = 0; i < data_length; ++i) {
-        nalu_data[nalu_data_position++] = data[i];
-        if (nalu_data_position >= NALU::NALU_MAXLEN - 1) {
-            // This should never happen, but rather continue parsing than
-            // possibly raising an 'memory access' exception
-            nalu_data_position = 0;
-        }
-        // Since the '0,0,0,1' is written by the loop,
-        // The 5th byte is the first byte that is actually 'parsed'
-        if(nalu_data_position==5){
-            timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
-        }
-        switch (nalu_search_state) {
-            case 0:
-            case 1:
-            case 2:
-                if (data[i] == 0)
-                    nalu_search_state++;
-                else
-                    nalu_search_state = 0;
-                break;
-            case 3:
-                if (data[i] == 1) {
-                    nalu_data[0] = 0;
-                    nalu_data[1] = 0;
-                    nalu_data[2] = 0;
-                    nalu_data[3] = 1;
-                    if(cb!=nullptr && nalu_data_position>=4){
-                        const size_t naluLen=nalu_data_position-4;
-                        NALU nalu(nalu_data,naluLen,isH265);
-                        cb(nalu);
-                    }
-                    nalu_data_position = 4;
+    size_t i=0;
+    while (i<data_length){
+        // Search state 0 means the last byte was not a zero. Everything in front of the next zero byte
+        // can be copied directly. This does exactly the same as calling parseByte for each of these bytes,
+        // as long as the copy does not reach the (should never happen) NALU_MAXLEN wrap around
+        if(nalu_search_state==0){
+            const size_t maxSpan=std::min(data_length-i,NALU::NALU_MAXLEN-2-nalu_data_position);
+            const size_t span=StartCodeScanner::findFirstZero(&data[i],maxSpan);
+            if(span>0){
+                memcpy(&(*nalu_data)[nalu_data_position],&data[i],span);
+                if(nalu_data_position<5 && nalu_data_position+span>=5){
+                    timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
                 }
-                nalu_search_state = 0;
-                break;
-            default:
-                break;
+                nalu_data_position+=span;
+                i+=span;
+                continue;
+            }
         }
+        parseByte(data[i],isH265);
+        i++;
+    }
+}
+
+void ParseRAW::parseDataScalar(const uint8_t* data,const size_t data_length,const bool isH265){
+    for (size_t i = 0; i < data_length; ++i) {
+        parseByte(data[i],isH265);
+    }
+}
+
+void ParseRAW::parseByte(const uint8_t byte,const bool isH265){
+    (*nalu_data)[nalu_data_position++] = byte;
+    if (nalu_data_position >= NALU::NALU_MAXLEN - 1) {
+        // This should never happen, but rather continue parsing than
+        // possibly raising an 'memory access' exception
+        nalu_data_position = 0;
+    }
+    // Since the '0,0,0,1' is written by the loop,
+    // The 5th byte is the first byte that is actually 'parsed'
+    if(nalu_data_position==5){
+        timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
+    }
+    switch (nalu_search_state) {
+        case 0:
+        case 1:
+        case 2:
+            if (byte == 0)
+                nalu_search_state++;
+            else
+                nalu_search_state = 0;
+            break;
+        case 3:
+            if (byte == 1) {
+                (*nalu_data)[0] = 0;
+                (*nalu_data)[1] = 0;
+                (*nalu_data)[2] = 0;
+                (*nalu_data)[3] = 1;
+                if(cb!=nullptr && nalu_data_position>=4){
+                    const size_t naluLen=nalu_data_position-4;
+                    NALU nalu(nalu_data,naluLen,isH265);
+                    cb(nalu);
+                }
+                getAvailableBuffer();
+                nalu_data_position = 4;
+            }
+            nalu_search_state = 0;
+            break;
+        default:
+            break;
     }
 }
 
 void ParseRAW::parseDjiLiveVideoData(const uint8_t* data,const size_t data_length){
     for (size_t i = 0; i < data_length; ++i) {
-        nalu_data[nalu_data_position++] = data[i];
+        (*nalu_data)[nalu_data_position++] = data[i];
         if (nalu_data_position >= NALU::NALU_MAXLEN - 1) {
             nalu_data_position = 0;
         }
@@ -92,10 +118,10 @@ void ParseRAW::parseDjiLiveVideoData(const uint8_t* data,const size_t data_lengt
                 break;
             case 3:
                 if (data[i] == 1) {
-                    nalu_data[0] = 0;
-                    nalu_data[1] = 0;
-                    nalu_data[2] = 0;
-                    nalu_data[3] = 1;
+                    (*nalu_data)[0] = 0;
+                    (*nalu_data)[1] = 0;
+                    (*nalu_data)[2] = 0;
+                    (*nalu_data)[3] = 1;
                     if(cb!=nullptr && nalu_data_position>=4){
                         NALU nalu(nalu_data,nalu_data_position-4);
                         if(nalu.isSPS() || nalu.isPPS()){
@@ -112,6 +138,7 @@ void ParseRAW::parseDjiLiveVideoData(const uint8_t* data,const size_t data_lengt
                             dji_data_buff_size+=nalu.getSize();
                         }
                     }
+                    getAvailableBuffer();
                     nalu_data_position = 4;
                 }
                 nalu_search_state = 0;
@@ -17,24 +17,27 @@ class ParseRAW {
 public:
     ParseRAW(NALU_DATA_CALLBACK cb);
     // normally H264, otherwise H264 - both protocols use the [0,0,0,1] pattern as prefix
+    // Bytes that cannot be part of a start code are found with SIMD and copied in bulk (see StartCodeScanner)
     void parseData(const uint8_t* data,const size_t data_length,const bool isH265=false);
+    // Same result as parseData, but looks at each byte individually. Reference implementation, only use for testing / benchmarking
+    void parseDataScalar(const uint8_t* data,const size_t data_length,const bool isH265=false);
     // Special parsing method, where AUD determine the end of sliced data packets that cannot decoded individually
     void parseDjiLiveVideoData(const uint8_t* data,const size_t data_length);
     void reset();
 private:
     const NALU_DATA_CALLBACK cb;
-    NALU::NALU_BUFFER nalu_data;
-    //std::vector<uint8_t> nalu_data;
-    //std::shared_ptr<NALU::NALU_BUFFER> nalu_data;
-    std::mutex mBufferMutex;
-    std::vector<NALU::NALU_BUFFER> allocatedBuffers{10};
+    // NALUs are assembled in pooled buffers, such that the consumer can hold onto a NALU without copying it
+    NALU::NALU_BUFFER_POOL mBufferPool{2};
+    NALU::NALU_BUFFER_POOL::Handle nalu_data=mBufferPool.acquire();
 
     size_t nalu_data_position=4;
     int nalu_search_state=0;
     //
     std::array<uint8_t,NALU::NALU_MAXLEN> dji_data_buff;
     std::size_t dji_data_buff_size=0;
-    //
+    // Advance the start code search by one byte
+    void parseByte(const uint8_t byte,const bool isH265);
+    // Call after a NALU was forwarded. If the consumer kept a reference, continue with a fresh buffer
     void getAvailableBuffer();
     // This time point is as 'early as possible' to debug the parsing time as accurately as possible.
     // E.g not the time when the 'ending' sequence was detected, but the first byte of this nalu was received / parsed
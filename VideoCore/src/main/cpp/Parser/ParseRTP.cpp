@@ -5,6 +5,8 @@
 #include "ParseRTP.h"
 #include <AndroidLogger.hpp>
 #include <arpa/inet.h>
+#include <cstring>
+#include <algorithm>
 
 //changed "unsigned char" to uint8_t
 typedef struct rtp_header {
@@ -54,10 +56,45 @@ typedef struct fu_indicator {
 static constexpr auto RTP_PAYLOAD_TYPE_H264=96;
 static constexpr auto MY_SSRC_NUM=10;
 
-typedef struct nalu_header_h265{
-    uint16_t payloadHdr;
-    uint16_t donl;
-}__attribute__ ((packed)) nalu_header_h265_t;
+// Everything the depacketizer needs to know about the codec. H264: RFC 6184, H265: RFC 7798
+// Only non-interleaved mode is supported (no STAP-B,MTAP,FU-B and no DONL fields)
+struct RTPCodecH264{
+    static constexpr const bool IS_H265=false;
+    static constexpr const size_t NAL_HEADER_SIZE=1;
+    static constexpr const int TYPE_AGGREGATION=24; // STAP-A
+    static constexpr const int TYPE_FRAGMENTATION=28; // FU-A
+    static constexpr const int TYPE_PACI=-1; // Does not exist for h264
+    static int getType(const uint8_t* nalHeader){
+        return nalHeader[0] & 0x1f;
+    }
+    static bool isSingleNALU(const int type){
+        return type>=1 && type<=23;
+    }
+    // The fu header contains the type of the fragmented NALU, the rest comes from the fu indicator
+    static void writeFragmentedNALUHeader(uint8_t* dst,const uint8_t* nalHeader,const uint8_t fuHeader){
+        dst[0]=(uint8_t)((nalHeader[0] & 0xE0) | (fuHeader & 0x1f));
+    }
+};
+struct RTPCodecH265{
+    static constexpr const bool IS_H265=true;
+    static constexpr const size_t NAL_HEADER_SIZE=2;
+    static constexpr const int TYPE_AGGREGATION=48; // AP
+    static constexpr const int TYPE_FRAGMENTATION=49; // FU
+    static constexpr const int TYPE_PACI=50;
+    static int getType(const uint8_t* nalHeader){
+        return (nalHeader[0] >> 1) & 0x3f;
+    }
+    static bool isSingleNALU(const int type){
+        return type>=0 && type<=47;
+    }
+    static void writeFragmentedNALUHeader(uint8_t* dst,const uint8_t* nalHeader,const uint8_t fuHeader){
+        dst[0]=(uint8_t)((nalHeader[0] & 0x81) | ((fuHeader & 0x3f) << 1));
+        dst[1]=nalHeader[1];
+    }
+};
+// Same for h264 FU-A and h265 FU
+static constexpr const uint8_t FU_HEADER_START_BIT=0x80;
+static constexpr const uint8_t FU_HEADER_END_BIT=0x40;
 
 RTPDecoder::RTPDecoder(NALU_DATA_CALLBACK cb): cb(std::move(cb)){
 }
@@ -68,6 +105,8 @@ void RTPDecoder::reset(){
 }
 
 static void debugRtpHeader(const rtp_header_t* rtp_header){
+    // Called for every packet, don't build the string if it is not printed anyways
+    if(!MLOG_IS_ENABLED(MLogLevel::V))return;
     std::stringstream ss;
     ss<<"cc"<<(int)rtp_header->cc<<"\n";
     ss<<"extension"<<(int)rtp_header->extension<<"\n";
@@ -78,18 +117,32 @@ static void debugRtpHeader(const rtp_header_t* rtp_header){
     ss<<"sequence"<<(int)htons(rtp_header->sequence)<<"\n";
     ss<<"timestamp"<<(int)rtp_header->timestamp<<"\n";
     ss<<"sources"<<(int)rtp_header->sources<<"\n";
-    MLOGD<<"RTP Header: "<<ss.str();
+    MLOGV<<"RTP Header: "<<ss.str();
 }
 
-void RTPDecoder::parseRTPtoNALU(const uint8_t* rtp_data, const size_t data_length){
-    //12 rtp header bytes and 1 nalu_header_t type byte
-    if(data_length <= sizeof(rtp_header_t)+sizeof(nalu_header_t)){
-        MLOGD<<"Not enough rtp data";
-        return;
+const uint8_t* RTPDecoder::getPayload(const uint8_t* rtp_data,const size_t data_length,size_t& payloadLength){
+    if(data_length<sizeof(rtp_header_t)){
+        return nullptr;
+    }
+    const auto* rtp_header=(rtp_header_t*)rtp_data;
+    size_t offset=sizeof(rtp_header_t)+rtp_header->cc*sizeof(uint32_t);
+    if(rtp_header->extension){
+        // 16 bit profile, 16 bit length (in 32 bit words) then the extension data
+        if(offset+4>data_length)return nullptr;
+        const size_t extensionLength=(rtp_data[offset+2]<<8) | rtp_data[offset+3];
+        offset+=4+extensionLength*sizeof(uint32_t);
     }
-    MLOGD<<"Got rtp data";
-    // Testing regarding sequence numbers.This stuff an be removed without issues
-    const int seqNr=getSequenceNumber(rtp_data,data_length);
+    size_t end=data_length;
+    if(rtp_header->padding){
+        // The last byte contains the n of padding bytes (including itself)
+        end-=rtp_data[data_length-1];
+    }
+    if(offset>=end || end>data_length)return nullptr;
+    payloadLength=end-offset;
+    return &rtp_data[offset];
+}
+
+void RTPDecoder::checkSequenceNumber(const int seqNr){
     if(seqNr==lastSequenceNumber){
         // duplicate. This should never happen for 'normal' rtp streams, but can be usefully when testing bitrates
         // (Since you can send the same packet multiple times to emulate a higher bitrate)
@@ -101,146 +154,165 @@ void RTPDecoder::parseRTPtoNALU(const uint8_t* rtp_data, const size_t data_lengt
         flagPacketHasGoneMissing=false;
     }else{
         // Don't forget that the sequence number loops every UINT16_MAX packets
-        if(seqNr != ((lastSequenceNumber+1) % UINT16_MAX)){
-            // We are missing a Packet !
+        if(seqNr != ((lastSequenceNumber+1) % (UINT16_MAX+1))){
+            // We are missing a Packet ! Any fragmented NALU we are currently assembling is incomplete
             MLOGD<<"missing a packet. Last:"<<lastSequenceNumber<<" Curr:"<<seqNr<<" Diff:"<<(seqNr-(int)lastSequenceNumber);
-            //flagPacketHasGoneMissing=true;
+            flagPacketHasGoneMissing=true;
         }
     }
     lastSequenceNumber=seqNr;
+}
+
+void RTPDecoder::parseRTPtoNALU(const uint8_t* rtp_data, const size_t data_length){
+    parseRTP<RTPCodecH264>(rtp_data,data_length);
+}
+
+void RTPDecoder::parseRTPH265toNALU(const uint8_t* rtp_data, const size_t data_length){
+    parseRTP<RTPCodecH265>(rtp_data,data_length);
+}
 
-    const auto* rtp_header=(rtp_header_t*)&rtp_data[0];
-    debugRtpHeader(rtp_header);
-    //  24576
-    if(rtp_header->payload==96){
-        MLOGD<<"Is h264";
-    }else if(rtp_header->payload==97){
-        MLOGD<<"Is h265";
+template<class Codec>
+void RTPDecoder::parseRTP(const uint8_t* rtp_data, const size_t data_length){
+    size_t payloadLength;
+    const uint8_t* payload=getPayload(rtp_data,data_length,payloadLength);
+    //rtp header bytes and at least one byte after the NAL unit header
+    if(payload==nullptr || payloadLength<=Codec::NAL_HEADER_SIZE){
+        MLOGD<<"Not enough rtp data";
+        return;
     }
-    const auto* nalu_header=(nalu_header_t *)&rtp_data[sizeof(rtp_header_t)];
-
-    if (nalu_header->type == 28) { /* FU-A */
-        MLOGD<<"Got partial NALU";
-        const fu_header_t* fu_header = (fu_header_t*)&rtp_data[13];
-        if (fu_header->e == 1) {
-            /* end of fu-a */
-            memcpy(&mNALU_DATA[mNALU_DATA_LENGTH], &rtp_data[14], (size_t)data_length - 14);
-            mNALU_DATA_LENGTH+= data_length - 14;
-            if(!flagPacketHasGoneMissing){
-                // To better measure latency we can actually use the timestamp from when the first bytes for this packet were received
-                forwardNALU(timePointStartOfReceivingNALU);
+    MLOGV<<"Got rtp data";
+    checkSequenceNumber(getSequenceNumber(rtp_data,data_length));
+    debugRtpHeader((rtp_header_t*)rtp_data);
+    currentPacketHasMarker=((const rtp_header_t*)rtp_data)->marker;
+    parsePayload<Codec>(payload,&payload[Codec::NAL_HEADER_SIZE],payloadLength-Codec::NAL_HEADER_SIZE);
+}
+
+template<class Codec>
+void RTPDecoder::parsePayload(const uint8_t* nalHeader,const uint8_t* data,const size_t data_length){
+    const int type=Codec::getType(nalHeader);
+    if(Codec::isSingleNALU(type)){
+        MLOGV<<"Got full nalu";
+        discardIncompleteNALU();
+        timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
+        // Full NALU - we can remove the 'drop packet' flag
+        if(flagPacketHasGoneMissing){
+            MLOGD<<"Got full NALU - clearing missing packet flag";
+            flagPacketHasGoneMissing= false;
+        }
+        beginNALU(nalHeader,Codec::NAL_HEADER_SIZE);
+        appendNALU(data,data_length);
+        forwardNALU(timePointStartOfReceivingNALU,Codec::IS_H265,currentPacketHasMarker);
+    }else if(type==Codec::TYPE_AGGREGATION){
+        MLOGV<<"Got aggregation packet";
+        discardIncompleteNALU();
+        timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
+        // Self-contained as well - we can remove the 'drop packet' flag
+        flagPacketHasGoneMissing=false;
+        // Each NALU (including its NAL unit header) is prefixed by its 16 bit size
+        size_t offset=0;
+        while (offset+2<=data_length){
+            const size_t naluSize=(data[offset]<<8) | data[offset+1];
+            offset+=2;
+            if(naluSize<=Codec::NAL_HEADER_SIZE || offset+naluSize>data_length){
+                MLOGD<<"Invalid aggregation packet";
+                break;
             }
-            mNALU_DATA_LENGTH=0;
-        } else if (fu_header->s == 1) {
+            beginNALU(&data[offset],Codec::NAL_HEADER_SIZE);
+            appendNALU(&data[offset+Codec::NAL_HEADER_SIZE],naluSize-Codec::NAL_HEADER_SIZE);
+            // The marker bit only applies to the last NALU in the packet
+            forwardNALU(timePointStartOfReceivingNALU,Codec::IS_H265,currentPacketHasMarker && offset+naluSize==data_length);
+            offset+=naluSize;
+        }
+    }else if(type==Codec::TYPE_FRAGMENTATION){
+        MLOGV<<"Got partial NALU";
+        if(data_length<=1)return;
+        const uint8_t fuHeader=data[0];
+        if(fuHeader & FU_HEADER_START_BIT){
+            discardIncompleteNALU();
             timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
             // Beginning of new fu sequence - we can remove the 'drop packet' flag
             if(flagPacketHasGoneMissing){
                 MLOGD<<"Got fu-a start - clearing missing packet flag";
                 flagPacketHasGoneMissing=false;
             }
-            /* start of fu-a */
-            mNALU_DATA[0]=0;
-            mNALU_DATA[1]=0;
-            mNALU_DATA[2]=0;
-            mNALU_DATA[3]=1;
-            mNALU_DATA_LENGTH=4;
-            const uint8_t h264_nal_header = (uint8_t)(fu_header->type & 0x1f)
-                                            | (nalu_header->nri << 5)
-                                            | (nalu_header->f << 7);
-            mNALU_DATA[4]=h264_nal_header;
-            mNALU_DATA_LENGTH++;
-            memcpy(&mNALU_DATA[mNALU_DATA_LENGTH], &rtp_data[14], (size_t)data_length - 14);
-            mNALU_DATA_LENGTH+= data_length - 14;
-        } else {
-            /* middle of fu-a */
-            memcpy(&mNALU_DATA[mNALU_DATA_LENGTH], &rtp_data[14], (size_t)data_length - 14);
-            mNALU_DATA_LENGTH+= data_length - 14;
+            uint8_t reconstructedHeader[Codec::NAL_HEADER_SIZE];
+            Codec::writeFragmentedNALUHeader(reconstructedHeader,nalHeader,fuHeader);
+            beginNALU(reconstructedHeader,Codec::NAL_HEADER_SIZE);
+        }else if(mNALU_DATA_LENGTH==0){
+            // middle or end without start
+            flagPacketHasGoneMissing=true;
         }
-        //LOGV("partially nalu");
-    } else if(nalu_header->type>0 && nalu_header->type<24){
-        MLOGD<<"Got full nalu";
-        timePointStartOfReceivingNALU=std::chrono::steady_clock::now();
-        // Full NALU - we can remove the 'drop packet' flag
-        if(flagPacketHasGoneMissing){
-            MLOGD<<"Got full NALU - clearing missing packet flag";
-            flagPacketHasGoneMissing= false;
+        if(!flagPacketHasGoneMissing){
+            // Never write past the end of the NALU buffer. Treat it like a missing packet
+            if(!appendNALU(&data[1],data_length-1)){
+                flagPacketHasGoneMissing=true;
+            }
         }
-        /* full nalu */
-        mNALU_DATA[0]=0;
-        mNALU_DATA[1]=0;
-        mNALU_DATA[2]=0;
-        mNALU_DATA[3]=1;
-        mNALU_DATA_LENGTH=4;
-        const uint8_t h264_nal_header = (uint8_t )(nalu_header->type & 0x1f)
-                                        | (nalu_header->nri << 5)
-                                        | (nalu_header->f << 7);
-        mNALU_DATA[4]=h264_nal_header;
-        mNALU_DATA_LENGTH++;
-        memcpy(&mNALU_DATA[mNALU_DATA_LENGTH], &rtp_data[13], (size_t)data_length - 13);
-        mNALU_DATA_LENGTH+= data_length - 13;
-        forwardNALU(timePointStartOfReceivingNALU);
-        mNALU_DATA_LENGTH=0;
+        if(fuHeader & FU_HEADER_END_BIT){
+            if(!flagPacketHasGoneMissing){
+                // To better measure latency we can actually use the timestamp from when the first bytes for this packet were received
+                forwardNALU(timePointStartOfReceivingNALU,Codec::IS_H265,currentPacketHasMarker);
+            }else{
+                // Incomplete NALUs stall the HW decoder, better drop them
+                nDroppedIncompleteNALUs++;
+            }
+            mNALU_DATA_LENGTH=0;
+        }
+    }else if(type==Codec::TYPE_PACI){
+        // Payload content information header: A(1) cType(6) PHSsize(5) F0..F2(3) Y(1), then PHSsize bytes of PHES
+        // followed by the actual payload. Its NAL unit header is the PACI header with type=cType
+        if(data_length<2)return;
+        const int cType=(data[0]>>1) & 0x3f;
+        const size_t phsSize=((data[0] & 0x01)<<4) | (data[1]>>4);
+        if(cType==Codec::TYPE_PACI || data_length<=2+phsSize)return;
+        uint8_t innerHeader[Codec::NAL_HEADER_SIZE];
+        std::memcpy(innerHeader,nalHeader,Codec::NAL_HEADER_SIZE);
+        innerHeader[0]=(uint8_t)((nalHeader[0] & 0x81) | (cType<<1));
+        parsePayload<Codec>(innerHeader,&data[2+phsSize],data_length-2-phsSize);
     }else{
-        //MLOGD<<"header:"<<nalu_header->type;
+        MLOGD<<"Unsupported NALU type "<<type;
     }
 }
 
-void RTPDecoder::parseRTPH265toNALU(const uint8_t* rtp_data, const size_t data_length){
-    //12 rtp header bytes and 1 nalu_header_t type byte
-    if(data_length <= sizeof(rtp_header_t)+sizeof(nalu_header_t)){
-        MLOGD<<"Not enough rtp data";
-        return;
-    }
-    MLOGD<<"Got rtp data";
-    // Testing regarding sequence numbers.This stuff an be removed without issues
-    const int seqNr=getSequenceNumber(rtp_data,data_length);
-    if(seqNr==lastSequenceNumber){
-        // duplicate. This should never happen for 'normal' rtp streams, but can be usefully when testing bitrates
-        // (Since you can send the same packet multiple times to emulate a higher bitrate)
-        MLOGD<<"Same seqNr";
-        //return;
-    }
-    if(lastSequenceNumber==-1){
-        // first packet in stream
-        flagPacketHasGoneMissing=false;
-    }else{
-        // Don't forget that the sequence number loops every UINT16_MAX packets
-        if(seqNr != ((lastSequenceNumber+1) % UINT16_MAX)){
-            // We are missing a Packet !
-            MLOGD<<"missing a packet. Last:"<<lastSequenceNumber<<" Curr:"<<seqNr<<" Diff:"<<(seqNr-(int)lastSequenceNumber);
-            //flagPacketHasGoneMissing=true;
-        }
+void RTPDecoder::discardIncompleteNALU(){
+    if(mNALU_DATA_LENGTH>0){
+        // The end of the fragmented NALU went missing
+        nDroppedIncompleteNALUs++;
+        mNALU_DATA_LENGTH=0;
     }
-    lastSequenceNumber=seqNr;
+}
 
-    const auto* rtp_header=(rtp_header_t*)&rtp_data[0];
-    debugRtpHeader(rtp_header);
-    //  24576
-    if(rtp_header->payload==96){
-        MLOGD<<"Is payload type 96";
+void RTPDecoder::beginNALU(const uint8_t* nalHeader,const size_t nalHeaderLength){
+    (*mNALU_DATA)[0]=0;
+    (*mNALU_DATA)[1]=0;
+    (*mNALU_DATA)[2]=0;
+    (*mNALU_DATA)[3]=1;
+    memcpy(&(*mNALU_DATA)[4],nalHeader,nalHeaderLength);
+    mNALU_DATA_LENGTH=4+nalHeaderLength;
+}
+
+bool RTPDecoder::appendNALU(const uint8_t* data,const size_t data_length){
+    if(mNALU_DATA_LENGTH+data_length>NALU::NALU_MAXLEN){
+        MLOGE<<"NALU too big";
+        return false;
     }
-    const auto* nalu_header=(nalu_header_h265_t*)&rtp_data[sizeof(rtp_header_t)];
-    const auto* nalUnitPayloadData=&rtp_data[sizeof(rtp_header_t) + sizeof(nalu_header_h265_t)];
-    const size_t nalUnitPayloadDataSize= data_length - sizeof(rtp_header_t) + sizeof(nalu_header_h265_t);
-
-    MLOGD<<"H265 NALU hdr: "<<((int)nalu_header->payloadHdr)<<" "<<((int)nalu_header->donl);
-    mNALU_DATA[0]=0;
-    mNALU_DATA[1]=0;
-    mNALU_DATA[2]=0;
-    mNALU_DATA[3]=1;
-    mNALU_DATA_LENGTH=4;
-    memcpy(&mNALU_DATA[mNALU_DATA_LENGTH], nalUnitPayloadData, nalUnitPayloadDataSize);
-    mNALU_DATA_LENGTH+=nalUnitPayloadDataSize;
-    forwardNALU(std::chrono::steady_clock::now(),true);
+    memcpy(&(*mNALU_DATA)[mNALU_DATA_LENGTH],data,data_length);
+    mNALU_DATA_LENGTH+=data_length;
+    return true;
 }
 
-void RTPDecoder::forwardNALU(const std::chrono::steady_clock::time_point creationTime,const bool isH265) {
+void RTPDecoder::forwardNALU(const std::chrono::steady_clock::time_point creationTime,const bool isH265,const bool isEndOfAccessUnit) {
     if(cb!= nullptr){
         NALU nalu(mNALU_DATA, mNALU_DATA_LENGTH,isH265,creationTime);
+        nalu.isEndOfAccessUnit=isEndOfAccessUnit;
         //nalu_data.resize(nalu_data_length);
         //NALU nalu(nalu_data);
         cb(nalu);
     }
+    // Somebody kept a reference to the NALU, do not overwrite its data
+    if(mNALU_DATA.useCount()>1){
+        mNALU_DATA=mBufferPool.acquire();
+    }
     mNALU_DATA_LENGTH=0;
 }
 
@@ -288,7 +360,7 @@ int RTPEncoder::parseNALtoRTP(int framerate, const uint8_t *nalu_data, const siz
         rtp_hdr->payload = RTP_PAYLOAD_TYPE_H264;
         // rtp_hdr->marker = (pstStream->u32PackCount - 1 == i) ? 1 : 0;   /* If the packet is the end of a frame, set it to 1, otherwise it is 0. rfc 1889 does not specify the purpose of this bit*/
         rtp_hdr->marker=0;
-        rtp_hdr->sequence = htons(++seq_num % UINT16_MAX);
+        rtp_hdr->sequence = htons(++seq_num);
         rtp_hdr->timestamp = htonl(ts_current);
         //rtp_hdr->timestamp=0;
         rtp_hdr->sources = htonl(MY_SSRC_NUM);
@@ -346,7 +418,7 @@ int RTPEncoder::parseNALtoRTP(int framerate, const uint8_t *nalu_data, const siz
                 rtp_hdr->version = 2;
                 rtp_hdr->payload = RTP_PAYLOAD_TYPE_H264;
                 rtp_hdr->marker = 0;    /* If the packet is the end of a frame, set it to 1, otherwise it is 0. rfc 1889 does not specify the purpose of this bit*/
-                rtp_hdr->sequence = htons(++seq_num % UINT16_MAX);
+                rtp_hdr->sequence = htons(++seq_num);
                 rtp_hdr->timestamp = htonl(ts_current);
                 rtp_hdr->sources = htonl(MY_SSRC_NUM);
                 /*
@@ -380,7 +452,7 @@ int RTPEncoder::parseNALtoRTP(int framerate, const uint8_t *nalu_data, const siz
                 rtp_hdr->version = 2;
                 rtp_hdr->payload = RTP_PAYLOAD_TYPE_H264;
                 rtp_hdr->marker = 0;    /* 该包为一帧的结尾则置为1, 否则为0. rfc 1889 没有规定该位的用途 */
-                rtp_hdr->sequence = htons(++seq_num % UINT16_MAX);
+                rtp_hdr->sequence = htons(++seq_num);
                 rtp_hdr->timestamp = htonl(ts_current);
                 rtp_hdr->sources = htonl(MY_SSRC_NUM);
                 /*
@@ -413,7 +485,7 @@ int RTPEncoder::parseNALtoRTP(int framerate, const uint8_t *nalu_data, const siz
                 rtp_hdr->version = 2;
                 rtp_hdr->payload = RTP_PAYLOAD_TYPE_H264;
                 rtp_hdr->marker = 1;    /* 该包为一帧的结尾则置为1, 否则为0. rfc 1889 没有规定该位的用途 */
-                rtp_hdr->sequence = htons(++seq_num % UINT16_MAX);
+                rtp_hdr->sequence = htons(++seq_num);
                 rtp_hdr->timestamp = htonl(ts_current);
                 rtp_hdr->sources = htonl(MY_SSRC_NUM);
                 /*
@@ -481,3 +553,79 @@ void TestEncodeDecodeRTP::onNALU(const NALU &nalu) {
     assert(lastNALU==nullptr);
     lastNALU=std::make_unique<NALU>(nalu);
 }
+
+// Minimal rtp header (no CSRC, no extension) + payload
+static std::vector<uint8_t> makeRTPPacket(const uint16_t seqNr,const std::vector<uint8_t>& payload){
+    std::vector<uint8_t> packet(sizeof(rtp_header_t)+payload.size());
+    auto* rtp_header=(rtp_header_t*)packet.data();
+    rtp_header->version=2;
+    rtp_header->sequence=htons(seqNr);
+    std::copy(payload.begin(),payload.end(),packet.begin()+sizeof(rtp_header_t));
+    return packet;
+}
+
+int TestEncodeDecodeRTP::testDepacketizer() {
+    std::vector<std::vector<uint8_t>> nalus;
+    RTPDecoder decoder([&nalus](const NALU& nalu){
+        nalus.emplace_back(nalu.getData(),nalu.getData()+nalu.getSize());
+    });
+    int nFailed=0;
+    // assert() is a no-op in release builds
+    const auto check=[&nalus,&nFailed](const char* name,const std::vector<std::vector<uint8_t>>& expected){
+        if(nalus!=expected){
+            MLOGE<<"testDepacketizer "<<name<<": got "<<nalus.size()<<" NALUs, expected "<<expected.size();
+            nFailed++;
+        }
+        nalus.clear();
+    };
+    const auto checkDropped=[&decoder,&nFailed](const char* name,const long expected){
+        if(decoder.nDroppedIncompleteNALUs!=expected){
+            MLOGE<<"testDepacketizer "<<name<<": "<<decoder.nDroppedIncompleteNALUs<<" dropped NALUs, expected "<<expected;
+            nFailed++;
+        }
+    };
+    uint16_t seq=0;
+    const auto h264=[&decoder,&seq](const std::vector<uint8_t>& payload){
+        const auto packet=makeRTPPacket(seq++,payload);
+        decoder.parseRTPtoNALU(packet.data(),packet.size());
+    };
+    const auto h265=[&decoder,&seq](const std::vector<uint8_t>& payload){
+        const auto packet=makeRTPPacket(seq++,payload);
+        decoder.parseRTPH265toNALU(packet.data(),packet.size());
+    };
+    // h264 STAP-A with SPS and PPS
+    h264({0x78, 0,3, 0x67,1,2, 0,2, 0x68,3});
+    check("STAP-A",{{0,0,0,1,0x67,1,2},{0,0,0,1,0x68,3}});
+    // h264 FU-A in 3 parts (IDR slice, nri=3)
+    h264({0x7C,0x85,1,2});
+    h264({0x7C,0x05,3});
+    h264({0x7C,0x45,4});
+    check("FU-A",{{0,0,0,1,0x65,1,2,3,4}});
+    // h264 FU-A with a missing middle part is dropped
+    h264({0x7C,0x85,1});
+    seq++;
+    h264({0x7C,0x45,3});
+    check("FU-A missing middle",{});
+    checkDropped("FU-A missing middle",1);
+    // h264 FU-A whose end is missing, discarded by the start of the next one
+    h264({0x7C,0x85,1});
+    seq++;
+    h264({0x7C,0x85,2});
+    h264({0x7C,0x45,3});
+    check("FU-A missing end",{{0,0,0,1,0x65,2,3}});
+    checkDropped("FU-A missing end",2);
+    // h265 AP with VPS,SPS and PPS (types 32,33,34)
+    h265({0x60,0x01, 0,3, 0x40,0x01,1, 0,3, 0x42,0x01,2, 0,3, 0x44,0x01,3});
+    check("AP",{{0,0,0,1,0x40,0x01,1},{0,0,0,1,0x42,0x01,2},{0,0,0,1,0x44,0x01,3}});
+    // h265 FU with an IDR_W_RADL (type 19)
+    h265({0x62,0x01,0x93,1,2});
+    h265({0x62,0x01,0x53,3});
+    check("FU",{{0,0,0,1,0x26,0x01,1,2,3}});
+    // h265 PACI (cType=1, one byte of PHES) containing a single TRAIL_R NALU
+    h265({0x64,0x01,0x02,0x10,0xFF,5,6});
+    check("PACI",{{0,0,0,1,0x02,0x01,5,6}});
+    if(nFailed==0){
+        MLOGD<<"testDepacketizer passed";
+    }
+    return nFailed;
+}
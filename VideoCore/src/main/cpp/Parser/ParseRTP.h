@@ -6,10 +6,14 @@
 #define LIVE_VIDEO_10MS_ANDROID_PARSERTP_H
 
 #include <cstdio>
+#include <functional>
+#include <memory>
 #include "../NALU/NALU.hpp"
 
 /*********************************************
- ** Parses a stream of rtp h264 data into NALUs
+ ** Parses a stream of rtp h264 / h265 data into NALUs
+ ** Supports single NAL unit, aggregation (STAP-A / AP) and fragmentation (FU-A / FU) packets,
+ ** as well as PACI for h265. Both codecs share the same depacketizer (see RTPCodecH264 / RTPCodecH265)
 **********************************************/
 class RTPDecoder{
 public:
@@ -21,17 +25,39 @@ public:
     void reset();
     // Returns the sequence number of an RTP packet
     static int getSequenceNumber(const uint8_t* rtp_data,const size_t data_len);
+    // Fragmented NALUs where at least one fragment (including the end) went missing are not forwarded
+    long nDroppedIncompleteNALUs=0;
+    // Returns pointer to the payload (after the header,CSRCs and extension) or nullptr if the packet is invalid
+    static const uint8_t* getPayload(const uint8_t* rtp_data,const size_t data_length,size_t& payloadLength);
 private:
+    template<class Codec>
+    void parseRTP(const uint8_t* rtp_data, const size_t data_length);
+    // Separate NAL unit header, since the header of a PACI payload is not in front of its data
+    template<class Codec>
+    void parsePayload(const uint8_t* nalHeader,const uint8_t* data,const size_t data_length);
+    void checkSequenceNumber(const int seqNr);
+    // A fragmented NALU that did not end yet is overwritten by the next NALU, count it as dropped
+    void discardIncompleteNALU();
+    // Write 0,0,0,1 and the NAL unit header
+    void beginNALU(const uint8_t* nalHeader,const size_t nalHeaderLength);
+    // Returns false if the NALU would exceed NALU_MAXLEN
+    bool appendNALU(const uint8_t* data,const size_t data_length);
     // Properly calls the cb function
     // Resets the mNALU_DATA_LENGTH to 0
-    void forwardNALU(const std::chrono::steady_clock::time_point creationTime,const bool isH265=false);
+    // isEndOfAccessUnit: the NALU was completed by a packet with the marker bit set
+    void forwardNALU(const std::chrono::steady_clock::time_point creationTime,const bool isH265=false,const bool isEndOfAccessUnit=false);
     const NALU_DATA_CALLBACK cb;
-    std::array<uint8_t,NALU::NALU_MAXLEN> mNALU_DATA;
+    // The NALU is assembled in place in a pooled buffer. If the consumer of the callback
+    // holds onto the NALU, a new buffer is taken from the pool for the next NALU
+    NALU::NALU_BUFFER_POOL mBufferPool{2};
+    NALU::NALU_BUFFER_POOL::Handle mNALU_DATA=mBufferPool.acquire();
     size_t mNALU_DATA_LENGTH=0;
 private:
-    //TDOD: What shall we do if a start, middle or end of fu-a is missing ?
+    // If a start, middle or end of fu-a is missing the NALU is dropped (see RTPReorderBuffer for re-ordering)
     int lastSequenceNumber=-1;
     bool flagPacketHasGoneMissing=false;
+    // Marker bit of the rtp packet that is currently parsed
+    bool currentPacketHasMarker=false;
     // This time point is as 'early as possible' to debug the parsing time as accurately as possible.
     // E.g for a fu-a NALU the time point when the start fu-a was received, not when its end is received
     std::chrono::steady_clock::time_point timePointStartOfReceivingNALU;
@@ -89,6 +115,9 @@ public:
     // This encodes the nalu to RTP then decodes it again
     // After that, check that their contents match
     void testEncodeDecodeRTP(const NALU& nalu);
+    // Feed hand-made aggregation / fragmentation / PACI packets (h264 and h265) to the decoder
+    // and check that the right NALUs come out. Returns the n of failed checks
+    static int testDepacketizer();
 };
 
 #endif //LIVE_VIDEO_10MS_ANDROID_PARSERTP_H
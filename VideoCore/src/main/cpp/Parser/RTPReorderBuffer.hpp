@@ -0,0 +1,189 @@
+#ifndef LIVEVIDEO10MS_RTPREORDERBUFFER_HPP
+#define LIVEVIDEO10MS_RTPREORDERBUFFER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "ParseRTP.h"
+
+// Small jitter / reorder buffer for RTP packets that sits in front of the RTPDecoder.
+// Packets are forwarded ordered by their (16 bit, wrapping) sequence number. If a packet is missing, the packets after
+// it are held back until either the missing packet arrives or the budget (n of packets / time) is exceeded. Then the
+// missing packet is given up and the RTPDecoder sees the sequence gap (and drops the incomplete NALU).
+// A latency budget of 0 means pass-through (no re-ordering, no added latency)
+// Timeouts are checked when a new packet arrives. If the stream stalls call checkTimeouts() periodically, else the
+// held back packets stay in the buffer until the next packet arrives
+class RTPReorderBuffer{
+public:
+    typedef std::function<void(const uint8_t* rtp_data,const size_t data_length)> RTP_PACKET_CALLBACK;
+    struct Stats{
+        // Arrived out of order but in time, forwarded in the right order
+        long nReorderedPackets=0;
+        // Arrived after the buffer already gave up on them, or duplicates. Not forwarded
+        long nLatePackets=0;
+        // Never arrived (in time). The buffer skipped over them
+        long nDroppedPackets=0;
+    };
+    explicit RTPReorderBuffer(RTP_PACKET_CALLBACK cb):cb(std::move(cb)){}
+    /**
+     * @param maxNPackets max n of packets that are held back while waiting for a missing one
+     * @param maxLatency max time a packet is held back while waiting for a missing one. 0 == pass-through
+     */
+    void setBudget(const std::size_t maxNPackets,const std::chrono::microseconds maxLatency){
+        flush();
+        mMaxLatency=maxLatency;
+        slots.resize(std::max(maxNPackets,(std::size_t)1));
+        for(auto& slot:slots){
+            slot.used=false;
+            slot.data.reserve(SLOT_DEFAULT_CAPACITY);
+        }
+        reset();
+    }
+    void addPacket(const uint8_t* rtp_data,const size_t data_length,const std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now()){
+        if(mMaxLatency.count()==0){
+            cb(rtp_data,data_length);
+            return;
+        }
+        const int seqNr=RTPDecoder::getSequenceNumber(rtp_data,data_length);
+        if(seqNr<0)return;
+        const auto seq=(uint16_t)seqNr;
+        if(!started){
+            started=true;
+            nextSeq=seq;
+            highestSeq=seq;
+        }
+        int16_t delta=diff(seq,nextSeq);
+        if(delta < -RESYNC_THRESHOLD || delta > RESYNC_THRESHOLD){
+            // Most likely the tx was restarted
+            flush();
+            nextSeq=seq;
+            highestSeq=seq;
+            delta=0;
+        }
+        if(delta<0){
+            stats.nLatePackets++;
+            checkTimeouts(now);
+            return;
+        }
+        if(diff(seq,highestSeq)<0){
+            stats.nReorderedPackets++;
+        }else{
+            highestSeq=seq;
+        }
+        if(delta==0){
+            cb(rtp_data,data_length);
+            nextSeq++;
+            forwardConsecutive();
+        }else{
+            // Window full - give up on the oldest missing packet(s) until this one fits
+            while (diff(seq,nextSeq)>=(int)slots.size()){
+                skipOne();
+                forwardConsecutive();
+            }
+            if(diff(seq,nextSeq)==0){
+                cb(rtp_data,data_length);
+                nextSeq++;
+                forwardConsecutive();
+            }else{
+                Slot& slot=slotFor(seq);
+                if(slot.used){
+                    stats.nLatePackets++;
+                }else{
+                    slot.used=true;
+                    slot.seq=seq;
+                    slot.arrival=now;
+                    slot.data.assign(rtp_data,rtp_data+data_length);
+                    nBuffered++;
+                }
+            }
+        }
+        checkTimeouts(now);
+    }
+    // Forward everything that is still buffered, skipping missing packets
+    void flush(){
+        while (nBuffered>0){
+            skipOne();
+            forwardConsecutive();
+        }
+    }
+    // Drop everything that is still buffered
+    void reset(){
+        for(auto& slot:slots){
+            slot.used=false;
+        }
+        nBuffered=0;
+        started=false;
+    }
+    const Stats& getStats()const{
+        return stats;
+    }
+    // Give up on the missing packets in front of each buffered packet that exceeded the latency budget
+    void checkTimeouts(const std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now()){
+        while (nBuffered>0){
+            const Slot* oldest=nullptr;
+            for(const auto& slot:slots){
+                if(slot.used && (oldest==nullptr || slot.arrival<oldest->arrival)){
+                    oldest=&slot;
+                }
+            }
+            if(now-oldest->arrival<mMaxLatency)return;
+            const uint16_t target=oldest->seq;
+            while (diff(target,nextSeq)>=0){
+                skipOne();
+            }
+            forwardConsecutive();
+        }
+    }
+private:
+    struct Slot{
+        bool used=false;
+        uint16_t seq=0;
+        std::chrono::steady_clock::time_point arrival;
+        std::vector<uint8_t> data;
+    };
+    // RTP packets are usually <=1500 bytes, bigger packets grow the slot once
+    static constexpr const std::size_t SLOT_DEFAULT_CAPACITY=2048;
+    // Sequence number jumps bigger than that are treated as a new stream
+    static constexpr const int RESYNC_THRESHOLD=1024;
+    const RTP_PACKET_CALLBACK cb;
+    std::chrono::microseconds mMaxLatency{0};
+    std::vector<Slot> slots{1};
+    std::size_t nBuffered=0;
+    bool started=false;
+    uint16_t nextSeq=0;
+    uint16_t highestSeq=0;
+    Stats stats;
+    // Difference between two sequence numbers, taking the wrap around at 65535 into account
+    static int16_t diff(const uint16_t a,const uint16_t b){
+        return (int16_t)(uint16_t)(a-b);
+    }
+    Slot& slotFor(const uint16_t seq){
+        return slots[seq % slots.size()];
+    }
+    // Forward all buffered packets starting at nextSeq until there is a gap
+    void forwardConsecutive(){
+        while (nBuffered>0){
+            Slot& slot=slotFor(nextSeq);
+            if(!slot.used || slot.seq!=nextSeq)break;
+            cb(slot.data.data(),slot.data.size());
+            slot.used=false;
+            nBuffered--;
+            nextSeq++;
+        }
+    }
+    // Advance nextSeq by one, forwarding the packet if we have it
+    void skipOne(){
+        Slot& slot=slotFor(nextSeq);
+        if(slot.used && slot.seq==nextSeq){
+            cb(slot.data.data(),slot.data.size());
+            slot.used=false;
+            nBuffered--;
+        }else{
+            stats.nDroppedPackets++;
+        }
+        nextSeq++;
+    }
+};
+
+#endif //LIVEVIDEO10MS_RTPREORDERBUFFER_HPP
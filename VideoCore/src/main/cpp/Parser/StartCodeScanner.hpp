@@ -0,0 +1,50 @@
+#ifndef LIVEVIDEO10MS_STARTCODESCANNER_HPP
+#define LIVEVIDEO10MS_STARTCODESCANNER_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Every start code (0,0,1 or 0,0,0,1) begins with a zero byte. Raw h264/h265 data
+// rarely contains zero bytes (emulation prevention), so the parser can skip (memcpy) everything in front
+// of the next zero byte without looking at each byte individually.
+namespace StartCodeScanner{
+    // Returns the index of the first zero byte in data, or data_length if there is none
+    static size_t findFirstZeroScalar(const uint8_t* data,const size_t data_length){
+        for(size_t i=0;i<data_length;i++){
+            if(data[i]==0)return i;
+        }
+        return data_length;
+    }
+    // Same as above, but checks 16 bytes at a time with SSE2 / NEON if available
+    static size_t findFirstZero(const uint8_t* data,const size_t data_length){
+        size_t i=0;
+#if defined(__SSE2__)
+        const __m128i zero=_mm_setzero_si128();
+        for(;i+16<=data_length;i+=16){
+            const __m128i chunk=_mm_loadu_si128((const __m128i*)&data[i]);
+            const int mask=_mm_movemask_epi8(_mm_cmpeq_epi8(chunk,zero));
+            if(mask!=0){
+                return i+__builtin_ctz((unsigned)mask);
+            }
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        for(;i+16<=data_length;i+=16){
+            const uint8x16_t isZero=vceqq_u8(vld1q_u8(&data[i]),vdupq_n_u8(0));
+            // Narrow each 0x00 / 0xFF byte to 4 bits, such that the result fits into 64 bits
+            const uint64_t mask=vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(isZero),4)),0);
+            if(mask!=0){
+                return i+(__builtin_ctzll(mask)>>2);
+            }
+        }
+#endif
+        return i+findFirstZeroScalar(&data[i],data_length-i);
+    }
+}
+
+#endif //LIVEVIDEO10MS_STARTCODESCANNER_HPP
@@ -0,0 +1,91 @@
+#ifndef LIVEVIDEO10MS_TESTPARSERAW_HPP
+#define LIVEVIDEO10MS_TESTPARSERAW_HPP
+
+#include "ParseRAW.h"
+#include <AndroidLogger.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compares ParseRAW::parseData (SIMD) against the byte by byte reference ParseRAW::parseDataScalar.
+// The input has to be an Annex B byte stream (like a raw .h264 / .h265 file). A .mp4 has length prefixed NALUs
+// with almost no start codes, which makes the SIMD scan look faster than it is. Run by ReceiveChainBenchmark
+namespace TEST_PARSE_RAW{
+    struct Result{
+        size_t nNALUs=0;
+        // FNV-1a over the size and content of all NALUs
+        uint64_t hash=14695981039346656037ULL;
+        double seconds=0;
+        bool operator==(const Result& other)const{
+            return nNALUs==other.nNALUs && hash==other.hash;
+        }
+    };
+    static void hashNALU(Result& result,const NALU& nalu){
+        result.nNALUs++;
+        const auto add=[&result](uint8_t byte){
+            result.hash^=byte;
+            result.hash*=1099511628211ULL;
+        };
+        const auto size=nalu.getSize();
+        for(int i=0;i<4;i++)add((uint8_t)(size>>(i*8)));
+        for(size_t i=0;i<size;i++)add(nalu.getData()[i]);
+    }
+    // If chunkSize==0 random chunk sizes between 1 and 4096 are used (same seed for both parsers)
+    static Result parse(const std::vector<uint8_t>& data,const bool useScalar,const size_t chunkSize,const bool hash){
+        Result result;
+        ParseRAW parser([&result,hash](const NALU& nalu){
+            if(hash){
+                hashNALU(result,nalu);
+            }else{
+                result.nNALUs++;
+            }
+        });
+        std::mt19937 random(1234);
+        std::uniform_int_distribution<size_t> randomChunkSize(1,4096);
+        const auto before=std::chrono::steady_clock::now();
+        size_t offset=0;
+        while(offset<data.size()){
+            const size_t len=std::min(chunkSize==0 ? randomChunkSize(random) : chunkSize,data.size()-offset);
+            if(useScalar){
+                parser.parseDataScalar(&data[offset],len);
+            }else{
+                parser.parseData(&data[offset],len);
+            }
+            offset+=len;
+        }
+        result.seconds=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-before).count()/1000.0/1000.0/1000.0;
+        return result;
+    }
+    // Returns false if the two parsers produce different NALUs
+    static bool validate(const std::vector<uint8_t>& data){
+        for(const size_t chunkSize:{(size_t)0,(size_t)1,(size_t)7,(size_t)1024}){
+            if(!(parse(data,true,chunkSize,true)==parse(data,false,chunkSize,true))){
+                MLOGE<<"ParseRAW mismatch with chunk size "<<chunkSize;
+                return false;
+            }
+        }
+        return true;
+    }
+    static double bestGBs(const std::vector<uint8_t>& data,const bool useScalar,const size_t chunkSize,const int repetitions){
+        double best=0;
+        for(int i=0;i<repetitions;i++){
+            const auto result=parse(data,useScalar,chunkSize,false);
+            best=std::max(best,(double)data.size()/result.seconds/1000.0/1000.0/1000.0);
+        }
+        return best;
+    }
+    struct BenchmarkResult{
+        bool identical=false;
+        double scalarGBs=0;
+        double simdGBs=0;
+    };
+    static BenchmarkResult benchmark(const std::vector<uint8_t>& annexB,const size_t chunkSize=1024,const int repetitions=10){
+        BenchmarkResult result;
+        result.identical=validate(annexB);
+        result.scalarGBs=bestGBs(annexB,true,chunkSize,repetitions);
+        result.simdGBs=bestGBs(annexB,false,chunkSize,repetitions);
+        return result;
+    }
+}
+
+#endif //LIVEVIDEO10MS_TESTPARSERAW_HPP
@@ -0,0 +1,202 @@
+#ifndef LIVEVIDEO10MS_DECODINGPIPELINE_HPP
+#define LIVEVIDEO10MS_DECODINGPIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <jni.h>
+#include <SPSCQueue.hpp>
+#include <TimeHelper.hpp>
+#include <AndroidThreadPrioValues.hpp>
+#include "../NALU/NALU.hpp"
+
+#ifdef __ANDROID__
+#include <NDKThreadHelper.hpp>
+#endif
+
+// Splits receiving, parsing and feeding the decoder into 3 threads that are connected by lock-free SPSC queues:
+// receive thread (e.g. UDPReceiver) -> pushDatagram() -> [datagram queue] -> parser thread -> PARSE_CALLBACK
+// parser (NALU callback) -> pushNALU() -> [NALU queue] -> decoder input thread -> DECODE_CALLBACK
+// Feeding the decoder blocks while MediaCodec has no free input buffer. In the single threaded mode that also blocks
+// the receive thread and the socket buffer overflows. Here the receive thread never blocks - if the datagram queue is
+// full the datagram is dropped (and counted). The parser thread waits for the decoder input thread if the NALU queue is full.
+// The NALUs are only copied by reference if the parser uses a pooled buffer (see NALU_BUFFER_POOL)
+class DecodingPipeline{
+public:
+    // Called on the parser thread with the data from pushDatagram()
+    typedef std::function<void(const uint8_t* data,const std::size_t data_length)> PARSE_CALLBACK;
+    // Called on the decoder input thread with the NALUs from pushNALU()
+    typedef std::function<void(const NALU& nalu)> DECODE_CALLBACK;
+    // Statistics for one queue. Every value has only one writer thread (producer or consumer), read from anywhere
+    struct StageStats{
+        // n of elements that were taken out of the queue
+        std::atomic<long> nElements{0};
+        // n of elements that did not fit into the queue (receive stage) or times the producer had to wait (parse stage)
+        std::atomic<long> nQueueFull{0};
+        std::atomic<std::size_t> maxDepth{0};
+        // time between pushing an element and the consumer thread picking it up
+        std::atomic<int64_t> sumDwellTimeNs{0};
+        std::atomic<int64_t> maxDwellTimeNs{0};
+        float getAvgDwellTime_ms()const{
+            const long n=nElements.load();
+            if(n==0)return 0;
+            return (float)((double)sumDwellTimeNs.load()/n/1000.0/1000.0);
+        }
+    };
+    /**
+     * @param javaVm used to set the thread priorities on android. Can be nullptr
+     * @param nDatagramSlots capacity of the datagram queue (rounded up to a power of 2)
+     * @param nNALUSlots capacity of the NALU queue (rounded up to a power of 2)
+     */
+    DecodingPipeline(JavaVM* javaVm,PARSE_CALLBACK onParse,DECODE_CALLBACK onDecode,const std::size_t nDatagramSlots=DEFAULT_N_DATAGRAM_SLOTS,const std::size_t nNALUSlots=DEFAULT_N_NALU_SLOTS):
+            javaVm(javaVm),onParse(std::move(onParse)),onDecode(std::move(onDecode)),mDatagramQueue(nDatagramSlots),mNALUQueue(nNALUSlots){
+    }
+    ~DecodingPipeline(){
+        stop();
+    }
+    // Start the parser and decoder input thread
+    void start(){
+        running=true;
+        mParserThread=std::make_unique<std::thread>(&DecodingPipeline::parseLoop,this);
+        mDecoderInputThread=std::make_unique<std::thread>(&DecodingPipeline::decodeLoop,this);
+#ifdef __ANDROID__
+        NDKThreadHelper::setName(mParserThread->native_handle(),"VideoParser");
+        NDKThreadHelper::setName(mDecoderInputThread->native_handle(),"DecoderInput");
+#endif
+    }
+    // Stop and join both threads. Anything that is still queued is discarded
+    void stop(){
+        running=false;
+        if(mParserThread && mParserThread->joinable()){
+            mParserThread->join();
+        }
+        if(mDecoderInputThread && mDecoderInputThread->joinable()){
+            mDecoderInputThread->join();
+        }
+        mParserThread.reset();
+        mDecoderInputThread.reset();
+    }
+    // Call from the receive thread only. Never blocks, drops the datagram if the parser thread cannot keep up
+    void pushDatagram(const uint8_t* data,const std::size_t data_length){
+        Datagram* slot=mDatagramQueue.beginWrite();
+        if(slot==nullptr){
+            mDatagramStats.nQueueFull++;
+            return;
+        }
+        slot->data.assign(data,data+data_length);
+        slot->enqueueTime=std::chrono::steady_clock::now();
+        mDatagramQueue.commitWrite();
+        updateMaxDepth(mDatagramStats,mDatagramQueue.size());
+    }
+    // Call from the parser thread only (e.g. from the NALU callback of the parser). Waits while the NALU queue is full
+    void pushNALU(const NALU& nalu){
+        QueuedNALU* slot=mNALUQueue.beginWrite();
+        if(slot==nullptr){
+            mNALUStats.nQueueFull++;
+            while ((slot=mNALUQueue.beginWrite())==nullptr){
+                if(!running)return;
+                std::this_thread::sleep_for(WAIT_FOR_FREE_SLOT_INTERVAL);
+            }
+        }
+        slot->nalu.emplace(nalu);
+        slot->enqueueTime=std::chrono::steady_clock::now();
+        mNALUQueue.commitWrite();
+        updateMaxDepth(mNALUStats,mNALUQueue.size());
+    }
+    const StageStats& getDatagramStats()const{
+        return mDatagramStats;
+    }
+    const StageStats& getNALUStats()const{
+        return mNALUStats;
+    }
+    std::string getStatsString()const{
+        std::stringstream ss;
+        ss<<std::fixed;
+        ss.precision(2);
+        const auto print=[&ss](const char* name,const StageStats& stats,const std::size_t currentDepth,const std::size_t capacity){
+            ss<<name<<" queue: "<<currentDepth<<"/"<<capacity<<" max: "<<stats.maxDepth
+              <<" | dwell avg: "<<stats.getAvgDwellTime_ms()<<"ms max: "<<(float)(stats.maxDwellTimeNs/1000.0/1000.0)<<"ms"
+              <<" | full: "<<stats.nQueueFull;
+        };
+        print("Datagram",mDatagramStats,mDatagramQueue.size(),mDatagramQueue.capacity());
+        ss<<"\n";
+        print("NALU",mNALUStats,mNALUQueue.size(),mNALUQueue.capacity());
+        return ss.str();
+    }
+private:
+    struct Datagram{
+        std::vector<uint8_t> data;
+        std::chrono::steady_clock::time_point enqueueTime;
+    };
+    struct QueuedNALU{
+        std::optional<NALU> nalu;
+        std::chrono::steady_clock::time_point enqueueTime;
+    };
+    static constexpr const std::size_t DEFAULT_N_DATAGRAM_SLOTS=1024;
+    // Each queued NALU holds a pooled (1MB) buffer, and every queued NALU adds to the latency. The NALU queue only has to bridge
+    // the time the decoder needs to hand out the next input buffer. If the decoder falls behind the parser waits, and the
+    // datagram queue (cheap, right sized buffers) takes the backlog
+    static constexpr const std::size_t DEFAULT_N_NALU_SLOTS=8;
+    // Both loops re-check the running flag at least that often
+    static constexpr const auto WAIT_FOR_DATA_TIMEOUT=std::chrono::milliseconds(100);
+    static constexpr const auto WAIT_FOR_FREE_SLOT_INTERVAL=std::chrono::microseconds(100);
+    JavaVM* const javaVm;
+    const PARSE_CALLBACK onParse;
+    const DECODE_CALLBACK onDecode;
+    SPSCQueue<Datagram> mDatagramQueue;
+    SPSCQueue<QueuedNALU> mNALUQueue;
+    StageStats mDatagramStats;
+    StageStats mNALUStats;
+    std::atomic<bool> running=false;
+    std::unique_ptr<std::thread> mParserThread;
+    std::unique_ptr<std::thread> mDecoderInputThread;
+    static void updateMaxDepth(StageStats& stats,const std::size_t depth){
+        if(depth>stats.maxDepth.load(std::memory_order_relaxed)){
+            stats.maxDepth.store(depth,std::memory_order_relaxed);
+        }
+    }
+    static void addDwellTime(StageStats& stats,const std::chrono::steady_clock::time_point enqueueTime){
+        const int64_t dwellTimeNs=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-enqueueTime).count();
+        stats.sumDwellTimeNs.store(stats.sumDwellTimeNs.load(std::memory_order_relaxed)+dwellTimeNs,std::memory_order_relaxed);
+        if(dwellTimeNs>stats.maxDwellTimeNs.load(std::memory_order_relaxed)){
+            stats.maxDwellTimeNs.store(dwellTimeNs,std::memory_order_relaxed);
+        }
+        stats.nElements.store(stats.nElements.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+    }
+    void setThreadPriority(const int priority,const char* name){
+        if(javaVm!=nullptr){
+#ifdef __ANDROID__
+            NDKThreadHelper::setProcessThreadPriorityAttachDetach(javaVm,priority,name);
+#endif
+        }
+    }
+    void parseLoop(){
+        setThreadPriority(FPV_VR_PRIORITY::CPU_PRIORITY_VIDEO_PARSER,"VideoParser");
+        while (running){
+            Datagram* datagram=mDatagramQueue.waitForData(WAIT_FOR_DATA_TIMEOUT);
+            if(datagram==nullptr)continue;
+            addDwellTime(mDatagramStats,datagram->enqueueTime);
+            onParse(datagram->data.data(),datagram->data.size());
+            mDatagramQueue.commitRead();
+        }
+    }
+    void decodeLoop(){
+        setThreadPriority(FPV_VR_PRIORITY::CPU_PRIORITY_DECODER_INPUT,"DecoderInput");
+        while (running){
+            QueuedNALU* queuedNALU=mNALUQueue.waitForData(WAIT_FOR_DATA_TIMEOUT);
+            if(queuedNALU==nullptr)continue;
+            addDwellTime(mNALUStats,queuedNALU->enqueueTime);
+            onDecode(*queuedNALU->nalu);
+            // Give the (pooled) buffer back to the parser as soon as possible
+            queuedNALU->nalu.reset();
+            mNALUQueue.commitRead();
+        }
+    }
+};
+
+#endif //LIVEVIDEO10MS_DECODINGPIPELINE_HPP
@@ -8,32 +8,48 @@
 #include <android/asset_manager_jni.h>
 #include <FileHelper.hpp>
 #include <NDKHelper.hpp>
+#include <LatencyTrace.hpp>
+#include <LatencyHistogram.hpp>
 
 //TEST
 //#include <NdkImage.h>
 //#include <NdkImageReader.h>
 
 VideoPlayer::VideoPlayer(JNIEnv* env, jobject context, const char* DIR) :
-        mLowLagDecoder(env),
     mParser{std::bind(&VideoPlayer::onNewNALU, this, std::placeholders::_1)},
     mSettingsN(env,context,"pref_video",true),
     GROUND_RECORDING_DIRECTORY(DIR),
-    mGroundRecorderFPV(GROUND_RECORDING_DIRECTORY),
+    mGroundRecorderFPV(GROUND_RECORDING_DIRECTORY,getGroundRecorderOptions(mSettingsN)),
     mFileReceiver(1024){
     env->GetJavaVM(&javaVm);
+    if(mSettingsN.getBoolean(IDV::VS_USE_FFMPEG_DECODER,false)){
+        mDecoder=std::make_unique<FFMpegSurfaceDecoder>();
+    }else{
+        auto lowLagDecoder=std::make_unique<LowLagDecoder>(env);
+        mLowLagDecoder=lowLagDecoder.get();
+        mDecoder=std::move(lowLagDecoder);
+    }
     //
-    mLowLagDecoder.registerOnDecoderRatioChangedCallback([this](const VideoRatio ratio) {
+    mDecoder->registerOnDecoderRatioChangedCallback([this](const VideoRatio ratio) {
         const bool changed=ratio!=this->latestVideoRatio;
         this->latestVideoRatio=ratio;
         latestVideoRatioChanged=changed;
     });
-    mLowLagDecoder.registerOnDecodingInfoChangedCallback([this](const DecodingInfo info) {
+    mDecoder->registerOnDecodingInfoChangedCallback([this](const DecodingInfo info) {
         const bool changed=info!=this->latestDecodingInfo;
         this->latestDecodingInfo=info;
         latestDecodingInfoChanged=changed;
     });
 }
 
+GroundRecorderFPV::Options VideoPlayer::getGroundRecorderOptions(const SharedPreferences& settings){
+    GroundRecorderFPV::Options options;
+    options.overflowPolicy=settings.getBoolean(IDV::VS_GROUND_RECORDING_BLOCK_ON_OVERFLOW,false) ?
+            GroundRecorderFPV::OverflowPolicy::BLOCK : GroundRecorderFPV::OverflowPolicy::DROP;
+    options.syncInterval=std::chrono::milliseconds(std::max(settings.getInt(IDV::VS_GROUND_RECORDING_SYNC_INTERVAL_MS,0),0));
+    return options;
+}
+
 //Not yet parsed bit stream (e.g. raw h264 or rtp data)
 void VideoPlayer::onNewVideoData(const uint8_t* data, const std::size_t data_length,const VIDEO_DATA_TYPE videoDataType){
     //MLOGD("onNewVideoData %d",data_length);
@@ -49,6 +65,7 @@ void VideoPlayer::onNewVideoData(const uint8_t* data, const std::size_t data_len
             break;
         case VIDEO_DATA_TYPE::CUSTOM2:
             mParser.parseCustomRTPinsideFEC(data, data_length);
+            sendFECFeedbackIfNeeded();
             break;
         case VIDEO_DATA_TYPE::DJI:
             mParser.parseDjiLiveVideoData(data,data_length);
@@ -62,11 +79,37 @@ void VideoPlayer::onNewVideoData(const uint8_t* data, const std::size_t data_len
     }
 }
 
+void VideoPlayer::sendFECFeedbackIfNeeded(){
+    const auto now=std::chrono::steady_clock::now();
+    if(now-lastFECFeedback<FEC_FEEDBACK_INTERVAL)return;
+    lastFECFeedback=now;
+    std::lock_guard<std::mutex> lock(mFeedbackMutex);
+    if(mFeedbackSender== nullptr)return;
+    const FECFeedback feedback(nFECFeedbacks++,mParser.getFECStats());
+    mFeedbackSender->mySendTo((const uint8_t*)&feedback,sizeof(feedback));
+}
+
+void VideoPlayer::sendKeyFrameRequest(){
+    std::lock_guard<std::mutex> lock(mFeedbackMutex);
+    if(mFeedbackSender== nullptr)return;
+    const KeyFrameRequest request(nKeyFrameRequests++);
+    mFeedbackSender->mySendTo((const uint8_t*)&request,sizeof(request));
+}
+
 void VideoPlayer::onNewNALU(const NALU& nalu){
     //MLOGD("VideoNative::onNewNALU %d %s",(int)nalu.data_length,nalu.get_nal_name().c_str());
     //nalu.debugX();
     //mTestEncodeDecodeRTP.testEncodeDecodeRTP(nalu);
-    mLowLagDecoder.interpretNALU(nalu);
+    LatencyTrace::stampDepacketized(nalu.creationTime);
+    if(mDecodingPipeline){
+        mDecodingPipeline->pushNALU(nalu);
+    }else{
+        decodeNALU(nalu);
+    }
+}
+
+void VideoPlayer::decodeNALU(const NALU& nalu){
+    mDecoder->interpretNALU(nalu);
     mGroundRecorderFPV.writePacketIfStarted(nalu.getData(),nalu.getSize(),GroundRecorderFPV::PACKET_TYPE_VIDEO_H264);
 }
 
@@ -77,10 +120,10 @@ void VideoPlayer::setVideoSurface(JNIEnv *env, jobject surface) {
     //set the jni object for settings
     mSettingsN.replaceJNI(env);
     if(surface!=nullptr){
-        mLowLagDecoder.setOutputSurface(env,surface,mSettingsN);
+        mDecoder->setOutputSurface(env,surface,mSettingsN);
         MLOGD<<"Start with surface";
     }else{
-        mLowLagDecoder.setOutputSurface(env, nullptr,mSettingsN);
+        mDecoder->setOutputSurface(env, nullptr,mSettingsN);
         MLOGD<<"Set surface to null";
     }
 }
@@ -93,6 +136,10 @@ void VideoPlayer::start(JNIEnv *env,jobject androidContext) {
     const auto VS_SOURCE= static_cast<SOURCE_TYPE_OPTIONS>(mSettingsN.getInt(IDV::VS_SOURCE));
     const int VS_FILE_ONLY_LIMIT_FPS=mSettingsN.getInt(IDV::VS_FILE_ONLY_LIMIT_FPS,60);
     const bool VS_GroundRecording=mSettingsN.getBoolean(IDV::VS_GROUND_RECORDING);
+    const bool VS_LATENCY_TRACE=mSettingsN.getBoolean(IDV::VS_LATENCY_TRACE,false);
+    const bool VS_REQUEST_KEY_FRAMES=mSettingsN.getBoolean(IDV::VS_REQUEST_KEY_FRAMES,false);
+    LatencyTrace::reset();
+    LatencyTrace::setEnabled(VS_LATENCY_TRACE);
 
     //Add Ground recorder if enabled and needed
     if(VS_GroundRecording && VS_SOURCE!=FILE && VS_SOURCE != ASSETS){
@@ -113,9 +160,51 @@ void VideoPlayer::start(JNIEnv *env,jobject androidContext) {
             const int VS_PORT=mSettingsN.getInt(IDV::VS_PORT);
             const int VS_PROTOCOL= mSettingsN.getInt(IDV::VS_PROTOCOL);
             const auto videoDataType=static_cast<VIDEO_DATA_TYPE>(VS_PROTOCOL);
+            const int VS_RTP_REORDER_BUDGET_US=mSettingsN.getInt(IDV::VS_RTP_REORDER_BUDGET_US,0);
+            const bool VS_PIPELINED_DECODING=mSettingsN.getBoolean(IDV::VS_PIPELINED_DECODING,false);
+            mParser.setRTPReorderBudget(RTP_REORDER_MAX_N_PACKETS,std::chrono::microseconds(VS_RTP_REORDER_BUDGET_US));
+            if(VS_PIPELINED_DECODING){
+                mDecodingPipeline=std::make_unique<DecodingPipeline>(javaVm,[this,videoDataType](const uint8_t* data,size_t data_length){
+                    onNewVideoData(data,data_length,videoDataType);
+                },[this](const NALU& nalu){
+                    decodeNALU(nalu);
+                });
+                mDecodingPipeline->start();
+            }
             mUDPReceiver=std::make_unique<UDPReceiver>(javaVm,VS_PORT, "V_UDP_R", FPV_VR_PRIORITY::CPU_PRIORITY_UDPRECEIVER_VIDEO, [this,videoDataType](const uint8_t* data, size_t data_length) {
-                onNewVideoData(data,data_length,videoDataType);
+                if(mDecodingPipeline){
+                    mDecodingPipeline->pushDatagram(data,data_length);
+                }else{
+                    onNewVideoData(data,data_length,videoDataType);
+                }
             }, WANTED_UDP_RCVBUF_SIZE);
+            if(VS_REQUEST_KEY_FRAMES && mLowLagDecoder){
+                mLowLagDecoder->registerOnKeyFrameRequestCallback([this]{
+                    sendKeyFrameRequest();
+                });
+            }
+            if(videoDataType==CUSTOM2 || VS_REQUEST_KEY_FRAMES){
+                // Report the FEC loss back to the transmitter / request key frames (see VideoTransmitter)
+                mUDPReceiver->registerOnSourceIPFound([this,VS_PORT](const std::string ip){
+                    std::lock_guard<std::mutex> lock(mFeedbackMutex);
+                    mFeedbackSender=std::make_unique<UDPSender>(ip,VS_PORT+FECFeedback::FEEDBACK_PORT_OFFSET);
+                });
+            }
+            const bool isRTP=videoDataType==RTP || videoDataType==RTP_H265;
+            if(videoDataType==CUSTOM2 || (isRTP && VS_RTP_REORDER_BUDGET_US>0)){
+                // Without new packets the FEC decoder would hold back everything after a lost sequence,
+                // the rtp re-order buffer everything after a lost packet
+                const auto receiveTimeout=videoDataType==CUSTOM2 ? H264Parser::FEC_TIMEOUT :
+                        H264Parser::getRTPReorderTimeout(std::chrono::microseconds(VS_RTP_REORDER_BUDGET_US));
+                mUDPReceiver->setReceiveTimeout(receiveTimeout,[this,videoDataType]{
+                    if(mDecodingPipeline){
+                        mDecodingPipeline->pushDatagram(nullptr,0);
+                    }else{
+                        onNewVideoData(nullptr,0,videoDataType);
+                    }
+                });
+            }
+            mUDPReceiver->setBatchMode(UDP_RECEIVE_BATCH_SIZE);
             mUDPReceiver->startReceiving();
         }break;
         case FILE:
@@ -153,7 +242,26 @@ void VideoPlayer::start(JNIEnv *env,jobject androidContext) {
             });
             mFFMpegVideoReceiver->start_playing();
         }break;
-        case EXTERNAL:{
+        case REPLAY:{
+            const std::string filename=mSettingsN.getString(IDV::VS_REPLAY_FILENAME);
+            auto videoDataType=static_cast<VIDEO_DATA_TYPE>(mSettingsN.getInt(IDV::VS_PROTOCOL));
+            // VS_PROTOCOL is the protocol of the datagrams in a .pcap, a .fpv capture contains the raw NALUs
+            if(CaptureReader::containsRawNALUs(filename)){
+                videoDataType=(videoDataType==RAW_H265 || videoDataType==RTP_H265) ? RAW_H265 : RAW;
+            }
+            auto config=ReplayConfig::parse(mSettingsN.getString(IDV::VS_REPLAY_CONFIG));
+            if(!config){
+                MLOGE<<"Invalid VS_REPLAY_CONFIG, replaying without impairment";
+                config=ReplayConfig{};
+            }
+            mParser.setRTPReorderBudget(RTP_REORDER_MAX_N_PACKETS,std::chrono::microseconds(mSettingsN.getInt(IDV::VS_RTP_REORDER_BUDGET_US,0)));
+            mPacketReplayer=std::make_unique<PacketReplayer>(javaVm,FPV_VR_PRIORITY::CPU_PRIORITY_UDPRECEIVER_VIDEO,*config,[this,videoDataType](const uint8_t* data,size_t data_length){
+                onNewVideoData(data,data_length,videoDataType);
+            });
+            mPacketReplayer->startReplaying(filename);
+        }break;
+        case EXTERNAL:
+        case EXTERNAL_UVC:{
             //Data is being received somewhere else and passed trough-init nothing.
             MLOGD<<"Started with SOURCE=EXTERNAL";
         }break;
@@ -168,6 +276,21 @@ void VideoPlayer::stop(JNIEnv *env,jobject androidContext) {
         mUDPReceiver->stopReceiving();
         mUDPReceiver.reset();
     }
+    if(mPacketReplayer){
+        mPacketReplayer->stopReplaying();
+        mPacketReplayer.reset();
+    }
+    if(mDecodingPipeline){
+        mDecodingPipeline->stop();
+        mDecodingPipeline.reset();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mFeedbackMutex);
+        mFeedbackSender.reset();
+    }
+    if(mLowLagDecoder){
+        mLowLagDecoder->registerOnKeyFrameRequestCallback(nullptr);
+    }
     mFileReceiver.stopReadingIfStarted();
     if(mFFMpegVideoReceiver){
         mFFMpegVideoReceiver->shutdown_callback();
@@ -175,6 +298,10 @@ void VideoPlayer::stop(JNIEnv *env,jobject androidContext) {
         mFFMpegVideoReceiver.reset();
     }
     mGroundRecorderFPV.stop(env,androidContext);
+    if(LatencyTrace::isEnabled()){
+        LatencyTrace::dumpToFile(FileHelper::findUnusedFilename(GROUND_RECORDING_DIRECTORY,"lvlt"));
+        LatencyTrace::setEnabled(false);
+    }
 }
 
 std::string VideoPlayer::getInfoString()const{
@@ -184,15 +311,50 @@ std::string VideoPlayer::getInfoString()const{
         ss << "\nReceived: " << mUDPReceiver->getNReceivedBytes() << "B"
            << " | parsed frames: "
            << mParser.nParsedNALUs << " | key frames: " << mParser.nParsedKeyFrames;
+        const auto reorderStats=mParser.getRTPReorderStats();
+        ss << "\nRTP reordered: " << reorderStats.nReorderedPackets << " | late: " << reorderStats.nLatePackets
+           << " | dropped: " << reorderStats.nDroppedPackets << " | incomplete NALUs: " << mParser.getNDroppedIncompleteNALUs();
+        if(mDecodingPipeline){
+            ss << "\n" << mDecodingPipeline->getStatsString();
+        }
+    }else if(mPacketReplayer){
+        ss << mPacketReplayer->getStatsString();
+        ss << "\nParsed frames: " << mParser.nParsedNALUs << " | key frames: " << mParser.nParsedKeyFrames;
+        const auto reorderStats=mParser.getRTPReorderStats();
+        ss << "\nRTP reordered: " << reorderStats.nReorderedPackets << " | late: " << reorderStats.nLatePackets
+           << " | dropped: " << reorderStats.nDroppedPackets << " | incomplete NALUs: " << mParser.getNDroppedIncompleteNALUs();
     }else if(mFFMpegVideoReceiver){
         ss << "Connecting to "<<mFFMpegVideoReceiver->m_url;
         ss << "\n"<<mFFMpegVideoReceiver->currentErrorMessage;
         ss <<"\nReceived: "<<mFFMpegVideoReceiver->currentlyReceivedVideoData<<" B"
                 << " | parsed frames: "
                 << mParser.nParsedNALUs << " | key frames: " << mParser.nParsedKeyFrames;
+    }else if(mFileReceiver.getDuration().count()>0){
+        ss << "Playing .fpv file " << mFileReceiver.getPosition().count()/1000 << "s / "
+           << mFileReceiver.getDuration().count()/1000 << "s | parsed frames: " << mParser.nParsedNALUs;
     }else{
         ss << "Not receiving udp raw / rtp / rtsp";
     }
+    if(mLowLagDecoder){
+        const auto admissionStats=mLowLagDecoder->getAdmissionStats();
+        if(admissionStats.nDroppedFrames>0){
+            ss << "\n" << admissionStats.toString();
+        }
+        const auto restartStats=mLowLagDecoder->getRestartStats();
+        if(restartStats.nRestarts>0){
+            ss << "\n" << restartStats.toString();
+        }
+    }
+    const auto decodingLatency=mDecoder->getDecodingLatency().toString();
+    if(!decodingLatency.empty()){
+        ss << "\n" << decodingLatency;
+    }
+    if(mGroundRecorderFPV.isStarted()){
+        ss << "\n" << mGroundRecorderFPV.getStatsString();
+    }
+    if(LatencyTrace::isEnabled()){
+        ss << "\n" << LatencyTrace::snapshot().toString();
+    }
     return ss.str();
 }
 
@@ -261,6 +423,16 @@ JNI_METHOD(jstring , getVideoInfoString)
     return ret;
 }
 
+// See LatencyHistogram::serialize, one histogram per DecodingLatency::Stage
+JNI_METHOD(jbyteArray , nativeGetDecodingLatency)
+(JNIEnv *env,jclass jclass1,jlong instance) {
+    VideoPlayer* p=native(instance);
+    const auto serialized=LatencyHistogram::serialize(p->mDecoder->getDecodingLatency().snapshot());
+    jbyteArray ret=env->NewByteArray((jsize)serialized.size());
+    env->SetByteArrayRegion(ret,0,(jsize)serialized.size(),(const jbyte*)serialized.data());
+    return ret;
+}
+
 JNI_METHOD(jboolean , anyVideoDataReceived)
 (JNIEnv *env,jclass jclass1,jlong testReceiverN) {
     VideoPlayer* p=native(testReceiverN);
@@ -299,6 +471,12 @@ JNI_METHOD(jlong , nativeGetExternalFileReader)
     return (jlong) &p->mFileReceiver;
 }
 
+JNI_METHOD(void , nativeSeek)
+(JNIEnv *env,jclass jclass1,jlong instance,jint positionMs) {
+    VideoPlayer* p=native(instance);
+    p->mFileReceiver.seek(std::chrono::milliseconds(positionMs));
+}
+
 JNI_METHOD(void,nativeCallBack)
 (JNIEnv *env,jclass jclass1,jobject videoParamsChangedI,jlong testReceiverN){
     VideoPlayer* p=native(testReceiverN);
@@ -313,11 +491,12 @@ JNI_METHOD(void,nativeCallBack)
         if(p->latestDecodingInfoChanged){
             jclass jcDecodingInfo = env->FindClass("constantin/video/core/player/DecodingInfo");
             assert(jcDecodingInfo!=nullptr);
-            jmethodID jcDecodingInfoConstructor = env->GetMethodID(jcDecodingInfo, "<init>", "(FFFFFIII)V");
+            jmethodID jcDecodingInfoConstructor = env->GetMethodID(jcDecodingInfo, "<init>", "(FFFFFIIIZFZ)V");
             assert(jcDecodingInfoConstructor!= nullptr);
             const auto info=p->latestDecodingInfo;
             auto decodingInfo=env->NewObject(jcDecodingInfo,jcDecodingInfoConstructor,(jfloat)info.currentFPS,(jfloat)info.currentKiloBitsPerSecond,
-                           (jfloat)info.avgParsingTime_ms,(jfloat)info.avgWaitForInputBTime_ms,(jfloat)info.avgDecodingTime_ms,(jint)info.nNALU,(jint)info.nNALUSFeeded,(jint)info.nDecodedFrames);
+                           (jfloat)info.avgParsingTime_ms,(jfloat)info.avgWaitForInputBTime_ms,(jfloat)info.avgDecodingTime_ms,(jint)info.nNALU,(jint)info.nNALUSFeeded,(jint)info.nDecodedFrames,
+                           (jboolean)info.feedAccessUnits,(jfloat)info.avgNALUsPerInputBuffer,(jboolean)info.asyncDecoding);
             assert(decodingInfo!=nullptr);
             jmethodID onDecodingInfoChangedJAVA = env->GetMethodID(jClassExtendsIVideoParamsChanged, "onDecodingInfoChanged", "(Lconstantin/video/core/player/DecodingInfo;)V");
             assert(onDecodingInfoChangedJAVA!=nullptr);
@@ -330,7 +509,24 @@ JNI_METHOD(void,nativeCallBack)
 JNI_METHOD(void , testLatency)
 (JNIEnv *env,jclass jclass1) {
     test_latency({});
+    // 1KB packets, as fast as possible for ~2 seconds
+    test_receive_single_vs_batched({1024,100*1000,200*1000});
     TEST_TIME_HELPER::test();
+    // Also run as a host ctest, see Benchmark/UnitTests.cpp
+    int nFailedChecks=0;
+    nFailedChecks+=TestEncodeDecodeRTP::testDepacketizer();
+    nFailedChecks+=TEST_SPSC_QUEUE::test();
+    nFailedChecks+=TEST_MPSC_QUEUE::test();
+    nFailedChecks+=TEST_ACCESS_UNIT_ASSEMBLER::test();
+    nFailedChecks+=TEST_KEY_FRAME_FINDER::test();
+    nFailedChecks+=TEST_LATENCY_TRACE::test();
+    nFailedChecks+=TEST_LATENCY_HISTOGRAM::test();
+    if(nFailedChecks!=0){
+        MLOGE<<"Self tests: "<<nFailedChecks<<" failed checks";
+    }
+    test_rtp_parse_cost();
+    // 1KB packets, 5000 packets per second for ~2 seconds
+    test_single_thread_vs_pipelined({1024,5*1000,10*1000});
 }
 
 }
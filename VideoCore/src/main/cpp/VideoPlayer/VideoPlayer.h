@@ -6,6 +6,10 @@
 #define FPV_VR_VIDEOPLAYERN_H
 
 #include <UDPReceiver.h>
+#include <UDPSender.h>
+#include <PacketReplayer.h>
+#include <wifibroadcast/fec_controller.hh>
+#include <mutex>
 #include "GroundRecorderRAW.hpp"
 #include <SharedPreferences.hpp>
 #include <GroundRecorderFPV.hpp>
@@ -14,7 +18,10 @@
 #include "../Experiment360/FFMpegVideoReceiver.h"
 #include "../Experiment360/FFMPEGFileWriter.h"
 #include "../Decoder/LowLagDecoder.h"
+#include "../Decoder/FFMpegSurfaceDecoder.h"
 #include "../Parser/H264Parser.h"
+#include "DecodingPipeline.hpp"
+#include "../NALU/KeyFrameRequest.hpp"
 
 class VideoPlayer{
 public:
@@ -40,21 +47,47 @@ public:
     std::string getInfoString()const;
 private:
     void onNewNALU(const NALU& nalu);
+    // Feed the decoder and write to the ground recorder. Called on the decoder input thread in pipelined mode
+    void decodeNALU(const NALU& nalu);
+    // FEC mode only, tell the transmitter how many blocks were lost / recovered (see FECRatioController)
+    void sendFECFeedbackIfNeeded();
+    // Called by the decoder if VS_REQUEST_KEY_FRAMES is enabled, see LowLagDecoder::KEY_FRAME_REQUEST_CALLBACK
+    void sendKeyFrameRequest();
+    // VS_GROUND_RECORDING_BLOCK_ON_OVERFLOW, VS_GROUND_RECORDING_SYNC_INTERVAL_MS
+    static GroundRecorderFPV::Options getGroundRecorderOptions(const SharedPreferences& settings);
     //Assumptions: Max bitrate: 40 MBit/s, Max time to buffer: 100ms
     //5 MB should be plenty !
     static constexpr const size_t WANTED_UDP_RCVBUF_SIZE=1024*1024*5;
+    //Up to 16 datagrams per recvmmsg call. Does not add latency (see UDPReceiver::setBatchMode)
+    static constexpr const size_t UDP_RECEIVE_BATCH_SIZE=16;
+    //Max n of rtp packets held back by the re-order buffer (the time budget is a setting)
+    static constexpr const size_t RTP_REORDER_MAX_N_PACKETS=64;
+    static constexpr const auto FEC_FEEDBACK_INTERVAL=std::chrono::milliseconds(100);
     //Retreive settings from shared preferences
     SharedPreferences mSettingsN;
-    enum SOURCE_TYPE_OPTIONS{UDP,FILE,ASSETS,VIA_FFMPEG_URL,EXTERNAL};
+    // REPLAY: a .pcap / .fpv capture with the network conditions of VS_REPLAY_CONFIG (see PacketReplayer)
+    enum SOURCE_TYPE_OPTIONS{UDP,FILE,ASSETS,VIA_FFMPEG_URL,EXTERNAL,EXTERNAL_UVC,REPLAY};
     const std::string GROUND_RECORDING_DIRECTORY;
     JavaVM* javaVm=nullptr;
     //TestEncodeDecodeRTP mTestEncodeDecodeRTP;
 public:
     H264Parser mParser;
-    LowLagDecoder mLowLagDecoder;
+    // LowLagDecoder (MediaCodec) or FFMpegSurfaceDecoder if VS_USE_FFMPEG_DECODER is enabled
+    std::unique_ptr<IDecoder> mDecoder;
+    // Same as mDecoder for the MediaCodec backend, nullptr otherwise
+    LowLagDecoder* mLowLagDecoder=nullptr;
     std::unique_ptr<FFMpegVideoReceiver> mFFMpegVideoReceiver;
     std::unique_ptr<UDPReceiver> mUDPReceiver;
+    std::unique_ptr<PacketReplayer> mPacketReplayer;
+    // Only created if VS_PIPELINED_DECODING is enabled (UDP source only). Else receiving,parsing and decoding is done on the same thread
+    std::unique_ptr<DecodingPipeline> mDecodingPipeline;
     long nNALUsAtLastCall=0;
+    // Created once the IP of the transmitter is known. Sends the FECFeedback and KeyFrameRequest packets
+    std::unique_ptr<UDPSender> mFeedbackSender;
+    std::mutex mFeedbackMutex;
+    std::chrono::steady_clock::time_point lastFECFeedback{};
+    uint32_t nFECFeedbacks=0;
+    uint32_t nKeyFrameRequests=0;
 public:
     DecodingInfo latestDecodingInfo{};
     std::atomic<bool> latestDecodingInfoChanged=false;
@@ -1,5 +1,8 @@
 #include <UDPSender.h>
 #include <atomic>
+#include <ctime>
+#include "DecodingPipeline.hpp"
+#include "../Parser/ParseRTP.h"
 
 static void fillBufferWithRandomData(std::vector<uint8_t>& data){
     const std::size_t size=data.size();
@@ -171,6 +174,185 @@ static void test_latency(const Options& o){
 }
 
 
+static std::chrono::nanoseconds threadCPUTime(){
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return std::chrono::seconds(ts.tv_sec)+std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+struct ReceiveThroughputResult{
+    std::size_t nReceivedPackets;
+    long nReceiveCalls;
+    double packetsPerSecond;
+    // CPU time the receiver thread spent per packet (syscall + callback)
+    double cpuNanosecondsPerPacket;
+};
+
+// Send o.N_PACKETS as fast as possible (capped by o.WANTED_PACKETS_PER_SECOND) and measure
+// how fast and how efficiently the UDPReceiver pulls them out of the socket.
+// batchSize<=1 uses one recvfrom per datagram, else recvmmsg with up to batchSize datagrams per call
+static ReceiveThroughputResult test_receive_throughput(const Options& o,const std::size_t batchSize){
+    const std::chrono::nanoseconds TIME_BETWEEN_PACKETS=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::seconds(1))/o.WANTED_PACKETS_PER_SECOND;
+    // Only written by the receiver thread, read after it has been joined
+    std::size_t nReceivedPackets=0;
+    std::chrono::nanoseconds firstPacketCPUTime{0},lastPacketCPUTime{0};
+    std::chrono::steady_clock::time_point firstPacketTime,lastPacketTime;
+    const auto onPackets=[&](const std::size_t nPackets){
+        const auto cpuTime=threadCPUTime();
+        const auto now=std::chrono::steady_clock::now();
+        if(nReceivedPackets==0){
+            firstPacketCPUTime=cpuTime;
+            firstPacketTime=now;
+        }
+        nReceivedPackets+=nPackets;
+        lastPacketCPUTime=cpuTime;
+        lastPacketTime=now;
+    };
+    UDPReceiver udpReceiver{nullptr,o.INPUT_PORT,"BTUdpRec",0,[&onPackets](const uint8_t*,size_t){
+        onPackets(1);
+    },1024*1024*8};
+    if(batchSize>1){
+        udpReceiver.setBatchMode(batchSize,[&onPackets](const UDPReceiver::Packet[],size_t nPackets){
+            onPackets(nPackets);
+        },o.PACKET_SIZE);
+    }
+    udpReceiver.startReceiving();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    UDPSender udpSender{o.DESTINATION_IP,o.OUTPUT_PORT,UDPSender::EXAMPLE_MEDIUM_SNDBUFF_SIZE};
+    const auto buff=createRandomDataBuffer(o.PACKET_SIZE);
+    const auto firstPacketTimePoint=std::chrono::steady_clock::now();
+    for(int i=0;i<o.N_PACKETS;i++){
+        udpSender.mySendTo(buff.data(),buff.size());
+        const auto timePointReadyToSendNextPacket=firstPacketTimePoint+i*TIME_BETWEEN_PACKETS;
+        while(std::chrono::steady_clock::now()<timePointReadyToSendNextPacket){
+            // busy wait, sleep_for is too coarse for high packet rates
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    udpReceiver.stopReceiving();
+
+    ReceiveThroughputResult result{nReceivedPackets,udpReceiver.getNReceiveCalls(),0,0};
+    if(nReceivedPackets>1){
+        const double wallTimeS=std::chrono::duration_cast<std::chrono::nanoseconds>(lastPacketTime-firstPacketTime).count()/1000.0/1000.0/1000.0;
+        // The CPU time of the first packet is not included in the window
+        result.packetsPerSecond=(double)(nReceivedPackets-1)/wallTimeS;
+        result.cpuNanosecondsPerPacket=(double)(lastPacketCPUTime-firstPacketCPUTime).count()/(double)(nReceivedPackets-1);
+    }
+    return result;
+}
+
+static void test_receive_single_vs_batched(const Options& o,const std::size_t batchSize=16){
+    const auto single=test_receive_throughput(o,1);
+    const auto batched=test_receive_throughput(o,batchSize);
+    const auto print=[&o](const char* name,const ReceiveThroughputResult& r){
+        MLOGD<<name<<": received "<<r.nReceivedPackets<<"/"<<o.N_PACKETS<<" packets in "<<r.nReceiveCalls<<" syscalls, "
+        <<r.packetsPerSecond<<" packets/s, "<<r.cpuNanosecondsPerPacket<<" ns CPU per packet\n";
+    };
+    print("Single (recvfrom)",single);
+    print("Batched (recvmmsg)",batched);
+}
+
+// Simulates a decoder that blocks for decoderStall on every stallInterval-th NALU (MediaCodec waiting for a free input buffer).
+// In single threaded mode the receiver thread is blocked during that time, with a small socket buffer packets are lost.
+// In pipelined mode only the decoder input thread is blocked. Returns the n of packets that made it to the decoder
+static std::size_t test_decoder_stall(const Options& o,const bool pipelined,const std::chrono::milliseconds decoderStall=std::chrono::milliseconds(35),
+        const int stallInterval=500){
+    const std::chrono::nanoseconds TIME_BETWEEN_PACKETS=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::seconds(1))/o.WANTED_PACKETS_PER_SECOND;
+    NALU::NALU_BUFFER_POOL pool{4};
+    std::atomic<std::size_t> nDecodedNALUs=0;
+    // One datagram == one NALU, that is enough to put the same load on the decoder in both modes
+    const auto decode=[&nDecodedNALUs,decoderStall,stallInterval](const NALU& nalu){
+        if(++nDecodedNALUs % stallInterval==0){
+            std::this_thread::sleep_for(decoderStall);
+        }
+    };
+    std::unique_ptr<DecodingPipeline> pipeline;
+    const auto parse=[&pool,&pipeline,&decode](const uint8_t* data,size_t data_length){
+        auto buffer=pool.acquire();
+        std::memcpy(buffer->data(),data,data_length);
+        const NALU nalu(buffer,data_length);
+        if(pipeline){
+            pipeline->pushNALU(nalu);
+        }else{
+            decode(nalu);
+        }
+    };
+    if(pipelined){
+        pipeline=std::make_unique<DecodingPipeline>(nullptr,parse,decode);
+        pipeline->start();
+    }
+    // Small socket buffer, such that even a short stall overflows it
+    UDPReceiver udpReceiver{nullptr,o.INPUT_PORT,"StallUdpRec",0,[&pipeline,&parse](const uint8_t* data,size_t data_length){
+        if(pipeline){
+            pipeline->pushDatagram(data,data_length);
+        }else{
+            parse(data,data_length);
+        }
+    },1024*64};
+    udpReceiver.startReceiving();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    UDPSender udpSender{o.DESTINATION_IP,o.OUTPUT_PORT,UDPSender::EXAMPLE_MEDIUM_SNDBUFF_SIZE};
+    const auto buff=createRandomDataBuffer(o.PACKET_SIZE);
+    const auto firstPacketTimePoint=std::chrono::steady_clock::now();
+    for(int i=0;i<o.N_PACKETS;i++){
+        udpSender.mySendTo(buff.data(),buff.size());
+        const auto timePointReadyToSendNextPacket=firstPacketTimePoint+i*TIME_BETWEEN_PACKETS;
+        while(std::chrono::steady_clock::now()<timePointReadyToSendNextPacket){
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    udpReceiver.stopReceiving();
+    if(pipeline){
+        MLOGD<<pipeline->getStatsString()<<"\n";
+        pipeline->stop();
+    }
+    return nDecodedNALUs;
+}
+
+static void test_single_thread_vs_pipelined(const Options& o){
+    const auto single=test_decoder_stall(o,false);
+    const auto pipelined=test_decoder_stall(o,true);
+    MLOGD<<"Decoder stalls: single thread decoded "<<single<<"/"<<o.N_PACKETS<<" pipelined decoded "<<pipelined<<"/"<<o.N_PACKETS<<"\n";
+}
+
+// CPU time per RTP packet spent in RTPDecoder::parseRTPtoNALU with the per-packet (verbose) logs printed - like every
+// MLOGD before they became MLOGV - and with them disabled at runtime. With MLOG_MIN_LEVEL>2 they are compiled out
+// and both values should be the same
+static void test_rtp_parse_cost(const int nNALUs=2000){
+    std::vector<std::vector<uint8_t>> rtpPackets;
+    RTPEncoder encoder([&rtpPackets](const RTPEncoder::RTPPacket& packet){
+        rtpPackets.emplace_back(packet.data,packet.data+packet.data_len);
+    });
+    std::vector<uint8_t> nalu;
+    for(int i=0;i<nNALUs;i++){
+        // Mix of NALUs that fit into one rtp packet and NALUs that need fragmentation
+        nalu.resize(i%4==0 ? 20*1024 : 800);
+        fillBufferWithRandomData(nalu);
+        const uint8_t header[5]={0,0,0,1,(uint8_t)(i%4==0 ? 0x65 : 0x41)};
+        std::memcpy(nalu.data(),header,sizeof(header));
+        encoder.parseNALtoRTP(30,nalu.data(),nalu.size());
+    }
+    const auto measure=[&rtpPackets](const MLogLevel level){
+        std::size_t nReceivedNALUs=0;
+        RTPDecoder decoder([&nReceivedNALUs](const NALU&){
+            nReceivedNALUs++;
+        });
+        MLogThreshold::set(level);
+        const auto before=threadCPUTime();
+        for(const auto& packet:rtpPackets){
+            decoder.parseRTPtoNALU(packet.data(),packet.size());
+        }
+        const auto cpuTime=threadCPUTime()-before;
+        MLogThreshold::set(MLogLevel::D);
+        return (double)cpuTime.count()/(double)rtpPackets.size();
+    };
+    const double withLogs=measure(MLogLevel::V);
+    const double withoutLogs=measure(MLogLevel::D);
+    MLOGD<<"RTP parse cost ("<<rtpPackets.size()<<" packets): verbose logs "<<withLogs<<" ns CPU per packet, disabled "
+    <<withoutLogs<<" ns CPU per packet. MLOG_MIN_LEVEL "<<MLOG_MIN_LEVEL<<"\n";
+}
+
 int main(int argc, char *argv[])
 {
 	// For testing the localhost latency just use the same udp port for input and output
@@ -183,7 +365,10 @@ int main(int argc, char *argv[])
 	int output_port=6001;
 	// default localhost
 	int mode=0;
-    while ((opt = getopt(argc, argv, "s:p:t:i:o:m:")) != -1) {
+	int batchSize=0;
+	bool comparePipelined=false;
+	bool rtpParseCost=false;
+    while ((opt = getopt(argc, argv, "s:p:t:i:o:m:b:dr")) != -1) {
         switch (opt) {
         case 's':
             ps = atoi(optarg);
@@ -203,11 +388,23 @@ int main(int argc, char *argv[])
 		case 'm':
 			mode=atoi(optarg);
 			break;
+		case 'b':
+			batchSize=atoi(optarg);
+			break;
+		case 'd':
+			comparePipelined=true;
+			break;
+		case 'r':
+			rtpParseCost=true;
+			break;
         default: /* '?' */
         show_usage:
             MLOGD<<"Usage: [-s=packet size in bytes] [-p=packets per second] [-t=time to run in seconds]"
 			//<<"[-i=input udp port] [-o=output udp port]"
-			<<" [-m= mode 0 for sendto localhost else airpi]\n";
+			<<" [-m= mode 0 for sendto localhost else airpi]"
+			<<" [-b=recvmmsg batch size, compare single vs batched receive instead of measuring latency]"
+			<<" [-d compare single thread vs pipelined decoding with a stalling decoder]"
+			<<" [-r measure the per packet cost of the rtp parser with and without verbose logs]\n";
             return 1;
         }
     }
@@ -222,7 +419,15 @@ int main(int argc, char *argv[])
     // 8 MBit/s is a just enough for encoded 720p video
 	MLOGD<<"Selected input: "<<options.INPUT_PORT<<"\n";
 	MLOGD<<"Selected output: "<<options.DESTINATION_IP<<" OUTPUT_PORT"<<options.OUTPUT_PORT<<"\n";
-	test_latency(options);
+	if(rtpParseCost){
+		test_rtp_parse_cost();
+	}else if(batchSize>0){
+		test_receive_single_vs_batched(options,batchSize);
+	}else if(comparePipelined){
+		test_single_thread_vs_pipelined(options);
+	}else{
+		test_latency(options);
+	}
 
     return 0;
 }
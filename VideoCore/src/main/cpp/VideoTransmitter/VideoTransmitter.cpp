@@ -21,8 +21,11 @@
 #include <arpa/inet.h>
 #include <StringHelper.hpp>
 #include <UDPSender.h>
+#include <UDPReceiver.h>
 #include <wifibroadcast/fec.hh>
+#include <wifibroadcast/fec_controller.hh>
 #include "../Parser/ParseRTP.h"
+#include "../NALU/KeyFrameRequest.hpp"
 #include <ATraceCompbat.hpp>
 
 
@@ -30,7 +33,26 @@ class VideoTransmitter{
 public:
     VideoTransmitter(const std::string& IP,const int Port):
     mUDPSender(IP,Port,UDPSender::EXAMPLE_MEDIUM_SNDBUFF_SIZE),
-    mEncodeRTP(std::bind(&VideoTransmitter::newRTPPacket, this, std::placeholders::_1),MY_RTP_PACKET_MAX_SIZE){}
+    mEncodeRTP(std::bind(&VideoTransmitter::newRTPPacket, this, std::placeholders::_1),MY_RTP_PACKET_MAX_SIZE){
+        // The receiver reports its loss (FEC mode only), such that the FEC ratio can be adjusted
+        // and requests key frames after it dropped frames (any mode, if enabled on the receiver)
+        enc.controller(mFECRatioController);
+        mFECFrameEncoder.controller(mFECRatioController);
+        mFECFeedbackReceiver=std::make_unique<UDPReceiver>(nullptr,Port+FECFeedback::FEEDBACK_PORT_OFFSET,"FECFeedback",0,[this](const uint8_t* data,size_t data_length){
+            FECFeedback feedback;
+            KeyFrameRequest keyFrameRequest;
+            if(FECFeedback::parse(data,data_length,feedback)){
+                mFECRatioController->add_report(feedback);
+            }else if(KeyFrameRequest::parse(data,data_length,keyFrameRequest)){
+                MLOGD<<"Key frame request "<<(int)keyFrameRequest.requestNum;
+                keyFrameRequested=true;
+            }
+        });
+        mFECFeedbackReceiver->startReceiving();
+    }
+    ~VideoTransmitter(){
+        mFECFeedbackReceiver->stopReceiving();
+    }
     /**
      * send data to the ip and port set previously. Logs error on failure.
      * If data length exceeds the max UDP packet size, the method splits data into smaller packets
@@ -44,9 +66,14 @@ public:
     AvgCalculatorSize avgNALUSize;
     // Do FEC over the RTP packets
     bool DO_FEC_WRAPPING=false;
+    // Only if DO_FEC_WRAPPING: One FEC sequence for all RTP packets of a frame (what is passed to RTPSend)
+    // instead of one per RTP packet
+    bool FEC_PER_FRAME=false;
     // Prepend each udp packets with 4 bytes of sequence numbers (for raw)
     bool ADD_SEQUENCE_NR=false;
     int SEND_EACH_RTP_PACKET_MULTIPLE_TIMES=0;
+    // Set by the feedback receiver thread, consumed by the encoder drain thread (java)
+    std::atomic<bool> keyFrameRequested{false};
 private:
     // RTP parser splits into packets of this maximum size
     static constexpr const size_t MY_RTP_PACKET_MAX_SIZE=65507;//TODO remove
@@ -58,10 +85,15 @@ private:
     std::chrono::steady_clock::time_point lastForwardedPacket{};
     //
     FECBufferEncoder enc{1500,0.5f};
+    // Starts with 1 FEC block per rtp packet (same as a fixed ratio of 0.5) until the first feedback arrives
+    std::shared_ptr<FECRatioController> mFECRatioController=std::make_shared<FECRatioController>();
+    std::unique_ptr<UDPReceiver> mFECFeedbackReceiver;
+    // Does not hold back the data of a frame, since RTPSend() creates all RTP packets of the frame at once
+    FECFrameEncoder mFECFrameEncoder{1500,0.5f,64};
+    void sendFECBlocks(const std::vector<std::shared_ptr<FECBlock>>& blks);
     //
     RTPEncoder mEncodeRTP;
     void newRTPPacket(const RTPEncoder::RTPPacket& packet);
-    FECDecoder mFECDecoder;
 };
 
 //Split data into smaller packets when exceeding UDP max packet size
@@ -122,6 +154,9 @@ void VideoTransmitter::sendPacket(const uint8_t *data, ssize_t data_length) {
 void VideoTransmitter::RTPSend(const uint8_t *data, ssize_t data_length) {
     ATrace_beginSection("VideoTransmitter::RTPSend");
     mEncodeRTP.parseNALtoRTP(30,data,data_length);
+    if(DO_FEC_WRAPPING && FEC_PER_FRAME){
+        sendFECBlocks(mFECFrameEncoder.flush());
+    }
     ATrace_endSection();
 }
 
@@ -135,15 +170,17 @@ void VideoTransmitter::newRTPPacket(const RTPEncoder::RTPPacket& packet) {
         ATrace_beginSection("VideoTransmitter::FECWrapping");
         MLOGD<<"Wrapping rtp packet into FEC";
         assert(packet.data_len<=1024);
-        std::vector<std::shared_ptr<FECBlock> > blks = enc.encode_buffer(packet.data,packet.data_len);
-        // With a ratio of 0.5 we should get exactly 2 blocks
-        assert(blks.size()==2);
-        ATrace_endSection();
-        for (auto blk : blks) {
-            ATrace_beginSection("UDP::sendto");
-            mUDPSender.mySendTo(blk->pkt_data(), blk->pkt_length());
+        if(FEC_PER_FRAME){
+            // Sent once the frame is complete
+            sendFECBlocks(mFECFrameEncoder.add_packet(packet.data,packet.data_len));
             ATrace_endSection();
+            return;
         }
+        std::vector<std::shared_ptr<FECBlock> > blks = enc.encode_buffer(packet.data,packet.data_len);
+        // One data block and as many FEC blocks as the FEC ratio (including the fractions carried over by
+        // mFECRatioController) asks for - can be none or several
+        ATrace_endSection();
+        sendFECBlocks(blks);
         //
     }else{
         // To emulate a higher bitstream rate (the receiver has to drop duplicates though)
@@ -158,6 +195,13 @@ void VideoTransmitter::newRTPPacket(const RTPEncoder::RTPPacket& packet) {
     }
 }
 
+void VideoTransmitter::sendFECBlocks(const std::vector<std::shared_ptr<FECBlock>>& blks) {
+    for (const auto& blk : blks) {
+        ATrace_beginSection("UDP::sendto");
+        mUDPSender.mySendTo(blk->pkt_data(), blk->pkt_length());
+        ATrace_endSection();
+    }
+}
 
 //----------------------------------------------------JAVA bindings---------------------------------------------------------------
 
@@ -183,6 +227,11 @@ JNI_METHOD(void, nativeDelete)
     delete native(p);
 }
 
+JNI_METHOD(jboolean, nativeConsumeKeyFrameRequest)
+(JNIEnv *env, jobject obj, jlong p) {
+    return (jboolean) native(p)->keyFrameRequested.exchange(false);
+}
+
 JNI_METHOD(void, nativeSend)
 (JNIEnv *env, jobject obj, jlong p,jobject buf,jint size,jint streamMode) {
     //jlong size=env->GetDirectBufferCapacity(buf);
@@ -191,6 +240,7 @@ JNI_METHOD(void, nativeSend)
         MLOGE<<"Something wrong with the byte buffer (is it direct ?)";
     }
     native(p)->DO_FEC_WRAPPING=false;
+    native(p)->FEC_PER_FRAME=false;
     native(p)->ADD_SEQUENCE_NR=false;
     native(p)->SEND_EACH_RTP_PACKET_MULTIPLE_TIMES=0;
     //LOGD("size %d",size);
@@ -204,10 +254,15 @@ JNI_METHOD(void, nativeSend)
         // Send each rtp packet multiple times
         native(p)->SEND_EACH_RTP_PACKET_MULTIPLE_TIMES=5;
         native(p)->RTPSend((uint8_t*)data,(ssize_t)size);
-    }else{
+    }else if(streamMode==3){
         // RTP inside FEC over UDP
         native(p)->DO_FEC_WRAPPING=true;
         native(p)->RTPSend((uint8_t *) data, (ssize_t) size);
+    }else{
+        // RTP inside FEC over UDP, one FEC sequence per frame. Same stream format, the receiver uses CUSTOM2 too
+        native(p)->DO_FEC_WRAPPING=true;
+        native(p)->FEC_PER_FRAME=true;
+        native(p)->RTPSend((uint8_t *) data, (ssize_t) size);
     }
 }
 
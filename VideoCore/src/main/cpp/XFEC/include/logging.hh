@@ -1,7 +1,12 @@
 
 #pragma once
 
-#ifdef __ANDROID__
+// Without log4cpp (e.g. the host benchmark) AndroidLogger logs to std::cout
+#if defined(__ANDROID__) || !__has_include(<log4cpp/Category.hh>)
+#define XFEC_LOG_ANDROID_LOGGER
+#endif
+
+#ifdef XFEC_LOG_ANDROID_LOGGER
 
 // Using AndroidLogger instead is straight forward
 #include <AndroidLogger.hpp>
@@ -11,7 +16,7 @@
 
 #endif
 
-#ifndef __ANDROID__
+#ifndef XFEC_LOG_ANDROID_LOGGER
 
 #include <cctype>
 #include <algorithm>
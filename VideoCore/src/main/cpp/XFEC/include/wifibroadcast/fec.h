@@ -20,6 +20,10 @@ void fec_encode(unsigned int blockSize,
 		unsigned char **fec_blocks,
 		unsigned int nrFecBlocks);
 
+/*
+ * erased_blocks has to be in ascending order, the FEC blocks (fec_blocks /
+ * fec_block_nos) can be in any order.
+ */
 void fec_decode(unsigned int blockSize,
 		unsigned char **data_blocks,
 		unsigned int nr_data_blocks,
@@ -30,6 +34,40 @@ void fec_decode(unsigned int blockSize,
 
 void fec_print(fec_code_t code, int width);
 
+/*
+ * Implementation of the GF(2^8) multiply(-accumulate) loops that do the
+ * actual encoding / decoding work. All of them produce the same output.
+ * fec_init() selects the fastest one supported by the CPU (FEC_KERNEL_AUTO).
+ */
+typedef enum {
+  FEC_KERNEL_AUTO = -1,
+  FEC_KERNEL_SCALAR = 0,
+  FEC_KERNEL_SSSE3,
+  FEC_KERNEL_AVX2,
+  FEC_KERNEL_NEON
+} fec_kernel_t;
+
+/* returns the kernel that is used from now on. Unsupported kernels fall back to FEC_KERNEL_SCALAR */
+fec_kernel_t fec_set_kernel(fec_kernel_t kernel);
+
+fec_kernel_t fec_get_kernel(void);
+
+const char *fec_kernel_name(fec_kernel_t kernel);
+
+/* dst[] = dst[] + c * src[] and dst[] = c * src[] with the current kernel, for tests and benchmarks */
+void fec_addmul(unsigned char *dst, unsigned char *src, unsigned char c, unsigned int sz);
+
+void fec_mul(unsigned char *dst, unsigned char *src, unsigned char c, unsigned int sz);
+
+/*
+ * fec_decode() caches the inverted decode matrices of the last 16 erasure
+ * patterns (per thread). Disabling or enabling the cache clears it and the
+ * hit / miss counters of the calling thread.
+ */
+void fec_set_matrix_cache(int enabled);
+
+void fec_get_matrix_cache_stats(unsigned long *hits, unsigned long *misses);
+
 void fec_license(void);
 
 #ifdef __cplusplus  
@@ -5,10 +5,13 @@
 #include <memory.h>
 
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <iostream>
 #include <set>
 #include <queue>
+#include <chrono>
 
 #include <wifibroadcast/fec.h>
 
@@ -32,8 +35,7 @@ public:
   FECBlock(uint8_t seq_num, uint8_t block, uint8_t nblocks, uint8_t nfec_blocks,
 	   uint16_t max_block_len, uint16_t data_length) {
     m_data_length = max_block_len + sizeof(FECHeader) - 2;
-    m_data.reset(new uint8_t[m_data_length]);
-    std::fill(m_data.get(), m_data.get() + m_data_length, 0);
+    allocate(m_data_length);
     FECHeader *h = header();
     h->seq_num = seq_num;
     h->block = block;
@@ -45,20 +47,48 @@ public:
   // Create a block from a packet buffer
   FECBlock(const uint8_t *buf, uint16_t pkt_length) {
     m_data_length = pkt_length;
-    m_data.reset(new uint8_t[m_data_length]);
-    std::fill(m_data.get(), m_data.get() + m_data_length, 0);
-    std::copy(buf, buf + pkt_length, m_data.get());
+    allocate(m_data_length);
+    std::copy(buf, buf + pkt_length, m_data);
   }
 
   // Create a block from an existing header
   FECBlock(const FECHeader &h, uint16_t block_length) {
     m_data_length = block_length + sizeof(FECHeader) - 2;
-    m_data.reset(new uint8_t[m_data_length]);
-    std::fill(m_data.get(), m_data.get() + m_data_length, 0);
+    allocate(m_data_length);
     *header() = h;
     data_length(block_length - 2);
   }
 
+  // Create an empty block that uses (but does not own) memory of capacity bytes, see FECBlockArena
+  FECBlock(uint8_t *memory, uint16_t capacity) :
+    m_data(memory), m_data_length(0), m_capacity(capacity) {}
+
+  FECBlock(const FECBlock&) = delete;
+  FECBlock& operator=(const FECBlock&) = delete;
+
+  // Re-use this block for a packet buffer. Only allocates if the packet does not fit into the capacity.
+  // The remaining capacity is zeroed, such that a shorter data block is zero padded for FEC.
+  void assign(const uint8_t *buf, uint16_t pkt_length) {
+    reserve(pkt_length);
+    m_data_length = pkt_length;
+    std::copy(buf, buf + pkt_length, m_data);
+    std::fill(m_data + pkt_length, m_data + m_capacity, 0);
+  }
+
+  // Re-use this block for an existing header
+  void assign(const FECHeader &h, uint16_t block_length) {
+    reserve(block_length + sizeof(FECHeader) - 2);
+    m_data_length = block_length + sizeof(FECHeader) - 2;
+    std::fill(m_data, m_data + m_capacity, 0);
+    *header() = h;
+    data_length(block_length - 2);
+  }
+
+  // The size of the packet memory, pkt_length() <= capacity()
+  uint16_t capacity() const {
+    return m_capacity;
+  }
+
   // The FEC block size, which includes the data and data length fields
   uint16_t block_size() const {
     return data_length() + 2;
@@ -72,10 +102,10 @@ public:
 
   // A pointer to the data (does not include the header or length fields)
   uint8_t *data() {
-    return m_data.get() + sizeof(FECHeader);
+    return m_data + sizeof(FECHeader);
   }
   const uint8_t *data() const {
-    return data();
+    return m_data + sizeof(FECHeader);
   }
 
   // The length of data (does not include the header or length fields)
@@ -88,26 +118,26 @@ public:
 
   // A pointer to the data that should be included in FEC (everything except the header)
   uint8_t *fec_data() {
-    return m_data.get() + sizeof(FECHeader) - 2;
+    return m_data + sizeof(FECHeader) - 2;
   }
   const uint8_t *fec_data() const {
-    return fec_data();
+    return m_data + sizeof(FECHeader) - 2;
   }
 
   // A pointer to the header
   FECHeader *header() {
-    return reinterpret_cast<FECHeader*>(m_data.get());
+    return reinterpret_cast<FECHeader*>(m_data);
   }
   const FECHeader *header() const {
-    return reinterpret_cast<const FECHeader*>(m_data.get());
+    return reinterpret_cast<const FECHeader*>(m_data);
   }
 
   // A pointer to all packet data (header + length + data)
   uint8_t *pkt_data() {
-    return m_data.get();
+    return m_data;
   }
   const uint8_t *pkt_data() const {
-    return m_data.get();
+    return m_data;
   }
 
   // The length of the entire packet (header + length + data)
@@ -115,6 +145,15 @@ public:
     return m_data_length;
   }
 
+  // n of packet buffers allocated by all FECBlocks and FECBlockArenas so far,
+  // such that tests can check that a code path does not allocate
+  static size_t n_allocations() {
+    return s_n_allocations.load(std::memory_order_relaxed);
+  }
+  static void count_allocation() {
+    s_n_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+
   // What type of block is this, data or FEC?
   bool is_data_block() const {
     return header()->block < header()->n_blocks;
@@ -129,8 +168,107 @@ public:
   }
 
 private:
-  std::unique_ptr<uint8_t> m_data;
+  // Either m_owned_data or memory owned by someone else (FECBlockArena)
+  uint8_t *m_data;
+  std::unique_ptr<uint8_t[]> m_owned_data;
   uint16_t m_data_length;
+  uint16_t m_capacity;
+  static inline std::atomic<size_t> s_n_allocations{0};
+
+  void allocate(uint16_t capacity) {
+    count_allocation();
+    m_owned_data.reset(new uint8_t[capacity]);
+    m_data = m_owned_data.get();
+    m_capacity = capacity;
+    std::fill(m_data, m_data + m_capacity, 0);
+  }
+
+  void reserve(uint16_t capacity) {
+    if (capacity > m_capacity) {
+      allocate(capacity);
+    }
+  }
+};
+
+// Preallocated FECBlocks for the decoder, such that receiving a packet does not allocate.
+// The packet memory of all slots is one contiguous allocation.
+// Blocks are reference counted (not thread safe), a block is recycled once the last reference is released.
+// If all slots are in use another slot is allocated and kept (counted in n_overflow_slots()),
+// thus a too small arena only costs allocations until it has grown to what the stream needs.
+class FECBlockArena {
+public:
+  FECBlockArena(size_t n_slots, uint16_t slot_size);
+
+  // The returned block has a reference count of 1
+  FECBlock *acquire();
+  void add_ref(FECBlock *blk);
+  void release(FECBlock *blk);
+
+  size_t n_slots() const {
+    return m_slots.size();
+  }
+  size_t n_free_slots() const {
+    return m_free_slots.size();
+  }
+  size_t n_overflow_slots() const {
+    return m_slots.size() - m_n_preallocated_slots;
+  }
+
+private:
+  struct Slot : public FECBlock {
+    Slot(uint8_t *memory, uint16_t capacity) : FECBlock(memory, capacity), ref_count(0) {}
+    uint32_t ref_count;
+  };
+  const uint16_t m_slot_size;
+  const size_t m_n_preallocated_slots;
+  std::unique_ptr<uint8_t[]> m_memory;
+  std::vector<std::unique_ptr<uint8_t[]> > m_overflow_memory;
+  std::vector<std::unique_ptr<Slot> > m_slots;
+  std::vector<Slot*> m_free_slots;
+};
+
+// A non-owning reference to a block of the decoder. The block is recycled when the view is destroyed or reset.
+// A view must not outlive the decoder that created it.
+class FECBlockView {
+public:
+  FECBlockView() : m_arena(nullptr), m_block(nullptr) {}
+  FECBlockView(FECBlockArena *arena, FECBlock *block) : m_arena(arena), m_block(block) {}
+  FECBlockView(FECBlockView &&other) noexcept : m_arena(other.m_arena), m_block(other.m_block) {
+    other.m_block = nullptr;
+  }
+  FECBlockView& operator=(FECBlockView &&other) noexcept {
+    if (this != &other) {
+      reset();
+      m_arena = other.m_arena;
+      m_block = other.m_block;
+      other.m_block = nullptr;
+    }
+    return *this;
+  }
+  ~FECBlockView() {
+    reset();
+  }
+
+  void reset() {
+    if (m_block) {
+      m_arena->release(m_block);
+      m_block = nullptr;
+    }
+  }
+
+  explicit operator bool() const {
+    return m_block != nullptr;
+  }
+  const FECBlock *operator->() const {
+    return m_block;
+  }
+  const FECBlock &operator*() const {
+    return *m_block;
+  }
+
+private:
+  FECBlockArena *m_arena;
+  FECBlock *m_block;
 };
 
 class FECEncoder {
@@ -160,10 +298,16 @@ public:
   // Complete the sequence with the current set of blocks
   void flush();
 
+  // Change the number of FEC blocks, starting with the next sequence (see FECRatioController)
+  void num_fec_blocks(uint8_t num_fec_blocks) {
+    m_next_num_fec_blocks = num_fec_blocks;
+  }
+
 private:
   uint8_t m_seq_num;
   uint8_t m_num_blocks;
   uint8_t m_num_fec_blocks;
+  uint8_t m_next_num_fec_blocks;
   uint16_t m_max_block_size;
   std::vector<std::shared_ptr<FECBlock> > m_in_blocks;
   std::queue<std::shared_ptr<FECBlock> > m_out_blocks;
@@ -174,11 +318,19 @@ private:
 };
 
 
+class FECRatioController;
+
 class FECBufferEncoder {
 public:
   FECBufferEncoder(uint32_t maximum_block_size = 1460, float fec_ratio = 0.5) :
     m_max_block_size(maximum_block_size), m_fec_ratio(fec_ratio), m_seq_num(1) { }
 
+  // Let the controller choose the number of FEC blocks of each buffer instead of the fixed ratio.
+  // A buffer might be sent without FEC blocks then.
+  void controller(std::shared_ptr<FECRatioController> controller) {
+    m_controller = controller;
+  }
+
   std::vector<std::shared_ptr<FECBlock> >
   encode_buffer(const uint8_t* buf, size_t length);
   std::vector<std::shared_ptr<FECBlock> >
@@ -192,28 +344,104 @@ private:
   uint32_t m_max_block_size;
   float m_fec_ratio;
   uint8_t m_seq_num;
+  std::shared_ptr<FECRatioController> m_controller;
+};
+
+// Collects the packets of a video frame (e.g. the RTP packets of one access unit) into one FEC sequence,
+// such that a lost packet can be recovered by the FEC blocks of the whole frame instead of only by the ones
+// of its own packet. Each packet is one data block, the receiver gets the packets back unchanged.
+// A sequence is completed at the end of a frame, when it has max_blocks data blocks or (if max_delay is not 0)
+// when a packet is added more than max_delay after the first packet of the sequence.
+// The blocks of a sequence are only returned once it is completed, thus it adds up to one frame of latency.
+// Data blocks are not padded to the size of the largest block of the sequence.
+class FECFrameEncoder {
+public:
+  FECFrameEncoder(uint16_t maximum_block_size = 1460, float fec_ratio = 0.5, uint8_t max_blocks = 32,
+		  std::chrono::milliseconds max_delay = std::chrono::milliseconds(0));
+
+  // See FECBufferEncoder::controller()
+  void controller(std::shared_ptr<FECRatioController> controller) {
+    m_controller = controller;
+  }
+
+  // Add a packet of up to maximum_block_size bytes, bigger packets are dropped.
+  // Returns the blocks of the completed sequence(s), if any
+  std::vector<std::shared_ptr<FECBlock> >
+  add_packet(const uint8_t *buf, size_t length, bool end_of_frame = false);
+
+  // Complete the current sequence, e.g. at the end of a frame
+  std::vector<std::shared_ptr<FECBlock> > flush();
+
+private:
+  uint16_t m_max_block_size;
+  float m_fec_ratio;
+  uint8_t m_max_blocks;
+  std::chrono::steady_clock::duration m_max_delay;
+  uint8_t m_seq_num;
+  std::shared_ptr<FECRatioController> m_controller;
+  // The packets of the current sequence, back to back
+  std::vector<uint8_t> m_data;
+  std::vector<uint16_t> m_lengths;
+  std::chrono::steady_clock::time_point m_first_packet_time;
+
+  void encode(std::vector<std::shared_ptr<FECBlock> > &out);
 };
 
 
 
 struct FECDecoderStats {
   FECDecoderStats() : total_blocks(0), total_packets(0), dropped_blocks(0), dropped_packets(0),
-		      lost_sync(0), bytes(0) {}
+		      lost_sync(0), bytes(0), recovered_blocks(0), window_recovered_blocks(0),
+		      expired_sequences(0), output_blocks(0), lost_blocks(0) {}
   size_t total_blocks;
   size_t total_packets;
   size_t dropped_blocks;
   size_t dropped_packets;
   size_t lost_sync;
   size_t bytes;
+  // Data blocks recovered by FEC
+  size_t recovered_blocks;
+  // Data blocks recovered by FEC in a sequence that was not the latest one anymore.
+  // Without the window these would have been lost.
+  size_t window_recovered_blocks;
+  // Sequences that were given up because of the timeout
+  size_t expired_sequences;
+  // Data blocks output
+  size_t output_blocks;
+  // Data blocks that could not be received nor recovered. If nothing of a sequence was received
+  // it is assumed to have had as many data blocks as the previous one.
+  size_t lost_blocks;
 };
 
 FECDecoderStats operator-(const FECDecoderStats& s1, const FECDecoderStats &s2);
 FECDecoderStats operator+(const FECDecoderStats& s1, const FECDecoderStats &s2);
 
+// Received blocks, blocks recovered by FEC and the output queue are all FECBlocks of an FECBlockArena
+// that are recycled once the sequence is done and the consumer has released them.
+// With get_block_view() receiving and decoding does not allocate once the arena is large enough.
+//
+// Up to n_window_sequences sequences are decoded concurrently, such that late (reordered) packets
+// of an older sequence can still be used. A sequence is decoded as soon as any n_blocks of its
+// n_blocks + n_fec_blocks blocks have been received. Data blocks are output in order, also across sequences:
+// A sequence with missing data blocks holds back the data of newer sequences until it is decoded,
+// until it is older than the window or until timeout has passed since its first packet.
+// With a window of 1 a sequence is given up as soon as a packet of the next sequence arrives.
+// A packet without FEC blocks (n_fec_blocks == 0) is a sequence of its own.
 class FECDecoder {
 public:
 
+  // The arena starts empty and grows to what the stream needs
   FECDecoder();
+  // Preallocate the arena for sequences of up to max_blocks data blocks and max_fec_blocks FEC blocks
+  // with a block size (see FECBlock::block_size()) of up to max_block_size, for all sequences of the window
+  // and the output of the previous one that is still consumed.
+  // n_window_sequences is rounded up to a power of 2 (max 64). A timeout of 0 disables the timeout.
+  FECDecoder(uint8_t max_blocks, uint8_t max_fec_blocks, uint16_t max_block_size,
+	     uint8_t n_window_sequences = 1, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+  ~FECDecoder();
+
+  FECDecoder(const FECDecoder&) = delete;
+  FECDecoder& operator=(const FECDecoder&) = delete;
 
   void add_block(const uint8_t *buf, uint16_t block_length);
   // Make sure to use pkt_data and pkt_length instead of data / data_length
@@ -221,30 +449,88 @@ public:
     add_block(blk->pkt_data(), blk->pkt_length());
   }
 
-  // Retrieve the next data/fec block
+  // Give up sequences whose timeout has passed. Called by add_block(), call it if no packets arrive
+  void check_timeout();
+
+  // Give up all sequences that are not complete, e.g. at the end of the stream
+  void flush();
+
+  // Retrieve the next data/fec block. Returns a copy of the block, use get_block_view() to avoid the allocation
   std::shared_ptr<FECBlock> get_block();
 
+  // Retrieve the next data/fec block without copying it. The view evaluates to false if there is no block
+  FECBlockView get_block_view();
+
   const FECDecoderStats &stats() const {
     return m_stats;
   }
 
+  const FECBlockArena &arena() const {
+    return m_arena;
+  }
+
 private:
-  // The block size of the current sequence (0 on restart)
-  uint16_t m_block_size;
-  // The previous sequence number
-  FECHeader m_prev_header;
-  // The blocks that have been received previously for this sequence
-  std::vector<std::shared_ptr<FECBlock> > m_blocks;
-  // The FEC blocks that have been received previously for this sequence
-  std::vector<std::shared_ptr<FECBlock> > m_fec_blocks;
-  // The output queue of blocks
-  std::queue<std::shared_ptr<FECBlock> > m_out_blocks;
+  // All received blocks of one sequence
+  struct Sequence {
+    bool in_use;
+    uint8_t seq_num;
+    uint8_t n_blocks;
+    uint8_t n_fec_blocks;
+    // Size of the largest block
+    uint16_t block_size;
+    // Indexed by the block number, nullptr if not received (yet)
+    std::vector<FECBlock*> blocks;
+    uint8_t n_received_blocks;
+    std::vector<FECBlock*> fec_blocks;
+    // All data blocks are available (or the sequence cannot be decoded)
+    bool done;
+    // The next data block to output
+    uint8_t next_out;
+    std::chrono::steady_clock::time_point first_packet_time;
+  };
+  // If this many packets in a row are older than the window the transmitter was probably restarted
+  static constexpr uint32_t RESYNC_AFTER_N_LATE_PACKETS = 64;
+
+  FECBlockArena m_arena;
+  std::chrono::steady_clock::duration m_timeout;
+  // Indexed by seq_num % size (a power of 2)
+  std::vector<Sequence> m_window;
+  bool m_have_seq;
+  // Latest sequence number received
+  uint8_t m_newest_seq;
+  // Oldest sequence that has not been output completely
+  uint8_t m_out_seq;
+  uint32_t m_n_late_packets;
+  // n_blocks of the latest sequence that was started
+  uint8_t m_last_n_blocks;
+  // The output queue of blocks, m_out_blocks[m_out_pos] is the next one
+  std::vector<FECBlock*> m_out_blocks;
+  size_t m_out_pos;
   // The running total of the decoder status
   FECDecoderStats m_stats;
-  // Used for tracking dropped packets/sequences
-  std::vector<uint8_t> m_block_numbers;
-
-  void decode();
+  // Re-used by decode()
+  std::vector<uint8_t*> m_block_ptrs;
+  std::vector<uint8_t*> m_fec_block_ptrs;
+  std::vector<unsigned int> m_fec_block_idxs;
+  std::vector<unsigned int> m_erased_block_idxs;
+
+  Sequence &sequence(uint8_t seq_num) {
+    return m_window[seq_num & (m_window.size() - 1)];
+  }
+  Sequence &start_sequence(const FECHeader &h, std::chrono::steady_clock::time_point now);
+  void decode(Sequence &seq);
+  // The sequence is complete or decoded, the FEC blocks are not needed anymore
+  void finish(Sequence &seq);
+  void release(Sequence &seq);
+  // Output the data blocks in order, as far as possible
+  void output_in_order();
+  // Output what is available of the oldest sequence and continue with the next one
+  void give_up_oldest(bool expired);
+  // Start with a new sequence, give up everything else
+  void restart(uint8_t seq_num);
+  // Add a reference to the block and append it to the output queue
+  void output(FECBlock *blk);
+  void check_timeout(std::chrono::steady_clock::time_point now);
 };
 
 #endif //FEC_ENCODER_HH
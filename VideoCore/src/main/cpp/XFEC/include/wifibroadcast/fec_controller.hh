@@ -0,0 +1,94 @@
+#ifndef FEC_CONTROLLER_HH
+#define FEC_CONTROLLER_HH
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include <wifibroadcast/fec.hh>
+
+// The loss report the receiver sends back to the transmitter, see FECRatioController.
+// All counters are running totals of the receiver's FECDecoderStats, such that a lost report
+// only delays the information. Sent as one UDP packet to the port of the video stream + FEEDBACK_PORT_OFFSET.
+struct __attribute__((__packed__)) FECFeedback {
+  static constexpr uint32_t MAGIC = 0x46454346; // "FECF"
+  static constexpr int FEEDBACK_PORT_OFFSET = 1;
+  FECFeedback() : magic(MAGIC), report_num(0), output_blocks(0), lost_blocks(0), recovered_blocks(0) {}
+  FECFeedback(uint32_t report_num, const FECDecoderStats &stats) :
+    magic(MAGIC), report_num(report_num), output_blocks(stats.output_blocks),
+    lost_blocks(stats.lost_blocks), recovered_blocks(stats.recovered_blocks) {}
+  uint32_t magic;
+  // Incremented with each report, resets when the receiver restarts
+  uint32_t report_num;
+  uint32_t output_blocks;
+  uint32_t lost_blocks;
+  uint32_t recovered_blocks;
+
+  // Returns false if the buffer is not a feedback packet
+  static bool parse(const uint8_t *buf, size_t length, FECFeedback &feedback);
+};
+
+// Chooses the FEC ratio (FEC blocks / data blocks) of an FECBufferEncoder from the loss the receiver reports.
+// The target ratio follows the data block loss before FEC (scaled by loss_margin, to cover loss bursts).
+// If the target is above the current ratio, or whenever data blocks were lost after FEC (the ratio is
+// multiplied by increase_factor then), the ratio is increased to at least the target + hysteresis.
+// After an increase the ratio is held for hold_reports reports, afterwards it
+// decreases towards the target by decrease_step per report.
+//
+// add_report() and n_fec_blocks() may be called from different threads.
+class FECRatioController {
+public:
+  struct Config {
+    Config() : min_ratio(0.125f), max_ratio(1.0f), initial_ratio(1.0f), loss_margin(4.0f),
+	       max_residual_loss(0.001f), increase_factor(2.0f), decrease_step(0.05f),
+	       hysteresis(0.1f), hold_reports(20), loss_smoothing(0.1f) {}
+    float min_ratio;
+    float max_ratio;
+    // Used until the first report arrives
+    float initial_ratio;
+    float loss_margin;
+    // Fraction of the data blocks that may be lost after FEC before the ratio is increased
+    float max_residual_loss;
+    float increase_factor;
+    float decrease_step;
+    float hysteresis;
+    uint32_t hold_reports;
+    // Weight of a new report in the average loss, if the loss decreases. Increases are used immediately.
+    float loss_smoothing;
+  };
+
+  explicit FECRatioController(const Config &config = Config());
+
+  // A report of the receiver. Duplicate and reordered reports are ignored.
+  void add_report(const FECFeedback &feedback);
+
+  // The number of FEC blocks for the next sequence of n_blocks data blocks.
+  // Fractions of FEC blocks are carried over to the next sequences, such that for example
+  // a ratio of 0.25 adds a FEC block to every 4th sequence of 1 data block.
+  uint8_t n_fec_blocks(uint8_t n_blocks);
+
+  float fec_ratio() const {
+    return m_ratio.load(std::memory_order_relaxed);
+  }
+  // Average data block loss before FEC
+  float loss() const {
+    return m_loss.load(std::memory_order_relaxed);
+  }
+  // Data block loss after FEC of the latest report
+  float residual_loss() const {
+    return m_residual_loss.load(std::memory_order_relaxed);
+  }
+
+private:
+  const Config m_config;
+  std::atomic<float> m_ratio;
+  std::atomic<float> m_loss;
+  std::atomic<float> m_residual_loss;
+  bool m_have_report;
+  FECFeedback m_prev_report;
+  uint32_t m_hold;
+  // Only used by n_fec_blocks()
+  float m_fec_credit;
+};
+
+#endif //FEC_CONTROLLER_HH
@@ -178,6 +178,13 @@ __attribute__((aligned (256)))
 
 #define gf_mul(x,y) gf_mul_table[(x<<8)+y]
 
+/*
+ * gf_mul_lo[c][x] = c*x and gf_mul_hi[c][x] = c*(x<<4) for x < 16.
+ * Used by the SIMD kernels, see below.
+ */
+static gf gf_mul_lo[GF_SIZE + 1][16] __attribute__((aligned (16)));
+static gf gf_mul_hi[GF_SIZE + 1][16] __attribute__((aligned (16)));
+
 #define USE_GF_MULC register gf * __gf_mulc_
 #define GF_MULC0(c) __gf_mulc_ = &gf_mul_table[(c)<<8]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
@@ -193,6 +200,12 @@ init_mul_table(void)
 
     for (j=0; j< GF_SIZE+1; j++)
 	gf_mul_table[j] = gf_mul_table[j<<8] = 0;
+
+    for (i=0; i< GF_SIZE+1; i++)
+	for (j=0; j< 16; j++) {
+	    gf_mul_lo[i][j] = gf_mul_table[(i<<8) + j];
+	    gf_mul_hi[i][j] = gf_mul_table[(i<<8) + (j<<4)];
+	}
 }
 
 /*
@@ -398,7 +411,9 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 	);
 }
 #else
-# define addmul1 slow_addmul1
+#define FEC_KERNEL_DISPATCH
+/* points to the kernel selected by fec_set_kernel() */
+static void (*addmul1)(gf *dst1, gf *src1, gf c, int sz) = slow_addmul1;
 #endif
 
 static void addmul(gf *dst, gf *src, gf c, int sz) {
@@ -524,7 +539,7 @@ mul1(gf *dst1, gf *src1, gf c, int sz)
 	);
 }
 #else
-# define mul1 slow_mul1
+static void (*mul1)(gf *dst1, gf *src1, gf c, int sz) = slow_mul1;
 #endif
 
 static inline void mul(gf *dst, gf *src, gf c, int sz) {
@@ -532,6 +547,270 @@ static inline void mul(gf *dst, gf *src, gf c, int sz) {
     if (c != 0) mul1(dst, src, c, sz); else memset(dst, 0, sz);
 }
 
+/*
+ * SIMD versions of addmul1() / mul1().
+ * Multiplying by a constant is linear, thus c*x = c*(x & 0x0f) ^ c*(x & 0xf0).
+ * Both products are looked up in the 16 entry tables gf_mul_lo[c] and
+ * gf_mul_hi[c] with a byte shuffle (PSHUFB on x86, TBL on ARM), 16 or 32
+ * bytes at a time. The result is bit-exact with the table driven code,
+ * which also does the bytes that do not fill a whole vector.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FEC_HAVE_X86_KERNELS
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static inline __m128i
+ssse3_mul16(__m128i s, __m128i lo, __m128i hi, __m128i mask)
+{
+    return _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+			 _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+}
+
+__attribute__((target("ssse3")))
+static void
+ssse3_addmul1(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i lo = _mm_load_si128((const __m128i *) gf_mul_lo[c]);
+    const __m128i hi = _mm_load_si128((const __m128i *) gf_mul_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	__m128i p = ssse3_mul16(_mm_loadu_si128((const __m128i *) (src + i)), lo, hi, mask);
+	__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+	_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+    }
+    if (i < sz)
+	slow_addmul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("ssse3")))
+static void
+ssse3_mul1(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i lo = _mm_load_si128((const __m128i *) gf_mul_lo[c]);
+    const __m128i hi = _mm_load_si128((const __m128i *) gf_mul_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	__m128i p = ssse3_mul16(_mm_loadu_si128((const __m128i *) (src + i)), lo, hi, mask);
+	_mm_storeu_si128((__m128i *) (dst + i), p);
+    }
+    if (i < sz)
+	slow_mul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_mul32(__m256i s, __m256i lo, __m256i hi, __m256i mask)
+{
+    return _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+			    _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_addmul1(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_mul_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_mul_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+	__m256i p = avx2_mul32(_mm256_loadu_si256((const __m256i *) (src + i)), lo, hi, mask);
+	__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+	_mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, p));
+    }
+    /* not calling ssse3_addmul1(), mixing legacy SSE and AVX code is slow */
+    if (i + 16 <= sz) {
+	__m128i p = ssse3_mul16(_mm_loadu_si128((const __m128i *) (src + i)),
+				_mm256_castsi256_si128(lo), _mm256_castsi256_si128(hi), _mm256_castsi256_si128(mask));
+	__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+	_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+	i += 16;
+    }
+    if (i < sz)
+	slow_addmul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_mul1(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_mul_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_mul_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+	__m256i p = avx2_mul32(_mm256_loadu_si256((const __m256i *) (src + i)), lo, hi, mask);
+	_mm256_storeu_si256((__m256i *) (dst + i), p);
+    }
+    if (i + 16 <= sz) {
+	__m128i p = ssse3_mul16(_mm_loadu_si128((const __m128i *) (src + i)),
+				_mm256_castsi256_si128(lo), _mm256_castsi256_si128(hi), _mm256_castsi256_si128(mask));
+	_mm_storeu_si128((__m128i *) (dst + i), p);
+	i += 16;
+    }
+    if (i < sz)
+	slow_mul1(dst + i, src + i, c, sz - i);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FEC_HAVE_NEON_KERNELS
+#include <arm_neon.h>
+
+static inline uint8x16_t
+neon_mul16(uint8x16_t s, uint8x16_t lo, uint8x16_t hi)
+{
+    const uint8x16_t l = vandq_u8(s, vdupq_n_u8(0x0f));
+    const uint8x16_t h = vshrq_n_u8(s, 4);
+#if defined(__aarch64__)
+    return veorq_u8(vqtbl1q_u8(lo, l), vqtbl1q_u8(hi, h));
+#else
+    /* armv7 only has the 8 byte wide table lookup */
+    const uint8x8x2_t lo2 = {{ vget_low_u8(lo), vget_high_u8(lo) }};
+    const uint8x8x2_t hi2 = {{ vget_low_u8(hi), vget_high_u8(hi) }};
+    return veorq_u8(vcombine_u8(vtbl2_u8(lo2, vget_low_u8(l)), vtbl2_u8(lo2, vget_high_u8(l))),
+		    vcombine_u8(vtbl2_u8(hi2, vget_low_u8(h)), vtbl2_u8(hi2, vget_high_u8(h))));
+#endif
+}
+
+static void
+neon_addmul1(gf *dst, gf *src, gf c, int sz)
+{
+    const uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    const uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	uint8x16_t p = neon_mul16(vld1q_u8(src + i), lo, hi);
+	vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    if (i < sz)
+	slow_addmul1(dst + i, src + i, c, sz - i);
+}
+
+static void
+neon_mul1(gf *dst, gf *src, gf c, int sz)
+{
+    const uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    const uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16)
+	vst1q_u8(dst + i, neon_mul16(vld1q_u8(src + i), lo, hi));
+    if (i < sz)
+	slow_mul1(dst + i, src + i, c, sz - i);
+}
+#endif
+
+/*
+ * x86: SSSE3 / AVX2 are detected at run time.
+ * ARM: NEON is mandatory for arm64-v8a and enabled by default for
+ * armeabi-v7a by the NDK, thus it is decided at compile time.
+ */
+static int
+kernel_supported(fec_kernel_t kernel)
+{
+    switch (kernel) {
+    case FEC_KERNEL_SCALAR:
+	return 1;
+#ifdef FEC_HAVE_X86_KERNELS
+    case FEC_KERNEL_SSSE3:
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+    case FEC_KERNEL_AVX2:
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+#ifdef FEC_HAVE_NEON_KERNELS
+    case FEC_KERNEL_NEON:
+	return 1;
+#endif
+    default:
+	return 0;
+    }
+}
+
+static fec_kernel_t fec_kernel = FEC_KERNEL_SCALAR;
+
+fec_kernel_t fec_set_kernel(fec_kernel_t kernel)
+{
+#ifndef FEC_KERNEL_DISPATCH
+    /* i386 assembler versions are used */
+    kernel = FEC_KERNEL_SCALAR;
+#else
+    if (kernel == FEC_KERNEL_AUTO) {
+	const fec_kernel_t preferred[] = { FEC_KERNEL_AVX2, FEC_KERNEL_SSSE3, FEC_KERNEL_NEON };
+	unsigned int i;
+	kernel = FEC_KERNEL_SCALAR;
+	for (i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+	    if (kernel_supported(preferred[i])) {
+		kernel = preferred[i];
+		break;
+	    }
+	}
+    } else if (!kernel_supported(kernel)) {
+	kernel = FEC_KERNEL_SCALAR;
+    }
+    switch (kernel) {
+#ifdef FEC_HAVE_X86_KERNELS
+    case FEC_KERNEL_SSSE3:
+	addmul1 = ssse3_addmul1;
+	mul1 = ssse3_mul1;
+	break;
+    case FEC_KERNEL_AVX2:
+	addmul1 = avx2_addmul1;
+	mul1 = avx2_mul1;
+	break;
+#endif
+#ifdef FEC_HAVE_NEON_KERNELS
+    case FEC_KERNEL_NEON:
+	addmul1 = neon_addmul1;
+	mul1 = neon_mul1;
+	break;
+#endif
+    default:
+	addmul1 = slow_addmul1;
+	mul1 = slow_mul1;
+	break;
+    }
+#endif
+    fec_kernel = kernel;
+    return kernel;
+}
+
+fec_kernel_t fec_get_kernel(void)
+{
+    return fec_kernel;
+}
+
+const char *fec_kernel_name(fec_kernel_t kernel)
+{
+    switch (kernel) {
+    case FEC_KERNEL_AUTO:   return "auto";
+    case FEC_KERNEL_SCALAR: return "scalar";
+    case FEC_KERNEL_SSSE3:  return "ssse3";
+    case FEC_KERNEL_AVX2:   return "avx2";
+    case FEC_KERNEL_NEON:   return "neon";
+    }
+    return "unknown";
+}
+
+void fec_addmul(unsigned char *dst, unsigned char *src, unsigned char c, unsigned int sz)
+{
+    addmul(dst, src, c, sz);
+}
+
+void fec_mul(unsigned char *dst, unsigned char *src, unsigned char c, unsigned int sz)
+{
+    mul(dst, src, c, sz);
+}
+
 /*
  * invert_mat() takes a matrix and produces its inverse
  * k is the size of the matrix.
@@ -672,6 +951,7 @@ void fec_init(void)
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
+    fec_set_kernel(FEC_KERNEL_AUTO);
 	fec_initialized = 1 ;
 }
 
@@ -847,6 +1127,95 @@ long long resolveTime =0;
 long long invTime =0;
 #endif
 
+/*
+ * LRU cache of inverted "mini" matrices. The matrix only depends on which
+ * data blocks are erased and which FEC blocks are used to recover them, in
+ * the order they are passed (not on the number of data blocks). The key is
+ * the ordered lists, a set would mix up rows and columns of callers that
+ * pass them in a different order. Bursty loss tends to repeat the same
+ * few patterns. Each thread has its own cache, such that decoders running on
+ * different threads do not need to synchronize.
+ */
+#define MATRIX_CACHE_SIZE 16
+#define MATRIX_CACHE_MAX_N 16	/* bigger matrices are not cached */
+
+struct matrix_cache_entry {
+    unsigned int n;		/* 0 == unused */
+    /* The rows and columns of the matrix, in the order fec_decode() got them */
+    unsigned char erased_blocks[MATRIX_CACHE_MAX_N];
+    unsigned char fec_block_nos[MATRIX_CACHE_MAX_N];
+    unsigned long last_used;
+    gf matrix[MATRIX_CACHE_MAX_N * MATRIX_CACHE_MAX_N];
+};
+
+struct matrix_cache {
+    int disabled;
+    unsigned long tick;
+    unsigned long hits;
+    unsigned long misses;
+    struct matrix_cache_entry entries[MATRIX_CACHE_SIZE];
+};
+
+static __thread struct matrix_cache matrix_cache;
+
+void fec_set_matrix_cache(int enabled)
+{
+    memset(&matrix_cache, 0, sizeof(matrix_cache));
+    matrix_cache.disabled = !enabled;
+}
+
+void fec_get_matrix_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = matrix_cache.hits;
+    *misses = matrix_cache.misses;
+}
+
+/*
+ * Returns the cached inverse for the erasure pattern, or NULL. On a miss
+ * *slot is set to the entry the inverse should be stored in (or NULL if the
+ * pattern cannot be cached).
+ */
+static gf *matrix_cache_find(unsigned int *fec_block_nos,
+			     unsigned int *erased_blocks,
+			     unsigned int n,
+			     struct matrix_cache_entry **slot)
+{
+    struct matrix_cache_entry *lru = &matrix_cache.entries[0];
+    unsigned int i, j;
+
+    *slot = NULL;
+    if (matrix_cache.disabled || n > MATRIX_CACHE_MAX_N)
+	return NULL;
+    for (i = 0; i < n; i++) {
+	if (erased_blocks[i] >= 128 || fec_block_nos[i] >= 128)
+	    return NULL;
+    }
+    matrix_cache.tick++;
+    for (i = 0; i < MATRIX_CACHE_SIZE; i++) {
+	struct matrix_cache_entry *e = &matrix_cache.entries[i];
+	if (e->n == n) {
+	    for (j = 0; j < n && e->erased_blocks[j] == erased_blocks[j] &&
+		     e->fec_block_nos[j] == fec_block_nos[j]; j++)
+		;
+	    if (j == n) {
+		e->last_used = matrix_cache.tick;
+		matrix_cache.hits++;
+		return e->matrix;
+	    }
+	}
+	if (e->last_used < lru->last_used)
+	    lru = e;
+    }
+    matrix_cache.misses++;
+    lru->n = 0;
+    for (i = 0; i < n; i++) {
+	lru->erased_blocks[i] = (unsigned char) erased_blocks[i];
+	lru->fec_block_nos[i] = (unsigned char) fec_block_nos[i];
+    }
+    *slot = lru;
+    return NULL;
+}
+
 /**
  * Resolves reduced system. Constructs "mini" encoding matrix, inverts
  * it, and multiply reduced vector by it.
@@ -863,10 +1232,19 @@ static inline void resolve(int blockSize,
 #endif
     /* construct matrix */
     int row;
-    unsigned char matrix[nr_fec_blocks*nr_fec_blocks];
+    unsigned char matrix_buf[nr_fec_blocks*nr_fec_blocks];
+    unsigned char *matrix;
+    struct matrix_cache_entry *slot;
     int ptr;
     int r;
 
+    if (nr_fec_blocks <= 0)
+	return;		/* nothing erased */
+    matrix = matrix_cache_find(fec_block_nos, erased_blocks, nr_fec_blocks, &slot);
+    if (matrix)
+	goto multiply;
+    matrix = matrix_buf;
+
     /* we pick the submatrix of code that keeps colums corresponding to
      * the erased data blocks, and rows corresponding to the present FEC
      * blocks. This is the matrix by which we would need to multiply the
@@ -902,7 +1280,13 @@ static inline void resolve(int blockSize,
 	fprintf(stderr, "\n");
 	assert(0);
     }
+    if (slot) {
+	memcpy(slot->matrix, matrix, nr_fec_blocks*nr_fec_blocks);
+	slot->n = nr_fec_blocks;
+	slot->last_used = matrix_cache.tick;
+    }
 
+ multiply:
     /* do the multiplication with the reduced code vector */
     for(row = 0, ptr=0; row < nr_fec_blocks; row++) {
 	int col;
@@ -7,6 +7,7 @@
 
 
 #include <wifibroadcast/fec.hh>
+#include <wifibroadcast/fec_controller.hh>
 
 /*******************************************************************************
  * FECEncoder
@@ -16,8 +17,8 @@ static bool hasFECInitialized=false;
 
 FECEncoder::FECEncoder(uint8_t num_blocks, uint8_t num_fec_blocks, uint16_t max_block_size,
 		       uint8_t start_seq_num) :
-  m_num_blocks(num_blocks), m_num_fec_blocks(num_fec_blocks), m_max_block_size(max_block_size),
-  m_seq_num(start_seq_num) {
+  m_num_blocks(num_blocks), m_num_fec_blocks(num_fec_blocks), m_next_num_fec_blocks(num_fec_blocks),
+  m_max_block_size(max_block_size), m_seq_num(start_seq_num) {
   // Ensure that the FEC library is initialized
   // This may not work with multiple threads!
   // Modification by C
@@ -29,6 +30,9 @@ FECEncoder::FECEncoder(uint8_t num_blocks, uint8_t num_fec_blocks, uint16_t max_
 
 // Allocate and initialize the next data block.
 std::shared_ptr<FECBlock> FECEncoder::get_next_block(uint16_t length) {
+  if (m_in_blocks.empty()) {
+    m_num_fec_blocks = m_next_num_fec_blocks;
+  }
   return std::shared_ptr<FECBlock>(new FECBlock(m_seq_num, m_in_blocks.size(), m_num_blocks,
 						m_num_fec_blocks, m_max_block_size, length));
 }
@@ -114,226 +118,426 @@ void FECEncoder::encode_blocks() {
 }
 
 
+/*******************************************************************************
+ * FECBlockArena
+ ******************************************************************************/
+
+FECBlockArena::FECBlockArena(size_t n_slots, uint16_t slot_size) :
+  m_slot_size(slot_size), m_n_preallocated_slots(n_slots),
+  m_memory(new uint8_t[n_slots * slot_size]()) {
+  FECBlock::count_allocation();
+  m_slots.reserve(n_slots);
+  m_free_slots.reserve(n_slots);
+  for (size_t i = 0; i < n_slots; ++i) {
+    m_slots.emplace_back(new Slot(m_memory.get() + i * slot_size, slot_size));
+    m_free_slots.push_back(m_slots.back().get());
+  }
+}
+
+FECBlock *FECBlockArena::acquire() {
+  if (m_free_slots.empty()) {
+    // Out of slots, add one
+    FECBlock::count_allocation();
+    m_overflow_memory.emplace_back(new uint8_t[m_slot_size]());
+    m_slots.emplace_back(new Slot(m_overflow_memory.back().get(), m_slot_size));
+    m_free_slots.push_back(m_slots.back().get());
+  }
+  Slot *slot = m_free_slots.back();
+  m_free_slots.pop_back();
+  slot->ref_count = 1;
+  return slot;
+}
+
+void FECBlockArena::add_ref(FECBlock *blk) {
+  ++static_cast<Slot*>(blk)->ref_count;
+}
+
+void FECBlockArena::release(FECBlock *blk) {
+  Slot *slot = static_cast<Slot*>(blk);
+  if (--slot->ref_count == 0) {
+    m_free_slots.push_back(slot);
+  }
+}
+
 /*******************************************************************************
  * FECDecoderEncoder
  ******************************************************************************/
 
-FECDecoder::FECDecoder() : m_block_size(0) {
+FECDecoder::FECDecoder() : FECDecoder(0, 0, 0) {
+}
+
+// The encoders skip sequence number 0 when it wraps around
+static uint8_t next_seq_num(uint8_t seq_num) {
+  return (seq_num == 255) ? 1 : seq_num + 1;
+}
+
+// The window size is a power of 2, such that seq_num % size is continuous when seq_num wraps around
+static size_t window_size(uint8_t n_window_sequences) {
+  size_t ret = 1;
+  while (ret < n_window_sequences && ret < 64) {
+    ret *= 2;
+  }
+  return ret;
+}
+
+FECDecoder::FECDecoder(uint8_t max_blocks, uint8_t max_fec_blocks, uint16_t max_block_size,
+		       uint8_t n_window_sequences, std::chrono::milliseconds timeout) :
+  m_arena((window_size(n_window_sequences) + 1) * (max_blocks + max_fec_blocks),
+	  max_block_size + sizeof(FECHeader) - 2),
+  m_timeout(timeout), m_window(window_size(n_window_sequences)), m_have_seq(false),
+  m_newest_seq(0), m_out_seq(0), m_n_late_packets(0), m_last_n_blocks(0), m_out_pos(0) {
   //fec_init();
   // Mod by Consti
     if(!hasFECInitialized){
         fec_init();
         hasFECInitialized=true;
     }
+    const size_t n = max_blocks + max_fec_blocks;
+    for (Sequence &seq : m_window) {
+      seq.in_use = false;
+      seq.blocks.reserve(max_blocks);
+      seq.fec_blocks.reserve(max_fec_blocks);
+    }
+    m_out_blocks.reserve((m_window.size() + 1) * n);
+    m_block_ptrs.reserve(max_blocks);
+    m_fec_block_ptrs.reserve(max_fec_blocks);
+    m_fec_block_idxs.reserve(max_fec_blocks);
+    m_erased_block_idxs.reserve(max_fec_blocks);
 }
 
-void FECDecoder::add_block(const uint8_t *buf, uint16_t block_length) {
-  std::shared_ptr<FECBlock> blk(new FECBlock(buf, block_length));
-  const FECHeader &h = *blk->header();
-  uint8_t n_blocks = h.n_blocks;
-  uint8_t n_fec_blocks = h.n_fec_blocks;
-  FECHeader &ph = m_prev_header;
-  uint16_t unrolled_prev_seq = static_cast<uint16_t>(ph.seq_num);
-  uint16_t unrolled_seq = static_cast<uint16_t>(h.seq_num);
-  if (unrolled_prev_seq > unrolled_seq) {
-    unrolled_seq += 256;
+FECDecoder::~FECDecoder() {
+  for (Sequence &seq : m_window) {
+    release(seq);
   }
-  ++m_stats.total_packets;
-  m_stats.bytes += block_length;
+  for (size_t i = m_out_pos; i < m_out_blocks.size(); ++i) {
+    m_arena.release(m_out_blocks[i]);
+  }
+}
 
-  // Just release the block of FEC is not being performed on this channel.
-  if ((n_blocks == 0) || (n_fec_blocks == 0)) {
-    uint16_t db = (unrolled_seq - unrolled_prev_seq - 1);
-    m_stats.dropped_packets += db;
-    m_stats.dropped_blocks += db;
-    ph = h;
-    m_out_blocks.push(blk);
+void FECDecoder::output(FECBlock *blk) {
+  ++m_stats.output_blocks;
+  m_arena.add_ref(blk);
+  m_out_blocks.push_back(blk);
+}
+
+void FECDecoder::release(Sequence &seq) {
+  if (!seq.in_use) {
     return;
   }
+  for (FECBlock *blk : seq.blocks) {
+    if (blk) {
+      m_arena.release(blk);
+    }
+  }
+  for (FECBlock *blk : seq.fec_blocks) {
+    m_arena.release(blk);
+  }
+  seq.blocks.clear();
+  seq.fec_blocks.clear();
+  seq.in_use = false;
+}
 
-  // Are we actively processing a block?
-  if (m_block_size != 0) {
-
-    // Did we reach the end of a sequence without getting enough blocks?
-    if (unrolled_prev_seq != unrolled_seq) {
+FECDecoder::Sequence &FECDecoder::start_sequence(const FECHeader &h, std::chrono::steady_clock::time_point now) {
+  Sequence &seq = sequence(h.seq_num);
+  release(seq);
+  seq.in_use = true;
+  seq.seq_num = h.seq_num;
+  seq.n_blocks = h.n_blocks;
+  seq.n_fec_blocks = h.n_fec_blocks;
+  seq.block_size = 0;
+  seq.blocks.assign(h.n_blocks, nullptr);
+  seq.n_received_blocks = 0;
+  seq.done = false;
+  seq.next_out = 0;
+  seq.first_packet_time = now;
+  m_last_n_blocks = h.n_blocks;
+  return seq;
+}
 
-      // If se get a (unrolled) sequence number that is less than the previous sequence number
-      // we've obviously lost sync.
-      if (unrolled_seq < unrolled_prev_seq) {
-	++m_stats.lost_sync;
-        LOG_DEBUG << "Lost sync: seq=" << int(h.seq_num) << " pseq=" << int(ph.seq_num);
-      } else {
+void FECDecoder::finish(Sequence &seq) {
+  seq.done = true;
+  for (FECBlock *blk : seq.fec_blocks) {
+    m_arena.release(blk);
+  }
+  seq.fec_blocks.clear();
+}
 
-	// Calculate how many packets we dropped with this break in the sequence.
-        uint32_t db = unrolled_seq - unrolled_prev_seq;
-        if (db > 0) {
-          m_stats.dropped_blocks += db;
-          LOG_DEBUG << "Dropped block: pbn=" << unrolled_seq << " pseq=" << unrolled_prev_seq;
-        }
-
-	// Calculate how many packets we dropped.
-	uint64_t pbn = unrolled_prev_seq * static_cast<uint64_t>(n_blocks + n_fec_blocks) + ph.block;
-	uint64_t bn = unrolled_seq * static_cast<uint64_t>(n_blocks + n_fec_blocks) + h.block;
-	if (pbn < bn) {
-	  m_stats.dropped_packets += bn - pbn;
-          LOG_DEBUG << "Dropped packets: pbn=" << pbn << " pseq=" << bn;
-	}
-      }
+void FECDecoder::restart(uint8_t seq_num) {
+  while (m_out_seq != m_newest_seq) {
+    give_up_oldest(false);
+  }
+  give_up_oldest(false);
+  m_newest_seq = seq_num;
+  m_out_seq = seq_num;
+  m_n_late_packets = 0;
+}
 
-      // Reset the sequence.
-      m_block_size = 0;
-      m_blocks.clear();
-      m_fec_blocks.clear();
+void FECDecoder::add_block(const uint8_t *buf, uint16_t block_length) {
+  if (block_length < sizeof(FECHeader)) {
+    ++m_stats.dropped_packets;
+    return;
+  }
+  FECHeader h = *reinterpret_cast<const FECHeader*>(buf);
+  ++m_stats.total_packets;
+  m_stats.bytes += block_length;
 
-    } else if(h.block <= ph.block) {
+  // Just release the block of FEC is not being performed on this channel.
+  if (h.n_blocks == 0) {
+    FECBlock *blk = m_arena.acquire();
+    blk->assign(buf, block_length);
+    ++m_stats.output_blocks;
+    m_out_blocks.push_back(blk);
+    return;
+  }
+  // Without FEC blocks FECEncoder uses a new sequence number for each block,
+  // which still has to be output in order with the sequences that have FEC blocks.
+  if (h.n_fec_blocks == 0) {
+    h.block = 0;
+    h.n_blocks = 1;
+  }
 
-      // This shouldn't happen.
-      ++m_stats.dropped_packets;
-      LOG_DEBUG << "FEC Decoder: This shouldn't happen";
+  const auto now = std::chrono::steady_clock::now();
+  if (!m_have_seq) {
+    m_have_seq = true;
+    m_newest_seq = m_out_seq = h.seq_num;
+  }
+  const int8_t since_newest = static_cast<int8_t>(h.seq_num - m_newest_seq);
+  const int8_t since_out = static_cast<int8_t>(h.seq_num - m_out_seq);
+  if (since_newest > 0) {
+    // A new sequence, the oldest ones might not fit into the window anymore
+    m_newest_seq = h.seq_num;
+    while (static_cast<uint8_t>(m_newest_seq - m_out_seq) >= m_window.size()) {
+      give_up_oldest(false);
+    }
+  } else if (since_out < 0) {
+    // Older than the window or already output completely
+    if (++m_n_late_packets > RESYNC_AFTER_N_LATE_PACKETS) {
+      ++m_stats.lost_sync;
+      LOG_DEBUG << "Lost sync: seq=" << int(h.seq_num) << " newest=" << int(m_newest_seq);
+      restart(h.seq_num);
     } else {
-
-      // Record any dropped packets from the last packet.
-      uint32_t dropped = (h.block - ph.block) - 1;
-      if (dropped > 0) {
-        m_stats.dropped_packets += dropped;
-        LOG_DEBUG << "Dropped prev: blk=" << int(h.block) << " pblk=" << int(ph.block);
-      }
+      ++m_stats.dropped_packets;
+      check_timeout(now);
+      return;
     }
-
-  } else if (unrolled_prev_seq == unrolled_seq) {
-
-    // Are we skipping past the end if the current block that has been completed?
-    ph = h;
-    return;
   }
-  ph = h;
+  m_n_late_packets = 0;
 
-  // Record any packets we might have skipped at the beginning of the sequence.
-  if ((m_block_size == 0) && (h.block > 0)) {
-    m_stats.dropped_packets += h.block;
-    LOG_DEBUG << "Dropped begin: blk=" << int(h.block) << " pblk=" << int(ph.block);
+  Sequence *seq = &sequence(h.seq_num);
+  if (!seq->in_use || seq->seq_num != h.seq_num) {
+    seq = &start_sequence(h, now);
   }
-
-  // The current block size is equal to the block size of the largest block.
-  if (blk->is_data_block()) {
-    m_block_size = std::max(m_block_size, blk->block_size());
+  if (seq->done || h.n_blocks != seq->n_blocks || h.block >= seq->n_blocks + seq->n_fec_blocks) {
+    // Not needed anymore (e.g. FEC block of a complete sequence) or garbage
+    check_timeout(now);
+    return;
   }
 
-  // Is this a data block or FEC block?
-  if (blk->is_data_block()) {
-
-    // Add this block to the list of blocks.
-    m_blocks.push_back(blk);
-
-    // Release the block if we don't have a gap.
-    if ((m_blocks.size() - 1) == h.block) {
-      m_out_blocks.push(blk);
-    }
-
-    // Have we reached the end of the data blocks without dropping a packet?
-    if (m_blocks.size() == n_blocks) {
-      m_block_size = 0;
-      m_blocks.clear();
-      m_fec_blocks.clear();
-      ++m_stats.total_blocks;
+  if (h.block < h.n_blocks) {
+    if (!seq->blocks[h.block]) {
+      FECBlock *blk = m_arena.acquire();
+      blk->assign(buf, block_length);
+      seq->blocks[h.block] = blk;
+      ++seq->n_received_blocks;
+      seq->block_size = std::max(seq->block_size, blk->block_size());
     }
-
   } else {
-
-    // Add this block to the list of FEC blocks.
-    m_fec_blocks.push_back(blk);
-
-    // Decode once we've received anough blocks + FEC blocks and have dropped a block.
-    if ((m_blocks.size() + m_fec_blocks.size()) == n_blocks) {
-
-      // Decode the sequence
-      decode();
-
-      // Start waiting for blocks from the next packet.
-      m_block_size = 0;
-      m_blocks.clear();
-      m_fec_blocks.clear();
-      ++m_stats.total_blocks;
+    bool duplicate = false;
+    for (FECBlock *blk : seq->fec_blocks) {
+      duplicate = duplicate || blk->header()->block == h.block;
+    }
+    if (!duplicate) {
+      FECBlock *blk = m_arena.acquire();
+      blk->assign(buf, block_length);
+      seq->fec_blocks.push_back(blk);
+      // FEC blocks always have the size of the largest block, which matters if the largest data block was lost.
+      // Their length field is FEC data, the size is given by the packet length.
+      seq->block_size = std::max(seq->block_size, static_cast<uint16_t>(block_length - (sizeof(FECHeader) - 2)));
     }
   }
-}
 
-void FECDecoder::decode() {
-  if (m_blocks.size() == 0) {
-    return;
+  if (seq->n_received_blocks == seq->n_blocks) {
+    // Got all data blocks without FEC
+    finish(*seq);
+    ++m_stats.total_blocks;
+  } else if (seq->n_received_blocks + seq->fec_blocks.size() >= seq->n_blocks) {
+    decode(*seq);
   }
-  const FECHeader &h = *m_blocks[0]->header();
-  uint8_t n_blocks = h.n_blocks;
-  uint8_t n_fec_blocks = h.n_fec_blocks;
+  check_timeout(now);
+}
 
-  // Sanity check the number of blocks
-  if (n_blocks > (m_blocks.size() + m_fec_blocks.size())) {
-    ++m_stats.lost_sync;
-    return;
+void FECDecoder::decode(Sequence &seq) {
+  const uint8_t n_blocks = seq.n_blocks;
+
+  // The FEC data of all blocks has to be at least block_size long, if not the headers are garbage.
+  const uint16_t min_capacity = seq.block_size + sizeof(FECHeader) - 2;
+  bool valid = true;
+  for (FECBlock *block : seq.blocks) {
+    valid = valid && (!block || block->capacity() >= min_capacity);
+  }
+  for (FECBlock *block : seq.fec_blocks) {
+    valid = valid && block->capacity() >= min_capacity;
   }
-  if ((n_blocks == 0) || (n_fec_blocks == 0)) {
+  if (!valid) {
+    ++m_stats.lost_sync;
+    finish(seq);
     return;
   }
 
-  // Create the vector of data blocks.
-  std::vector<uint8_t*> block_ptrs(n_blocks, 0);
-  std::vector<std::shared_ptr<FECBlock> > blocks(n_blocks);
-  for (auto block : m_blocks) {
-    blocks[block->header()->block] = block;
-    block_ptrs[block->header()->block] = block->fec_data();
-  }
-
-  // Create the erased blocks array
-  std::vector<std::shared_ptr<FECBlock> > fec_blocks;
-  std::vector<unsigned int> erased_block_idxs;
-  for (size_t i = 0; i < h.n_blocks; ++i) {
-    if (!block_ptrs[i]) {
-      std::shared_ptr<FECBlock> blk(new FECBlock(h, m_block_size));
-      erased_block_idxs.push_back(i);
-      fec_blocks.push_back(blk);
-      blocks[i] = blk;
-      block_ptrs[i] = blk->fec_data();
+  // Create the vector of data blocks and the erased blocks array
+  m_block_ptrs.assign(n_blocks, nullptr);
+  m_erased_block_idxs.clear();
+  const FECHeader &h = *seq.fec_blocks[0]->header();
+  for (size_t i = 0; i < n_blocks; ++i) {
+    if (seq.blocks[i]) {
+      m_block_ptrs[i] = seq.blocks[i]->fec_data();
+    } else {
+      FECBlock *blk = m_arena.acquire();
+      blk->assign(h, seq.block_size);
+      blk->header()->block = i;
+      m_erased_block_idxs.push_back(i);
+      seq.blocks[i] = blk;
+      m_block_ptrs[i] = blk->fec_data();
     }
   }
 
-  // Create the FEC blocks array
-  std::vector<uint8_t*> fec_block_ptrs;
-  std::vector<unsigned int> fec_block_idxs;
-  for (auto block : m_fec_blocks) {
+  // Create the FEC blocks array, as many as blocks are missing
+  m_fec_block_ptrs.clear();
+  m_fec_block_idxs.clear();
+  for (size_t i = 0; i < m_erased_block_idxs.size(); ++i) {
+    FECBlock *block = seq.fec_blocks[i];
     uint8_t fec_block_idx = block->header()->block - block->header()->n_blocks;
-    fec_block_ptrs.push_back(block->fec_data());
-    fec_block_idxs.push_back(fec_block_idx);
+    m_fec_block_ptrs.push_back(block->fec_data());
+    m_fec_block_idxs.push_back(fec_block_idx);
   }
 
   // Decode the blocks
-  fec_decode(m_block_size,
-	     block_ptrs.data(),
+  fec_decode(seq.block_size,
+	     m_block_ptrs.data(),
 	     n_blocks,
-	     fec_block_ptrs.data(),
-	     fec_block_idxs.data(),
-	     erased_block_idxs.data(),
-	     erased_block_idxs.size());
-
-  // Send the remainder of blocks that have a reasonable length.
-  for (size_t i = erased_block_idxs[0]; i < n_blocks; ++i) {
-    uint16_t length = blocks[i]->data_length();
-    if (length <= m_block_size) {
-      m_out_blocks.push(blocks[i]);
-    } else {
+	     m_fec_block_ptrs.data(),
+	     m_fec_block_idxs.data(),
+	     m_erased_block_idxs.data(),
+	     m_erased_block_idxs.size());
+
+  // Only output the recovered blocks that have a reasonable length.
+  for (unsigned int i : m_erased_block_idxs) {
+    // The length field is part of the block
+    if (seq.blocks[i]->data_length() + 2 > seq.block_size) {
       ++m_stats.dropped_blocks;
       LOG_DEBUG << "Dropped due to length";
+      m_arena.release(seq.blocks[i]);
+      seq.blocks[i] = nullptr;
+    } else {
+      ++m_stats.recovered_blocks;
+      if (seq.seq_num != m_newest_seq) {
+	++m_stats.window_recovered_blocks;
+      }
+    }
+  }
+  finish(seq);
+  ++m_stats.total_blocks;
+}
+
+void FECDecoder::output_in_order() {
+  while (m_have_seq) {
+    Sequence &seq = sequence(m_out_seq);
+    if (!seq.in_use || seq.seq_num != m_out_seq) {
+      // Nothing received of this sequence (yet)
+      return;
+    }
+    // Gaps are only skipped once it is clear that they cannot be filled anymore
+    while (seq.next_out < seq.n_blocks && (seq.blocks[seq.next_out] || seq.done)) {
+      if (seq.blocks[seq.next_out]) {
+	output(seq.blocks[seq.next_out]);
+      } else {
+	++m_stats.dropped_packets;
+	++m_stats.lost_blocks;
+      }
+      ++seq.next_out;
+    }
+    if (seq.next_out < seq.n_blocks || m_out_seq == m_newest_seq) {
+      return;
+    }
+    release(seq);
+    m_out_seq = next_seq_num(m_out_seq);
+  }
+}
+
+void FECDecoder::give_up_oldest(bool expired) {
+  Sequence &seq = sequence(m_out_seq);
+  if (seq.in_use && seq.seq_num == m_out_seq) {
+    if (!seq.done) {
+      ++m_stats.dropped_blocks;
+      if (expired) {
+	++m_stats.expired_sequences;
+      }
+    }
+    for (; seq.next_out < seq.n_blocks; ++seq.next_out) {
+      if (seq.blocks[seq.next_out]) {
+	output(seq.blocks[seq.next_out]);
+      } else {
+	++m_stats.dropped_packets;
+	++m_stats.lost_blocks;
+      }
+    }
+    release(seq);
+  } else {
+    ++m_stats.dropped_blocks;
+    m_stats.lost_blocks += m_last_n_blocks;
+  }
+  if (m_out_seq != m_newest_seq) {
+    m_out_seq = next_seq_num(m_out_seq);
+  }
+}
+
+void FECDecoder::flush() {
+  if (m_have_seq) {
+    restart(m_newest_seq);
+  }
+}
+
+void FECDecoder::check_timeout() {
+  check_timeout(std::chrono::steady_clock::now());
+}
+
+void FECDecoder::check_timeout(std::chrono::steady_clock::time_point now) {
+  output_in_order();
+  if (m_timeout.count() == 0) {
+    return;
+  }
+  // Only the oldest sequence can hold back data of newer sequences
+  while (m_have_seq && m_out_seq != m_newest_seq) {
+    // If nothing of the oldest sequence was received the time of the next sequence that was
+    uint8_t first = m_out_seq;
+    while (first != m_newest_seq && (!sequence(first).in_use || sequence(first).seq_num != first)) {
+      first = next_seq_num(first);
+    }
+    if (now - sequence(first).first_packet_time < m_timeout) {
+      return;
     }
+    give_up_oldest(true);
+    output_in_order();
   }
 }
 
 // Retrieve the next data/fec block
 std::shared_ptr<FECBlock> FECDecoder::get_block() {
-  if (m_out_blocks.empty()) {
+  FECBlockView view = get_block_view();
+  if (!view) {
     return std::shared_ptr<FECBlock>();
   }
-  std::shared_ptr<FECBlock> ret = m_out_blocks.front();
-  m_out_blocks.pop();
-  return ret;
+  return std::make_shared<FECBlock>(view->pkt_data(), view->pkt_length());
+}
+
+FECBlockView FECDecoder::get_block_view() {
+  if (m_out_pos == m_out_blocks.size()) {
+    // Keep the capacity
+    m_out_blocks.clear();
+    m_out_pos = 0;
+    return FECBlockView();
+  }
+  return FECBlockView(&m_arena, m_out_blocks[m_out_pos++]);
 }
 
 FECDecoderStats operator-(const FECDecoderStats& s1, const FECDecoderStats &s2) {
@@ -344,6 +548,11 @@ FECDecoderStats operator-(const FECDecoderStats& s1, const FECDecoderStats &s2)
   ret.dropped_packets = s1.dropped_packets - s2.dropped_packets;
   ret.lost_sync = s1.lost_sync - s2.lost_sync;
   ret.bytes = s1.bytes - s2.bytes;
+  ret.recovered_blocks = s1.recovered_blocks - s2.recovered_blocks;
+  ret.window_recovered_blocks = s1.window_recovered_blocks - s2.window_recovered_blocks;
+  ret.expired_sequences = s1.expired_sequences - s2.expired_sequences;
+  ret.output_blocks = s1.output_blocks - s2.output_blocks;
+  ret.lost_blocks = s1.lost_blocks - s2.lost_blocks;
   return ret;
 }
 
@@ -355,6 +564,11 @@ FECDecoderStats operator+(const FECDecoderStats& s1, const FECDecoderStats &s2)
   ret.dropped_packets = s1.dropped_packets + s2.dropped_packets;
   ret.lost_sync = s1.lost_sync + s2.lost_sync;
   ret.bytes = s1.bytes + s2.bytes;
+  ret.recovered_blocks = s1.recovered_blocks + s2.recovered_blocks;
+  ret.window_recovered_blocks = s1.window_recovered_blocks + s2.window_recovered_blocks;
+  ret.expired_sequences = s1.expired_sequences + s2.expired_sequences;
+  ret.output_blocks = s1.output_blocks + s2.output_blocks;
+  ret.lost_blocks = s1.lost_blocks + s2.lost_blocks;
   return ret;
 }
 
@@ -383,10 +597,15 @@ FECBufferEncoder::encode_buffer(const uint8_t *buf, size_t len) {
   }
 
   // Create the encoder
-  uint8_t nfecblocks = static_cast<uint8_t>(std::ceil(nblocks * m_fec_ratio));
-  FECEncoder enc(nblocks, nfecblocks, m_max_block_size + 2, m_seq_num++);
-  if (m_seq_num == 0) {
+  uint8_t nfecblocks = m_controller ? m_controller->n_fec_blocks(nblocks) :
+    static_cast<uint8_t>(std::ceil(nblocks * m_fec_ratio));
+  FECEncoder enc(nblocks, nfecblocks, m_max_block_size + 2, m_seq_num);
+  // Without FEC blocks each block gets its own sequence number
+  for (uint32_t i = 0; i < ((nfecblocks == 0) ? nblocks : 1); ++i) {
     ++m_seq_num;
+    if (m_seq_num == 0) {
+      ++m_seq_num;
+    }
   }
 
   // Encode all the blocks
@@ -401,6 +620,10 @@ FECBufferEncoder::encode_buffer(const uint8_t *buf, size_t len) {
     uint32_t length = end - start;
     std::shared_ptr<FECBlock> blk = enc.get_next_block(length);
     std::copy(buf + start, buf + end, blk->data());
+    if (nfecblocks == 0) {
+      // Not padded to the block size of the sequence by the encoder
+      blk->adjust_block_size(length + 2);
+    }
     enc.add_block(blk);
     count += length;
   }
@@ -412,3 +635,75 @@ FECBufferEncoder::encode_buffer(const uint8_t *buf, size_t len) {
 
   return ret;
 }
+
+
+/*******************************************************************************
+ * FECFrameEncoder
+ ******************************************************************************/
+
+FECFrameEncoder::FECFrameEncoder(uint16_t maximum_block_size, float fec_ratio, uint8_t max_blocks,
+				 std::chrono::milliseconds max_delay) :
+  m_max_block_size(maximum_block_size), m_fec_ratio(fec_ratio), m_max_blocks(std::max<uint8_t>(max_blocks, 1)),
+  m_max_delay(max_delay), m_seq_num(1) {
+  m_data.reserve(static_cast<size_t>(m_max_blocks) * m_max_block_size);
+  m_lengths.reserve(m_max_blocks);
+}
+
+std::vector<std::shared_ptr<FECBlock> >
+FECFrameEncoder::add_packet(const uint8_t *buf, size_t length, bool end_of_frame) {
+  std::vector<std::shared_ptr<FECBlock> > ret;
+  if (length > m_max_block_size) {
+    LOG_ERROR << "Packet of " << length << " bytes does not fit into a block";
+    return ret;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (m_lengths.empty()) {
+    m_first_packet_time = now;
+  } else if (m_max_delay.count() != 0 && now - m_first_packet_time > m_max_delay) {
+    encode(ret);
+    m_first_packet_time = now;
+  }
+  m_data.insert(m_data.end(), buf, buf + length);
+  m_lengths.push_back(static_cast<uint16_t>(length));
+  if (end_of_frame || m_lengths.size() == m_max_blocks) {
+    encode(ret);
+  }
+  return ret;
+}
+
+std::vector<std::shared_ptr<FECBlock> > FECFrameEncoder::flush() {
+  std::vector<std::shared_ptr<FECBlock> > ret;
+  encode(ret);
+  return ret;
+}
+
+void FECFrameEncoder::encode(std::vector<std::shared_ptr<FECBlock> > &out) {
+  const uint8_t nblocks = m_lengths.size();
+  if (nblocks == 0) {
+    return;
+  }
+  uint8_t nfecblocks = m_controller ? m_controller->n_fec_blocks(nblocks) :
+    static_cast<uint8_t>(std::min(std::ceil(nblocks * m_fec_ratio), 255.0f - nblocks));
+  FECEncoder enc(nblocks, nfecblocks, m_max_block_size + 2, m_seq_num);
+  // Without FEC blocks each block gets its own sequence number
+  for (uint32_t i = 0; i < ((nfecblocks == 0) ? nblocks : 1); ++i) {
+    m_seq_num = next_seq_num(m_seq_num);
+  }
+
+  size_t offset = 0;
+  for (uint16_t length : m_lengths) {
+    std::shared_ptr<FECBlock> blk = enc.get_next_block(length);
+    std::copy(m_data.data() + offset, m_data.data() + offset + length, blk->data());
+    offset += length;
+    enc.add_block(blk);
+  }
+  for (std::shared_ptr<FECBlock> blk = enc.get_block(); blk; blk = enc.get_block()) {
+    if (blk->is_data_block()) {
+      // The receiver pads the data blocks with zeroes again, there is no need to send the padding
+      blk->adjust_block_size(blk->data_length() + 2);
+    }
+    out.push_back(blk);
+  }
+  m_data.clear();
+  m_lengths.clear();
+}
@@ -0,0 +1,82 @@
+
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <wifibroadcast/fec_controller.hh>
+
+/*******************************************************************************
+ * FECFeedback
+ ******************************************************************************/
+
+bool FECFeedback::parse(const uint8_t *buf, size_t length, FECFeedback &feedback) {
+  if (length != sizeof(FECFeedback)) {
+    return false;
+  }
+  memcpy(&feedback, buf, sizeof(FECFeedback));
+  return feedback.magic == MAGIC;
+}
+
+/*******************************************************************************
+ * FECRatioController
+ ******************************************************************************/
+
+FECRatioController::FECRatioController(const Config &config) :
+  m_config(config), m_ratio(std::min(std::max(config.initial_ratio, config.min_ratio), config.max_ratio)),
+  m_loss(0), m_residual_loss(0), m_have_report(false), m_hold(0), m_fec_credit(0) {
+}
+
+void FECRatioController::add_report(const FECFeedback &feedback) {
+  if (m_have_report && feedback.report_num <= m_prev_report.report_num && feedback.report_num != 0) {
+    // Duplicate or reordered
+    return;
+  }
+  if (!m_have_report || feedback.output_blocks < m_prev_report.output_blocks ||
+      feedback.lost_blocks < m_prev_report.lost_blocks ||
+      feedback.recovered_blocks < m_prev_report.recovered_blocks) {
+    // The first report or the receiver restarted, the totals start over
+    m_have_report = true;
+    m_prev_report = feedback;
+    return;
+  }
+  const uint32_t output_blocks = feedback.output_blocks - m_prev_report.output_blocks;
+  const uint32_t lost_blocks = feedback.lost_blocks - m_prev_report.lost_blocks;
+  const uint32_t recovered_blocks = feedback.recovered_blocks - m_prev_report.recovered_blocks;
+  m_prev_report = feedback;
+  const uint32_t n_blocks = output_blocks + lost_blocks;
+  if (n_blocks == 0) {
+    // Nothing was received at all, there is nothing to learn from
+    return;
+  }
+
+  const float loss = static_cast<float>(std::min(recovered_blocks + lost_blocks, n_blocks)) / n_blocks;
+  const float residual_loss = static_cast<float>(lost_blocks) / n_blocks;
+  float avg_loss = m_loss.load(std::memory_order_relaxed);
+  avg_loss = (loss > avg_loss) ? loss : avg_loss + (loss - avg_loss) * m_config.loss_smoothing;
+  m_loss.store(avg_loss, std::memory_order_relaxed);
+  m_residual_loss.store(residual_loss, std::memory_order_relaxed);
+
+  float ratio = m_ratio.load(std::memory_order_relaxed);
+  const float target = std::min(std::max(m_config.loss_margin * avg_loss / std::max(1.0f - avg_loss, 0.01f),
+					 m_config.min_ratio), m_config.max_ratio);
+  if (residual_loss > m_config.max_residual_loss) {
+    ratio = std::max(ratio * m_config.increase_factor, target + m_config.hysteresis);
+    m_hold = m_config.hold_reports;
+  } else if (target > ratio) {
+    ratio = target + m_config.hysteresis;
+    m_hold = m_config.hold_reports;
+  } else if (m_hold > 0) {
+    --m_hold;
+  } else if (target < ratio) {
+    ratio = std::max(ratio - m_config.decrease_step, target);
+  }
+  m_ratio.store(std::min(std::max(ratio, m_config.min_ratio), m_config.max_ratio), std::memory_order_relaxed);
+}
+
+uint8_t FECRatioController::n_fec_blocks(uint8_t n_blocks) {
+  const float exact = n_blocks * fec_ratio() + m_fec_credit;
+  const float n_fec_blocks = std::min(std::floor(exact + 1e-4f), static_cast<float>(255 - n_blocks));
+  m_fec_credit = std::min(std::max(exact - n_fec_blocks, 0.0f), 1.0f);
+  return static_cast<uint8_t>(n_fec_blocks);
+}
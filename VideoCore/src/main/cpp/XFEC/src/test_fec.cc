@@ -5,9 +5,13 @@
 #include <random>
 #include <list>
 #include <chrono>
-//#include <cxxopts.hpp>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cassert>
 
 #include <wifibroadcast/fec.hh>
+#include <wifibroadcast/fec_controller.hh>
 #include <logging.hh>
 
 inline double cur_time() {
@@ -185,65 +189,600 @@ void run_test2(){
     MLOGD<<"Done";
 }
 
+// Decode the same lossy stream with get_block() and with get_block_view() and an arena preallocated for the stream.
+// The arena decoder has to output the same blocks without allocating any packet buffer (see FECBlock::n_allocations())
+// and without overflowing the arena. Returns the n of errors
+int test_decoder_allocations(const int nSequences=1000){
+    const uint8_t nBlocks=8;
+    const uint8_t nFecBlocks=4;
+    const uint16_t maxBlockSize=1400;
+    FECEncoder enc(nBlocks,nFecBlocks,maxBlockSize+2);
+    std::vector<std::shared_ptr<FECBlock>> packets;
+    for(int i=0;i<nSequences*nBlocks;i++){
+        const auto data=createRandomDataBuffer(1+rand()%maxBlockSize);
+        auto blk=enc.get_next_block(data.size());
+        std::copy(data.begin(),data.end(),blk->data());
+        enc.add_block(blk);
+        for(auto out=enc.get_block();out;out=enc.get_block()){
+            packets.push_back(out);
+        }
+    }
+    // Drop every 7th packet, that is at most 2 per sequence
+    std::vector<std::shared_ptr<FECBlock>> receivedPackets;
+    for(size_t i=0;i<packets.size();i++){
+        if(i%7!=0)receivedPackets.push_back(packets[i]);
+    }
+    std::vector<std::vector<uint8_t>> expected;
+    expected.reserve(packets.size());
+    FECDecoder decoder;
+    const size_t nAllocationsBefore=FECBlock::n_allocations();
+    for(const auto& packet:receivedPackets){
+        decoder.add_block(packet->pkt_data(),packet->pkt_length());
+        for(auto blk=decoder.get_block();blk;blk=decoder.get_block()){
+            expected.emplace_back(blk->data(),blk->data()+blk->data_length());
+        }
+    }
+    const size_t nAllocationsDefault=FECBlock::n_allocations()-nAllocationsBefore;
+
+    FECDecoder arenaDecoder(nBlocks,nFecBlocks,maxBlockSize+2);
+    std::vector<uint8_t> received;
+    received.reserve(maxBlockSize);
+    size_t nBlocksOut=0;
+    int nMismatches=0;
+    const size_t nAllocationsBeforeArena=FECBlock::n_allocations();
+    for(const auto& packet:receivedPackets){
+        arenaDecoder.add_block(packet->pkt_data(),packet->pkt_length());
+        for(auto blk=arenaDecoder.get_block_view();blk;blk=arenaDecoder.get_block_view()){
+            received.assign(blk->data(),blk->data()+blk->data_length());
+            if(nBlocksOut>=expected.size() || received!=expected[nBlocksOut]){
+                nMismatches++;
+            }
+            nBlocksOut++;
+        }
+    }
+    const size_t nAllocationsArena=FECBlock::n_allocations()-nAllocationsBeforeArena;
+    if(nBlocksOut!=expected.size()){
+        nMismatches++;
+    }
+    LOG_INFO<<"FECDecoder packets: "<<receivedPackets.size()<<" blocks out: "<<nBlocksOut<<" mismatches: "<<nMismatches
+            <<" packet buffer allocations per packet default: "<<((double)nAllocationsDefault/receivedPackets.size())
+            <<" arena: "<<((double)nAllocationsArena/receivedPackets.size())
+            <<" arena slots: "<<arenaDecoder.arena().n_slots()<<" overflow: "<<arenaDecoder.arena().n_overflow_slots();
+    int nErrors=nMismatches;
+    if(nAllocationsArena>0){
+        LOG_ERROR<<"FECDecoder arena: "<<nAllocationsArena<<" packet buffer allocations";
+        nErrors++;
+    }
+    if(arenaDecoder.arena().n_overflow_slots()>0){
+        LOG_ERROR<<"FECDecoder arena: "<<arenaDecoder.arena().n_overflow_slots()<<" overflow slots";
+        nErrors++;
+    }
+    return nErrors;
+}
 
+// The captures in XFEC/testing are logcat lines of H264Parser::debugSequenceNumbers(), each with the differences between 33
+// consecutive rtp sequence numbers. Returns the differences of all lines.
+// Outages of more than 64 packets are left out, they would dominate the result and no FEC can do anything about them
+std::vector<int> readSequenceNumberDiffs(const std::string& filename){
+    std::vector<int> ret;
+    std::ifstream file(filename);
+    std::string line;
+    while(std::getline(file,line)){
+        const auto pos=line.find("values : ");
+        if(pos==std::string::npos)continue;
+        std::istringstream values(line.substr(pos+9));
+        int diff;
+        while(values>>diff){
+            if(diff<=64)ret.push_back(diff);
+        }
+    }
+    return ret;
+}
 
-// Program: MyArgs
-#include <iostream>
-
-int main(int argc, char *argv[])
-{
-    std::cout << "There are " << argc << " arguments:\n";
+// Apply the loss / reordering of a capture to nPackets packets: A difference of d > 1 means d-1 packets were lost,
+// d <= 0 means a packet arrived late. The capture is repeated if it is too short.
+// Optionally move every reorderEvery-th packet reorderBy packets later.
+// Returns the indices of the packets in the order they are received
+std::vector<size_t> receiveOrderFromDiffs(const std::vector<int>& diffs,const size_t nPackets,const int reorderEvery=0,const int reorderBy=0){
+    std::vector<size_t> ret;
+    std::vector<bool> received(nPackets,false);
+    long seqNr=0;
+    for(size_t i=0;!diffs.empty() && seqNr<(long)nPackets;i++){
+        if(seqNr>=0 && !received[seqNr]){
+            received[seqNr]=true;
+            ret.push_back(seqNr);
+        }
+        const int diff=diffs[i%diffs.size()];
+        seqNr+=diff;
+        if(i%diffs.size()==diffs.size()-1){
+            // Continue after the highest packet when repeating the capture
+            seqNr=ret.empty() ? 0 : *std::max_element(ret.begin(),ret.end())+1;
+        }
+    }
+    if(reorderEvery>0){
+        for(size_t i=0;i+reorderBy<ret.size();i+=reorderEvery){
+            std::rotate(ret.begin()+i,ret.begin()+i+1,ret.begin()+i+1+reorderBy);
+        }
+    }
+    return ret;
+}
 
-    // Loop through each argument and print its number and value
-    for (int count{ 0 }; count < argc; ++count)
-    {
-        std::cout << count << ' ' << argv[count] << '\n';
+// Replay the loss (and optionally reordering) of the captures in XFEC/testing on a 8+4 stream,
+// with a decoder that only tracks one sequence and one with a window of 8 sequences.
+// The data blocks have to come out in order and unchanged. Returns the n of errors
+int test_replay_captures(const std::string& captureDirectory,const int nSequences=2000){
+    const uint8_t nBlocks=8;
+    const uint8_t nFecBlocks=4;
+    const uint16_t maxBlockSize=1400;
+    FECEncoder enc(nBlocks,nFecBlocks,maxBlockSize+2);
+    std::vector<std::shared_ptr<FECBlock>> packets;
+    std::vector<std::vector<uint8_t>> dataBlocks;
+    for(int i=0;i<nSequences*nBlocks;i++){
+        // The first 4 bytes are the index of the data block
+        auto data=createRandomDataBuffer(4+rand()%(maxBlockSize-4));
+        std::memcpy(data.data(),&i,4);
+        auto blk=enc.get_next_block(data.size());
+        std::copy(data.begin(),data.end(),blk->data());
+        enc.add_block(blk);
+        dataBlocks.push_back(data);
+        for(auto out=enc.get_block();out;out=enc.get_block()){
+            packets.push_back(out);
+        }
     }
+    int nErrors=0;
+    for(const std::string capture:{"10MBits_rtp_udp.txt","20MBits_rtp_udp.txt","20Mbits_gaps"}){
+        const auto diffs=readSequenceNumberDiffs(captureDirectory+"/"+capture);
+        if(diffs.empty()){
+            LOG_ERROR<<"Cannot read "<<captureDirectory<<"/"<<capture;
+            nErrors++;
+            continue;
+        }
+        for(const int reorderEvery:{0,10}){
+            // Reordering by more than one sequence
+            const auto receiveOrder=receiveOrderFromDiffs(diffs,packets.size(),reorderEvery,nBlocks+nFecBlocks+2);
+            for(const uint8_t nWindowSequences:{1,8}){
+                FECDecoder decoder(nBlocks,nFecBlocks,maxBlockSize+2,nWindowSequences);
+                int lastIndex=-1;
+                size_t nOut=0;
+                int nOutOfOrder=0;
+                int nMismatches=0;
+                const auto getBlocks=[&](){
+                    for(auto blk=decoder.get_block_view();blk;blk=decoder.get_block_view()){
+                        int index=-1;
+                        if(blk->data_length()>=4)std::memcpy(&index,blk->data(),4);
+                        if(index<0 || index>=(int)dataBlocks.size() ||
+                           !std::equal(blk->data(),blk->data()+blk->data_length(),dataBlocks[index].begin(),dataBlocks[index].end())){
+                            nMismatches++;
+                            continue;
+                        }
+                        if(index<=lastIndex){
+                            nOutOfOrder++;
+                        }
+                        lastIndex=index;
+                        nOut++;
+                    }
+                };
+                for(const size_t i:receiveOrder){
+                    decoder.add_block(packets[i]->pkt_data(),packets[i]->pkt_length());
+                    getBlocks();
+                }
+                decoder.flush();
+                getBlocks();
+                const auto& stats=decoder.stats();
+                LOG_INFO<<capture<<(reorderEvery>0 ? " reordered" : "")<<" window "<<(int)nWindowSequences
+                        <<" received "<<receiveOrder.size()<<"/"<<packets.size()<<" data blocks out "<<nOut<<"/"<<dataBlocks.size()
+                        <<" recovered "<<stats.recovered_blocks<<" because of window "<<stats.window_recovered_blocks
+                        <<" dropped blocks "<<stats.dropped_blocks<<" out of order "<<nOutOfOrder<<" mismatches "<<nMismatches;
+                nErrors+=nOutOfOrder+nMismatches;
+            }
+        }
+    }
+    return nErrors;
+}
 
-    return 0;
+// The SIMD kernels supported by this CPU
+std::vector<fec_kernel_t> supportedSIMDKernels(){
+    std::vector<fec_kernel_t> ret;
+    for(const auto kernel:{FEC_KERNEL_SSSE3,FEC_KERNEL_AVX2,FEC_KERNEL_NEON}){
+        if(fec_set_kernel(kernel)==kernel){
+            ret.push_back(kernel);
+        }
+    }
+    return ret;
 }
 
+// Check that all SIMD kernels supported by this CPU are bit-exact with the scalar (table driven) one.
+// Covers all constants, sizes that do not fill a whole vector and unaligned buffers.
+// Returns the n of mismatches
+int test_kernels(){
+    fec_init();
+    const fec_kernel_t defaultKernel=fec_get_kernel();
+    auto src=createRandomDataBuffer(1401+3);
+    const auto dstInitial=createRandomDataBuffer(1401+3);
+    int nMismatches=0;
+    for(const auto kernel:supportedSIMDKernels()){
+        int nMismatchesKernel=0;
+        for(int c=0;c<256;c++){
+            for(const unsigned int size:{1,15,16,17,31,32,33,47,63,64,100,1400,1401}){
+                for(const unsigned int offset:{0,1,3}){
+                    for(const bool accumulate:{false,true}){
+                        std::vector<uint8_t> expected(dstInitial);
+                        std::vector<uint8_t> actual(dstInitial);
+                        const auto run=[&](std::vector<uint8_t>& dst){
+                            if(accumulate){
+                                fec_addmul(dst.data()+offset,src.data()+offset,c,size);
+                            }else{
+                                fec_mul(dst.data()+offset,src.data()+offset,c,size);
+                            }
+                        };
+                        fec_set_kernel(FEC_KERNEL_SCALAR);
+                        run(expected);
+                        fec_set_kernel(kernel);
+                        run(actual);
+                        if(expected!=actual){
+                            nMismatchesKernel++;
+                        }
+                    }
+                }
+            }
+        }
+        // And the whole encoder (8 data blocks, 4 fec blocks)
+        const auto dataBlocks=createRandomDataBuffers(8,1400);
+        std::vector<std::vector<uint8_t>> expected(4,std::vector<uint8_t>(1400));
+        std::vector<std::vector<uint8_t>> actual(4,std::vector<uint8_t>(1400));
+        const auto encode=[&dataBlocks](std::vector<std::vector<uint8_t>>& fecBlocks){
+            std::vector<unsigned char*> dataPtrs,fecPtrs;
+            for(const auto& block:dataBlocks)dataPtrs.push_back((unsigned char*)block.data());
+            for(auto& block:fecBlocks)fecPtrs.push_back(block.data());
+            fec_encode(1400,dataPtrs.data(),dataPtrs.size(),fecPtrs.data(),fecPtrs.size());
+        };
+        fec_set_kernel(FEC_KERNEL_SCALAR);
+        encode(expected);
+        fec_set_kernel(kernel);
+        encode(actual);
+        if(expected!=actual){
+            nMismatchesKernel++;
+        }
+        LOG_INFO<<"Kernel "<<fec_kernel_name(kernel)<<" mismatches: "<<nMismatchesKernel;
+        nMismatches+=nMismatchesKernel;
+    }
+    fec_set_kernel(defaultKernel);
+    return nMismatches;
+}
 
+// Encode / decode throughput of all kernels supported by this CPU for some k (data blocks) / n (data + fec blocks).
+// MB/s are the MB of data blocks per second. For decoding the first n-k data blocks are lost
+void benchmark_kernels(const uint32_t blockSize=1400,const int iterations=2000){
+    fec_init();
+    const fec_kernel_t defaultKernel=fec_get_kernel();
+    std::vector<fec_kernel_t> kernels={FEC_KERNEL_SCALAR};
+    for(const auto kernel:supportedSIMDKernels()){
+        kernels.push_back(kernel);
+    }
+    const std::vector<std::pair<unsigned int,unsigned int>> configurations={{4,6},{8,12},{16,24},{32,48}};
+    for(const auto& configuration:configurations){
+        const unsigned int k=configuration.first;
+        const unsigned int nFec=configuration.second-k;
+        const auto dataBlocks=createRandomDataBuffers(k,blockSize);
+        auto receivedBlocks=dataBlocks;
+        std::vector<std::vector<uint8_t>> fecBlocks(nFec,std::vector<uint8_t>(blockSize));
+        std::vector<std::vector<uint8_t>> receivedFecBlocks(fecBlocks);
+        std::vector<unsigned char*> dataPtrs,receivedPtrs,fecPtrs,receivedFecPtrs;
+        for(unsigned int i=0;i<k;i++){
+            dataPtrs.push_back((unsigned char*)dataBlocks[i].data());
+            receivedPtrs.push_back(receivedBlocks[i].data());
+        }
+        std::vector<unsigned int> fecBlockNos,erasedBlocks;
+        for(unsigned int i=0;i<nFec;i++){
+            fecPtrs.push_back(fecBlocks[i].data());
+            receivedFecPtrs.push_back(receivedFecBlocks[i].data());
+            fecBlockNos.push_back(i);
+            erasedBlocks.push_back(i);
+        }
+        for(const auto kernel:kernels){
+            fec_set_kernel(kernel);
+            const auto encodeBegin=std::chrono::steady_clock::now();
+            for(int i=0;i<iterations;i++){
+                fec_encode(blockSize,dataPtrs.data(),k,fecPtrs.data(),nFec);
+            }
+            const std::chrono::duration<double> encodeTime=std::chrono::steady_clock::now()-encodeBegin;
+            std::chrono::duration<double> decodeTime(0);
+            bool decodeOk=true;
+            for(int i=0;i<iterations;i++){
+                // decoding works in place on the fec blocks
+                for(unsigned int j=0;j<nFec;j++){
+                    receivedFecBlocks[j]=fecBlocks[j];
+                    std::fill(receivedBlocks[j].begin(),receivedBlocks[j].end(),0);
+                }
+                const auto decodeBegin=std::chrono::steady_clock::now();
+                fec_decode(blockSize,receivedPtrs.data(),k,receivedFecPtrs.data(),fecBlockNos.data(),erasedBlocks.data(),nFec);
+                decodeTime+=std::chrono::steady_clock::now()-decodeBegin;
+            }
+            for(unsigned int i=0;i<nFec;i++){
+                decodeOk=decodeOk && receivedBlocks[i]==dataBlocks[i];
+            }
+            const double mb=(double)k*blockSize*iterations/1024.0/1024.0;
+            LOG_INFO<<"Kernel "<<fec_kernel_name(kernel)<<" k/n "<<k<<"/"<<configuration.second<<" block size "<<blockSize
+                    <<" encode "<<(mb/encodeTime.count())<<" MB/s decode "<<(mb/decodeTime.count())<<" MB/s"
+                    <<(decodeOk ? "" : " DECODE FAILED");
+        }
+    }
+    fec_set_kernel(defaultKernel);
+}
 
+// Decode time of fec_decode() with and without the cache of inverted decode matrices, for the erasure patterns
+// the captures in XFEC/testing cause on a 8+4 stream (only sequences that lost data blocks and can be recovered).
+// With small blocks the matrix inversion is a much bigger part of the decode time.
+// Every pattern is decoded with the FEC blocks in the received and in reversed order, which has to give the same
+// blocks, i.e. the cache must not mix up the two. Returns the n of decodes with wrong data blocks
+int benchmark_matrix_cache(const std::string& captureDirectory,const int nSequences=2000){
+    const unsigned int k=8;
+    const unsigned int nFec=4;
+    fec_init();
+    struct ErasurePattern{
+        std::vector<unsigned int> erasedBlocks;
+        std::vector<unsigned int> fecBlockNos;
+    };
+    std::vector<ErasurePattern> patterns;
+    for(const std::string capture:{"10MBits_rtp_udp.txt","20MBits_rtp_udp.txt","20Mbits_gaps"}){
+        const auto diffs=readSequenceNumberDiffs(captureDirectory+"/"+capture);
+        std::vector<bool> received(nSequences*(k+nFec),false);
+        for(const auto i:receiveOrderFromDiffs(diffs,received.size())){
+            received[i]=true;
+        }
+        for(int seq=0;seq<nSequences;seq++){
+            ErasurePattern pattern;
+            for(unsigned int i=0;i<k+nFec;i++){
+                const bool isReceived=received[seq*(k+nFec)+i];
+                if(i<k && !isReceived){
+                    pattern.erasedBlocks.push_back(i);
+                }else if(i>=k && isReceived && pattern.fecBlockNos.size()<pattern.erasedBlocks.size()){
+                    pattern.fecBlockNos.push_back(i-k);
+                }
+            }
+            if(!pattern.erasedBlocks.empty() && pattern.fecBlockNos.size()==pattern.erasedBlocks.size()){
+                patterns.push_back(pattern);
+                if(pattern.fecBlockNos.size()>1){
+                    std::reverse(pattern.fecBlockNos.begin(),pattern.fecBlockNos.end());
+                    patterns.push_back(pattern);
+                }
+            }
+        }
+    }
+    if(patterns.empty()){
+        LOG_ERROR<<"No erasure patterns in "<<captureDirectory;
+        return 1;
+    }
+    int nFailed=0;
+    for(const uint32_t blockSize:{1024u,64u}){
+        const auto dataBlocks=createRandomDataBuffers(k,blockSize);
+        std::vector<std::vector<uint8_t>> fecBlocks(nFec,std::vector<uint8_t>(blockSize));
+        std::vector<unsigned char*> dataPtrs,fecPtrs;
+        for(unsigned int i=0;i<k;i++){
+            dataPtrs.push_back((unsigned char*)dataBlocks[i].data());
+        }
+        for(unsigned int i=0;i<nFec;i++){
+            fecPtrs.push_back(fecBlocks[i].data());
+        }
+        fec_encode(blockSize,dataPtrs.data(),k,fecPtrs.data(),nFec);
+        for(const int cacheEnabled:{0,1}){
+            fec_set_matrix_cache(cacheEnabled);
+            auto receivedBlocks=dataBlocks;
+            std::vector<std::vector<uint8_t>> receivedFecBlocks(nFec);
+            std::vector<unsigned char*> receivedPtrs,receivedFecPtrs;
+            for(unsigned int i=0;i<k;i++){
+                receivedPtrs.push_back(receivedBlocks[i].data());
+            }
+            std::chrono::duration<double> decodeTime(0);
+            for(auto& pattern:patterns){
+                // decoding works in place on the fec blocks
+                receivedFecPtrs.clear();
+                for(unsigned int i=0;i<pattern.fecBlockNos.size();i++){
+                    receivedFecBlocks[i]=fecBlocks[pattern.fecBlockNos[i]];
+                    receivedFecPtrs.push_back(receivedFecBlocks[i].data());
+                }
+                for(const auto erased:pattern.erasedBlocks){
+                    std::fill(receivedBlocks[erased].begin(),receivedBlocks[erased].end(),0);
+                }
+                const auto decodeBegin=std::chrono::steady_clock::now();
+                fec_decode(blockSize,receivedPtrs.data(),k,receivedFecPtrs.data(),pattern.fecBlockNos.data(),
+                           pattern.erasedBlocks.data(),pattern.erasedBlocks.size());
+                decodeTime+=std::chrono::steady_clock::now()-decodeBegin;
+                for(const auto erased:pattern.erasedBlocks){
+                    if(receivedBlocks[erased]!=dataBlocks[erased]){
+                        nFailed++;
+                        break;
+                    }
+                }
+            }
+            unsigned long hits,misses;
+            fec_get_matrix_cache_stats(&hits,&misses);
+            LOG_INFO<<"Matrix cache "<<(cacheEnabled ? "on " : "off")<<" block size "<<blockSize<<" "<<patterns.size()<<" decodes "
+                    <<(decodeTime.count()*1e6/patterns.size())<<" us/decode hit rate "
+                    <<(hits+misses==0 ? 0.0 : (double)hits/(hits+misses))<<" failed decodes "<<nFailed;
+        }
+    }
+    fec_set_matrix_cache(1);
+    return nFailed;
+}
 
-#ifndef __ANDROID__
-int main(int argc, char** argv) {
+// Gilbert-Elliott channel: In the good / bad state a packet is lost with lossGood / lossBad,
+// after each packet the state changes with pGoodToBad / pBadToGood (bursty loss)
+struct GilbertElliottChannel{
+    double pGoodToBad;
+    double pBadToGood;
+    double lossGood;
+    double lossBad;
+    bool bad=false;
+    bool lose(std::mt19937& rng){
+        std::uniform_real_distribution<double> dist(0.0,1.0);
+        const bool lost=dist(rng)<(bad ? lossBad : lossGood);
+        bad=dist(rng)<(bad ? 1.0-pBadToGood : pGoodToBad);
+        return lost;
+    }
+};
+
+// Goodput (delivered data bytes / sent bytes, including the FEC blocks) and residual loss (data blocks lost after FEC)
+// of a fixed FEC ratio of 0.5 compared to a FECRatioController, for a couple of channel conditions one after another.
+// The receiver reports its loss every reportInterval packets. Buffers of 1 block are what VideoTransmitter sends.
+void benchmark_adaptive_fec(const int nBuffersPerPhase=20000,const int reportInterval=100){
+    struct Phase{
+        const char* name;
+        GilbertElliottChannel channel;
+    };
+    const std::vector<Phase> phases={
+            {"clean",{0.0,1.0,0.0,0.0}},
+            {"random 1%",{0.0,1.0,0.01,0.0}},
+            {"bursty",{0.01,0.2,0.0,0.5}},
+            {"bad",{0.05,0.1,0.02,0.8}},
+            {"clean",{0.0,1.0,0.0,0.0}},
+    };
+    const uint32_t blockSize=1024;
+    for(const uint32_t nBlocksPerBuffer:{1,8}){
+        const auto buffer=createRandomDataBuffer(blockSize*nBlocksPerBuffer);
+        for(const bool adaptive:{false,true}){
+            std::mt19937 rng(1234);
+            FECBufferEncoder enc(blockSize,0.5f);
+            auto controller=std::make_shared<FECRatioController>();
+            if(adaptive){
+                enc.controller(controller);
+            }
+            FECDecoder dec(8,8,blockSize+2,8);
+            uint32_t nReports=0;
+            size_t nPackets=0;
+            for(const auto& phase:phases){
+                GilbertElliottChannel channel=phase.channel;
+                const FECDecoderStats begin=dec.stats();
+                size_t sentBytes=0;
+                double sumRatio=0;
+                for(int i=0;i<nBuffersPerPhase;i++){
+                    for(const auto& blk:enc.encode_buffer(buffer)){
+                        sentBytes+=blk->pkt_length();
+                        if(!channel.lose(rng)){
+                            dec.add_block(blk->pkt_data(),blk->pkt_length());
+                        }
+                        for(auto out=dec.get_block_view();out;out=dec.get_block_view());
+                        if(++nPackets%reportInterval==0){
+                            controller->add_report(FECFeedback(nReports++,dec.stats()));
+                        }
+                    }
+                    sumRatio+=adaptive ? controller->fec_ratio() : 0.5;
+                }
+                const FECDecoderStats stats=dec.stats()-begin;
+                const size_t nDataBlocks=(size_t)nBuffersPerPhase*nBlocksPerBuffer;
+                LOG_INFO<<"Gilbert-Elliott "<<nBlocksPerBuffer<<" block(s) per buffer "<<phase.name<<(adaptive ? " adaptive" : " fixed")
+                        <<" avg ratio "<<(sumRatio/nBuffersPerPhase)
+                        <<" goodput "<<((double)stats.output_blocks*blockSize/sentBytes)
+                        <<" residual loss "<<((double)(nDataBlocks-std::min(nDataBlocks,stats.output_blocks))/nDataBlocks);
+            }
+        }
+    }
+}
 
-  cxxopts::Options options(argv[0], "Allowed options");
-  options.add_options()
-    ("h,help", "produce help message")
-    ("iterations", "the number of iterations to run",
-     cxxopts::value<uint32_t>()->default_value("1000"))
-    ("block_size", "the block size to test",
-     cxxopts::value<uint32_t>()->default_value("1400"))
-    ("fec_ratio", "the FEC block / data block ratio",
-     cxxopts::value<float>()->default_value("0.5"))
-    ;
-
-  auto result = options.parse(argc, argv);
-  if (result.count("help")) {
-    std::cout << options.help() << std::endl;
-    return EXIT_SUCCESS;
-  }
-  uint32_t iterations = result["iterations"].as<uint32_t>();
-  uint32_t block_size = result["block_size"].as<uint32_t>();
-  float fec_ratio = result["fec_ratio"].as<float>();
-
-  // Configure logging
-  log4cpp::Appender *appender1 = new log4cpp::OstreamAppender("console", &std::cout);
-  appender1->setLayout(new log4cpp::BasicLayout());
-  log4cpp::Category& root = log4cpp::Category::getRoot();
-  root.setPriority(log4cpp::Priority::DEBUG);
-  root.addAppender(appender1);
-  
-  FECBufferEncoder enc(block_size, fec_ratio);
-  std::pair<uint32_t, double> passed = run_test(enc, block_size, iterations);
-  LOG_INFO << passed.first << " tests passed out of " << iterations
-           << "  " << passed.second << " Mbps";
-  
-  return (passed.first == iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+// One FEC sequence per video frame (FECFrameEncoder) compared to one per RTP packet (FECBufferEncoder), both
+// with a fixed FEC ratio. A GOP of 30 frames has a key frame of 40 packets and P frames of 4 to 12 packets,
+// the packets of a frame are sent back to back. Time is counted in packets sent: The completion delay of a frame
+// is the number of packets sent from its first packet until all its packets are output by the receiver
+// (the frame cannot be decoded before). 'per packet 1+1' is what VideoTransmitter did before (ratio 0.5 rounded up).
+void benchmark_frame_fec(const int nFrames=6000){
+    struct Mode{
+        const char* name;
+        bool perFrame;
+        // 0: no FECRatioController, each packet gets one FEC block
+        float ratio;
+    };
+    const std::vector<Mode> modes={{"per packet 1+1",false,0},{"per packet",false,0.25f},{"per frame",true,0.5f},{"per frame",true,0.25f}};
+    const std::vector<std::pair<const char*,GilbertElliottChannel>> channels={
+            {"random 1%",{0.0,1.0,0.01,0.0}},
+            {"random 5%",{0.0,1.0,0.05,0.0}},
+            {"bursty",{0.01,0.2,0.0,0.5}},
+    };
+    const uint16_t maxPacketSize=1024;
+    std::mt19937 frameRng(42);
+    std::vector<std::vector<std::vector<uint8_t>>> frames(nFrames);
+    size_t nPackets=0;
+    for(int f=0;f<nFrames;f++){
+        const int n=(f%30==0) ? 40 : std::uniform_int_distribution<int>(4,12)(frameRng);
+        for(int p=0;p<n;p++){
+            const size_t size=(p==n-1) ? std::uniform_int_distribution<int>(100,maxPacketSize)(frameRng) : maxPacketSize;
+            std::vector<uint8_t> packet(size,(uint8_t)p);
+            // The receiver identifies the packets by their frame / packet index
+            std::memcpy(packet.data(),&f,sizeof(f));
+            std::memcpy(&packet[4],&p,sizeof(p));
+            frames[f].push_back(std::move(packet));
+        }
+        nPackets+=n;
+    }
+    for(const auto& channel:channels){
+        for(const auto& mode:modes){
+            std::mt19937 rng(1234);
+            GilbertElliottChannel lossChannel=channel.second;
+            FECRatioController::Config config;
+            config.min_ratio=config.max_ratio=config.initial_ratio=mode.ratio;
+            auto controller=std::make_shared<FECRatioController>(config);
+            FECBufferEncoder packetEnc(maxPacketSize,0.5f);
+            FECFrameEncoder frameEnc(maxPacketSize,0.5f,64);
+            if(mode.ratio>0){
+                packetEnc.controller(controller);
+                frameEnc.controller(controller);
+            }
+            FECDecoder dec(64,64,maxPacketSize+2,1);
+            size_t slot=0,sentBlocks=0,sentBytes=0,outPackets=0;
+            std::vector<size_t> frameStart(nFrames,0),frameOut(nFrames,0),frameComplete(nFrames,0);
+            const auto receive=[&](){
+                for(auto out=dec.get_block_view();out;out=dec.get_block_view()){
+                    int f,p;
+                    std::memcpy(&f,out->data(),sizeof(f));
+                    std::memcpy(&p,out->data()+4,sizeof(p));
+                    ++outPackets;
+                    if(++frameOut[f]==frames[f].size()){
+                        frameComplete[f]=slot;
+                    }
+                }
+            };
+            const auto send=[&](const std::vector<std::shared_ptr<FECBlock>>& blks){
+                for(const auto& blk:blks){
+                    ++slot;
+                    ++sentBlocks;
+                    sentBytes+=blk->pkt_length();
+                    if(!lossChannel.lose(rng)){
+                        dec.add_block(blk->pkt_data(),blk->pkt_length());
+                    }
+                    receive();
+                }
+            };
+            for(int f=0;f<nFrames;f++){
+                frameStart[f]=slot+1;
+                for(const auto& packet:frames[f]){
+                    send(mode.perFrame ? frameEnc.add_packet(packet.data(),packet.size()) : packetEnc.encode_buffer(packet));
+                }
+                if(mode.perFrame){
+                    send(frameEnc.flush());
+                }
+            }
+            dec.flush();
+            receive();
+            size_t nComplete=0;
+            double sumDelay=0,sumExtraDelay=0;
+            for(int f=0;f<nFrames;f++){
+                if(frameOut[f]==frames[f].size()){
+                    ++nComplete;
+                    const size_t delay=frameComplete[f]-frameStart[f]+1;
+                    sumDelay+=delay;
+                    sumExtraDelay+=(double)delay-frames[f].size();
+                }
+            }
+            LOG_INFO<<"Frame FEC "<<channel.first<<" "<<mode.name<<" ratio "<<(mode.ratio>0 ? mode.ratio : 1.0f)
+                    <<" blocks sent per packet "<<((double)sentBlocks/nPackets)
+                    <<" frames complete "<<((double)nComplete/nFrames)
+                    <<" packet loss "<<((double)(nPackets-outPackets)/nPackets)
+                    <<" completion delay "<<(sumDelay/std::max<size_t>(nComplete,1))
+                    <<" (+"<<(sumExtraDelay/std::max<size_t>(nComplete,1))<<") packets";
+        }
+    }
 }
-#endif
+
+
 
 void test() {
   uint32_t iterations = 100;
@@ -256,6 +795,64 @@ void test() {
            << "  " << passed.second << " Mbps";
 }
 
+// The tests that replay the captures in XFEC/testing only run if captureDirectory is not empty,
+// the captures are not part of the apk. Returns the n of errors
+int run_tests(const std::string& captureDirectory){
+  int nErrors=0;
+  test();
+  run_test2();
+  const int nKernelMismatches=test_kernels();
+  if(nKernelMismatches!=0){
+    LOG_ERROR<<"test_kernels: "<<nKernelMismatches<<" SIMD / scalar mismatches";
+  }
+  nErrors+=nKernelMismatches;
+  const int nAllocationErrors=test_decoder_allocations();
+  if(nAllocationErrors!=0){
+    LOG_ERROR<<"test_decoder_allocations: "<<nAllocationErrors<<" errors";
+  }
+  nErrors+=nAllocationErrors;
+  if(!captureDirectory.empty()){
+    const int nReplayErrors=test_replay_captures(captureDirectory);
+    if(nReplayErrors!=0){
+      LOG_ERROR<<"test_replay_captures: "<<nReplayErrors<<" errors";
+    }
+    nErrors+=nReplayErrors;
+    const int nFailedDecodes=benchmark_matrix_cache(captureDirectory);
+    if(nFailedDecodes!=0){
+      LOG_ERROR<<"benchmark_matrix_cache: "<<nFailedDecodes<<" failed decodes";
+    }
+    nErrors+=nFailedDecodes;
+  }
+  return nErrors;
+}
+
+void run_benchmarks(){
+  benchmark_kernels();
+  benchmark_adaptive_fec();
+  benchmark_frame_fec();
+}
+
+#ifndef __ANDROID__
+// Host test, see Benchmark/CMakeLists.txt
+// test_fec [captureDirectory] [--benchmark]
+int main(int argc, char** argv) {
+  std::string captureDirectory;
+  bool benchmark=false;
+  for(int i=1;i<argc;i++){
+    if(std::string(argv[i])=="--benchmark"){
+      benchmark=true;
+    }else{
+      captureDirectory=argv[i];
+    }
+  }
+  const int nErrors=run_tests(captureDirectory);
+  if(benchmark){
+    run_benchmarks();
+  }
+  LOG_INFO<<"test_fec: "<<nErrors<<" errors";
+  return nErrors==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
 
 #ifdef __ANDROID__
 
@@ -270,8 +867,9 @@ extern "C" {
 
 JNI_METHOD(void , nativeTestFec)
 (JNIEnv *env, jclass jclass1) {
-    test();
-    run_test2();
+    const int nErrors=run_tests("");
+    assert(nErrors==0);
+    run_benchmarks();
 }
 
 }
@@ -39,12 +39,16 @@ public class AVideoSettings extends AppCompatActivity {
                 Preference p4=findPreference(getString(R.string.VS_FILE_ONLY_LIMIT_FPS));
                 Preference p5=findPreference(getString(R.string.VS_USE_SW_DECODER));
                 Preference p6=findPreference(getString(R.string.VS_GROUND_RECORDING));
+                Preference p7=findPreference(getString(R.string.VS_REPLAY_FILENAME));
+                Preference p8=findPreference(getString(R.string.VS_REPLAY_CONFIG));
                 p1.setEnabled(true);
                 p2.setEnabled(true);
                 p3.setEnabled(true);
                 p4.setEnabled(true);
                 p5.setEnabled(true);
                 p6.setEnabled(true);
+                p7.setEnabled(true);
+                p8.setEnabled(true);
             }
         }
 
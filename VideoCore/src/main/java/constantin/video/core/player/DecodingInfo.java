@@ -15,6 +15,9 @@ public class DecodingInfo {
     public final int nNALU;
     public final int nNALUSFeeded;
     public final int nDecodedFrames;
+    public final boolean feedAccessUnits; //one input buffer per frame instead of one per NALU. avgParsingTime_ms includes waiting for the whole frame
+    public final float avgNALUsPerInputBuffer;
+    public final boolean asyncDecoding; //decoder notifies about free buffers instead of being polled. avgWaitForInputBTime_ms is ~0 unless the decoder has no free input buffer
 
     public DecodingInfo(){
         currentFPS=0;
@@ -26,10 +29,18 @@ public class DecodingInfo {
         nNALUSFeeded=0;
         avgTotalDecodingTime_ms =0;
         nDecodedFrames=0;
+        feedAccessUnits=false;
+        avgNALUsPerInputBuffer=0;
+        asyncDecoding=false;
     }
 
     public DecodingInfo(float currentFPS, float currentKiloBitsPerSecond,float avgParsingTime_ms,float avgWaitForInputBTime_ms,float avgHWDecodingTime_ms,
                         int nNALU,int nNALUSFeeded,int nDecodedFrames){
+        this(currentFPS,currentKiloBitsPerSecond,avgParsingTime_ms,avgWaitForInputBTime_ms,avgHWDecodingTime_ms,nNALU,nNALUSFeeded,nDecodedFrames,false,1,false);
+    }
+
+    public DecodingInfo(float currentFPS, float currentKiloBitsPerSecond,float avgParsingTime_ms,float avgWaitForInputBTime_ms,float avgHWDecodingTime_ms,
+                        int nNALU,int nNALUSFeeded,int nDecodedFrames,boolean feedAccessUnits,float avgNALUsPerInputBuffer,boolean asyncDecoding){
         this.currentFPS=currentFPS;
         this.currentKiloBitsPerSecond=currentKiloBitsPerSecond;
         this.avgParsingTime_ms=avgParsingTime_ms;
@@ -39,6 +50,9 @@ public class DecodingInfo {
         this.nNALU=nNALU;
         this.nNALUSFeeded=nNALUSFeeded;
         this.nDecodedFrames=nDecodedFrames;
+        this.feedAccessUnits=feedAccessUnits;
+        this.avgNALUsPerInputBuffer=avgNALUsPerInputBuffer;
+        this.asyncDecoding=asyncDecoding;
     }
 
     public Map<String,Object> toMap(){
@@ -52,6 +66,9 @@ public class DecodingInfo {
         decodingInfo.put("nNALU",nNALU);
         decodingInfo.put("nNALUSFeeded",nNALUSFeeded);
         decodingInfo.put("nDecodedFrames",nDecodedFrames);
+        decodingInfo.put("feedAccessUnits",feedAccessUnits);
+        decodingInfo.put("avgNALUsPerInputBuffer",avgNALUsPerInputBuffer);
+        decodingInfo.put("asyncDecoding",asyncDecoding);
         return decodingInfo;
     }
 
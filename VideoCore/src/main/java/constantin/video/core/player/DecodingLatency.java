@@ -0,0 +1,135 @@
+package constantin.video.core.player;
+
+import androidx.annotation.Nullable;
+
+import java.nio.BufferUnderflowException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.Locale;
+
+/**
+ * Per frame latency of each decoding stage (see DecodingLatency in IDecoder.hpp).
+ * Parsed from the serialized native LatencyHistogram, with the same bucket layout such that the percentiles
+ * match the ones of the native video info string.
+ */
+@SuppressWarnings("WeakerAccess")
+public class DecodingLatency {
+    public static final int STAGE_PARSE=0;
+    public static final int STAGE_WAIT_FOR_INPUT=1;
+    public static final int STAGE_DECODE=2;
+    public static final int STAGE_TOTAL=3;
+    private static final String[] STAGE_NAMES={"Parsing","WaitInputBuffer","Decoding","Total"};
+    private static final int VERSION=1;
+
+    public static class Histogram{
+        private final int subBucketBits;
+        private final long[] counts;
+        public final long nSamples;
+        public final long sumUs;
+        public final long maxUs;
+
+        private Histogram(int subBucketBits,long[] counts,long sumUs,long maxUs){
+            this.subBucketBits=subBucketBits;
+            this.counts=counts;
+            long n=0;
+            for(final long count:counts){
+                n+=count;
+            }
+            this.nSamples=n;
+            this.sumUs=sumUs;
+            this.maxUs=maxUs;
+        }
+
+        private long bucketUpperBoundUs(int index){
+            final int subBuckets=1<<subBucketBits;
+            if(index<subBuckets)return index;
+            final int exponent=index/subBuckets-1;
+            return ((long)(subBuckets+index%subBuckets+1)<<exponent)-1;
+        }
+
+        // Nearest rank, p in [0..100]. Same as LatencyHistogram::Snapshot::percentile()
+        public long getPercentileUs(double p){
+            if(nSamples==0)return 0;
+            final long rank=Math.max((long)(p/100.0*nSamples+0.999999),1);
+            long n=0;
+            for(int i=0;i<counts.length;i++){
+                n+=counts[i];
+                if(n>=rank){
+                    return Math.min(bucketUpperBoundUs(i),maxUs);
+                }
+            }
+            return maxUs;
+        }
+
+        public long getAvgUs(){
+            return nSamples>0 ? sumUs/nSamples : 0;
+        }
+
+        @Override
+        public String toString() {
+            if(nSamples==0)return "n=0";
+            return String.format(Locale.US,"n=%d avg=%.2fms p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms",nSamples,getAvgUs()/1000.0,
+                    getPercentileUs(50)/1000.0,getPercentileUs(90)/1000.0,getPercentileUs(99)/1000.0,maxUs/1000.0);
+        }
+    }
+
+    private final Histogram[] stages;
+
+    private DecodingLatency(Histogram[] stages){
+        this.stages=stages;
+    }
+
+    // stage: one of the STAGE_ constants
+    public Histogram getStage(int stage){
+        return stages[stage];
+    }
+
+    public int getNStages(){
+        return stages.length;
+    }
+
+    // Format see LatencyHistogram::serialize(), null if the data cannot be parsed
+    @Nullable
+    public static DecodingLatency parse(@Nullable byte[] data){
+        if(data==null)return null;
+        final ByteBuffer buffer=ByteBuffer.wrap(data).order(ByteOrder.LITTLE_ENDIAN);
+        try{
+            final byte[] magic=new byte[4];
+            buffer.get(magic);
+            if(magic[0]!='L' || magic[1]!='V' || magic[2]!='L' || magic[3]!='H')return null;
+            final int version=buffer.getInt();
+            final int subBucketBits=buffer.getInt();
+            final int nBuckets=buffer.getInt();
+            final int nHistograms=buffer.getInt();
+            if(version!=VERSION || nBuckets<=0 || nHistograms<0 || nHistograms>buffer.remaining()/20)return null;
+            final Histogram[] histograms=new Histogram[nHistograms];
+            for(int i=0;i<nHistograms;i++){
+                final long sumUs=buffer.getLong();
+                final long maxUs=buffer.getLong();
+                final int nNonEmpty=buffer.getInt();
+                final long[] counts=new long[nBuckets];
+                for(int j=0;j<nNonEmpty;j++){
+                    final int index=buffer.getInt();
+                    final long count=buffer.getInt() & 0xFFFFFFFFL;
+                    if(index<0 || index>=nBuckets)return null;
+                    counts[index]=count;
+                }
+                histograms[i]=new Histogram(subBucketBits,counts,sumUs,maxUs);
+            }
+            return new DecodingLatency(histograms);
+        }catch (BufferUnderflowException e){
+            return null;
+        }
+    }
+
+    @Override
+    public String toString() {
+        final StringBuilder builder=new StringBuilder();
+        for(int i=0;i<stages.length;i++){
+            if(stages[i].nSamples==0)continue;
+            if(builder.length()>0)builder.append("\n");
+            builder.append(i<STAGE_NAMES.length ? STAGE_NAMES[i] : ("Stage"+i)).append(": ").append(stages[i]);
+        }
+        return builder.toString();
+    }
+}
@@ -48,6 +48,13 @@ public class VideoPlayer implements IVideoParamsChanged{
         return nativeGetExternalFileReader(nativeVideoPlayer);
     }
 
+    /**
+     * Source==FILE with a .fpv file only: Continue playback at the last key frame before positionMs
+     */
+    public void seekTo(final int positionMs){
+        nativeSeek(nativeVideoPlayer,positionMs);
+    }
+
     private void setVideoSurface(final @Nullable Surface surface){
         verifyApplicationThread();
         nativeSetVideoSurface(nativeVideoPlayer,surface);
@@ -139,6 +146,12 @@ public class VideoPlayer implements IVideoParamsChanged{
         return nativeVideoPlayer;
     }
 
+    // Percentiles of the per frame decoding latency since the decoder was started, null if the native data cannot be parsed
+    @Nullable
+    public DecodingLatency getDecodingLatency(){
+        return DecodingLatency.parse(nativeGetDecodingLatency(nativeVideoPlayer));
+    }
+
     // called by native code via NDK
     @Override
     @SuppressWarnings({"UnusedDeclaration"})
@@ -182,11 +195,13 @@ public class VideoPlayer implements IVideoParamsChanged{
 
     //get members or other information. Some might be only usable in between (nativeStart <-> nativeStop)
     public static native String getVideoInfoString(long nativeInstance);
+    public static native byte[] nativeGetDecodingLatency(long nativeInstance);
     public static native boolean anyVideoDataReceived(long nativeInstance);
     public static native boolean anyVideoBytesParsedSinceLastCall(long nativeInstance);
     public static native boolean receivingVideoButCannotParse(long nativeInstance);
     public static native long nativeGetExternalGroundRecorder(long nativeInstance);
     public static native long nativeGetExternalFileReader(long nativeInstance);
+    public static native void nativeSeek(long nativeInstance,int positionMs);
 
     //TODO: Use message queue from cpp for performance#
     //This initiates a 'call back' for the IVideoParams
@@ -21,7 +21,7 @@ import static android.content.Context.MODE_PRIVATE;
 //Provides conv
 public class VideoSettings {
     private static final String TAG=VideoSettings.class.getSimpleName();
-    public enum VS_SOURCE{UDP,FILE,ASSETS,FFMPEG,EXTERNAL}
+    public enum VS_SOURCE{UDP,FILE,ASSETS,FFMPEG,EXTERNAL,EXTERNAL_UVC,REPLAY}
     public static final int VIDEO_MODE_2D_MONOSCOPIC=0;
 
     public static boolean PLAYBACK_FLE_EXISTS(final Context context){
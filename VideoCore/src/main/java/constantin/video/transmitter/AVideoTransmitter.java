@@ -99,6 +99,12 @@ public class AVideoTransmitter extends AppCompatActivity{
                             }
                             mUDPSender.sendOnCurrentThread(outputBuffer);
                             codec.releaseOutputBuffer(outputBufferId,false);
+                            // The receiver dropped frames and waits for a key frame (see KeyFrameRequest.hpp)
+                            if(mUDPSender.consumeKeyFrameRequest()){
+                                final Bundle params=new Bundle();
+                                params.putInt(MediaCodec.PARAMETER_KEY_REQUEST_SYNC_FRAME,0);
+                                codec.setParameters(params);
+                            }
                         } else if (outputBufferId == MediaCodec.INFO_OUTPUT_FORMAT_CHANGED) {
                             // Subsequent data will conform to new format.
                             final MediaFormat currentOutputFormat= codec.getOutputFormat();
@@ -21,6 +21,7 @@ public class VideoTransmitter {
     native void nativeDelete(long p);
     //Called by sendAsync / sendOnCurrentThread
     native void nativeSend(long p,ByteBuffer data,int dataSize,int mode);
+    native boolean nativeConsumeKeyFrameRequest(long p);
 
     private final long nativeInstance;
     private final int streamMode;
@@ -54,6 +55,10 @@ public class VideoTransmitter {
         nativeSend(nativeInstance,data,data.remaining(),streamMode);
     }
 
+    // Returns true once for each time the receiver requested a key frame (repeated requests before calling this are merged)
+    public boolean consumeKeyFrameRequest(){
+        return nativeConsumeKeyFrameRequest(nativeInstance);
+    }
 
     @Override
     protected void finalize() throws Throwable {